@@ -8,11 +8,6 @@
 #include "builder.h"
 #include "modules/debug.h"
 
-#if DEBUG_ENABLED
-    // Initialize debug system
-    debug_init();
-#endif
-
 // Global variables
 FILE *log_fp = NULL;
 FILE *error_log_fp = NULL;
@@ -30,34 +25,39 @@ ubuntu_release_t ubuntu_releases[] = {
     {"", "", "", "", 0, 0, ""}  // Sentinel
 };
 
-// Mali driver information
+// Mali driver information. Entries without a sha256 here must be pinned in
+// MALI_PINS_FILE; unpinned blobs are never downloaded.
 mali_driver_t mali_drivers[] = {
     {
         "Mali G610 CSF Firmware", 
         "https://github.com/JeffyCN/mirrors/raw/libmali/firmware/g610/mali_csffw.bin",
         "mali_csffw.bin",
-        1  // Required
+        1, // Required
+        "", 0
     },
     {
         "Mali G610 Wayland Driver", 
         "https://github.com/JeffyCN/mirrors/raw/libmali/lib/aarch64-linux-gnu/libmali-valhall-g610-g6p0-wayland-gbm.so",
         "libmali-valhall-g610-g6p0-wayland-gbm.so",
-        1  // Required
+        1, // Required
+        "", 0
     },
     {
         "Mali G610 X11+Wayland Driver", 
         "https://github.com/JeffyCN/mirrors/raw/libmali/lib/aarch64-linux-gnu/libmali-valhall-g610-g6p0-x11-wayland-gbm.so",
         "libmali-valhall-g610-g6p0-x11-wayland-gbm.so",
-        1  // Required
+        1, // Required
+        "", 0
     },
     {
         "Mali G610 Vulkan Driver", 
         "https://github.com/JeffyCN/mirrors/raw/libmali/lib/aarch64-linux-gnu/libmali-valhall-g610-g6p0-wayland-gbm-vulkan.so",
         "libmali-valhall-g610-g6p0-wayland-gbm-vulkan.so",
-        0  // Optional
+        0, // Optional
+        "", 0
     },
     {
-        "", "", "", 0  // Sentinel
+        "", "", "", 0, "", 0  // Sentinel
     }
 };
 
@@ -122,66 +122,6 @@ const char* get_token_type_description(const char* token) {
     return "Unknown token format";
 }
 
-// Test GitHub token validity
-int test_github_token(const char* token) {
-    if (!token || strlen(token) == 0) {
-        return 0;
-    }
-    
-    char cmd[512];
-    int result;
-    
-    // Test the token by making a simple API call
-    snprintf(cmd, sizeof(cmd), 
-             "curl -s -f -H \"Authorization: token %s\" "
-             "https://api.github.com/user >/dev/null 2>&1", 
-             token);
-    
-    result = system(cmd);
-    
-    return (result == 0) ? 1 : 0;
-}
-
-// Configure git to use GitHub token
-int configure_git_with_token(const char* token) {
-    if (!token || strlen(token) == 0) {
-        return 0;
-    }
-    
-    char cmd[1024];
-    error_context_t error_ctx = {0};
-    
-    // Configure git credential helper to use the token
-    snprintf(cmd, sizeof(cmd), 
-             "git config --global credential.\"https://github.com\".helper "
-             "'!f() { echo \"username=x-access-token\"; echo \"password=%s\"; }; f'", 
-             token);
-    
-    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
-        return 0;
-    }
-    
-    // Configure URL rewriting for HTTPS
-    snprintf(cmd, sizeof(cmd),
-             "git config --global url.\"https://x-access-token:%s@github.com/\".insteadOf \"https://github.com/\"",
-             token);
-    
-    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
-        return 0;
-    }
-    
-    // Configure URL rewriting for SSH to HTTPS (for repositories that use git@ URLs)
-    snprintf(cmd, sizeof(cmd),
-             "git config --global url.\"https://x-access-token:%s@github.com/\".insteadOf \"git@github.com:\"",
-             token);
-    
-    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
-        return 0;
-    }
-    
-    return 1;
-}
-
 // Initialize build configuration
 void init_build_config(build_config_t *config) {
     if (!config) return;
@@ -205,6 +145,10 @@ void init_build_config(build_config_t *config) {
     // Build options
     config->jobs = sysconf(_SC_NPROCESSORS_ONLN);
     if (config->jobs <= 0) config->jobs = 4;
+    config->adaptive_jobs = 1;
+    config->job_memory = 1LL << 30;
+    config->command_timeout = 0;
+    config->idle_timeout = 30 * 60;
     
     // Check .env for custom settings
     FILE *fp = fopen(".env", "r");
@@ -231,23 +175,49 @@ void init_build_config(build_config_t *config) {
     config->clean_build = 0;
     config->continue_on_error = 0;
     config->log_level = LOG_LEVEL_INFO;
+    config->batch = 0;
+    
+    // Rootfs bootstrap
+    config->bootstrap_engine = BOOTSTRAP_DEBOOTSTRAP;
+    config->benchmark_bootstrap = 0;
+    
+    // Rootfs slimming
+    config->slim_policy = 0;
+    config->slim_report_top = 20;
     
-    // GPU options
-    config->install_gpu_blobs = 1;
-    config->enable_opencl = 1;
-    config->enable_vulkan = 1;
+    // GPU options; off until every Mali blob is pinned
+    config->install_gpu_blobs = mali_blobs_pinned();
+    config->enable_opencl = config->install_gpu_blobs;
+    config->enable_vulkan = config->install_gpu_blobs;
     
     // Component selection
     config->build_kernel = 1;
     config->build_rootfs = 1;
     config->build_uboot = 1;
     config->create_image = 1;
+    config->create_spi_image = 1;
+    config->compress_format = COMPRESS_ZSTD;
+    config->compress_level = -1;
+    config->compress_threads = 0;
+    
+    // Build matrix
+    config->matrix_count = 0;
+    config->matrix_parallel = 0;
     
     // Image settings
     strcpy(config->image_size, "8192");
     strcpy(config->hostname, "orangepi");
     strcpy(config->username, "orangepi");
     strcpy(config->password, "orangepi");
+    strcpy(config->locales, "en_US.UTF-8");
+    
+    // Metrics
+    strcpy(config->metrics_file, METRICS_FILE);
+    
+    // Download store
+    strcpy(config->cache_dir, CACHE_DIR);
+    config->download_segments = 1;
+    config->kernel_sparse = 0;
 }
 
 // Create required directories
@@ -306,6 +276,42 @@ void process_args(int argc, char *argv[], build_config_t *config) {
             printf("  --no-rootfs               Skip rootfs building\n");
             printf("  --no-uboot                Skip U-Boot building\n");
             printf("  --no-image                Skip image creation\n");
+            printf("  --no-spi                  Skip the SPI NOR flash image\n");
+            printf("  --compress FORMAT         Compressed image: zstd, xz or none (default: %s)\n",
+                   compress_format_name(config->compress_format));
+            printf("  --compress-level N        Compression level (default: 10 for zstd, 6 for xz)\n");
+            printf("  --compress-threads N      Compression threads (default: the job count)\n");
+            printf("  --matrix TARGETS          Build several targets sharing kernel and bootloader,\n");
+            printf("                            e.g. desktop:24.04,server:22.04,emulation:24.04:retropie\n");
+            printf("  --matrix-parallel N       Matrix targets built at once (default: the job count)\n");
+            printf("  --bootstrap ENGINE        Rootfs bootstrap: debootstrap or single-pass (default: %s)\n",
+                   bootstrap_engine_name(config->bootstrap_engine));
+            printf("  --benchmark-bootstrap     Time both bootstrap engines before building the rootfs\n");
+            printf("  --locales LIST            Locales to generate, first is the default (default: %s)\n",
+                   config->locales);
+            printf("  --slim POLICY             Slim the rootfs: apt,docs,locales,strip-dev, default or all\n");
+            printf("  --slim-top N              Entries in the rootfs size report (default: %d)\n",
+                   config->slim_report_top);
+            printf("  --metrics-file PATH       Prometheus textfile to write, empty disables (default: %s)\n",
+                   config->metrics_file);
+            printf("  --cache-dir PATH          Persistent store for verified downloads (default: %s)\n",
+                   config->cache_dir);
+            printf("  --download-segments N     Fetch downloads over 32M as N parallel ranges (default: %d)\n",
+                   config->download_segments);
+            printf("  --sparse-kernel           Partial kernel clone, sparse checkout learned from the last build\n");
+            printf("  --job-memory SIZE         Memory one make job needs, caps jobs by MemAvailable (default: %lldM)\n",
+                   config->job_memory >> 20);
+            printf("  --static-jobs             Run make with -j<jobs> instead of the adaptive jobserver\n");
+            printf("  --command-timeout TIME    Stop commands running longer than TIME, 0 disables (default: %ds)\n",
+                   config->command_timeout);
+            printf("  --idle-timeout TIME       Stop commands without output or progress for TIME (default: %ds)\n",
+                   config->idle_timeout);
+            printf("  --stage-limit SPEC        STAGE:cpu.weight=N,memory.max=SIZE,io.weight=N,timeout=TIME,\n");
+            printf("                            idle-timeout=TIME, STAGE * for all\n");
+            printf("  --manifest FILE           Load build settings from an INI manifest; later options\n");
+            printf("                            override it\n");
+            printf("  --batch                   Build without menus or prompts, never reading stdin\n");
+            printf("  --profile                 Report a span profile with the stage report\n");
             printf("  --clean                   Clean previous build\n");
             printf("  --verbose                 Verbose output\n");
             printf("  --help                    Show this help\n");
@@ -358,6 +364,142 @@ void process_args(int argc, char *argv[], build_config_t *config) {
             config->build_uboot = 0;
         } else if (strcmp(argv[i], "--no-image") == 0) {
             config->create_image = 0;
+        } else if (strcmp(argv[i], "--no-spi") == 0) {
+            config->create_spi_image = 0;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            if (i + 1 < argc) {
+                if (strcmp(argv[i + 1], "zstd") == 0) {
+                    config->compress_format = COMPRESS_ZSTD;
+                } else if (strcmp(argv[i + 1], "xz") == 0) {
+                    config->compress_format = COMPRESS_XZ;
+                } else if (strcmp(argv[i + 1], "none") == 0) {
+                    config->compress_format = COMPRESS_NONE;
+                } else {
+                    printf("Unknown compression format: %s\n", argv[i + 1]);
+                }
+                i++;
+            }
+        } else if (strcmp(argv[i], "--compress-level") == 0) {
+            if (i + 1 < argc) {
+                config->compress_level = atoi(argv[i + 1]);
+                i++;
+            }
+        } else if (strcmp(argv[i], "--compress-threads") == 0) {
+            if (i + 1 < argc) {
+                config->compress_threads = atoi(argv[i + 1]);
+                i++;
+            }
+        } else if (strcmp(argv[i], "--matrix") == 0) {
+            if (i + 1 < argc) {
+                if (parse_matrix_targets(config, argv[i + 1]) != ERROR_SUCCESS) {
+                    printf("Invalid matrix targets: %s\n", argv[i + 1]);
+                }
+                i++;
+            }
+        } else if (strcmp(argv[i], "--matrix-parallel") == 0) {
+            if (i + 1 < argc) {
+                config->matrix_parallel = atoi(argv[i + 1]);
+                i++;
+            }
+        } else if (strcmp(argv[i], "--bootstrap") == 0) {
+            if (i + 1 < argc) {
+                if (strcmp(argv[i + 1], "single-pass") == 0) {
+                    config->bootstrap_engine = BOOTSTRAP_SINGLE_PASS;
+                } else if (strcmp(argv[i + 1], "debootstrap") == 0) {
+                    config->bootstrap_engine = BOOTSTRAP_DEBOOTSTRAP;
+                } else {
+                    printf("Unknown bootstrap engine: %s\n", argv[i + 1]);
+                }
+                i++;
+            }
+        } else if (strcmp(argv[i], "--benchmark-bootstrap") == 0) {
+            config->benchmark_bootstrap = 1;
+        } else if (strcmp(argv[i], "--locales") == 0) {
+            if (i + 1 < argc) {
+                strncpy(config->locales, argv[i + 1], sizeof(config->locales) - 1);
+                config->locales[sizeof(config->locales) - 1] = '\0';
+                i++;
+            }
+        } else if (strcmp(argv[i], "--slim") == 0) {
+            if (i + 1 < argc) {
+                int policy = parse_slim_policy(argv[i + 1]);
+                if (policy < 0) {
+                    printf("Unknown slimming policy: %s\n", argv[i + 1]);
+                } else {
+                    config->slim_policy = policy;
+                }
+                i++;
+            }
+        } else if (strcmp(argv[i], "--slim-top") == 0) {
+            if (i + 1 < argc) {
+                config->slim_report_top = atoi(argv[i + 1]);
+                i++;
+            }
+        } else if (strcmp(argv[i], "--metrics-file") == 0) {
+            if (i + 1 < argc) {
+                strncpy(config->metrics_file, argv[i + 1], sizeof(config->metrics_file) - 1);
+                config->metrics_file[sizeof(config->metrics_file) - 1] = '\0';
+                i++;
+            }
+        } else if (strcmp(argv[i], "--cache-dir") == 0) {
+            if (i + 1 < argc) {
+                strncpy(config->cache_dir, argv[i + 1], sizeof(config->cache_dir) - 1);
+                config->cache_dir[sizeof(config->cache_dir) - 1] = '\0';
+                i++;
+            }
+        } else if (strcmp(argv[i], "--download-segments") == 0) {
+            if (i + 1 < argc) {
+                config->download_segments = atoi(argv[i + 1]);
+                if (config->download_segments < 1) config->download_segments = 1;
+                i++;
+            }
+        } else if (strcmp(argv[i], "--sparse-kernel") == 0) {
+            config->kernel_sparse = 1;
+        } else if (strcmp(argv[i], "--job-memory") == 0) {
+            if (i + 1 < argc) {
+                long long size = parse_size(argv[i + 1]);
+                if (size <= 0) {
+                    printf("Invalid job memory: %s\n", argv[i + 1]);
+                } else {
+                    config->job_memory = size;
+                }
+                i++;
+            }
+        } else if (strcmp(argv[i], "--static-jobs") == 0) {
+            config->adaptive_jobs = 0;
+        } else if (strcmp(argv[i], "--command-timeout") == 0 || strcmp(argv[i], "--idle-timeout") == 0) {
+            if (i + 1 < argc) {
+                int seconds = parse_duration(argv[i + 1]);
+                if (seconds < 0) {
+                    printf("Invalid timeout: %s\n", argv[i + 1]);
+                } else if (strcmp(argv[i], "--command-timeout") == 0) {
+                    config->command_timeout = seconds;
+                } else {
+                    config->idle_timeout = seconds;
+                }
+                i++;
+            }
+        } else if (strcmp(argv[i], "--stage-limit") == 0) {
+            if (i + 1 < argc) {
+                if (parse_stage_limit(config, argv[i + 1]) != ERROR_SUCCESS) {
+                    printf("Invalid stage limit: %s\n", argv[i + 1]);
+                }
+                i++;
+            }
+        } else if (strcmp(argv[i], "--manifest") == 0) {
+            if (i + 1 < argc) {
+                // Building with part of a manifest applied would not be the build it describes
+                int result = manifest_load(config, argv[i + 1]);
+                if (result != ERROR_SUCCESS) {
+                    printf("Invalid manifest: %s\n", argv[i + 1]);
+                    exit(result);
+                }
+                i++;
+            }
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            config->batch = 1;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile_enable(1);
         } else if (strcmp(argv[i], "--clean") == 0) {
             config->clean_build = 1;
         } else if (strcmp(argv[i], "--verbose") == 0) {
@@ -368,9 +510,28 @@ void process_args(int argc, char *argv[], build_config_t *config) {
     }
 }
 
+// Ask for an emulation platform; returns 0 when the user backed out
+static int select_emulation_platform(build_config_t *config) {
+    static const emulation_platform_t platforms[] = {
+        EMU_NONE, EMU_LIBREELEC, EMU_EMULATIONSTATION, EMU_RETROPIE, EMU_LAKKA, EMU_ALL
+    };
+    
+    show_emulation_menu();
+    int choice = get_user_choice("Select emulation platform", 0, 5);
+    if (choice <= 0) return 0;
+    
+    config->emu_platform = platforms[choice];
+    return 1;
+}
+
 // Start interactive build
 int start_interactive_build(build_config_t *config) {
     int choice;
+    int result;
+    
+    if (config->batch) {
+        return perform_batch_build(config);
+    }
     
     print_header();
     print_legal_notice();
@@ -396,16 +557,20 @@ int start_interactive_build(build_config_t *config) {
                 break;
                 
             case 2:  // Custom Build
-                return perform_custom_build(config);
+                result = perform_custom_build(config);
+                if (result != ERROR_USER_CANCELLED) {
+                    return result;
+                }
+                break;
                 
             case 3:  // Emulation Focus
                 config->distro_type = DISTRO_EMULATION;
-                show_emulation_menu();
-                choice = get_user_choice("Select emulation platform", 0, 5);
-                if (choice > 0) {
-                    config->emu_platform = choice;
+                if (select_emulation_platform(config)) {
                     if (confirm_action("Proceed with emulation build?")) {
-                        return perform_custom_build(config);
+                        result = perform_custom_build(config);
+                        if (result != ERROR_USER_CANCELLED) {
+                            return result;
+                        }
                     }
                 }
                 break;
@@ -451,18 +616,190 @@ int start_interactive_build(build_config_t *config) {
     return ERROR_SUCCESS;
 }
 
+// Run one build step as an accounted build stage
+static int run_build_stage(const char *name, int (*step)(build_config_t *), build_config_t *config) {
+    build_stage_t *stage = build_stage_begin(name);
+    int result = step(config);
+    build_stage_end(stage, result);
+    return result;
+}
+
+// Create the output directories and set up the build host
+int prepare_build_host(build_config_t *config) {
+    int result;
+    
+    // Ensure output directories exist
+    result = ensure_directories_exist(config);
+    if (result != ERROR_SUCCESS && !config->continue_on_error) {
+        return result;
+    }
+    
+    // Setup build environment
+    build_stage_t *stage = build_stage_begin("environment");
+    result = setup_build_environment();
+    build_stage_end(stage, result);
+    if (result != ERROR_SUCCESS && !config->continue_on_error) {
+        return result;
+    }
+    
+    // Install prerequisites
+    stage = build_stage_begin("prerequisites");
+    result = install_prerequisites();
+    build_stage_end(stage, result);
+    return result;
+}
+
+// Run the stages all targets share: the kernel, the GPU stack on the host
+// and the bootloader
+int build_shared_stages(build_config_t *config) {
+    int result;
+    
+    if (config->build_kernel) {
+        // Download kernel source
+        result = run_build_stage("kernel_download", download_kernel_source, config);
+        if (result != ERROR_SUCCESS && !config->continue_on_error) {
+            return result;
+        }
+        
+        // Configure kernel
+        result = run_build_stage("kernel_config", configure_kernel, config);
+        if (result != ERROR_SUCCESS && !config->continue_on_error) {
+            return result;
+        }
+        
+        // Build kernel
+        result = run_build_stage("kernel_build", build_kernel, config);
+        if (result != ERROR_SUCCESS && !config->continue_on_error) {
+            return result;
+        }
+    }
+    
+    // Download and install Mali drivers
+    if (config->install_gpu_blobs) {
+        result = run_build_stage("mali_download", download_mali_blobs, config);
+        if (result != ERROR_SUCCESS && !config->continue_on_error) {
+            return result;
+        }
+        
+        result = run_build_stage("mali_install", install_mali_drivers, config);
+        if (result != ERROR_SUCCESS && !config->continue_on_error) {
+            return result;
+        }
+        
+        if (config->enable_opencl) {
+            result = run_build_stage("opencl", setup_opencl_support, config);
+            if (result != ERROR_SUCCESS && !config->continue_on_error) {
+                return result;
+            }
+        }
+        
+        if (config->enable_vulkan) {
+            result = run_build_stage("vulkan", setup_vulkan_support, config);
+            if (result != ERROR_SUCCESS && !config->continue_on_error) {
+                return result;
+            }
+        }
+    }
+    
+    // Build bootloader
+    if (config->build_uboot) {
+        result = run_build_stage("uboot_download", download_uboot_source, config);
+        if (result == ERROR_SUCCESS || config->continue_on_error) {
+            result = run_build_stage("uboot_build", build_uboot, config);
+        }
+        if (result != ERROR_SUCCESS && !config->continue_on_error) {
+            return result;
+        }
+    }
+    
+    return ERROR_SUCCESS;
+}
+
+// Run the stages of one target: its rootfs and its images
+int build_target_stages(build_config_t *config) {
+    int result;
+    
+    // Compare the bootstrap engines on this package set
+    if (config->build_rootfs && config->benchmark_bootstrap) {
+        result = benchmark_bootstrap_engines(config);
+        if (result != ERROR_SUCCESS && !config->continue_on_error) {
+            return result;
+        }
+    }
+    
+    // Build rootfs
+    if (config->build_rootfs) {
+        result = run_build_stage("rootfs", build_ubuntu_rootfs, config);
+        if (result != ERROR_SUCCESS && !config->continue_on_error) {
+            return result;
+        }
+    }
+    
+    // Install kernel
+    result = run_build_stage("kernel_install", install_kernel, config);
+    if (result != ERROR_SUCCESS && !config->continue_on_error) {
+        return result;
+    }
+    
+    // Install system packages
+    result = run_build_stage("system_packages", install_system_packages, config);
+    if (result != ERROR_SUCCESS && !config->continue_on_error) {
+        return result;
+    }
+    
+    // Configure system services
+    result = run_build_stage("system_services", configure_system_services, config);
+    if (result != ERROR_SUCCESS && !config->continue_on_error) {
+        return result;
+    }
+    
+    // Slim the rootfs before it is copied into the image
+    if (config->build_rootfs && config->slim_policy) {
+        result = run_build_stage("rootfs_slim", slim_rootfs, config);
+        if (result != ERROR_SUCCESS && !config->continue_on_error) {
+            return result;
+        }
+    }
+    
+    // Create the SD image and, alongside it, the SPI flash image
+    if (config->create_image || config->create_spi_image) {
+        result = run_build_stage("image", create_images, config);
+        if (result != ERROR_SUCCESS && !config->continue_on_error) {
+            return result;
+        }
+    }
+    
+    // Compress and checksum the SD image in one read
+    if (config->create_image && config->compress_format != COMPRESS_NONE) {
+        result = run_build_stage("image_compress", compress_system_image, config);
+        if (result != ERROR_SUCCESS && !config->continue_on_error) {
+            return result;
+        }
+    }
+    
+    return ERROR_SUCCESS;
+}
+
 // Perform quick setup - FIXED VERSION
 int perform_quick_setup(build_config_t *config) {
     int result;
     
+    // A target matrix builds every listed target instead of the quick setup one
+    if (config->matrix_count > 0) {
+        return perform_matrix_build(config);
+    }
+    
     // Set default quick setup options
     config->distro_type = DISTRO_DESKTOP;
     config->emu_platform = EMU_NONE;
     strcpy(config->ubuntu_release, "24.04");  // Use stable Noble instead of development version
     strcpy(config->ubuntu_codename, "noble");
-    config->install_gpu_blobs = 1;
-    config->enable_opencl = 1;
-    config->enable_vulkan = 1;
+    config->install_gpu_blobs = mali_blobs_pinned();
+    config->enable_opencl = config->install_gpu_blobs;
+    config->enable_vulkan = config->install_gpu_blobs;
+    if (!config->install_gpu_blobs) {
+        LOG_WARNING("Mali blobs have no sha256 pins (see " MALI_PINS_FILE "), building without GPU drivers");
+    }
     config->build_kernel = 1;
     config->build_rootfs = 1;
     config->build_uboot = 1;
@@ -478,91 +815,271 @@ int perform_quick_setup(build_config_t *config) {
     
     LOG_INFO("Starting quick setup build...");
     
-    // Ensure output directories exist
-    result = ensure_directories_exist(config);
+    result = prepare_build_host(config);
     if (result != ERROR_SUCCESS && !config->continue_on_error) {
         return result;
     }
     
-    // Setup build environment
-    result = setup_build_environment();
+    result = build_shared_stages(config);
     if (result != ERROR_SUCCESS && !config->continue_on_error) {
         return result;
     }
     
-    // Install prerequisites
-    result = install_prerequisites();
+    result = build_target_stages(config);
     if (result != ERROR_SUCCESS && !config->continue_on_error) {
         return result;
     }
     
-    // Download kernel source
-    result = download_kernel_source(config);
+    build_stage_report();
+    
+    LOG_INFO("Quick setup build completed successfully");
+    return ERROR_SUCCESS;
+}
+
+// Build the configuration as it stands: the target matrix when one is given,
+// otherwise its single target. The settings are recorded as a manifest first,
+// so any build can be repeated with --batch --manifest
+static int perform_configured_build(build_config_t *config) {
+    char manifest_path[MAX_PATH_LEN + 32];
+    error_context_t error_ctx = {0};
+    int result;
+    
+    if (create_directory_safe(config->output_dir, &error_ctx) == 0) {
+        snprintf(manifest_path, sizeof(manifest_path), "%s/build-manifest.ini", config->output_dir);
+        manifest_write(config, manifest_path);
+    }
+    
+    if (config->matrix_count > 0) {
+        return perform_matrix_build(config);
+    }
+    
+    result = prepare_build_host(config);
     if (result != ERROR_SUCCESS && !config->continue_on_error) {
         return result;
     }
     
-    // Configure kernel
-    result = configure_kernel(config);
+    result = build_shared_stages(config);
     if (result != ERROR_SUCCESS && !config->continue_on_error) {
         return result;
     }
     
-    // Build kernel
-    result = build_kernel(config);
+    result = build_target_stages(config);
     if (result != ERROR_SUCCESS && !config->continue_on_error) {
         return result;
     }
     
-    // Download Mali blobs
-    if (config->install_gpu_blobs) {
-        result = download_mali_blobs(config);
-        if (result != ERROR_SUCCESS && !config->continue_on_error) {
-            return result;
-        }
-    }
+    build_stage_report();
+    return ERROR_SUCCESS;
+}
+
+// Build without menus or prompts (--batch); stdin is never read
+int perform_batch_build(build_config_t *config) {
+    int result;
     
-    // Build rootfs
-    if (config->build_rootfs) {
-        result = build_ubuntu_rootfs(config);
-        if (result != ERROR_SUCCESS && !config->continue_on_error) {
-            return result;
-        }
+    config->batch = 1;
+    
+    // Anything that still reads stdin gets end of file instead of waiting
+    if (!freopen("/dev/null", "r", stdin)) {
+        LOG_WARNING("Could not detach stdin for batch mode");
     }
     
-    // Install kernel
-    result = install_kernel(config);
-    if (result != ERROR_SUCCESS && !config->continue_on_error) {
+    result = validate_config(config);
+    if (result != ERROR_SUCCESS) {
         return result;
     }
     
-    // Install Mali drivers
-    if (config->install_gpu_blobs) {
-        result = install_mali_drivers(config);
-        if (result != ERROR_SUCCESS && !config->continue_on_error) {
-            return result;
+    LOG_INFO("Starting batch build...");
+    
+    result = perform_configured_build(config);
+    if (result == ERROR_SUCCESS) {
+        LOG_INFO("Batch build completed successfully");
+    }
+    return result;
+}
+
+// Ask for a distribution type, and a platform for emulation builds
+static void select_distro_type(build_config_t *config) {
+    static const distro_type_t types[] = {
+        DISTRO_DESKTOP, DISTRO_SERVER, DISTRO_EMULATION, DISTRO_MINIMAL
+    };
+    
+    show_distro_selection_menu();
+    int choice = get_user_choice("Select distribution type", 0, 4);
+    if (choice <= 0) return;
+    
+    if (types[choice - 1] == DISTRO_EMULATION) {
+        if (!select_emulation_platform(config)) return;
+    } else {
+        config->emu_platform = EMU_NONE;
+    }
+    config->distro_type = types[choice - 1];
+}
+
+// Ask for an Ubuntu release
+static void select_ubuntu_release(build_config_t *config) {
+    int count = 0;
+    
+    while (strlen(ubuntu_releases[count].version) > 0) count++;
+    
+    show_ubuntu_selection_menu();
+    int choice = get_user_choice("Select Ubuntu release", 0, count);
+    if (choice <= 0) return;
+    
+    ubuntu_release_t *release = &ubuntu_releases[choice - 1];
+    strncpy(config->ubuntu_release, release->version, sizeof(config->ubuntu_release) - 1);
+    config->ubuntu_release[sizeof(config->ubuntu_release) - 1] = '\0';
+    strncpy(config->ubuntu_codename, release->codename, sizeof(config->ubuntu_codename) - 1);
+    config->ubuntu_codename[sizeof(config->ubuntu_codename) - 1] = '\0';
+}
+
+// Toggle the GPU options until the user goes back
+static void select_gpu_options(build_config_t *config) {
+    while (1) {
+        show_gpu_options_menu(config);
+        int choice = get_user_choice("Select option", 0, 5);
+        
+        switch (choice) {
+            case 1:
+                config->install_gpu_blobs = !config->install_gpu_blobs;
+                break;
+            case 2:
+                config->enable_opencl = !config->enable_opencl;
+                break;
+            case 3:
+                config->enable_vulkan = !config->enable_vulkan;
+                break;
+            case 4:
+            case 5:
+                config->install_gpu_blobs = choice == 4;
+                config->enable_opencl = choice == 4;
+                config->enable_vulkan = choice == 4;
+                break;
+            default:
+                return;
         }
         
-        if (config->enable_opencl) {
-            result = setup_opencl_support(config);
-            if (result != ERROR_SUCCESS && !config->continue_on_error) {
-                return result;
-            }
+        // OpenCL and Vulkan run on the Mali blobs
+        if (choice == 1 && !config->install_gpu_blobs) {
+            config->enable_opencl = 0;
+            config->enable_vulkan = 0;
+        } else if (config->enable_opencl || config->enable_vulkan) {
+            config->install_gpu_blobs = 1;
         }
+    }
+}
+
+// Toggle the components to build until the user goes back
+static void select_build_components(build_config_t *config) {
+    while (1) {
+        show_build_components_menu(config);
         
-        if (config->enable_vulkan) {
-            result = setup_vulkan_support(config);
-            if (result != ERROR_SUCCESS && !config->continue_on_error) {
-                return result;
-            }
+        switch (get_user_choice("Select option", 0, 6)) {
+            case 1:
+                config->build_kernel = !config->build_kernel;
+                break;
+            case 2:
+                config->build_rootfs = !config->build_rootfs;
+                break;
+            case 3:
+                config->build_uboot = !config->build_uboot;
+                break;
+            case 4:
+                config->create_image = !config->create_image;
+                break;
+            case 5:
+                config->create_spi_image = !config->create_spi_image;
+                break;
+            case 6:
+                // none -> zstd -> xz -> none; levels differ per format
+                config->compress_format = config->compress_format == COMPRESS_NONE ? COMPRESS_ZSTD :
+                                          config->compress_format == COMPRESS_ZSTD ? COMPRESS_XZ :
+                                          COMPRESS_NONE;
+                config->compress_level = -1;
+                break;
+            default:
+                return;
         }
     }
+}
+
+// Perform custom build: set up the configuration through the menus, then build it
+int perform_custom_build(build_config_t *config) {
+    char buffer[64];
     
-    // Install system packages
-    result = install_system_packages(config);
-    if (result != ERROR_SUCCESS && !config->continue_on_error) {
-        return result;
+    if (config->batch) {
+        return perform_batch_build(config);
     }
     
-    // Configure system services
-    result = configure_system_services(co
+    while (1) {
+        show_custom_build_menu();
+        
+        switch (get_user_choice("Select option", 0, 7)) {
+            case 1:  // Distribution Type
+                select_distro_type(config);
+                break;
+                
+            case 2:  // Ubuntu Version
+                select_ubuntu_release(config);
+                break;
+                
+            case 3:  // Kernel Options
+                printf("Current kernel version: %s\n", config->kernel_version);
+                if (get_user_input("Enter kernel version: ", buffer, sizeof(buffer)) && strlen(buffer) >= 3) {
+                    strncpy(config->kernel_version, buffer, sizeof(config->kernel_version) - 1);
+                    config->kernel_version[sizeof(config->kernel_version) - 1] = '\0';
+                }
+                break;
+                
+            case 4:  // GPU Configuration
+                select_gpu_options(config);
+                break;
+                
+            case 5:  // Build Components
+                select_build_components(config);
+                break;
+                
+            case 6:  // Image Settings
+                show_image_settings_menu(config);
+                break;
+                
+            case 7:  // Start Build
+                show_build_summary(config);
+                if (validate_config(config) == ERROR_SUCCESS && confirm_action("Start custom build?")) {
+                    LOG_INFO("Starting custom build...");
+                    return perform_configured_build(config);
+                }
+                break;
+                
+            default:  // Back
+                return ERROR_USER_CANCELLED;
+        }
+    }
+}
+
+// Program entry point: defaults, then .env and the command line (a manifest
+// applied where --manifest appears), then the batch build or the menus
+int main(int argc, char *argv[]) {
+    static build_config_t config;
+    int result;
+    
+    global_config = &config;
+    init_build_config(&config);
+    process_args(argc, argv, &config);
+    
+    debug_init();
+    setup_signal_handlers();
+    
+    result = check_root_permissions();
+    if (result == ERROR_SUCCESS) {
+        if (config.batch) {
+            result = perform_batch_build(&config);
+        } else {
+            result = start_interactive_build(&config);
+        }
+    }
+    
+    debug_cleanup();
+    
+    // Error codes are the exit status, so CI can tell failures apart
+    return result;
+}
@@ -16,6 +16,8 @@
 #include <sys/resource.h>
 #include <dlfcn.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
 
 // Global debug state
 debug_config_t debug_config = {
@@ -30,8 +32,6 @@ debug_config_t debug_config = {
     .debug_fp = NULL
 };
 
-debug_timer_t debug_timers[32];
-debug_alloc_t *debug_allocations = NULL;
 custom_module_t *loaded_modules = NULL;
 int debug_initialized = 0;
 
@@ -74,8 +74,10 @@ int debug_init(void) {
         }
     }
     
-    // Initialize timers
-    memset(debug_timers, 0, sizeof(debug_timers));
+    // Timers are spans of the build profiler
+    if (debug_build_options.enable_profiling) {
+        profile_enable(1);
+    }
     
     // Create debug output directory
     char cmd[512];
@@ -193,148 +195,386 @@ void debug_log(debug_level_t level, const char *file, int line, const char *func
     }
 }
 
-// Timer functions
+// Timer functions; timers are spans of the build profiler, so they nest and
+// repeated timers with the same name are aggregated
 void debug_timer_start(const char *name) {
-    for (int i = 0; i < 32; i++) {
-        if (!debug_timers[i].active) {
-            strncpy(debug_timers[i].name, name, sizeof(debug_timers[i].name) - 1);
-            debug_timers[i].name[sizeof(debug_timers[i].name) - 1] = '\0';
-            gettimeofday(&debug_timers[i].start_time, NULL);
-            debug_timers[i].active = 1;
-            DEBUG_TRACE("Started timer: %s", name);
-            return;
+    profile_begin(name);
+    DEBUG_TRACE("Started timer: %s", name);
+}
+
+void debug_timer_end(const char *name) {
+    profile_end(name);
+    DEBUG_TRACE("Ended timer: %s", name);
+}
+
+void debug_timer_report(const char *name) {
+    profile_report(name);
+}
+
+void debug_timer_report_all(void) {
+    profile_report_all();
+}
+
+// Memory debugging: live allocations are kept in an open-addressing hash
+// table keyed by pointer, with records carved out of slabs so tracking an
+// allocation never calls malloc itself
+#define DEBUG_ALLOC_SLAB_RECORDS 256
+#define DEBUG_ALLOC_MAX_SITES 1024      // Power of two
+
+typedef struct debug_alloc_slab {
+    struct debug_alloc_slab *next;
+    debug_alloc_t records[DEBUG_ALLOC_SLAB_RECORDS];
+} debug_alloc_slab_t;
+
+static debug_alloc_t **alloc_table = NULL;
+static size_t alloc_table_size = 0;     // Power of two
+static size_t alloc_table_used = 0;     // Live entries plus tombstones
+static debug_alloc_slab_t *alloc_slabs = NULL;
+static debug_alloc_t *alloc_free_records = NULL;
+static debug_alloc_site_t alloc_sites[DEBUG_ALLOC_MAX_SITES];
+static int alloc_site_count = 0;
+static debug_memory_stats_t alloc_stats;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Marks a removed entry so probe chains stay intact
+static debug_alloc_t alloc_tombstone;
+
+// Pointer hash (Fibonacci hashing; malloc results are 16-byte aligned)
+static size_t alloc_hash(const void *ptr, size_t table_size) {
+    return (size_t)((((uintptr_t)ptr >> 4) * 11400714819323198485ULL) >> 32) & (table_size - 1);
+}
+
+// Find or create the counters of a call site; caller holds alloc_lock
+static int alloc_find_site(const char *file, int line, const char *func) {
+    size_t slot = (size_t)((((uintptr_t)file >> 3) ^ (uintptr_t)line) * 2654435761u) & (DEBUG_ALLOC_MAX_SITES - 1);
+
+    for (int probe = 0; probe < DEBUG_ALLOC_MAX_SITES; probe++) {
+        debug_alloc_site_t *site = &alloc_sites[(slot + probe) & (DEBUG_ALLOC_MAX_SITES - 1)];
+
+        if (!site->file) {
+            if (alloc_site_count >= DEBUG_ALLOC_MAX_SITES - 1) break;
+            site->file = file;
+            site->line = line;
+            site->function = func;
+            alloc_site_count++;
+            return (int)(site - alloc_sites);
+        }
+        // __FILE__ literals are compared by content, the linker may not merge them
+        if (site->line == line && (site->file == file || strcmp(site->file, file) == 0)) {
+            return (int)(site - alloc_sites);
         }
     }
-    DEBUG_WARN("No free timer slots for: %s", name);
+
+    return -1;
 }
 
-void debug_timer_end(const char *name) {
-    for (int i = 0; i < 32; i++) {
-        if (debug_timers[i].active && strcmp(debug_timers[i].name, name) == 0) {
-            gettimeofday(&debug_timers[i].end_time, NULL);
-            debug_timers[i].duration_us = 
-                (debug_timers[i].end_time.tv_sec - debug_timers[i].start_time.tv_sec) * 1000000 +
-                (debug_timers[i].end_time.tv_usec - debug_timers[i].start_time.tv_usec);
-            debug_timers[i].active = 0;
-            DEBUG_TRACE("Ended timer: %s (%ld μs)", name, debug_timers[i].duration_us);
-            return;
+// Take a record from the slab free list; caller holds alloc_lock
+static debug_alloc_t* alloc_new_record(void) {
+    if (!alloc_free_records) {
+        debug_alloc_slab_t *slab = malloc(sizeof(debug_alloc_slab_t));
+        if (!slab) return NULL;
+
+        slab->next = alloc_slabs;
+        alloc_slabs = slab;
+        for (int i = DEBUG_ALLOC_SLAB_RECORDS - 1; i >= 0; i--) {
+            slab->records[i].next = alloc_free_records;
+            alloc_free_records = &slab->records[i];
         }
     }
-    DEBUG_WARN("Timer not found: %s", name);
+
+    debug_alloc_t *record = alloc_free_records;
+    alloc_free_records = record->next;
+    return record;
 }
 
-void debug_timer_report(const char *name) {
-    for (int i = 0; i < 32; i++) {
-        if (strcmp(debug_timers[i].name, name) == 0) {
-            if (debug_timers[i].duration_us > 1000000) {
-                DEBUG_INFO("Timer %s: %.2f seconds", name, debug_timers[i].duration_us / 1000000.0);
-            } else if (debug_timers[i].duration_us > 1000) {
-                DEBUG_INFO("Timer %s: %.2f milliseconds", name, debug_timers[i].duration_us / 1000.0);
-            } else {
-                DEBUG_INFO("Timer %s: %ld microseconds", name, debug_timers[i].duration_us);
-            }
-            return;
+// Rebuild the table at a new size, dropping tombstones; caller holds alloc_lock
+static int alloc_table_resize(size_t new_size) {
+    debug_alloc_t **table = calloc(new_size, sizeof(debug_alloc_t *));
+    if (!table) return -1;
+
+    for (size_t i = 0; i < alloc_table_size; i++) {
+        debug_alloc_t *record = alloc_table[i];
+        if (!record || record == &alloc_tombstone) continue;
+
+        size_t slot = alloc_hash(record->ptr, new_size);
+        while (table[slot]) {
+            slot = (slot + 1) & (new_size - 1);
         }
+        table[slot] = record;
     }
-    DEBUG_WARN("Timer not found for report: %s", name);
+
+    free(alloc_table);
+    alloc_table = table;
+    alloc_table_size = new_size;
+    alloc_table_used = alloc_stats.live_allocations;
+    return 0;
 }
 
-void debug_timer_report_all(void) {
-    DEBUG_INFO("=== Timer Report ===");
-    for (int i = 0; i < 32; i++) {
-        if (strlen(debug_timers[i].name) > 0) {
-            debug_timer_report(debug_timers[i].name);
+// Start tracking a block; realloc passes new_allocation = 0. Caller holds alloc_lock
+static void alloc_track(void *ptr, size_t size, int site, int new_allocation) {
+    // Keep the load factor, tombstones included, under 70%
+    if ((alloc_table_used + 1) * 10 >= alloc_table_size * 7) {
+        size_t new_size = alloc_table_size ? alloc_table_size : 1024;
+        if ((alloc_stats.live_allocations + 1) * 10 >= new_size * 7 / 2) new_size *= 2;
+        if (alloc_table_resize(new_size) != 0) return;
+    }
+
+    debug_alloc_t *record = alloc_new_record();
+    if (!record) return;
+
+    record->ptr = ptr;
+    record->size = size;
+    record->site = site;
+    record->timestamp = time(NULL);
+    record->next = NULL;
+
+    size_t slot = alloc_hash(ptr, alloc_table_size);
+    while (alloc_table[slot] && alloc_table[slot] != &alloc_tombstone) {
+        slot = (slot + 1) & (alloc_table_size - 1);
+    }
+    if (!alloc_table[slot]) alloc_table_used++;
+    alloc_table[slot] = record;
+
+    alloc_stats.live_allocations++;
+    alloc_stats.total_allocations += new_allocation;
+    alloc_stats.live_bytes += size;
+    if (alloc_stats.live_bytes > alloc_stats.peak_bytes) {
+        alloc_stats.peak_bytes = alloc_stats.live_bytes;
+        alloc_stats.peak_time = record->timestamp;
+    }
+
+    if (site >= 0) {
+        alloc_sites[site].allocations += new_allocation;
+        alloc_sites[site].bytes_allocated += size;
+        alloc_sites[site].live_bytes += size;
+        if (alloc_sites[site].live_bytes > alloc_sites[site].peak_bytes) {
+            alloc_sites[site].peak_bytes = alloc_sites[site].live_bytes;
+        }
+    }
+}
+
+// Stop tracking a block and return its record; caller holds alloc_lock
+static debug_alloc_t* alloc_untrack(void *ptr, int is_free) {
+    if (!alloc_table) return NULL;
+
+    size_t slot = alloc_hash(ptr, alloc_table_size);
+    while (alloc_table[slot]) {
+        debug_alloc_t *record = alloc_table[slot];
+        if (record != &alloc_tombstone && record->ptr == ptr) {
+            alloc_table[slot] = &alloc_tombstone;
+
+            alloc_stats.live_allocations--;
+            alloc_stats.live_bytes -= record->size;
+            if (record->site >= 0) {
+                alloc_sites[record->site].frees += is_free;
+                alloc_sites[record->site].live_bytes -= record->size;
+            }
+
+            record->next = alloc_free_records;
+            alloc_free_records = record;
+            return record;
         }
+        slot = (slot + 1) & (alloc_table_size - 1);
     }
-    DEBUG_INFO("=== End Timer Report ===");
+
+    return NULL;
 }
 
-// Memory debugging functions
 void* debug_malloc(size_t size, const char *file, int line, const char *func) {
     void *ptr = malloc(size);
     if (ptr) {
-        debug_alloc_t *alloc = malloc(sizeof(debug_alloc_t));
-        if (alloc) {
-            alloc->ptr = ptr;
-            alloc->size = size;
-            strncpy(alloc->file, file, sizeof(alloc->file) - 1);
-            alloc->file[sizeof(alloc->file) - 1] = '\0';
-            alloc->line = line;
-            strncpy(alloc->function, func, sizeof(alloc->function) - 1);
-            alloc->function[sizeof(alloc->function) - 1] = '\0';
-            alloc->timestamp = time(NULL);
-            alloc->next = debug_allocations;
-            debug_allocations = alloc;
-            DEBUG_TRACE("Allocated %zu bytes at %p", size, ptr);
-        }
+        pthread_mutex_lock(&alloc_lock);
+        alloc_track(ptr, size, alloc_find_site(file, line, func), 1);
+        pthread_mutex_unlock(&alloc_lock);
+        DEBUG_TRACE("Allocated %zu bytes at %p", size, ptr);
     } else {
         DEBUG_ERROR("Failed to allocate %zu bytes", size);
     }
     return ptr;
 }
 
+void* debug_calloc(size_t count, size_t size, const char *file, int line, const char *func) {
+    void *ptr = calloc(count, size);
+    if (ptr) {
+        pthread_mutex_lock(&alloc_lock);
+        alloc_track(ptr, count * size, alloc_find_site(file, line, func), 1);
+        pthread_mutex_unlock(&alloc_lock);
+        DEBUG_TRACE("Allocated %zu x %zu bytes at %p", count, size, ptr);
+    } else {
+        DEBUG_ERROR("Failed to allocate %zu x %zu bytes", count, size);
+    }
+    return ptr;
+}
+
+void* debug_realloc(void *ptr, size_t size, const char *file, int line, const char *func) {
+    if (!ptr) {
+        return debug_malloc(size, file, line, func);
+    }
+    if (size == 0) {
+        debug_free(ptr, file, line, func);
+        return NULL;
+    }
+
+    // The block may move, so it is untracked first and tracked again after
+    pthread_mutex_lock(&alloc_lock);
+    int site = alloc_find_site(file, line, func);
+    debug_alloc_t *record = alloc_untrack(ptr, 0);
+    size_t old_size = record ? record->size : 0;
+    int old_site = record ? record->site : site;
+    pthread_mutex_unlock(&alloc_lock);
+
+    if (!record) {
+        DEBUG_WARN("Attempt to realloc untracked pointer %p", ptr);
+    }
+
+    // The old address is only used again when realloc fails and leaves it valid
+    uintptr_t old_address = (uintptr_t)ptr;
+    void *new_ptr = realloc(ptr, size);
+
+    pthread_mutex_lock(&alloc_lock);
+    if (site >= 0) {
+        alloc_sites[site].reallocs++;
+    }
+    if (new_ptr) {
+        // Live bytes stay with the site that made the original allocation
+        alloc_track(new_ptr, size, old_site, !record);
+    } else if (record) {
+        alloc_track((void *)old_address, old_size, old_site, 0);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+
+    if (new_ptr) {
+        DEBUG_TRACE("Reallocated %zu bytes to %zu bytes at %p", old_size, size, new_ptr);
+    } else {
+        DEBUG_ERROR("Failed to reallocate %#lx to %zu bytes", (unsigned long)old_address, size);
+    }
+    return new_ptr;
+}
+
 void debug_free(void *ptr, const char *file, int line, const char *func) {
+    (void)file; (void)line; (void)func;
+
     if (!ptr) {
         DEBUG_WARN("Attempt to free NULL pointer");
         return;
     }
-    
-    debug_alloc_t *prev = NULL;
-    debug_alloc_t *current = debug_allocations;
-    
-    while (current) {
-        if (current->ptr == ptr) {
-            if (prev) {
-                prev->next = current->next;
-            } else {
-                debug_allocations = current->next;
-            }
-            DEBUG_TRACE("Freed %zu bytes at %p", current->size, ptr);
-            free(current);
-            free(ptr);
-            return;
-        }
-        prev = current;
-        current = current->next;
+
+    pthread_mutex_lock(&alloc_lock);
+    debug_alloc_t *record = alloc_untrack(ptr, 1);
+    size_t size = record ? record->size : 0;
+    pthread_mutex_unlock(&alloc_lock);
+
+    if (record) {
+        DEBUG_TRACE("Freed %zu bytes at %p", size, ptr);
+    } else {
+        DEBUG_WARN("Attempt to free untracked pointer %p", ptr);
     }
-    
-    DEBUG_WARN("Attempt to free untracked pointer %p", ptr);
     free(ptr);
 }
 
+// Current tracker totals
+void debug_memory_get_stats(debug_memory_stats_t *stats) {
+    pthread_mutex_lock(&alloc_lock);
+    *stats = alloc_stats;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Order call sites by the bytes they still hold, then by bytes allocated
+static int compare_alloc_sites(const void *a, const void *b) {
+    const debug_alloc_site_t *sa = *(const debug_alloc_site_t * const *)a;
+    const debug_alloc_site_t *sb = *(const debug_alloc_site_t * const *)b;
+
+    if (sa->live_bytes != sb->live_bytes) return sa->live_bytes < sb->live_bytes ? 1 : -1;
+    if (sa->bytes_allocated != sb->bytes_allocated) return sa->bytes_allocated < sb->bytes_allocated ? 1 : -1;
+    return 0;
+}
+
 void debug_memory_report(void) {
-    size_t total_leaked = 0;
-    int leak_count = 0;
-    
+    debug_alloc_site_t *sites[DEBUG_ALLOC_MAX_SITES];
+    int site_count = 0;
+    char peak_time[32] = "-";
+
     DEBUG_INFO("=== Memory Leak Report ===");
-    
-    debug_alloc_t *current = debug_allocations;
-    while (current) {
-        total_leaked += current->size;
-        leak_count++;
-        DEBUG_WARN("Memory leak: %zu bytes at %p (allocated in %s:%d:%s())", 
-                   current->size, current->ptr, current->file, current->line, current->function);
-        current = current->next;
+
+    pthread_mutex_lock(&alloc_lock);
+
+    for (size_t i = 0; i < alloc_table_size; i++) {
+        debug_alloc_t *record = alloc_table[i];
+        if (!record || record == &alloc_tombstone) continue;
+
+        debug_alloc_site_t *site = record->site >= 0 ? &alloc_sites[record->site] : NULL;
+        DEBUG_WARN("Memory leak: %zu bytes at %p (allocated in %s:%d:%s())",
+                   record->size, record->ptr,
+                   site ? site->file : "?", site ? site->line : 0, site ? site->function : "?");
     }
-    
-    if (leak_count == 0) {
+
+    if (alloc_stats.live_allocations == 0) {
         DEBUG_INFO("No memory leaks detected");
     } else {
-        DEBUG_ERROR("Total leaked memory: %zu bytes in %d allocations", total_leaked, leak_count);
+        DEBUG_ERROR("Total leaked memory: %zu bytes in %lu allocations",
+                    alloc_stats.live_bytes, alloc_stats.live_allocations);
     }
-    
+
+    if (alloc_stats.peak_time) {
+        struct tm tm_info;
+        localtime_r(&alloc_stats.peak_time, &tm_info);
+        strftime(peak_time, sizeof(peak_time), "%H:%M:%S", &tm_info);
+    }
+    DEBUG_INFO("Peak tracked memory: %zu bytes at %s, %lu allocations in total",
+               alloc_stats.peak_bytes, peak_time, alloc_stats.total_allocations);
+
+    // Per call site counters
+    for (int i = 0; i < DEBUG_ALLOC_MAX_SITES; i++) {
+        if (alloc_sites[i].file) sites[site_count++] = &alloc_sites[i];
+    }
+    qsort(sites, site_count, sizeof(sites[0]), compare_alloc_sites);
+
+    if (site_count > 0) {
+        DEBUG_INFO("%-40s %8s %8s %8s %12s %12s %12s", "call site", "allocs", "frees", "reallocs",
+                   "allocated", "live", "peak");
+    }
+    for (int i = 0; i < site_count; i++) {
+        char location[128];
+        const char *basename = strrchr(sites[i]->file, '/');
+
+        snprintf(location, sizeof(location), "%s:%d:%s()", basename ? basename + 1 : sites[i]->file,
+                 sites[i]->line, sites[i]->function);
+        DEBUG_INFO("%-40s %8lu %8lu %8lu %12zu %12zu %12zu", location,
+                   sites[i]->allocations, sites[i]->frees, sites[i]->reallocs,
+                   sites[i]->bytes_allocated, sites[i]->live_bytes, sites[i]->peak_bytes);
+    }
+
+    pthread_mutex_unlock(&alloc_lock);
+
     DEBUG_INFO("=== End Memory Report ===");
 }
 
 void debug_memory_cleanup(void) {
-    debug_alloc_t *current = debug_allocations;
-    while (current) {
-        debug_alloc_t *next = current->next;
-        free(current->ptr);
-        free(current);
-        current = next;
+    pthread_mutex_lock(&alloc_lock);
+
+    for (size_t i = 0; i < alloc_table_size; i++) {
+        debug_alloc_t *record = alloc_table[i];
+        if (record && record != &alloc_tombstone) {
+            free(record->ptr);
+        }
     }
-    debug_allocations = NULL;
+    free(alloc_table);
+    alloc_table = NULL;
+    alloc_table_size = 0;
+    alloc_table_used = 0;
+
+    while (alloc_slabs) {
+        debug_alloc_slab_t *next = alloc_slabs->next;
+        free(alloc_slabs);
+        alloc_slabs = next;
+    }
+    alloc_free_records = NULL;
+
+    memset(alloc_sites, 0, sizeof(alloc_sites));
+    alloc_site_count = 0;
+    memset(&alloc_stats, 0, sizeof(alloc_stats));
+
+    pthread_mutex_unlock(&alloc_lock);
 }
 
 // Configuration debugging
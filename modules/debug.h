@@ -52,26 +52,37 @@ typedef struct {
     FILE *debug_fp;
 } debug_config_t;
 
-// Performance profiling
-typedef struct {
-    char name[64];
-    struct timeval start_time;
-    struct timeval end_time;
-    long duration_us;  // microseconds
-    int active;
-} debug_timer_t;
-
 // Memory tracking
 typedef struct debug_alloc {
     void *ptr;
     size_t size;
-    char file[64];
-    int line;
-    char function[64];
+    int site;                   // Index into the call site table, -1 if full
     time_t timestamp;
-    struct debug_alloc *next;
+    struct debug_alloc *next;   // Free list link while the record is unused
 } debug_alloc_t;
 
+// Aggregate counters of one allocating call site
+typedef struct {
+    const char *file;
+    int line;
+    const char *function;
+    unsigned long allocations;
+    unsigned long frees;
+    unsigned long reallocs;
+    size_t bytes_allocated;
+    size_t live_bytes;
+    size_t peak_bytes;
+} debug_alloc_site_t;
+
+// Tracker totals and the peak memory watermark
+typedef struct {
+    unsigned long live_allocations;
+    unsigned long total_allocations;
+    size_t live_bytes;
+    size_t peak_bytes;
+    time_t peak_time;
+} debug_memory_stats_t;
+
 // Module system structures
 typedef enum {
     MODULE_TYPE_UI = 0,
@@ -108,8 +119,6 @@ typedef struct custom_module {
 
 // Global debug state
 extern debug_config_t debug_config;
-extern debug_timer_t debug_timers[32];
-extern debug_alloc_t *debug_allocations;
 extern custom_module_t *loaded_modules;
 extern int debug_initialized;
 
@@ -139,7 +148,7 @@ void debug_set_output(int console, int file, const char *filename);
 #define DEBUG_VAR_PTR(var) DEBUG_DEBUG("Variable %s = %p", #var, var)
 #define DEBUG_VAR_HEX(var) DEBUG_DEBUG("Variable %s = 0x%x", #var, var)
 
-// Performance profiling macros
+// Performance profiling macros (backed by the span profiler in src/profile.c)
 #define DEBUG_TIMER_START(name) debug_timer_start(name)
 #define DEBUG_TIMER_END(name) debug_timer_end(name)
 #define DEBUG_TIMER_REPORT(name) debug_timer_report(name)
@@ -186,6 +195,7 @@ void* debug_realloc(void *ptr, size_t size, const char *file, int line, const ch
 void debug_free(void *ptr, const char *file, int line, const char *func);
 void debug_memory_report(void);
 void debug_memory_cleanup(void);
+void debug_memory_get_stats(debug_memory_stats_t *stats);
 
 int debug_execute_command(const char *cmd, const char *file, int line, const char *func);
 FILE* debug_file_open(const char *path, const char *mode, const char *file, int line, const char *func);
@@ -267,9 +277,10 @@ int debug_build_step_hook(const char *step_name, build_config_t *config);
 #define DEBUG_VAR_PTR(var)
 #define DEBUG_VAR_HEX(var)
 
-#define DEBUG_TIMER_START(name)
-#define DEBUG_TIMER_END(name)
-#define DEBUG_TIMER_REPORT(name)
+// Timers stay available in release builds through the span profiler
+#define DEBUG_TIMER_START(name) PROFILE_BEGIN(name)
+#define DEBUG_TIMER_END(name) PROFILE_END(name)
+#define DEBUG_TIMER_REPORT(name) do { if (profile_enabled) profile_report(name); } while (0)
 
 #define DEBUG_MALLOC(size) malloc(size)
 #define DEBUG_CALLOC(count, size) calloc(count, size)
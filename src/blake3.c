@@ -0,0 +1,214 @@
+/*
+ * blake3.c - BLAKE3 for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains a streaming BLAKE3 (unkeyed, 32-byte output) in portable
+ * C, next to the SHA-256 in sha256.c. Images are hashed with both while they
+ * are compressed; BLAKE3 is what b3sum checks.
+ */
+
+#include "builder.h"
+
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+
+#define BLAKE3_CHUNK_START 0x01
+#define BLAKE3_CHUNK_END   0x02
+#define BLAKE3_PARENT      0x04
+#define BLAKE3_ROOT        0x08
+
+static const uint32_t blake3_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// Message word order of each of the seven rounds
+static const uint8_t blake3_schedule[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define G(a, b, c, d, x, y) do { \
+    s[a] = s[a] + s[b] + (x); s[d] = ROTR32(s[d] ^ s[a], 16); \
+    s[c] = s[c] + s[d];       s[b] = ROTR32(s[b] ^ s[c], 12); \
+    s[a] = s[a] + s[b] + (y); s[d] = ROTR32(s[d] ^ s[a], 8);  \
+    s[c] = s[c] + s[d];       s[b] = ROTR32(s[b] ^ s[c], 7);  \
+} while (0)
+
+// Compress one block into a chaining value, in place
+static void blake3_compress(uint32_t cv[8], const uint32_t m[16], uint64_t counter,
+                            uint32_t block_len, uint32_t flags) {
+    uint32_t s[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        blake3_iv[0], blake3_iv[1], blake3_iv[2], blake3_iv[3],
+        (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags
+    };
+
+    for (int r = 0; r < 7; r++) {
+        const uint8_t *w = blake3_schedule[r];
+        G(0, 4, 8, 12, m[w[0]], m[w[1]]);
+        G(1, 5, 9, 13, m[w[2]], m[w[3]]);
+        G(2, 6, 10, 14, m[w[4]], m[w[5]]);
+        G(3, 7, 11, 15, m[w[6]], m[w[7]]);
+        G(0, 5, 10, 15, m[w[8]], m[w[9]]);
+        G(1, 6, 11, 12, m[w[10]], m[w[11]]);
+        G(2, 7, 8, 13, m[w[12]], m[w[13]]);
+        G(3, 4, 9, 14, m[w[14]], m[w[15]]);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        cv[i] = s[i] ^ s[i + 8];
+    }
+}
+
+// Little-endian message words of a block
+static void blake3_load_block(uint32_t m[16], const unsigned char *block) {
+    for (int i = 0; i < 16; i++) {
+        m[i] = (uint32_t)block[i * 4] | (uint32_t)block[i * 4 + 1] << 8 |
+               (uint32_t)block[i * 4 + 2] << 16 | (uint32_t)block[i * 4 + 3] << 24;
+    }
+}
+
+// CHUNK_START for the first block of a chunk
+static uint32_t blake3_start_flag(const blake3_ctx_t *ctx) {
+    return ctx->blocks_compressed == 0 ? BLAKE3_CHUNK_START : 0;
+}
+
+// Feed bytes of the current chunk; the last full block stays buffered
+// because it may be the one that ends the chunk
+static void blake3_chunk_update(blake3_ctx_t *ctx, const unsigned char *data, size_t len) {
+    uint32_t m[16];
+
+    while (len > 0) {
+        if (ctx->block_len == BLAKE3_BLOCK_LEN) {
+            blake3_load_block(m, ctx->block);
+            blake3_compress(ctx->cv, m, ctx->chunk_counter, BLAKE3_BLOCK_LEN, blake3_start_flag(ctx));
+            ctx->blocks_compressed++;
+            ctx->block_len = 0;
+        }
+        // Whole blocks straight from the input while more of the chunk follows
+        while (ctx->block_len == 0 && len > BLAKE3_BLOCK_LEN) {
+            blake3_load_block(m, data);
+            blake3_compress(ctx->cv, m, ctx->chunk_counter, BLAKE3_BLOCK_LEN, blake3_start_flag(ctx));
+            ctx->blocks_compressed++;
+            data += BLAKE3_BLOCK_LEN;
+            len -= BLAKE3_BLOCK_LEN;
+        }
+        size_t take = BLAKE3_BLOCK_LEN - ctx->block_len;
+        if (take > len) take = len;
+        memcpy(ctx->block + ctx->block_len, data, take);
+        ctx->block_len += take;
+        data += take;
+        len -= take;
+    }
+}
+
+// Chaining value of a finished chunk
+static void blake3_chunk_cv(const blake3_ctx_t *ctx, uint32_t cv[8]) {
+    unsigned char block[BLAKE3_BLOCK_LEN] = {0};
+    uint32_t m[16];
+
+    memcpy(block, ctx->block, ctx->block_len);
+    blake3_load_block(m, block);
+    memcpy(cv, ctx->cv, sizeof(ctx->cv));
+    blake3_compress(cv, m, ctx->chunk_counter, ctx->block_len,
+                    blake3_start_flag(ctx) | BLAKE3_CHUNK_END);
+}
+
+// Merge a finished chunk into the tree; one merge per trailing zero bit of
+// the chunk count
+static void blake3_push_chunk(blake3_ctx_t *ctx, uint32_t cv[8], uint64_t total_chunks) {
+    uint32_t m[16];
+
+    while ((total_chunks & 1) == 0) {
+        ctx->cv_stack_len--;
+        memcpy(m, ctx->cv_stack[ctx->cv_stack_len], 8 * sizeof(uint32_t));
+        memcpy(m + 8, cv, 8 * sizeof(uint32_t));
+        memcpy(cv, blake3_iv, sizeof(blake3_iv));
+        blake3_compress(cv, m, 0, BLAKE3_BLOCK_LEN, BLAKE3_PARENT);
+        total_chunks >>= 1;
+    }
+    memcpy(ctx->cv_stack[ctx->cv_stack_len], cv, 8 * sizeof(uint32_t));
+    ctx->cv_stack_len++;
+}
+
+// Start a new digest
+void blake3_init(blake3_ctx_t *ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+    memcpy(ctx->cv, blake3_iv, sizeof(blake3_iv));
+}
+
+// Add data to the digest
+void blake3_update(blake3_ctx_t *ctx, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    uint32_t cv[8];
+
+    while (len > 0) {
+        size_t chunk_len = (size_t)ctx->blocks_compressed * BLAKE3_BLOCK_LEN + ctx->block_len;
+        if (chunk_len == BLAKE3_CHUNK_LEN) {
+            blake3_chunk_cv(ctx, cv);
+            ctx->chunk_counter++;
+            blake3_push_chunk(ctx, cv, ctx->chunk_counter);
+            memcpy(ctx->cv, blake3_iv, sizeof(blake3_iv));
+            ctx->blocks_compressed = 0;
+            ctx->block_len = 0;
+            chunk_len = 0;
+        }
+        size_t take = BLAKE3_CHUNK_LEN - chunk_len;
+        if (take > len) take = len;
+        blake3_chunk_update(ctx, bytes, take);
+        bytes += take;
+        len -= take;
+    }
+}
+
+// Finish the digest
+void blake3_final(blake3_ctx_t *ctx, unsigned char digest[BLAKE3_DIGEST_LEN]) {
+    unsigned char block[BLAKE3_BLOCK_LEN] = {0};
+    uint32_t cv[8];
+    uint32_t m[16];
+    uint64_t counter = ctx->chunk_counter;
+    uint32_t block_len = ctx->block_len;
+    uint32_t flags = blake3_start_flag(ctx) | BLAKE3_CHUNK_END;
+
+    // The last chunk is the root unless there are parents above it
+    memcpy(block, ctx->block, ctx->block_len);
+    blake3_load_block(m, block);
+    memcpy(cv, ctx->cv, sizeof(ctx->cv));
+
+    for (int i = ctx->cv_stack_len - 1; i >= 0; i--) {
+        blake3_compress(cv, m, counter, block_len, flags);
+        memcpy(m, ctx->cv_stack[i], 8 * sizeof(uint32_t));
+        memcpy(m + 8, cv, 8 * sizeof(uint32_t));
+        memcpy(cv, blake3_iv, sizeof(blake3_iv));
+        counter = 0;
+        block_len = BLAKE3_BLOCK_LEN;
+        flags = BLAKE3_PARENT;
+    }
+    blake3_compress(cv, m, counter, block_len, flags | BLAKE3_ROOT);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = cv[i];
+        digest[i * 4 + 1] = cv[i] >> 8;
+        digest[i * 4 + 2] = cv[i] >> 16;
+        digest[i * 4 + 3] = cv[i] >> 24;
+    }
+}
+
+// Finish the digest as lowercase hex
+void blake3_final_hex(blake3_ctx_t *ctx, char hex[BLAKE3_HEX_LEN + 1]) {
+    unsigned char digest[BLAKE3_DIGEST_LEN];
+
+    blake3_final(ctx, digest);
+    for (int i = 0; i < BLAKE3_DIGEST_LEN; i++) {
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    }
+    hex[BLAKE3_HEX_LEN] = '\0';
+}
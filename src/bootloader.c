@@ -0,0 +1,518 @@
+/*
+ * bootloader.c - Bootloader pipeline for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file builds the bootloader from its three inputs: U-Boot, TF-A and
+ * rkbin. TF-A's BL31 and U-Boot proper with its SPL compile concurrently,
+ * sharing the jobserver. The DDR init blob, and BL31 when TF-A did not build,
+ * are taken from rkbin as its RKBOOT and RKTRUST files name them for the
+ * board, so rkbin updates need no change here. One binman run then lays out
+ * idbloader.img, u-boot.itb and the SPI flash image, which are checksummed
+ * and cached by the commits of the three inputs and any uncommitted changes
+ * to them, such as applied patches. From those the 16 MiB SPI
+ * NOR image is laid out while the SD image is assembled.
+ */
+
+#include "builder.h"
+#include <pthread.h>
+#include <sys/stat.h>
+
+// How a board's bootloader is put together
+typedef struct {
+    const char *name;
+    const char *defconfig;
+    const char *fallback_defconfig;
+    const char *atf_plat;
+    const char *boot_ini;           // rkbin RKBOOT file, names the DDR init blob
+    const char *trust_ini;          // rkbin RKTRUST file, names BL31
+} bootloader_board_t;
+
+static const bootloader_board_t bootloader_boards[] = {
+    {"orangepi-5-plus", "orangepi-5-plus-rk3588_defconfig", "evb-rk3588_defconfig", "rk3588",
+     "RKBOOT/RK3588MINIALL.ini", "RKTRUST/RK3588TRUST.ini"},
+    {NULL, NULL, NULL, NULL, NULL, NULL}
+};
+
+#define BOOTLOADER_BOARD "orangepi-5-plus"
+
+// SPI NOR layout; SPL reads u-boot.itb from CONFIG_SYS_SPI_U_BOOT_OFFS
+#define SPI_FLASH_SIZE (16LL << 20)
+#define SPI_IDBLOADER_OFFSET 0x8000LL
+#define SPI_UBOOT_OFFSET 0x60000LL
+
+// Files the pipeline produces; the SPI image only when U-Boot lays one out
+static const struct {
+    const char *name;
+    int required;
+} bootloader_artifacts[] = {
+    {"idbloader.img", 1},
+    {"u-boot.itb", 1},
+    {"u-boot-rockchip-spi.bin", 0},
+    {NULL, 0}
+};
+
+// One command run on its own thread
+typedef struct {
+    char cmd[MAX_CMD_LEN];
+    int result;
+} bootloader_job_t;
+
+static void* bootloader_job_main(void *arg) {
+    bootloader_job_t *job = arg;
+    job->result = execute_command_safe(job->cmd, 1, NULL);
+    return NULL;
+}
+
+// Value of key in [section] of an rkbin ini file
+static int rkbin_ini_value(const char *file, const char *section, const char *key, char *out, size_t size) {
+    char line[512];
+    int in_section = 0;
+
+    FILE *fp = fopen(file, "r");
+    if (!fp) return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '[') {
+            in_section = strncmp(line + 1, section, strlen(section)) == 0 && line[1 + strlen(section)] == ']';
+            continue;
+        }
+        size_t key_len = strlen(key);
+        if (in_section && strncasecmp(line, key, key_len) == 0 && line[key_len] == '=') {
+            snprintf(out, size, "%s", line + key_len + 1);
+            fclose(fp);
+            return out[0] != '\0';
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Commit of a checkout, "none" when it is missing
+static void source_commit(const char *dir, char *commit, size_t size) {
+    char cmd[MAX_CMD_LEN];
+
+    snprintf(commit, size, "none");
+    snprintf(cmd, sizeof(cmd), "git -C \"%s\" rev-parse HEAD 2>/dev/null", dir);
+    FILE *fp = popen(cmd, "r");
+    if (!fp) return;
+    if (fgets(commit, size, fp)) commit[strcspn(commit, "\r\n")] = '\0';
+    if (commit[0] == '\0') snprintf(commit, size, "none");
+    pclose(fp);
+}
+
+// Hash of the uncommitted changes of a checkout, "clean" when there are none
+static void source_changes(const char *dir, char *hash, size_t size) {
+    char cmd[MAX_CMD_LEN];
+    char buffer[4096];
+    char hex[SHA256_HEX_LEN + 1];
+    sha256_ctx_t ctx;
+    size_t len, total = 0;
+
+    snprintf(hash, size, "clean");
+    snprintf(cmd, sizeof(cmd), "git -C \"%s\" status --porcelain 2>/dev/null && "
+             "git -C \"%s\" diff --binary HEAD 2>/dev/null", dir, dir);
+    FILE *fp = popen(cmd, "r");
+    if (!fp) return;
+    sha256_init(&ctx);
+    while ((len = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        sha256_update(&ctx, buffer, len);
+        total += len;
+    }
+    pclose(fp);
+    if (total == 0) return;
+    sha256_final_hex(&ctx, hex);
+    snprintf(hash, size, "%.16s", hex);
+}
+
+// Checksum the artifacts in dir into dir/SHA256SUMS
+static int write_checksums(const char *dir) {
+    char path[MAX_PATH_LEN + 192];
+    char hex[SHA256_HEX_LEN + 1];
+
+    if (snprintf(path, sizeof(path), "%s/SHA256SUMS", dir) >= (int)sizeof(path)) return ERROR_INSTALLATION_FAILED;
+    FILE *fp = fopen(path, "w");
+    if (!fp) return ERROR_INSTALLATION_FAILED;
+    for (int i = 0; bootloader_artifacts[i].name; i++) {
+        if (snprintf(path, sizeof(path), "%s/%s", dir, bootloader_artifacts[i].name) >= (int)sizeof(path)) {
+            fclose(fp);
+            return ERROR_INSTALLATION_FAILED;
+        }
+        if (access(path, F_OK) != 0) continue;
+        if (sha256_file_hex(path, hex, NULL) != ERROR_SUCCESS) {
+            fclose(fp);
+            return ERROR_INSTALLATION_FAILED;
+        }
+        fprintf(fp, "%s  %s\n", hex, bootloader_artifacts[i].name);
+    }
+    return fclose(fp) == 0 ? ERROR_SUCCESS : ERROR_INSTALLATION_FAILED;
+}
+
+// Do the artifacts in dir match its SHA256SUMS, and are the required ones there
+static int verify_checksums(const char *dir) {
+    char path[MAX_PATH_LEN + 192];
+    char line[512];
+    char expected[SHA256_HEX_LEN + 1], name[128], hex[SHA256_HEX_LEN + 1];
+    int found = 0;
+
+    if (snprintf(path, sizeof(path), "%s/SHA256SUMS", dir) >= (int)sizeof(path)) return 0;
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%64s %127s", expected, name) != 2) continue;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path) ||
+            sha256_file_hex(path, hex, NULL) != ERROR_SUCCESS || strcmp(hex, expected) != 0) {
+            fclose(fp);
+            return 0;
+        }
+        for (int i = 0; bootloader_artifacts[i].name; i++) {
+            if (bootloader_artifacts[i].required && strcmp(bootloader_artifacts[i].name, name) == 0) found++;
+        }
+    }
+    fclose(fp);
+    return found == 2;
+}
+
+// Place the artifacts and their checksums from one directory in another
+static int place_artifacts(const char *from, const char *to) {
+    char src[MAX_PATH_LEN + 192];
+    char dest[MAX_PATH_LEN + 192];
+
+    for (int i = 0; bootloader_artifacts[i].name; i++) {
+        if (snprintf(src, sizeof(src), "%s/%s", from, bootloader_artifacts[i].name) >= (int)sizeof(src) ||
+            snprintf(dest, sizeof(dest), "%s/%s", to, bootloader_artifacts[i].name) >= (int)sizeof(dest)) {
+            return ERROR_INSTALLATION_FAILED;
+        }
+        if (access(src, F_OK) != 0) {
+            if (bootloader_artifacts[i].required) return ERROR_FILE_NOT_FOUND;
+            unlink(dest);
+            continue;
+        }
+        if (download_link(src, dest) != ERROR_SUCCESS) return ERROR_INSTALLATION_FAILED;
+    }
+    if (snprintf(src, sizeof(src), "%s/SHA256SUMS", from) >= (int)sizeof(src) ||
+        snprintf(dest, sizeof(dest), "%s/bootloader.sha256", to) >= (int)sizeof(dest)) {
+        return ERROR_INSTALLATION_FAILED;
+    }
+    return download_link(src, dest);
+}
+
+// Directory of the cached bootloader for the board and its three inputs: their
+// commits, and their uncommitted changes, which a commit alone does not show
+static int bootloader_cache_dir(const build_config_t *config, const bootloader_board_t *board,
+                                char *dir, size_t size) {
+    char sources[MAX_PATH_LEN + 32];
+    char commits[3][64];
+    char changes[3][32];
+    char key[SHA256_HEX_LEN + 1];
+    const char *names[] = {"u-boot", "arm-trusted-firmware", "rkbin"};
+    sha256_ctx_t ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, board->name, strlen(board->name) + 1);
+    sha256_update(&ctx, board->defconfig, strlen(board->defconfig) + 1);
+    sha256_update(&ctx, config->cross_compile, strlen(config->cross_compile) + 1);
+    for (int i = 0; i < 3; i++) {
+        if (snprintf(sources, sizeof(sources), "%s/%s", config->build_dir, names[i]) >= (int)sizeof(sources)) {
+            return -1;
+        }
+        source_commit(sources, commits[i], sizeof(commits[i]));
+        source_changes(sources, changes[i], sizeof(changes[i]));
+        sha256_update(&ctx, commits[i], strlen(commits[i]) + 1);
+        sha256_update(&ctx, changes[i], strlen(changes[i]) + 1);
+    }
+    sha256_final_hex(&ctx, key);
+    return snprintf(dir, size, "%s/bootloader/%.16s", config->cache_dir[0] ? config->cache_dir : CACHE_DIR,
+                    key) < (int)size ? 0 : -1;
+}
+
+// Build idbloader.img, u-boot.itb and the SPI image for the board
+int bootloader_build(build_config_t *config) {
+    char cmd[MAX_CMD_LEN];
+    char msg[MAX_PATH_LEN + 256];
+    char uboot_dir[MAX_PATH_LEN];
+    char atf_dir[MAX_PATH_LEN];
+    char rkbin_dir[MAX_PATH_LEN];
+    char cache_dir[MAX_PATH_LEN + 64];
+    char ini[MAX_PATH_LEN + 64];
+    char value[256];
+    char ddr_blob[MAX_PATH_LEN + 256] = "";
+    char bl31[MAX_PATH_LEN + 256] = "";
+    char path[MAX_PATH_LEN + 64];
+    const bootloader_board_t *board = &bootloader_boards[0];
+    error_context_t error_ctx = {0};
+
+    for (int i = 0; bootloader_boards[i].name; i++) {
+        if (strcmp(bootloader_boards[i].name, BOOTLOADER_BOARD) == 0) board = &bootloader_boards[i];
+    }
+    if (snprintf(uboot_dir, sizeof(uboot_dir), "%s/u-boot", config->build_dir) >= (int)sizeof(uboot_dir) ||
+        snprintf(atf_dir, sizeof(atf_dir), "%s/arm-trusted-firmware", config->build_dir) >= (int)sizeof(atf_dir) ||
+        snprintf(rkbin_dir, sizeof(rkbin_dir), "%s/rkbin", config->build_dir) >= (int)sizeof(rkbin_dir) ||
+        bootloader_cache_dir(config, board, cache_dir, sizeof(cache_dir)) != 0) {
+        LOG_ERROR("Build or cache directory path too long for the bootloader");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    // The same three inputs build the same bootloader
+    if (verify_checksums(cache_dir) && place_artifacts(cache_dir, config->output_dir) == ERROR_SUCCESS) {
+        metrics_record_cache("bootloader", 1, 0);
+        snprintf(msg, sizeof(msg), "Bootloader for %s unchanged, reused from %s", board->name, cache_dir);
+        LOG_INFO(msg);
+        return ERROR_SUCCESS;
+    }
+    metrics_record_cache("bootloader", 0, 1);
+
+    // The DDR init blob and rkbin's BL31, as rkbin names them for the board
+    snprintf(ini, sizeof(ini), "%s/%s", rkbin_dir, board->boot_ini);
+    if (rkbin_ini_value(ini, "CODE471_OPTION", "Path1", value, sizeof(value))) {
+        snprintf(ddr_blob, sizeof(ddr_blob), "%s/%s", rkbin_dir, value);
+    }
+    if (!ddr_blob[0] || access(ddr_blob, R_OK) != 0) {
+        snprintf(msg, sizeof(msg), "No DDR init blob for %s in %s", board->name, ini);
+        LOG_ERROR(msg);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    snprintf(msg, sizeof(msg), "DDR init blob: %s", ddr_blob);
+    LOG_INFO(msg);
+
+    // Configure U-Boot, then build it while TF-A builds BL31
+    snprintf(cmd, sizeof(cmd), "make -C %s CROSS_COMPILE=%s %s", uboot_dir, config->cross_compile, board->defconfig);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        snprintf(msg, sizeof(msg), "%s not found, using %s", board->defconfig, board->fallback_defconfig);
+        LOG_WARNING(msg);
+        snprintf(cmd, sizeof(cmd), "make -C %s CROSS_COMPILE=%s %s",
+                 uboot_dir, config->cross_compile, board->fallback_defconfig);
+        if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+            LOG_ERROR("Failed to configure U-Boot");
+            return ERROR_COMPILATION_FAILED;
+        }
+    }
+
+    LOG_INFO("Building TF-A BL31 and U-Boot concurrently...");
+    bootloader_job_t jobs[2];
+    pthread_t threads[2];
+    int started[2];
+    snprintf(jobs[0].cmd, sizeof(jobs[0].cmd), "make -C %s %s CROSS_COMPILE=%s PLAT=%s bl31",
+             atf_dir, jobserver_make_args(), config->cross_compile, board->atf_plat);
+    snprintf(jobs[1].cmd, sizeof(jobs[1].cmd), "make -C %s %s CROSS_COMPILE=%s u-boot.bin spl/u-boot-spl.bin",
+             uboot_dir, jobserver_make_args(), config->cross_compile);
+    for (int i = 0; i < 2; i++) {
+        jobs[i].result = -1;
+        started[i] = pthread_create(&threads[i], NULL, bootloader_job_main, &jobs[i]) == 0;
+        if (!started[i]) bootloader_job_main(&jobs[i]);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+    if (jobs[1].result != 0) {
+        LOG_ERROR("Failed to build U-Boot");
+        return ERROR_COMPILATION_FAILED;
+    }
+
+    // BL31 from source, or rkbin's when TF-A did not build for the board
+    snprintf(bl31, sizeof(bl31), "%s/build/%s/release/bl31/bl31.elf", atf_dir, board->atf_plat);
+    if (jobs[0].result != 0 || access(bl31, R_OK) != 0) {
+        snprintf(ini, sizeof(ini), "%s/%s", rkbin_dir, board->trust_ini);
+        bl31[0] = '\0';
+        if (rkbin_ini_value(ini, "BL31_OPTION", "PATH", value, sizeof(value))) {
+            snprintf(bl31, sizeof(bl31), "%s/%s", rkbin_dir, value);
+        }
+        if (!bl31[0] || access(bl31, R_OK) != 0) {
+            LOG_ERROR("TF-A did not build and rkbin has no BL31 for the board");
+            return ERROR_COMPILATION_FAILED;
+        }
+        LOG_WARNING("TF-A did not build, using the BL31 from rkbin");
+    }
+    snprintf(msg, sizeof(msg), "BL31: %s", bl31);
+    LOG_INFO(msg);
+
+    // One binman run lays out idbloader.img, u-boot.itb and the SPI image
+    LOG_INFO("Assembling bootloader images...");
+    snprintf(cmd, sizeof(cmd), "make -C %s %s CROSS_COMPILE=%s BL31=%s ROCKCHIP_TPL=%s",
+             uboot_dir, jobserver_make_args(), config->cross_compile, bl31, ddr_blob);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to assemble the bootloader images");
+        return ERROR_COMPILATION_FAILED;
+    }
+
+    // Trees without binman leave idbloader.img to mkimage
+    snprintf(path, sizeof(path), "%s/idbloader.img", uboot_dir);
+    if (access(path, F_OK) != 0) {
+        snprintf(cmd, sizeof(cmd), "%s/tools/mkimage -n rk3588 -T rksd -d %s:%s/spl/u-boot-spl.bin %s",
+                 uboot_dir, ddr_blob, uboot_dir, path);
+        execute_command_safe(cmd, 1, &error_ctx);
+    }
+
+    // Keep the result by its inputs, then place it in the output directory
+    snprintf(cmd, sizeof(cmd), "rm -rf %s && mkdir -p %s", cache_dir, cache_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+    for (int i = 0; bootloader_artifacts[i].name; i++) {
+        char dest[MAX_PATH_LEN + 192];
+        snprintf(path, sizeof(path), "%s/%s", uboot_dir, bootloader_artifacts[i].name);
+        if (snprintf(dest, sizeof(dest), "%s/%s", cache_dir, bootloader_artifacts[i].name) >= (int)sizeof(dest)) {
+            return ERROR_INSTALLATION_FAILED;
+        }
+        if (access(path, F_OK) != 0) {
+            if (!bootloader_artifacts[i].required) continue;
+            snprintf(msg, sizeof(msg), "U-Boot did not produce %s", bootloader_artifacts[i].name);
+            LOG_ERROR(msg);
+            return ERROR_COMPILATION_FAILED;
+        }
+        snprintf(cmd, sizeof(cmd), "cp %s %s", path, dest);
+        if (execute_command_safe(cmd, 0, &error_ctx) != 0) return ERROR_INSTALLATION_FAILED;
+    }
+    if (write_checksums(cache_dir) != ERROR_SUCCESS ||
+        place_artifacts(cache_dir, config->output_dir) != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to store the bootloader images");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    snprintf(msg, sizeof(msg), "Bootloader for %s built, checksums in %s/bootloader.sha256",
+             board->name, config->output_dir);
+    LOG_INFO(msg);
+    return ERROR_SUCCESS;
+}
+
+// Where SPL looks for u-boot.itb in SPI flash, from the U-Boot configuration
+static long long spi_uboot_offset(const build_config_t *config) {
+    char path[MAX_PATH_LEN + 32];
+    char line[256];
+    long long offset = SPI_UBOOT_OFFSET;
+
+    snprintf(path, sizeof(path), "%s/u-boot/.config", config->build_dir);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return offset;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "CONFIG_SYS_SPI_U_BOOT_OFFS=", 27) == 0) {
+            offset = strtoll(line + 27, NULL, 0);
+            break;
+        }
+    }
+    fclose(fp);
+    return offset;
+}
+
+// Copy a file into the image at offset, failing if it would pass limit
+static int spi_write_at(int out, const char *path, long long offset, long long limit) {
+    char buffer[65536];
+    char msg[MAX_PATH_LEN + 128];
+    struct stat st;
+    ssize_t len;
+
+    int in = open(path, O_RDONLY | O_CLOEXEC);
+    if (in < 0 || fstat(in, &st) != 0) {
+        if (in >= 0) close(in);
+        snprintf(msg, sizeof(msg), "Missing %s for the SPI image", path);
+        LOG_ERROR(msg);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    if (offset + st.st_size > limit) {
+        close(in);
+        snprintf(msg, sizeof(msg), "%s (%lld bytes) does not fit at 0x%llx in the SPI image",
+                 path, (long long)st.st_size, offset);
+        LOG_ERROR(msg);
+        return ERROR_INSUFFICIENT_SPACE;
+    }
+    while ((len = read(in, buffer, sizeof(buffer))) > 0) {
+        if (pwrite(out, buffer, len, offset) != len) {
+            close(in);
+            return ERROR_INSUFFICIENT_SPACE;
+        }
+        offset += len;
+    }
+    close(in);
+    return len < 0 ? ERROR_FILE_NOT_FOUND : ERROR_SUCCESS;
+}
+
+// Lay out the 16 MiB SPI NOR image from the bootloader artifacts
+int create_spi_image(build_config_t *config) {
+    char image[MAX_PATH_LEN + 64];
+    char tmp[MAX_PATH_LEN + 96];
+    char path[MAX_PATH_LEN + 96];
+    char hex[SHA256_HEX_LEN + 1];
+    char msg[MAX_PATH_LEN + 256];
+    unsigned char erased[65536];
+    long long uboot_offset = spi_uboot_offset(config);
+    int result;
+
+    snprintf(image, sizeof(image), "%s/orangepi5plus-spi.img", config->output_dir);
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", image, (int)getpid());
+
+    int out = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
+        LOG_ERROR("Failed to create the SPI image");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    // Pad with 0xff, the erased state of NOR flash
+    memset(erased, 0xff, sizeof(erased));
+    result = ERROR_SUCCESS;
+    for (long long done = 0; done < SPI_FLASH_SIZE && result == ERROR_SUCCESS; done += sizeof(erased)) {
+        if (write(out, erased, sizeof(erased)) != (ssize_t)sizeof(erased)) result = ERROR_INSUFFICIENT_SPACE;
+    }
+
+    // idbloader.img must end before u-boot.itb begins
+    if (result == ERROR_SUCCESS) {
+        snprintf(path, sizeof(path), "%s/idbloader.img", config->output_dir);
+        result = spi_write_at(out, path, SPI_IDBLOADER_OFFSET, uboot_offset);
+    }
+    if (result == ERROR_SUCCESS) {
+        snprintf(path, sizeof(path), "%s/u-boot.itb", config->output_dir);
+        result = spi_write_at(out, path, uboot_offset, SPI_FLASH_SIZE);
+    }
+    if (close(out) != 0 && result == ERROR_SUCCESS) result = ERROR_INSUFFICIENT_SPACE;
+    if (result != ERROR_SUCCESS || rename(tmp, image) != 0) {
+        unlink(tmp);
+        LOG_ERROR("Failed to lay out the SPI image");
+        return result != ERROR_SUCCESS ? result : ERROR_INSTALLATION_FAILED;
+    }
+
+    // Checksum next to it, in sha256sum format
+    if (sha256_file_hex(image, hex, NULL) == ERROR_SUCCESS) {
+        snprintf(path, sizeof(path), "%s.sha256", image);
+        FILE *fp = fopen(path, "w");
+        if (fp) {
+            fprintf(fp, "%s  orangepi5plus-spi.img\n", hex);
+            fclose(fp);
+        }
+    }
+
+    snprintf(msg, sizeof(msg), "SPI image created: %s (idbloader at 0x%llx, u-boot.itb at 0x%llx)",
+             image, SPI_IDBLOADER_OFFSET, uboot_offset);
+    LOG_INFO(msg);
+    return ERROR_SUCCESS;
+}
+
+// The SPI image, built on its own thread
+typedef struct {
+    build_config_t *config;
+    int result;
+} spi_job_t;
+
+static void* spi_image_main(void *arg) {
+    spi_job_t *job = arg;
+    job->result = create_spi_image(job->config);
+    return NULL;
+}
+
+// Assemble the SD image, and the SPI image from the same bootloader next to it
+int create_images(build_config_t *config) {
+    char path[MAX_PATH_LEN + 64];
+    pthread_t thread;
+    spi_job_t spi = {config, ERROR_SUCCESS};
+    int spi_started = 0;
+
+    snprintf(path, sizeof(path), "%s/u-boot.itb", config->output_dir);
+    if (config->create_spi_image && access(path, F_OK) == 0) {
+        spi_started = pthread_create(&thread, NULL, spi_image_main, &spi) == 0;
+        if (!spi_started) spi_image_main(&spi);
+    } else if (config->create_spi_image) {
+        LOG_WARNING("No u-boot.itb in the output directory, skipping the SPI image");
+    }
+
+    int result = config->create_image ? create_system_image(config) : ERROR_SUCCESS;
+
+    if (spi_started) {
+        pthread_join(thread, NULL);
+    }
+    return result != ERROR_SUCCESS ? result : spi.result;
+}
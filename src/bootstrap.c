@@ -0,0 +1,620 @@
+/*
+ * bootstrap.c - Rootfs bootstrap engines for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file creates the base Ubuntu root filesystem. Two engines are provided:
+ * the classic debootstrap path, which installs the distribution packages with
+ * apt-get inside the chroot afterwards, and a single-pass engine that resolves
+ * the complete package set on the host, downloads it in parallel, unpacks
+ * everything with the host dpkg and only runs maintainer scripts under
+ * emulation.
+ */
+
+#include "builder.h"
+
+#define UBUNTU_PORTS_MIRROR "http://ports.ubuntu.com/ubuntu-ports"
+#define UBUNTU_ARCHIVE_KEYRING "/usr/share/keyrings/ubuntu-archive-keyring.gpg"
+
+// Get a printable name for a bootstrap engine
+const char* bootstrap_engine_name(bootstrap_engine_t engine) {
+    switch (engine) {
+        case BOOTSTRAP_DEBOOTSTRAP:
+            return "debootstrap";
+        case BOOTSTRAP_SINGLE_PASS:
+            return "single-pass";
+        default:
+            return "unknown";
+    }
+}
+
+// Build the full package set of the rootfs (base + distribution + locales)
+int get_rootfs_package_set(build_config_t *config, char *buffer, size_t size) {
+    const char *base_packages = "ubuntu-minimal init systemd sudo";
+    const char *extra_packages = "";
+    const char *locale_packages = "wget ca-certificates locales language-pack-en";
+
+    switch (config->distro_type) {
+        case DISTRO_DESKTOP:
+            extra_packages = "ubuntu-desktop network-manager";
+            break;
+        case DISTRO_SERVER:
+            extra_packages = "ubuntu-server openssh-server";
+            break;
+        case DISTRO_EMULATION:
+            extra_packages = "xserver-xorg-core openbox";
+            break;
+        case DISTRO_MINIMAL:
+            extra_packages = "";
+            break;
+        default:
+            break;
+    }
+
+    int len = snprintf(buffer, size, "%s %s%s%s", base_packages, extra_packages,
+                       strlen(extra_packages) > 0 ? " " : "", locale_packages);
+    return (len < 0 || (size_t)len >= size) ? ERROR_UNKNOWN : ERROR_SUCCESS;
+}
+
+// Write the apt sources of the target system
+int write_apt_sources(build_config_t *config, const char *rootfs_dir) {
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+
+    LOG_INFO("Configuring package sources...");
+
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s/etc/apt", rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    snprintf(path, sizeof(path), "%s/etc/apt/sources.list", rootfs_dir);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        LOG_ERROR("Failed to write apt sources");
+        return ERROR_PERMISSION_DENIED;
+    }
+
+    fprintf(fp,
+            "deb " UBUNTU_PORTS_MIRROR " %s main restricted universe multiverse\n"
+            "deb " UBUNTU_PORTS_MIRROR " %s-updates main restricted universe multiverse\n"
+            "deb " UBUNTU_PORTS_MIRROR " %s-security main restricted universe multiverse\n",
+            config->ubuntu_codename, config->ubuntu_codename, config->ubuntu_codename);
+    fclose(fp);
+
+    return ERROR_SUCCESS;
+}
+
+// Bootstrap with debootstrap and install the package set inside the chroot
+static int bootstrap_rootfs_debootstrap(build_config_t *config, const char *rootfs_dir) {
+    char cmd[MAX_CMD_LEN];
+    char packages[1024];
+    error_context_t error_ctx = {0};
+
+    // Check if debootstrap script exists for this release
+    char script_path[256];
+    snprintf(script_path, sizeof(script_path), "/usr/share/debootstrap/scripts/%s",
+             config->ubuntu_codename);
+
+    if (access(script_path, F_OK) != 0) {
+        char msg[512];
+        snprintf(msg, sizeof(msg), "Debootstrap script not found for Ubuntu %s (%s)",
+                config->ubuntu_release, config->ubuntu_codename);
+        LOG_WARNING(msg);
+        LOG_INFO("Creating symlink to jammy script...");
+
+        // Try to create the symlink
+        snprintf(cmd, sizeof(cmd),
+                 "ln -sf /usr/share/debootstrap/scripts/jammy %s",
+                 script_path);
+        if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+            LOG_WARNING("Failed to create debootstrap script symlink");
+            LOG_INFO("Falling back to Ubuntu 22.04 (jammy) which is known to work");
+
+            // Change to jammy
+            strcpy(config->ubuntu_release, "22.04");
+            strcpy(config->ubuntu_codename, "jammy");
+        }
+    }
+
+    // Pick the fastest way to run aarch64 code before anything is unpacked
+    chroot_exec_mode_t exec_mode = detect_chroot_exec_mode();
+    if (exec_mode == CHROOT_EXEC_UNAVAILABLE) {
+        return ERROR_DEPENDENCY_MISSING;
+    }
+    int native = (exec_mode == CHROOT_EXEC_NATIVE);
+
+    // Run debootstrap first stage (or the whole bootstrap on an arm64 host);
+    // locales comes with apt below, once locale-gen is diverted
+    trace_step("debootstrap");
+    LOG_INFO(native ? "Running debootstrap natively..." : "Running debootstrap first stage...");
+    snprintf(cmd, sizeof(cmd),
+             "debootstrap --arch=arm64 %s--include=wget,ca-certificates "
+             "%s %s " UBUNTU_PORTS_MIRROR,
+             native ? "" : "--foreign ", config->ubuntu_codename, rootfs_dir);
+
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to run debootstrap first stage");
+        LOG_ERROR("This usually means the Ubuntu release is not supported");
+        LOG_ERROR("Try using Ubuntu 22.04 (jammy) or 20.04 (focal) instead");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    // Check if debootstrap created the necessary files
+    char debootstrap_dir[MAX_PATH_LEN];
+    snprintf(debootstrap_dir, sizeof(debootstrap_dir), "%s/debootstrap", rootfs_dir);
+    if (!native && access(debootstrap_dir, F_OK) != 0) {
+        LOG_ERROR("Debootstrap did not create the expected directory structure");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    // Make aarch64 binaries runnable inside the chroot
+    if (prepare_chroot_emulation(rootfs_dir) != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to set up ARM64 emulation");
+        return ERROR_DEPENDENCY_MISSING;
+    }
+
+    if (mount_chroot_filesystems(rootfs_dir) != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to mount the chroot filesystems");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    // Run debootstrap second stage
+    if (!native) {
+        trace_step("debootstrap_second_stage");
+        LOG_INFO("Running debootstrap second stage...");
+        if (execute_chroot_command(rootfs_dir, "/debootstrap/debootstrap --second-stage", 1, &error_ctx) != 0) {
+            LOG_ERROR("Failed to run debootstrap second stage");
+            return ERROR_INSTALLATION_FAILED;
+        }
+    }
+
+    if (divert_locale_gen(rootfs_dir) != ERROR_SUCCESS) {
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    if (write_apt_sources(config, rootfs_dir) != ERROR_SUCCESS) {
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    // Update package database in chroot
+    trace_step("apt_update");
+    LOG_INFO("Updating package database...");
+    execute_chroot_command(rootfs_dir,
+                           "/bin/bash -c 'export LANG=C.UTF-8; apt-get update'",
+                           1, &error_ctx);
+
+    // Install the remaining packages with apt inside the chroot
+    get_rootfs_package_set(config, packages, sizeof(packages));
+    trace_step("apt_install");
+    LOG_INFO("Installing base system packages...");
+    snprintf(cmd, sizeof(cmd),
+             "/bin/bash -c 'export LANG=C.UTF-8; export DEBIAN_FRONTEND=noninteractive; "
+             "apt-get install -y %s'",
+             packages);
+    if (execute_chroot_command(rootfs_dir, cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to install base system packages");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Sum the sizes of the package files listed in uris.txt that are present
+static long long sum_cached_packages(const char *apt_dir, long *present, long *missing, char *host, size_t host_size) {
+    char path[MAX_PATH_LEN];
+    char line[MAX_PATH_LEN * 2];
+    long long bytes = 0;
+    struct stat st;
+
+    *present = *missing = 0;
+    snprintf(path, sizeof(path), "%s/uris.txt", apt_dir);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *file = strchr(line, ' ');
+        if (!file) continue;
+        *file++ = '\0';
+        file[strcspn(file, "\n")] = '\0';
+
+        if (host[0] == '\0') {
+            metrics_url_host(line, host, host_size);
+        }
+        if (stat(file, &st) == 0 && st.st_size > 0) {
+            (*present)++;
+            bytes += st.st_size;
+        } else {
+            (*missing)++;
+        }
+    }
+    fclose(fp);
+
+    return bytes;
+}
+
+// Bootstrap by resolving and downloading on the host and unpacking in one pass
+static int bootstrap_rootfs_single_pass(build_config_t *config, const char *rootfs_dir) {
+    char cmd[MAX_CMD_LEN * 2];
+    char apt_dir[MAX_PATH_LEN];
+    char apt_opts[MAX_CMD_LEN];
+    char packages[1024];
+    char path[MAX_PATH_LEN];
+    char msg[512];
+    error_context_t error_ctx = {0};
+
+    // The host needs apt and dpkg to resolve and unpack arm64 packages
+    if (system("command -v apt-get >/dev/null 2>&1 && command -v dpkg >/dev/null 2>&1") != 0) {
+        LOG_WARNING("apt-get or dpkg not found on the host, falling back to debootstrap");
+        return bootstrap_rootfs_debootstrap(config, rootfs_dir);
+    }
+
+    if (access(UBUNTU_ARCHIVE_KEYRING, R_OK) != 0) {
+        LOG_WARNING("Ubuntu archive keyring not found on the host (install ubuntu-keyring), "
+                    "falling back to debootstrap");
+        return bootstrap_rootfs_debootstrap(config, rootfs_dir);
+    }
+
+    chroot_exec_mode_t exec_mode = detect_chroot_exec_mode();
+    if (exec_mode == CHROOT_EXEC_UNAVAILABLE) {
+        return ERROR_DEPENDENCY_MISSING;
+    }
+
+    get_rootfs_package_set(config, packages, sizeof(packages));
+
+    // Private apt state on the host; the archive cache survives between builds
+    if (snprintf(apt_dir, sizeof(apt_dir), "%s/apt-arm64", config->build_dir) >= (int)sizeof(apt_dir)) {
+        LOG_ERROR("Build directory path is too long for the host apt state");
+        return ERROR_FILE_NOT_FOUND;
+    }
+    snprintf(cmd, sizeof(cmd),
+             "mkdir -p %s/state/lists/partial %s/cache/archives/partial %s/sources.list.d "
+             "%s/preferences.d && touch %s/state/status",
+             apt_dir, apt_dir, apt_dir, apt_dir, apt_dir);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_ERROR("Failed to create host apt directories");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    if (snprintf(path, sizeof(path), "%s/sources.list", apt_dir) >= (int)sizeof(path)) {
+        LOG_ERROR("Build directory path is too long for the host apt sources");
+        return ERROR_FILE_NOT_FOUND;
+    }
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        LOG_ERROR("Failed to write host apt sources");
+        return ERROR_PERMISSION_DENIED;
+    }
+    fprintf(fp,
+            "deb [signed-by=" UBUNTU_ARCHIVE_KEYRING "] " UBUNTU_PORTS_MIRROR " %s main restricted universe multiverse\n"
+            "deb [signed-by=" UBUNTU_ARCHIVE_KEYRING "] " UBUNTU_PORTS_MIRROR " %s-updates main restricted universe multiverse\n"
+            "deb [signed-by=" UBUNTU_ARCHIVE_KEYRING "] " UBUNTU_PORTS_MIRROR " %s-security main restricted universe multiverse\n",
+            config->ubuntu_codename, config->ubuntu_codename, config->ubuntu_codename);
+    fclose(fp);
+
+    if (snprintf(apt_opts, sizeof(apt_opts),
+                 "-o APT::Architecture=arm64 -o APT::Architectures=arm64 "
+                 "-o Acquire::Languages=none -o Debug::NoLocking=1 "
+                 "-o Dir::State=%s/state -o Dir::State::status=%s/state/status "
+                 "-o Dir::Cache=%s/cache -o Dir::Etc::SourceList=%s/sources.list "
+                 "-o Dir::Etc::SourceParts=%s/sources.list.d "
+                 "-o Dir::Etc::PreferencesParts=%s/preferences.d",
+                 apt_dir, apt_dir, apt_dir, apt_dir, apt_dir, apt_dir) >= (int)sizeof(apt_opts)) {
+        LOG_ERROR("Build directory path is too long for the host apt options");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    // Refresh the package indices for arm64
+    trace_step("apt_update");
+    LOG_INFO("Updating arm64 package indices on the host...");
+    snprintf(cmd, sizeof(cmd), "apt-get %s update", apt_opts);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to update the arm64 package indices");
+        return ERROR_NETWORK_FAILURE;
+    }
+
+    // Resolve the full package set once, including everything essential.
+    // --print-uris leaves out every .deb already in the archives directory,
+    // so it looks at an empty scratch one: with a warm cache from an earlier
+    // build the list must still name every package, cached or not.
+    trace_step("resolve");
+    LOG_INFO("Resolving the complete package set on the host...");
+    snprintf(cmd, sizeof(cmd), "rm -rf %s/resolve && mkdir -p %s/resolve/partial", apt_dir, apt_dir);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_ERROR("Failed to create the package resolution directory");
+        return ERROR_FILE_NOT_FOUND;
+    }
+    if (snprintf(cmd, sizeof(cmd),
+                 "apt-get %s -o Dir::Cache::archives=%s/resolve/ -y -qq --print-uris "
+                 "install '?essential' '?priority(required)' %s "
+                 "| awk -v dir=%s/cache/archives '{ gsub(/\\047/, \"\", $1); print $1, dir \"/\" $2 }' "
+                 "> %s/uris.txt",
+                 apt_opts, apt_dir, packages, apt_dir, apt_dir) >= (int)sizeof(cmd)) {
+        LOG_ERROR("Package resolution command is too long");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_ERROR("Failed to resolve the rootfs package set");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    snprintf(cmd, sizeof(cmd), "test -s %s/uris.txt", apt_dir);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_ERROR("Package resolution returned an empty set");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    // Download everything not already cached, several files at a time
+    trace_step("download");
+    char mirror_host[64] = "";
+    long cached = 0, missing = 0;
+    long long cached_bytes = sum_cached_packages(apt_dir, &cached, &missing, mirror_host, sizeof(mirror_host));
+    metrics_record_cache("apt_archives", cached, missing);
+
+    snprintf(msg, sizeof(msg), "Downloading packages with %d parallel connections...",
+             config->jobs > 16 ? 16 : config->jobs);
+    LOG_INFO(msg);
+    snprintf(cmd, sizeof(cmd),
+             "while read url file; do [ -s \"$file\" ] || echo \"$url $file\"; done < %s/uris.txt "
+             "| xargs -r -P %d -n 2 sh -c 'curl -fsSL --retry 3 -o \"$1.part\" \"$0\" && mv \"$1.part\" \"$1\"'",
+             apt_dir, config->jobs > 16 ? 16 : config->jobs);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    // Let apt verify the hashes and fetch anything the parallel pass missed
+    if (snprintf(cmd, sizeof(cmd),
+                 "apt-get %s -y -qq --download-only install '?essential' '?priority(required)' %s",
+                 apt_opts, packages) >= (int)sizeof(cmd)) {
+        LOG_ERROR("Package download command is too long");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to download or verify the rootfs packages");
+        return ERROR_NETWORK_FAILURE;
+    }
+    metrics_add_download(strlen(mirror_host) ? mirror_host : "apt",
+                         sum_cached_packages(apt_dir, &cached, &missing, mirror_host, sizeof(mirror_host)) - cached_bytes);
+
+    // Split the set into essential packages and the rest
+    snprintf(cmd, sizeof(cmd),
+             "cd %s && : > essential.txt && : > rest.txt && "
+             "while read url file; do "
+             "if [ \"$(dpkg-deb -f \"$file\" Essential)\" = yes ]; then echo \"$file\" >> essential.txt; "
+             "else echo \"$file\" >> rest.txt; fi; done < uris.txt",
+             apt_dir);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_ERROR("Failed to inspect the downloaded packages");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    // Merged /usr layout, as created by debootstrap on current releases
+    if (strcmp(config->ubuntu_codename, "focal") != 0) {
+        snprintf(cmd, sizeof(cmd),
+                 "cd %s && mkdir -p usr/bin usr/sbin usr/lib && "
+                 "ln -sfn usr/bin bin && ln -sfn usr/sbin sbin && ln -sfn usr/lib lib",
+                 rootfs_dir);
+        execute_command_safe(cmd, 0, &error_ctx);
+    }
+
+    // Extract the essential packages so the chroot has a shell and dpkg
+    trace_step("extract_essential");
+    LOG_INFO("Extracting essential packages...");
+    snprintf(cmd, sizeof(cmd),
+             "xargs -r -P %d -I{} dpkg-deb --extract {} %s < %s/essential.txt",
+             jobserver_current_jobs(), rootfs_dir, apt_dir);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_ERROR("Failed to extract the essential packages");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    // dpkg database and a policy that keeps services from starting
+    snprintf(cmd, sizeof(cmd),
+             "cd %s && mkdir -p var/lib/dpkg/info var/lib/dpkg/updates usr/sbin etc && "
+             "touch var/lib/dpkg/status var/lib/dpkg/available && "
+             "{ [ -e etc/passwd ] || cp usr/share/base-passwd/passwd.master etc/passwd; } && "
+             "{ [ -e etc/group ] || cp usr/share/base-passwd/group.master etc/group; } && "
+             "printf '#!/bin/sh\\nexit 101\\n' > usr/sbin/policy-rc.d && chmod 755 usr/sbin/policy-rc.d",
+             rootfs_dir);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_ERROR("Failed to prepare the dpkg database");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    if (prepare_chroot_emulation(rootfs_dir) != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to set up ARM64 emulation");
+        return ERROR_DEPENDENCY_MISSING;
+    }
+
+    if (mount_chroot_filesystems(rootfs_dir) != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to mount the chroot filesystems");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    // The host dpkg unpacks; only the maintainer scripts it runs are emulated
+    const char *dpkg_opts = "--force-architecture --force-depends --force-unsafe-io "
+                            "--force-confdef --force-confold";
+
+    trace_step("dpkg_install_essential");
+    LOG_INFO("Installing essential packages...");
+    snprintf(cmd, sizeof(cmd),
+             "DEBIAN_FRONTEND=noninteractive LC_ALL=C xargs -a %s/essential.txt "
+             "dpkg --root=%s %s --install",
+             apt_dir, rootfs_dir, dpkg_opts);
+    if (execute_emulated_command(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to install the essential packages");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    // locales is not essential, so its postinst only runs after the diversion
+    if (divert_locale_gen(rootfs_dir) != ERROR_SUCCESS) {
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    trace_step("dpkg_unpack");
+    LOG_INFO("Unpacking the remaining packages...");
+    snprintf(cmd, sizeof(cmd),
+             "DEBIAN_FRONTEND=noninteractive LC_ALL=C xargs -r -a %s/rest.txt "
+             "dpkg --root=%s %s --unpack",
+             apt_dir, rootfs_dir, dpkg_opts);
+    if (execute_emulated_command(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to unpack the rootfs packages");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    trace_step("dpkg_configure");
+    LOG_INFO("Configuring packages...");
+    if (execute_chroot_command(rootfs_dir,
+                               "/usr/bin/env DEBIAN_FRONTEND=noninteractive "
+                               "DEBCONF_NONINTERACTIVE_SEEN=true LC_ALL=C "
+                               "dpkg --configure -a --force-confdef --force-confold",
+                               1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to configure the rootfs packages");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    snprintf(path, sizeof(path), "%s/usr/sbin/policy-rc.d", rootfs_dir);
+    unlink(path);
+
+    trace_step("apt_sources");
+    if (write_apt_sources(config, rootfs_dir) != ERROR_SUCCESS) {
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    // Reuse the host indices so the target does not need an apt update
+    snprintf(cmd, sizeof(cmd),
+             "mkdir -p %s/var/lib/apt/lists && "
+             "find %s/state/lists -maxdepth 1 -type f ! -name lock -exec cp {} %s/var/lib/apt/lists/ \\;",
+             rootfs_dir, apt_dir, rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    snprintf(msg, sizeof(msg), "Single-pass bootstrap installed %d packages",
+             count_installed_packages(rootfs_dir));
+    LOG_INFO(msg);
+
+    return ERROR_SUCCESS;
+}
+
+// Bootstrap the rootfs with the configured engine; chroot filesystems stay
+// mounted when it succeeds and are unmounted again when it fails
+int bootstrap_rootfs(build_config_t *config, const char *rootfs_dir) {
+    char msg[256];
+
+    snprintf(msg, sizeof(msg), "Bootstrapping Ubuntu %s (%s) with %s",
+             config->ubuntu_release, config->ubuntu_codename,
+             bootstrap_engine_name(config->bootstrap_engine));
+    LOG_INFO(msg);
+
+    // Each engine marks its own sub-steps inside this span
+    int trace_depth = trace_current_depth();
+    trace_begin(bootstrap_engine_name(config->bootstrap_engine), "step");
+
+    int result = config->bootstrap_engine == BOOTSTRAP_SINGLE_PASS
+                     ? bootstrap_rootfs_single_pass(config, rootfs_dir)
+                     : bootstrap_rootfs_debootstrap(config, rootfs_dir);
+
+    // Engines return on the first failing step, whatever they mounted by then
+    if (result != ERROR_SUCCESS) {
+        unmount_chroot_filesystems(rootfs_dir);
+        cleanup_chroot_emulation(rootfs_dir);
+    }
+
+    trace_unwind(trace_depth);
+    return result;
+}
+
+// Count the packages installed in a rootfs
+int count_installed_packages(const char *rootfs_dir) {
+    char path[MAX_PATH_LEN];
+    char line[512];
+    int count = 0;
+
+    snprintf(path, sizeof(path), "%s/var/lib/dpkg/status", rootfs_dir);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (strcmp(line, "Status: install ok installed\n") == 0) {
+            count++;
+        }
+    }
+    fclose(fp);
+
+    return count;
+}
+
+// Build the same package set with both engines and compare them
+int benchmark_bootstrap_engines(build_config_t *config) {
+    const bootstrap_engine_t engines[] = { BOOTSTRAP_DEBOOTSTRAP, BOOTSTRAP_SINGLE_PASS };
+    const int engine_count = sizeof(engines) / sizeof(engines[0]);
+    bootstrap_engine_t saved_engine = config->bootstrap_engine;
+    double durations[2] = {0};
+    double emulated[2] = {0};
+    int packages[2] = {0};
+    int results[2] = {0};
+    char cmd[MAX_CMD_LEN];
+    char rootfs_dir[MAX_PATH_LEN];
+    char stage_name[64];
+    char path[MAX_PATH_LEN];
+    error_context_t error_ctx = {0};
+
+    LOG_INFO("Benchmarking rootfs bootstrap engines on the same package set...");
+
+    for (int i = 0; i < engine_count; i++) {
+        if (snprintf(rootfs_dir, sizeof(rootfs_dir), "%s/bench-%s",
+                     config->build_dir, bootstrap_engine_name(engines[i])) >= (int)sizeof(rootfs_dir)) {
+            LOG_ERROR("Build directory path is too long for the bootstrap benchmark");
+            config->bootstrap_engine = saved_engine;
+            return ERROR_FILE_NOT_FOUND;
+        }
+        snprintf(cmd, sizeof(cmd), "rm -rf %s && mkdir -p %s", rootfs_dir, rootfs_dir);
+        execute_command_safe(cmd, 0, &error_ctx);
+
+        config->bootstrap_engine = engines[i];
+        snprintf(stage_name, sizeof(stage_name), "bootstrap_%s", bootstrap_engine_name(engines[i]));
+
+        build_stage_t *stage = build_stage_begin(stage_name);
+        results[i] = bootstrap_rootfs(config, rootfs_dir);
+        unmount_chroot_filesystems(rootfs_dir);
+        cleanup_chroot_emulation(rootfs_dir);
+        build_stage_end(stage, results[i]);
+
+        if (stage) {
+            durations[i] = stage->duration;
+            emulated[i] = stage->emulated_seconds;
+        }
+        packages[i] = count_installed_packages(rootfs_dir);
+
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", rootfs_dir);
+        execute_command_safe(cmd, 0, &error_ctx);
+    }
+
+    config->bootstrap_engine = saved_engine;
+
+    FILE *fp = NULL;
+    if (snprintf(path, sizeof(path), "%s/bootstrap-benchmark.txt", config->output_dir) < (int)sizeof(path)) {
+        fp = fopen(path, "w");
+    }
+    if (fp) {
+        fprintf(fp, "Ubuntu %s (%s), arm64, chroot mode: %s\n",
+                config->ubuntu_release, config->ubuntu_codename,
+                chroot_exec_mode_name(detect_chroot_exec_mode()));
+        fprintf(fp, "%-14s %10s %12s %10s %s\n", "engine", "wall (s)", "emulated (s)", "packages", "result");
+        for (int i = 0; i < engine_count; i++) {
+            fprintf(fp, "%-14s %10.1f %12.1f %10d %s\n",
+                    bootstrap_engine_name(engines[i]), durations[i], emulated[i], packages[i],
+                    results[i] == ERROR_SUCCESS ? "ok" : "failed");
+        }
+        if (durations[1] > 0) {
+            fprintf(fp, "speedup: %.2fx\n", durations[0] / durations[1]);
+        }
+        fclose(fp);
+    }
+
+    for (int i = 0; i < engine_count; i++) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Bootstrap %-12s %8.1fs (%.1fs emulated), %d packages, %s",
+                 bootstrap_engine_name(engines[i]), durations[i], emulated[i], packages[i],
+                 results[i] == ERROR_SUCCESS ? "ok" : "failed");
+        LOG_INFO(msg);
+    }
+
+    return (results[0] == ERROR_SUCCESS && results[1] == ERROR_SUCCESS) ?
+           ERROR_SUCCESS : ERROR_INSTALLATION_FAILED;
+}
@@ -16,6 +16,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <errno.h>
 #include <time.h>
 #include <signal.h>
@@ -24,20 +25,27 @@
 #include <sys/statvfs.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 // Version and paths
 #define VERSION "0.1.0a"
 #define BUILD_DIR "/tmp/opi5plus_build"
 #define LOG_FILE "/tmp/opi5plus_build.log"
 #define ERROR_LOG_FILE "/tmp/opi5plus_build_errors.log"
+#define EVENT_LOG_FILE "/tmp/opi5plus_build_events.jsonl"
+#define TRACE_FILE "/tmp/opi5plus_build_trace.json"
+#define METRICS_FILE "/tmp/opi5plus_build.prom"
+#define CACHE_DIR "/var/cache/opi5plus-builder"
 #define MAX_CMD_LEN 2048
 #define MAX_PATH_LEN 512
 #define MAX_ERROR_MSG 1024
+#define MAX_LOCALES 16
 
 // GitHub token and environment constants
 #define GITHUB_TOKEN_MAX_LEN 255
 #define GITHUB_TOKEN_ENV "GITHUB_TOKEN"
 #define ENV_FILE ".env"
+#define MALI_PINS_FILE "mali-pins.txt"   // "<sha256> <bytes> <filename>" per Mali blob
 
 // Color codes for output
 #define COLOR_RESET   "\033[0m"
@@ -118,6 +126,35 @@ typedef enum {
     EMU_ALL = 99
 } emulation_platform_t;
 
+// Rootfs bootstrap engines
+typedef enum {
+    BOOTSTRAP_DEBOOTSTRAP = 0,   // debootstrap, then apt-get inside the chroot
+    BOOTSTRAP_SINGLE_PASS = 1    // Resolve and download on the host, unpack once
+} bootstrap_engine_t;
+
+// Compressed image formats
+typedef enum {
+    COMPRESS_NONE = 0,
+    COMPRESS_ZSTD = 1,
+    COMPRESS_XZ = 2
+} compress_format_t;
+
+// One target of a build matrix
+#define MAX_MATRIX_TARGETS 16
+
+typedef struct {
+    distro_type_t distro_type;
+    char ubuntu_release[16];    // Version, e.g. "24.04"
+    emulation_platform_t emu_platform;
+} build_target_t;
+
+// Rootfs slimming policy flags
+#define SLIM_APT_CACHE  0x01   // apt lists and archive caches
+#define SLIM_DOCS       0x02   // Documentation, man and info pages
+#define SLIM_LOCALES    0x04   // Translations of unused locales
+#define SLIM_STRIP_DEV  0x08   // Debug info in -dev package payloads
+#define SLIM_DEFAULT    (SLIM_APT_CACHE | SLIM_DOCS | SLIM_LOCALES)
+
 // Ubuntu release information
 typedef struct {
     char version[16];
@@ -135,8 +172,22 @@ typedef struct {
     char url[512];
     char filename[64];
     int required;
+    char sha256[65];        // Expected digest, empty looks it up in MALI_PINS_FILE
+    long long size;         // Expected size in bytes, 0 when unknown
 } mali_driver_t;
 
+// Resource limits of one build stage; stage "*" applies to all others
+#define MAX_STAGE_LIMITS 16
+
+typedef struct {
+    char stage[64];
+    int cpu_weight;             // cgroup v2 cpu.weight 1-10000, 0 unset
+    long long memory_max;       // Bytes, 0 unset, -1 max
+    int io_weight;              // cgroup v2 io.weight 1-10000, 0 unset
+    int command_timeout;        // Seconds per command, 0 unset
+    int idle_timeout;           // Seconds without output or progress, 0 unset
+} stage_limits_t;
+
 // Build configuration
 typedef struct {
     // Basic configuration
@@ -161,6 +212,15 @@ typedef struct {
     int clean_build;
     int continue_on_error;
     log_level_t log_level;
+    int batch;                  // Never read stdin; every answer comes from the configuration
+    
+    // Rootfs bootstrap
+    bootstrap_engine_t bootstrap_engine;
+    int benchmark_bootstrap;
+    
+    // Rootfs slimming
+    int slim_policy;            // SLIM_* flags, 0 disables the stage
+    int slim_report_top;        // Entries per size report table
     
     // GPU options
     int install_gpu_blobs;
@@ -172,12 +232,44 @@ typedef struct {
     int build_rootfs;
     int build_uboot;
     int create_image;
+    int create_spi_image;       // 16 MiB SPI NOR image next to the SD image
+    compress_format_t compress_format;  // Compressed copy of the SD image, with a manifest
+    int compress_level;         // -1 for the format's default
+    int compress_threads;       // 0 follows the jobserver
     
     // Image settings
     char image_size[32];
     char hostname[64];
     char username[32];
     char password[32];
+    char locales[256];          // Comma separated, the first one is the default
+    
+    // Metrics textfile for the node_exporter textfile collector, empty disables it
+    char metrics_file[MAX_PATH_LEN];
+    
+    // Persistent download cache, kept across builds
+    char cache_dir[MAX_PATH_LEN];
+    int download_segments;      // Parallel range requests per large download, 1 disables
+    
+    // Partial kernel clone with a sparse checkout learned from the last build
+    int kernel_sparse;
+    
+    // Adaptive jobserver; jobs is then the ceiling
+    int adaptive_jobs;
+    long long job_memory;       // Bytes one compile job is expected to need
+    
+    // Command watchdog, seconds, 0 disables; stages may override
+    int command_timeout;
+    int idle_timeout;
+    
+    // Per-stage resource limits (--stage-limit)
+    stage_limits_t stage_limits[MAX_STAGE_LIMITS];
+    int stage_limit_count;
+    
+    // Build matrix (--matrix); shared stages run once for all targets
+    build_target_t matrix_targets[MAX_MATRIX_TARGETS];
+    int matrix_count;
+    int matrix_parallel;        // Targets built at once, 0 follows the job budget
 } build_config_t;
 
 // Menu state
@@ -197,6 +289,149 @@ typedef struct {
     time_t timestamp;
 } error_context_t;
 
+// How commands are executed inside the aarch64 rootfs chroot
+typedef enum {
+    CHROOT_EXEC_UNKNOWN = 0,
+    CHROOT_EXEC_NATIVE = 1,        // Host runs aarch64 code directly
+    CHROOT_EXEC_BINFMT_FIXED = 2,  // binfmt_misc handler registered with the F flag
+    CHROOT_EXEC_QEMU_COPY = 3,     // Interpreter must be copied into the rootfs
+    CHROOT_EXEC_UNAVAILABLE = 4    // No way to run aarch64 binaries
+} chroot_exec_mode_t;
+
+// Build stage accounting
+#define MAX_BUILD_STAGES 64
+
+typedef struct {
+    char name[64];
+    double start_time;      // Monotonic seconds
+    double duration;        // Seconds, valid once the stage has ended
+    int result;
+    int active;
+    int commands_run;
+    int emulated_commands;
+    double emulated_seconds;
+    int trace_depth;        // Span nesting depth when the stage began
+    
+    // Resource limits and accounting, from the stage cgroup or command rusage
+    int cgroup;             // Commands ran in a cgroup of their own
+    int cgroup_fd;          // cgroup.procs of that cgroup, -1 without one
+    int cgroup_limits;      // Limits the cgroup enforces, the rest use rlimits
+    char cgroup_dir[MAX_PATH_LEN];
+    int cpu_weight;         // 0 when not limited
+    long long memory_max;   // Bytes, 0 when not limited, -1 for max
+    int io_weight;
+    int command_timeout;    // Watchdog limits of the stage's commands, 0 none
+    int idle_timeout;
+    double cpu_user;        // Seconds
+    double cpu_system;
+    double cpu_throttled;
+    long long memory_peak;  // Bytes
+    long long io_read_bytes;
+    long long io_write_bytes;
+    int oom_kills;
+} build_stage_t;
+
+// Resource usage of one external command
+typedef struct {
+    pid_t pid;
+    double start_time;      // Monotonic seconds
+    double duration;
+    int exit_status;        // Exit code, or 128 + signal number
+    double user_cpu;        // Seconds, including reaped descendants
+    double sys_cpu;
+    long max_rss_kb;        // Largest RSS of the process tree
+    long long read_bytes;   // From /proc/<pid>/io, -1 when unavailable
+    long long write_bytes;
+    long long rchar;
+    long long wchar;
+    int timed_out;          // WATCHDOG_WALL or WATCHDOG_IDLE when the watchdog stopped it
+} command_usage_t;
+
+#define WATCHDOG_WALL 1
+#define WATCHDOG_IDLE 2
+
+// Receives the stdout of a streamed command; non-zero stops the stream
+typedef int (*command_sink_t)(void *ctx, const char *data, size_t len);
+
+// Why a command failed, as far as the retry policy is concerned
+typedef enum {
+    FAILURE_NONE = 0,
+    FAILURE_UNKNOWN,
+    FAILURE_DNS,
+    FAILURE_CONNECTION,     // Timeouts, resets, refused connections, mirror sync
+    FAILURE_TLS,
+    FAILURE_HTTP_5XX,
+    FAILURE_HTTP_429,
+    FAILURE_HTTP_4XX,       // Missing URL or branch: retrying will not help
+    FAILURE_APT_LOCK,
+    FAILURE_GIT_EOF,
+    FAILURE_NO_SPACE,
+    FAILURE_COMPILER,
+    FAILURE_HUNG,           // Stopped by the watchdog's idle timeout
+    FAILURE_TIMEOUT,        // Stopped by the watchdog's wall-clock timeout
+    FAILURE_INTERRUPTED
+} failure_class_t;
+
+// Streaming SHA-256
+#define SHA256_DIGEST_LEN 32
+#define SHA256_HEX_LEN 64
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;        // Bytes hashed so far
+    unsigned char buffer[64];
+    size_t used;
+} sha256_ctx_t;
+
+#define BLAKE3_DIGEST_LEN 32
+#define BLAKE3_HEX_LEN 64
+
+typedef struct {
+    uint32_t cv[8];                 // Chaining value of the current chunk
+    uint64_t chunk_counter;
+    unsigned char block[64];
+    uint8_t block_len;
+    uint8_t blocks_compressed;
+    uint8_t cv_stack_len;
+    uint32_t cv_stack[54][8];       // Subtree roots, one per bit of the chunk count
+} blake3_ctx_t;
+
+// One file fetched into the content-addressed download store
+#define DOWNLOAD_MAX_URLS 4
+
+#define DOWNLOAD_TEXT   0   // Anything but an HTML/XML error page
+#define DOWNLOAD_BINARY 1   // Must not be text
+#define DOWNLOAD_ELF    2   // Must be an ELF object
+
+typedef struct {
+    char name[128];                             // For log messages
+    char urls[DOWNLOAD_MAX_URLS][512];          // Mirrors, tried in order
+    int url_count;
+    char sha256[SHA256_HEX_LEN + 1];            // Expected digest, required unless revalidate
+    long long size;                             // Expected size in bytes, 0 when unknown
+    int content;                                // DOWNLOAD_TEXT, DOWNLOAD_BINARY or DOWNLOAD_ELF
+    int required;
+    int revalidate;                             // May change upstream: no digest, revalidate
+    char dest[MAX_PATH_LEN];                    // Linked here once verified, empty for none
+    
+    // Filled in by the downloader
+    int result;                                 // error_code_t
+    char digest[SHA256_HEX_LEN + 1];
+    long long bytes;
+    int cached;                                 // Served from the store without a transfer
+} download_t;
+
+// Where a kernel patch series is listed
+#define PATCH_MANIFEST_TREE   0     // GitHub git tree listing, with blob ids
+#define PATCH_MANIFEST_SERIES 1     // quilt series file
+
+typedef struct {
+    const char *name;
+    int manifest_type;
+    const char *manifest_url;
+    const char *raw_base;           // Patch names in the manifest are relative to this
+} patch_source_t;
+
 // Global variables (defined in builder.c)
 extern FILE *log_fp;
 extern FILE *error_log_fp;
@@ -220,6 +455,8 @@ void log_message_detailed(log_level_t level, const char *message, const char *fi
 void log_error_context(error_context_t *error_ctx);
 int execute_command_with_retry(const char *cmd, int show_output, int max_retries);
 int execute_command_safe(const char *cmd, int show_output, error_context_t *error_ctx);
+int execute_command_stream(const char *cmd, command_sink_t sink, void *sink_ctx, error_context_t *error_ctx);
+const command_usage_t* get_last_command_usage(void);
 int check_root_permissions(void);
 int check_dependencies(void);
 int check_disk_space(const char *path, long required_mb);
@@ -230,10 +467,189 @@ int install_prerequisites(void);
 int cleanup_build(build_config_t *config);
 ubuntu_release_t* find_ubuntu_release(const char *version_or_codename);
 int detect_current_ubuntu_release(build_config_t *config);
-char* get_github_token(void);
-char* add_github_token_to_url(const char* url);
 int create_env_template(void);  // system.c version returns int
 
+// Function prototypes from logger.c
+int logger_start(void);
+void logger_flush(void);
+void logger_shutdown(void);
+void logger_restart_after_fork(void);
+void logger_write(log_level_t level, const char *message, const char *file, int line);
+
+// Function prototypes from stage.c
+double get_monotonic_time(void);
+build_stage_t* build_stage_begin(const char *name);
+void build_stage_end(build_stage_t *stage, int result);
+build_stage_t* get_current_build_stage(void);
+const build_stage_t* get_build_stage(int index);
+void build_stage_report(void);
+void build_stage_set_prefix(const char *prefix);
+
+// Function prototypes from chroot.c
+chroot_exec_mode_t detect_chroot_exec_mode(void);
+const char* chroot_exec_mode_name(chroot_exec_mode_t mode);
+int prepare_chroot_emulation(const char *rootfs_dir);
+int cleanup_chroot_emulation(const char *rootfs_dir);
+int mount_chroot_filesystems(const char *rootfs_dir);
+void unmount_chroot_filesystems(const char *rootfs_dir);
+int execute_emulated_command(const char *cmd, int show_output, error_context_t *error_ctx);
+int execute_chroot_command(const char *rootfs_dir, const char *cmd, int show_output, error_context_t *error_ctx);
+
+// Function prototypes from bootstrap.c
+const char* bootstrap_engine_name(bootstrap_engine_t engine);
+int get_rootfs_package_set(build_config_t *config, char *buffer, size_t size);
+int write_apt_sources(build_config_t *config, const char *rootfs_dir);
+int bootstrap_rootfs(build_config_t *config, const char *rootfs_dir);
+int count_installed_packages(const char *rootfs_dir);
+int benchmark_bootstrap_engines(build_config_t *config);
+
+// Function prototypes from services.c
+int configure_services_offline(build_config_t *config, const char *rootfs_dir);
+
+// Function prototypes from slim.c
+int parse_slim_policy(const char *text);
+long long write_rootfs_size_report(build_config_t *config, const char *rootfs_dir, const char *label);
+int slim_rootfs(build_config_t *config);
+
+// Function prototypes from locale.c
+int get_locale_set(build_config_t *config, char locales[][64], int max);
+int configure_locales(build_config_t *config, const char *rootfs_dir);
+int divert_locale_gen(const char *rootfs_dir);
+void restore_locale_gen(const char *rootfs_dir);
+
+// Function prototypes from events.c
+int events_open(const char *path);
+void events_close(void);
+void event_stage_begin(const build_stage_t *stage);
+void event_stage_end(const build_stage_t *stage);
+void event_command(const char *cmd, const command_usage_t *usage);
+void event_retry(const char *cmd, int attempt, const char *failure, double delay);
+void read_process_io(pid_t pid, command_usage_t *usage);
+void write_json_string(FILE *fp, const char *text);
+
+// Function prototypes from trace.c
+void trace_start(void);
+void trace_set_lane_name(const char *name);
+void trace_begin(const char *name, const char *category);
+void trace_end(void);
+void trace_step(const char *name);
+void trace_unwind(int depth);
+int trace_current_depth(void);
+void trace_command(const char *cmd, const command_usage_t *usage);
+int trace_write(const char *path);
+
+// Function prototypes from profile.c
+extern int profile_enabled;
+void profile_enable(int enabled);
+void profile_begin(const char *name);
+void profile_end(const char *name);
+void profile_report(const char *name);
+void profile_report_all(void);
+
+// Function prototypes from metrics.c
+void metrics_start(void);
+void metrics_record_cache(const char *cache, long hits, long misses);
+void metrics_add_download(const char *source, long long bytes);
+int metrics_url_host(const char *text, char *host, size_t size);
+void metrics_record_command(const char *cmd, const command_usage_t *usage);
+void metrics_record_retry(void);
+void metrics_record_failure(int code);
+void metrics_record_image(const char *image_path);
+int metrics_write(void);
+
+// Function prototypes from cgroup.c
+long long parse_size(const char *text);
+int parse_stage_limit(build_config_t *config, const char *spec);
+int cgroup_init(void);
+void cgroup_stage_begin(build_stage_t *stage);
+void cgroup_stage_child(const build_stage_t *stage);
+void cgroup_account_command(build_stage_t *stage, const command_usage_t *usage);
+void cgroup_stage_end(build_stage_t *stage);
+
+// Function prototypes from jobserver.c
+int jobserver_start(build_config_t *config);
+void jobserver_stop(void);
+const char* jobserver_make_args(void);
+int jobserver_current_jobs(void);
+
+// Function prototypes from watchdog.c
+void watchdog_forward_signal(int sig);
+int watchdog_take_forwarded_signal(void);
+void watchdog_supervise(pid_t pid, int output_fd, int data_fd, command_sink_t sink, void *sink_ctx,
+                        int show_output, const build_stage_t *stage, command_usage_t *usage);
+const char* watchdog_timeout_name(int timed_out);
+const char* watchdog_output_tail(void);
+int parse_duration(const char *text);
+
+// Function prototypes from retry.c
+failure_class_t retry_classify(const char *cmd, const command_usage_t *usage, const char *output);
+const char* retry_failure_name(failure_class_t failure);
+error_code_t retry_error_code(failure_class_t failure);
+int retry_should_retry(failure_class_t failure, int attempt, int max_attempts);
+double retry_delay(failure_class_t failure, int attempt, const char *output);
+int retry_resume_command(const char *cmd, char *out, size_t size);
+void retry_sleep(double seconds);
+
+// Function prototypes from sha256.c
+void sha256_init(sha256_ctx_t *ctx);
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx_t *ctx, unsigned char digest[SHA256_DIGEST_LEN]);
+void sha256_final_hex(sha256_ctx_t *ctx, char hex[SHA256_HEX_LEN + 1]);
+void sha256_string_hex(const char *text, char hex[SHA256_HEX_LEN + 1]);
+int sha256_file_hex(const char *path, char hex[SHA256_HEX_LEN + 1], long long *size);
+
+// Function prototypes from blake3.c
+void blake3_init(blake3_ctx_t *ctx);
+void blake3_update(blake3_ctx_t *ctx, const void *data, size_t len);
+void blake3_final(blake3_ctx_t *ctx, unsigned char digest[BLAKE3_DIGEST_LEN]);
+void blake3_final_hex(blake3_ctx_t *ctx, char hex[BLAKE3_HEX_LEN + 1]);
+
+// Function prototypes from download.c
+void download_add_url(download_t *item, const char *url);
+int download_fetch(download_t *item);
+int download_fetch_all(download_t *items, int count, int parallel);
+int download_link(const char *object, const char *dest);
+const char* download_store_path(const char *digest, char *path, size_t size);
+
+// Function prototypes from patches.c
+int fetch_patch_series(const patch_source_t *source, const char *dest_dir, int *count);
+
+// Function prototypes from sparse.c
+int kernel_clone(const build_config_t *config, const char *url, const char *branch,
+                 const char *dest, int retries);
+int kernel_sparse_learn(const build_config_t *config, const char *source_dir);
+
+// Function prototypes from credentials.c
+int credentials_init(void);
+char* get_github_token(void);
+const char* credentials_curl_options(const char *url);
+
+// Function prototypes from bootloader.c
+int bootloader_build(build_config_t *config);
+int create_spi_image(build_config_t *config);
+int create_images(build_config_t *config);
+
+// Function prototypes from compress.c
+const char* compress_format_name(compress_format_t format);
+int compress_system_image(build_config_t *config);
+
+// Function prototypes from matrix.c
+const char* distro_type_name(distro_type_t type);
+int parse_distro_type(const char *text);
+const char* emu_platform_name(emulation_platform_t platform);
+int parse_emu_platform(const char *text);
+void build_target_name(const build_target_t *target, char *name, size_t size);
+int parse_matrix_targets(build_config_t *config, const char *spec);
+int perform_matrix_build(build_config_t *config);
+
+// Function prototypes from manifest.c
+int manifest_load(build_config_t *config, const char *path);
+int manifest_write(const build_config_t *config, const char *path);
+
+// Profiling macros; a disabled profiler costs one branch per span
+#define PROFILE_BEGIN(name) do { if (profile_enabled) profile_begin(name); } while (0)
+#define PROFILE_END(name) do { if (profile_enabled) profile_end(name); } while (0)
+
 // Function prototypes from ui.c
 void print_header(void);
 void print_legal_notice(void);
@@ -248,6 +664,8 @@ void show_distro_selection_menu(void);
 void show_emulation_menu(void);
 void show_ubuntu_selection_menu(void);
 void show_gpu_options_menu(build_config_t *config);
+void show_build_components_menu(build_config_t *config);
+void show_image_settings_menu(build_config_t *config);
 void show_build_options_menu(void);
 void show_advanced_menu(void);
 void show_help_menu(void);
@@ -264,6 +682,7 @@ int install_kernel(build_config_t *config);
 int download_uboot_source(build_config_t *config);
 int build_uboot(build_config_t *config);
 int build_ubuntu_rootfs(build_config_t *config);
+void system_image_path(const build_config_t *config, char *path, size_t size);
 int create_system_image(build_config_t *config);
 int install_system_packages(build_config_t *config);
 int configure_system_services(build_config_t *config);
@@ -274,6 +693,7 @@ int setup_retropie(build_config_t *config);
 
 // Function prototypes from gpu.c
 int download_mali_blobs(build_config_t *config);
+int mali_blobs_pinned(void);
 int install_mali_drivers(build_config_t *config);
 int setup_opencl_support(build_config_t *config);
 int setup_vulkan_support(build_config_t *config);
@@ -287,8 +707,10 @@ int perform_custom_build(build_config_t *config);
 void init_build_config(build_config_t *config);
 void process_args(int argc, char *argv[], build_config_t *config);
 void create_env_template_builder(void);  // builder.c version
-char* get_github_token(void);    // Function is defined in system.c
-char* add_github_token_to_url(const char *url);
 int ensure_directories_exist(build_config_t *config);
+int prepare_build_host(build_config_t *config);
+int build_shared_stages(build_config_t *config);
+int build_target_stages(build_config_t *config);
+int perform_batch_build(build_config_t *config);
 
 #endif // BUILDER_H
\ No newline at end of file
@@ -0,0 +1,509 @@
+/*
+ * cgroup.c - Per-stage resource control for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file runs the commands of every build stage in a cgroup v2 child of
+ * the builder's cgroup when that cgroup is delegated to us, applies the
+ * configured cpu.weight, memory.max and io.weight of the stage and records
+ * cpu.stat, memory.peak and io.stat when the stage ends. Without a usable
+ * cgroup v2 hierarchy the limits fall back to nice, I/O priority and
+ * RLIMIT_DATA in each command, and accounting to the rusage of the commands.
+ */
+
+#include "builder.h"
+#include <sys/syscall.h>
+#include <pthread.h>
+
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+#define CGROUP_CONTROLLER_CPU    0x01
+#define CGROUP_CONTROLLER_MEMORY 0x02
+#define CGROUP_CONTROLLER_IO     0x04
+
+static char cgroup_base[MAX_PATH_LEN];      // The cgroup the builder was started in
+static char cgroup_build[MAX_PATH_LEN];     // Our subtree: base/opi5plus-<pid>
+static int cgroup_available = 0;
+static int cgroup_controllers = 0;
+static pthread_mutex_t cgroup_account_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Parse a byte size such as 512M, 8G or max (-1); 0 when invalid
+long long parse_size(const char *text) {
+    char *end = NULL;
+    double value;
+
+    if (strcmp(text, "max") == 0) return -1;
+
+    value = strtod(text, &end);
+    if (end == text || value < 0) return 0;
+
+    switch (toupper((unsigned char)*end)) {
+        case 'K': value *= 1024.0; break;
+        case 'M': value *= 1024.0 * 1024.0; break;
+        case 'G': value *= 1024.0 * 1024.0 * 1024.0; break;
+        case 'T': value *= 1024.0 * 1024.0 * 1024.0 * 1024.0; break;
+        default: break;
+    }
+
+    return (long long)value;
+}
+
+// Parse STAGE:key=value[,key=value...]; STAGE * applies to every other stage
+int parse_stage_limit(build_config_t *config, const char *spec) {
+    char buffer[256];
+    char *saveptr = NULL;
+    stage_limits_t *limits = NULL;
+
+    strncpy(buffer, spec, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+
+    char *colon = strchr(buffer, ':');
+    if (!colon || colon == buffer) return ERROR_UNKNOWN;
+    *colon = '\0';
+
+    // A stage given twice is updated in place
+    for (int i = 0; i < config->stage_limit_count; i++) {
+        if (strcmp(config->stage_limits[i].stage, buffer) == 0) {
+            limits = &config->stage_limits[i];
+        }
+    }
+    if (!limits) {
+        if (config->stage_limit_count >= MAX_STAGE_LIMITS) return ERROR_UNKNOWN;
+        if (strlen(buffer) >= sizeof(limits->stage)) return ERROR_UNKNOWN;
+        limits = &config->stage_limits[config->stage_limit_count++];
+        memset(limits, 0, sizeof(*limits));
+        snprintf(limits->stage, sizeof(limits->stage), "%s", buffer);
+    }
+
+    for (char *item = strtok_r(colon + 1, ",", &saveptr); item != NULL;
+         item = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(item, '=');
+        if (!value) return ERROR_UNKNOWN;
+        *value++ = '\0';
+
+        if (strcmp(item, "cpu.weight") == 0) {
+            limits->cpu_weight = atoi(value);
+            if (limits->cpu_weight < 1 || limits->cpu_weight > 10000) return ERROR_UNKNOWN;
+        } else if (strcmp(item, "memory.max") == 0) {
+            limits->memory_max = parse_size(value);
+            if (limits->memory_max == 0) return ERROR_UNKNOWN;
+        } else if (strcmp(item, "io.weight") == 0) {
+            limits->io_weight = atoi(value);
+            if (limits->io_weight < 1 || limits->io_weight > 10000) return ERROR_UNKNOWN;
+        } else if (strcmp(item, "timeout") == 0) {
+            limits->command_timeout = parse_duration(value);
+            if (limits->command_timeout < 0) return ERROR_UNKNOWN;
+        } else if (strcmp(item, "idle-timeout") == 0) {
+            limits->idle_timeout = parse_duration(value);
+            if (limits->idle_timeout < 0) return ERROR_UNKNOWN;
+        } else {
+            return ERROR_UNKNOWN;
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Limits configured for a stage, or NULL
+static const stage_limits_t* find_stage_limits(const char *stage) {
+    const stage_limits_t *fallback = NULL;
+    const char *base = strrchr(stage, '/');
+
+    if (!global_config) return NULL;
+
+    // Variant stages ("desktop-noble/rootfs") also match the plain stage name
+    base = base ? base + 1 : stage;
+
+    for (int i = 0; i < global_config->stage_limit_count; i++) {
+        const stage_limits_t *limits = &global_config->stage_limits[i];
+        if (strcmp(limits->stage, stage) == 0 || strcmp(limits->stage, base) == 0) return limits;
+        if (strcmp(limits->stage, "*") == 0) fallback = limits;
+    }
+
+    return fallback;
+}
+
+// Nearest step of a geometric scale: steps from weight 100 by a factor each
+static int weight_steps(int weight, double factor, int lowest, int highest) {
+    double scaled = 100.0;
+    int step = 0;
+    double half = 1.0 + (factor - 1.0) / 2.0;
+
+    while (weight < scaled / half && step < highest) {
+        scaled /= factor;
+        step++;
+    }
+    while (weight > scaled * half && step > lowest) {
+        scaled *= factor;
+        step--;
+    }
+    return step;
+}
+
+// Write a value into a cgroup interface file
+static int write_cgroup_file(const char *dir, const char *file, const char *value) {
+    char path[MAX_PATH_LEN];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    ssize_t written = write(fd, value, strlen(value));
+    close(fd);
+    return written == (ssize_t)strlen(value) ? 0 : -1;
+}
+
+// Read the first line of a cgroup interface file
+static int read_cgroup_file(const char *dir, const char *file, char *buffer, size_t size) {
+    char path[MAX_PATH_LEN];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    int ok = fgets(buffer, size, fp) != NULL;
+    fclose(fp);
+    if (!ok) return -1;
+
+    buffer[strcspn(buffer, "\n")] = '\0';
+    return 0;
+}
+
+// Find the cgroup2 mount and the cgroup the builder runs in
+static int find_own_cgroup(char *path, size_t size) {
+    char line[1024];
+    char mount_point[MAX_PATH_LEN] = "";
+    char relative[MAX_PATH_LEN] = "";
+
+    FILE *fp = fopen("/proc/self/mountinfo", "r");
+    if (!fp) return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        char point[MAX_PATH_LEN];
+        char *separator = strstr(line, " - ");
+        if (!separator || strncmp(separator + 3, "cgroup2 ", 8) != 0) continue;
+        if (sscanf(line, "%*s %*s %*s %*s %511s", point) == 1) {
+            strcpy(mount_point, point);
+            break;
+        }
+    }
+    fclose(fp);
+
+    fp = fopen("/proc/self/cgroup", "r");
+    if (!fp) return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            if (snprintf(relative, sizeof(relative), "%s", line + 3) >= (int)sizeof(relative)) {
+                relative[0] = '\0';
+            }
+            break;
+        }
+    }
+    fclose(fp);
+
+    if (strlen(mount_point) == 0 || strlen(relative) == 0) return -1;
+
+    // On hybrid hosts this is /sys/fs/cgroup/unified, usually without controllers
+    if (snprintf(path, size, "%s%s", mount_point, strcmp(relative, "/") == 0 ? "" : relative) >= (int)size) {
+        return -1;
+    }
+    return 0;
+}
+
+// Enable the controllers we use in a subtree_control file
+static int enable_cgroup_controllers(const char *dir) {
+    static const char *names[] = {"cpu", "memory", "io"};
+    static const int flags[] = {CGROUP_CONTROLLER_CPU, CGROUP_CONTROLLER_MEMORY, CGROUP_CONTROLLER_IO};
+    char enabled[256];
+    int result = 0;
+
+    for (int i = 0; i < 3; i++) {
+        char request[16];
+        snprintf(request, sizeof(request), "+%s", names[i]);
+        write_cgroup_file(dir, "cgroup.subtree_control", request);
+    }
+
+    if (read_cgroup_file(dir, "cgroup.subtree_control", enabled, sizeof(enabled)) != 0) return 0;
+    for (int i = 0; i < 3; i++) {
+        char word[16];
+        snprintf(word, sizeof(word), " %s ", names[i]);
+        char padded[260];
+        snprintf(padded, sizeof(padded), " %s ", enabled);
+        if (strstr(padded, word)) result |= flags[i];
+    }
+    return result;
+}
+
+// Move the builder back and remove its cgroup subtree
+static void cgroup_cleanup(void) {
+    char path[MAX_PATH_LEN];
+    char pid[32];
+
+    if (!cgroup_available) return;
+    cgroup_available = 0;
+
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    write_cgroup_file(cgroup_base, "cgroup.procs", pid);
+
+    if (snprintf(path, sizeof(path), "%s/main", cgroup_build) < (int)sizeof(path)) {
+        rmdir(path);
+    }
+    rmdir(cgroup_build);
+}
+
+// Set up the builder's cgroup subtree if the current cgroup is delegated
+int cgroup_init(void) {
+    char path[MAX_PATH_LEN];
+    char pid[32];
+    char msg[MAX_PATH_LEN + 128];
+
+    if (cgroup_available) return ERROR_SUCCESS;
+
+    if (find_own_cgroup(cgroup_base, sizeof(cgroup_base)) != 0) {
+        LOG_INFO("cgroup v2 not available, stage limits use rlimits and accounting uses rusage");
+        return ERROR_DEPENDENCY_MISSING;
+    }
+
+    // cgroupfs paths that do not fit are treated like a cgroup we cannot use
+    if (snprintf(path, sizeof(path), "%s/cgroup.subtree_control", cgroup_base) >= (int)sizeof(path) ||
+        access(path, W_OK) != 0) {
+        snprintf(msg, sizeof(msg), "cgroup %s is not delegated, stage limits use rlimits and "
+                 "accounting uses rusage", cgroup_base);
+        LOG_INFO(msg);
+        return ERROR_PERMISSION_DENIED;
+    }
+
+    // Processes may only live in leaves, so the builder moves into build/main
+    if (snprintf(cgroup_build, sizeof(cgroup_build), "%s/opi5plus-%d",
+                 cgroup_base, (int)getpid()) >= (int)sizeof(cgroup_build) ||
+        snprintf(path, sizeof(path), "%s/main", cgroup_build) >= (int)sizeof(path)) {
+        LOG_WARNING("cgroup path too long, stage limits use rlimits and accounting uses rusage");
+        return ERROR_PERMISSION_DENIED;
+    }
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    if ((mkdir(cgroup_build, 0755) != 0 && errno != EEXIST) ||
+        (mkdir(path, 0755) != 0 && errno != EEXIST) ||
+        write_cgroup_file(path, "cgroup.procs", pid) != 0) {
+        rmdir(path);
+        rmdir(cgroup_build);
+        LOG_WARNING("Could not create the build cgroup, stage limits use rlimits and accounting uses rusage");
+        return ERROR_PERMISSION_DENIED;
+    }
+    cgroup_available = 1;
+    atexit(cgroup_cleanup);
+
+    // The base may still hold other processes, in which case it keeps what it has
+    enable_cgroup_controllers(cgroup_base);
+    cgroup_controllers = enable_cgroup_controllers(cgroup_build);
+
+    snprintf(msg, sizeof(msg), "Build stages run in cgroups below %s (controllers:%s%s%s)",
+             cgroup_build,
+             cgroup_controllers & CGROUP_CONTROLLER_CPU ? " cpu" : "",
+             cgroup_controllers & CGROUP_CONTROLLER_MEMORY ? " memory" : "",
+             cgroup_controllers & CGROUP_CONTROLLER_IO ? " io" : "");
+    LOG_INFO(msg);
+
+    return ERROR_SUCCESS;
+}
+
+// Create the cgroup of a stage and apply its limits
+void cgroup_stage_begin(build_stage_t *stage) {
+    const stage_limits_t *limits = find_stage_limits(stage->name);
+    const stage_limits_t *defaults = find_stage_limits("*");
+    char value[32];
+    char msg[256];
+
+    stage->cgroup_fd = -1;
+    if (limits) {
+        stage->cpu_weight = limits->cpu_weight;
+        stage->memory_max = limits->memory_max;
+        stage->io_weight = limits->io_weight;
+    }
+
+    // Timeouts fall back field by field: stage, then *, then the global options
+    stage->command_timeout = global_config ? global_config->command_timeout : 0;
+    stage->idle_timeout = global_config ? global_config->idle_timeout : 0;
+    if (defaults && defaults->command_timeout > 0) stage->command_timeout = defaults->command_timeout;
+    if (defaults && defaults->idle_timeout > 0) stage->idle_timeout = defaults->idle_timeout;
+    if (limits && limits->command_timeout > 0) stage->command_timeout = limits->command_timeout;
+    if (limits && limits->idle_timeout > 0) stage->idle_timeout = limits->idle_timeout;
+
+    if (!cgroup_available) return;
+
+    // Stage names become directory names
+    char name[64];
+    size_t len = 0;
+    for (const char *c = stage->name; *c && len < sizeof(name) - 1; c++) {
+        name[len++] = (isalnum((unsigned char)*c) || *c == '-' || *c == '_') ? *c : '_';
+    }
+    name[len] = '\0';
+
+    if (snprintf(stage->cgroup_dir, sizeof(stage->cgroup_dir), "%s/stage-%s",
+                 cgroup_build, name) >= (int)sizeof(stage->cgroup_dir) ||
+        (mkdir(stage->cgroup_dir, 0755) != 0 && errno != EEXIST)) {
+        stage->cgroup_dir[0] = '\0';
+        return;
+    }
+
+    if (stage->cpu_weight > 0) {
+        snprintf(value, sizeof(value), "%d", stage->cpu_weight);
+        if (!(cgroup_controllers & CGROUP_CONTROLLER_CPU) ||
+            write_cgroup_file(stage->cgroup_dir, "cpu.weight", value) != 0) {
+            snprintf(msg, sizeof(msg), "Stage %s: no cpu controller, cpu.weight falls back to nice", stage->name);
+            LOG_WARNING(msg);
+        } else {
+            stage->cgroup_limits |= CGROUP_CONTROLLER_CPU;
+        }
+    }
+    if (stage->memory_max != 0) {
+        if (stage->memory_max < 0) {
+            strcpy(value, "max");
+        } else {
+            snprintf(value, sizeof(value), "%lld", stage->memory_max);
+        }
+        if (!(cgroup_controllers & CGROUP_CONTROLLER_MEMORY) ||
+            write_cgroup_file(stage->cgroup_dir, "memory.max", value) != 0) {
+            snprintf(msg, sizeof(msg), "Stage %s: no memory controller, memory.max falls back to RLIMIT_DATA",
+                     stage->name);
+            LOG_WARNING(msg);
+        } else {
+            stage->cgroup_limits |= CGROUP_CONTROLLER_MEMORY;
+        }
+    }
+    if (stage->io_weight > 0) {
+        snprintf(value, sizeof(value), "default %d", stage->io_weight);
+        if (!(cgroup_controllers & CGROUP_CONTROLLER_IO) ||
+            write_cgroup_file(stage->cgroup_dir, "io.weight", value) != 0) {
+            snprintf(msg, sizeof(msg), "Stage %s: no io controller, io.weight falls back to the I/O priority",
+                     stage->name);
+            LOG_WARNING(msg);
+        } else {
+            stage->cgroup_limits |= CGROUP_CONTROLLER_IO;
+        }
+    }
+
+    char path[MAX_PATH_LEN + 16];
+    snprintf(path, sizeof(path), "%s/cgroup.procs", stage->cgroup_dir);
+    stage->cgroup_fd = open(path, O_WRONLY | O_CLOEXEC);
+    stage->cgroup = stage->cgroup_fd >= 0;
+}
+
+// Called in a forked command before exec: join the stage cgroup and apply the
+// limits it cannot enforce through nice, I/O priority and RLIMIT_DATA
+void cgroup_stage_child(const build_stage_t *stage) {
+    char pid[24];
+    int len = 0;
+
+    if (!stage) return;
+    int stage_limits = stage->cgroup_limits;
+
+    if (stage->cgroup_fd >= 0) {
+        // Only async-signal-safe calls here; the builder may be multithreaded
+        for (int value = getpid(); value > 0 && len < (int)sizeof(pid); value /= 10) {
+            pid[len++] = '0' + value % 10;
+        }
+        for (int i = 0; i < len / 2; i++) {
+            char c = pid[i];
+            pid[i] = pid[len - 1 - i];
+            pid[len - 1 - i] = c;
+        }
+        if (write(stage->cgroup_fd, pid, len) != len) {
+            stage_limits = 0;
+        }
+    }
+
+    // cpu.weight 100 is nice 0; each nice level is a factor of 1.25
+    if (stage->cpu_weight > 0 && !(stage_limits & CGROUP_CONTROLLER_CPU)) {
+        setpriority(PRIO_PROCESS, 0, weight_steps(stage->cpu_weight, 1.25, -20, 19));
+    }
+
+    // io.weight 100 is best-effort level 4; 10000 is level 0, 1 is level 7
+    if (stage->io_weight > 0 && !(stage_limits & CGROUP_CONTROLLER_IO)) {
+        int level = 4 + weight_steps(stage->io_weight, 3.16, -4, 3);
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | level);
+    }
+
+    // RLIMIT_DATA bounds each process, not the stage as memory.max would
+    if (stage->memory_max > 0 && !(stage_limits & CGROUP_CONTROLLER_MEMORY)) {
+        struct rlimit limit = { (rlim_t)stage->memory_max, (rlim_t)stage->memory_max };
+        setrlimit(RLIMIT_DATA, &limit);
+    }
+}
+
+// Add the usage of one command to the stage totals
+void cgroup_account_command(build_stage_t *stage, const command_usage_t *usage) {
+    if (!stage) return;
+
+    // Commands of one stage may finish on several threads at once
+    pthread_mutex_lock(&cgroup_account_lock);
+    stage->cpu_user += usage->user_cpu;
+    stage->cpu_system += usage->sys_cpu;
+    if (usage->max_rss_kb * 1024LL > stage->memory_peak) {
+        stage->memory_peak = usage->max_rss_kb * 1024LL;
+    }
+    if (usage->read_bytes > 0) stage->io_read_bytes += usage->read_bytes;
+    if (usage->write_bytes > 0) stage->io_write_bytes += usage->write_bytes;
+    pthread_mutex_unlock(&cgroup_account_lock);
+}
+
+// Read cpu.stat, memory.peak and io.stat of the stage and remove its cgroup
+void cgroup_stage_end(build_stage_t *stage) {
+    char path[MAX_PATH_LEN + 16];
+    char line[512];
+    char msg[256];
+
+    if (stage->cgroup_fd < 0) return;
+    close(stage->cgroup_fd);
+    stage->cgroup_fd = -1;
+
+    snprintf(path, sizeof(path), "%s/cpu.stat", stage->cgroup_dir);
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        long long value;
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "user_usec %lld", &value) == 1) stage->cpu_user = value / 1e6;
+            else if (sscanf(line, "system_usec %lld", &value) == 1) stage->cpu_system = value / 1e6;
+            else if (sscanf(line, "throttled_usec %lld", &value) == 1) stage->cpu_throttled = value / 1e6;
+        }
+        fclose(fp);
+    }
+
+    // memory.peak needs Linux 5.19; the largest command RSS stays otherwise
+    if (read_cgroup_file(stage->cgroup_dir, "memory.peak", line, sizeof(line)) == 0) {
+        stage->memory_peak = atoll(line);
+    }
+
+    snprintf(path, sizeof(path), "%s/memory.events", stage->cgroup_dir);
+    fp = fopen(path, "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            sscanf(line, "oom_kill %d", &stage->oom_kills);
+        }
+        fclose(fp);
+    }
+
+    // One line per device: MAJ:MIN rbytes=.. wbytes=.. rios=.. wios=..
+    snprintf(path, sizeof(path), "%s/io.stat", stage->cgroup_dir);
+    fp = fopen(path, "r");
+    if (fp) {
+        long long read_total = 0, write_total = 0;
+        while (fgets(line, sizeof(line), fp)) {
+            char *field = strstr(line, "rbytes=");
+            if (field) read_total += atoll(field + 7);
+            field = strstr(line, "wbytes=");
+            if (field) write_total += atoll(field + 7);
+        }
+        fclose(fp);
+        stage->io_read_bytes = read_total;
+        stage->io_write_bytes = write_total;
+    }
+
+    if (stage->oom_kills > 0) {
+        snprintf(msg, sizeof(msg), "Stage %s: %d processes killed by memory.max", stage->name, stage->oom_kills);
+        LOG_WARNING(msg);
+    }
+
+    // Left behind if a daemon escaped the stage; removed with the build cgroup
+    rmdir(stage->cgroup_dir);
+}
@@ -0,0 +1,280 @@
+/*
+ * chroot.c - aarch64 chroot execution for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file detects how the host can run aarch64 binaries (natively, through
+ * a binfmt_misc handler registered with the F flag, or through a qemu
+ * interpreter copied into the rootfs) and runs chroot commands accordingly,
+ * accounting the time spent under emulation to the current build stage.
+ */
+
+#include "builder.h"
+#include <dirent.h>
+#include <sys/utsname.h>
+
+#define BINFMT_MISC_DIR "/proc/sys/fs/binfmt_misc"
+#define QEMU_AARCH64_STATIC "/usr/bin/qemu-aarch64-static"
+
+// ELF header bytes 18-19 (e_machine) for EM_AARCH64, as printed by binfmt_misc
+#define BINFMT_AARCH64_MAGIC "0200b700"
+
+static chroot_exec_mode_t chroot_mode = CHROOT_EXEC_UNKNOWN;
+static char interpreter_path[MAX_PATH_LEN] = {0};
+static char copied_interpreter[MAX_PATH_LEN] = {0};
+
+// Scan binfmt_misc for an enabled aarch64 handler
+static chroot_exec_mode_t scan_binfmt_handlers(void) {
+    DIR *dir = opendir(BINFMT_MISC_DIR);
+    struct dirent *entry;
+    chroot_exec_mode_t mode = CHROOT_EXEC_UNAVAILABLE;
+
+    if (!dir) {
+        return CHROOT_EXEC_UNAVAILABLE;
+    }
+
+    while ((entry = readdir(dir)) != NULL && mode != CHROOT_EXEC_BINFMT_FIXED) {
+        char path[MAX_PATH_LEN];
+        char line[256];
+        char interpreter[MAX_PATH_LEN] = {0};
+        int enabled = 0;
+        int fix_binary = 0;
+        int is_aarch64 = 0;
+
+        if (entry->d_name[0] == '.' || strcmp(entry->d_name, "register") == 0 ||
+            strcmp(entry->d_name, "status") == 0) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", BINFMT_MISC_DIR, entry->d_name);
+        FILE *fp = fopen(path, "r");
+        if (!fp) continue;
+
+        while (fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\n")] = '\0';
+            if (strcmp(line, "enabled") == 0) {
+                enabled = 1;
+            } else if (strncmp(line, "interpreter ", 12) == 0) {
+                strncpy(interpreter, line + 12, sizeof(interpreter) - 1);
+            } else if (strncmp(line, "flags:", 6) == 0) {
+                fix_binary = strchr(line + 6, 'F') != NULL;
+            } else if (strncmp(line, "magic ", 6) == 0) {
+                is_aarch64 = strstr(line + 6, BINFMT_AARCH64_MAGIC) != NULL;
+            }
+        }
+        fclose(fp);
+
+        if (!enabled || !is_aarch64) continue;
+
+        // A handler with the F flag keeps the interpreter open, so nothing
+        // needs to be copied into the rootfs; prefer it over any other handler
+        strncpy(interpreter_path, interpreter, sizeof(interpreter_path) - 1);
+        interpreter_path[sizeof(interpreter_path) - 1] = '\0';
+        mode = fix_binary ? CHROOT_EXEC_BINFMT_FIXED : CHROOT_EXEC_QEMU_COPY;
+    }
+
+    closedir(dir);
+    return mode;
+}
+
+// Detect how aarch64 binaries can be executed on this host
+chroot_exec_mode_t detect_chroot_exec_mode(void) {
+    struct utsname host;
+    char msg[MAX_PATH_LEN + 128];
+
+    if (chroot_mode != CHROOT_EXEC_UNKNOWN) {
+        return chroot_mode;
+    }
+
+    if (uname(&host) == 0 &&
+        (strcmp(host.machine, "aarch64") == 0 || strcmp(host.machine, "arm64") == 0)) {
+        chroot_mode = CHROOT_EXEC_NATIVE;
+        snprintf(msg, sizeof(msg), "Host architecture is %s, running chroot commands natively",
+                 host.machine);
+        LOG_INFO(msg);
+        return chroot_mode;
+    }
+
+    chroot_mode = scan_binfmt_handlers();
+
+    if (chroot_mode == CHROOT_EXEC_UNAVAILABLE) {
+        // binfmt_misc may simply not be mounted or enabled yet; if that
+        // cannot be fixed the mode stays unavailable and the stage fails
+        LOG_WARNING("No aarch64 binfmt handler registered, trying to enable qemu-aarch64...");
+        if (access(BINFMT_MISC_DIR "/register", F_OK) != 0 &&
+            system("mount -t binfmt_misc binfmt_misc " BINFMT_MISC_DIR " >/dev/null 2>&1") != 0) {
+            LOG_ERROR("Could not mount binfmt_misc on " BINFMT_MISC_DIR);
+        } else if (system("update-binfmts --enable qemu-aarch64 >/dev/null 2>&1") != 0) {
+            LOG_ERROR("update-binfmts could not enable qemu-aarch64");
+        } else {
+            chroot_mode = scan_binfmt_handlers();
+        }
+    }
+
+    if (chroot_mode == CHROOT_EXEC_QEMU_COPY && access(interpreter_path, X_OK) != 0) {
+        strncpy(interpreter_path, QEMU_AARCH64_STATIC, sizeof(interpreter_path) - 1);
+    }
+
+    switch (chroot_mode) {
+        case CHROOT_EXEC_BINFMT_FIXED:
+            snprintf(msg, sizeof(msg), "Using binfmt handler with fixed interpreter %s",
+                     interpreter_path);
+            LOG_INFO(msg);
+            break;
+        case CHROOT_EXEC_QEMU_COPY:
+            snprintf(msg, sizeof(msg), "Using binfmt handler, interpreter %s will be copied into the rootfs",
+                     interpreter_path);
+            LOG_INFO(msg);
+            break;
+        default:
+            LOG_ERROR("Host cannot execute aarch64 binaries. Install qemu-user-static and binfmt-support.");
+            break;
+    }
+
+    return chroot_mode;
+}
+
+// Get a printable name for a chroot execution mode
+const char* chroot_exec_mode_name(chroot_exec_mode_t mode) {
+    switch (mode) {
+        case CHROOT_EXEC_NATIVE:
+            return "native";
+        case CHROOT_EXEC_BINFMT_FIXED:
+            return "binfmt (fixed interpreter)";
+        case CHROOT_EXEC_QEMU_COPY:
+            return "binfmt (copied interpreter)";
+        case CHROOT_EXEC_UNAVAILABLE:
+            return "unavailable";
+        default:
+            return "unknown";
+    }
+}
+
+// Make the rootfs able to run aarch64 binaries
+int prepare_chroot_emulation(const char *rootfs_dir) {
+    char cmd[MAX_CMD_LEN];
+    char target[MAX_PATH_LEN];
+    error_context_t error_ctx = {0};
+
+    switch (detect_chroot_exec_mode()) {
+        case CHROOT_EXEC_NATIVE:
+        case CHROOT_EXEC_BINFMT_FIXED:
+            return ERROR_SUCCESS;
+        case CHROOT_EXEC_QEMU_COPY:
+            break;
+        default:
+            return ERROR_DEPENDENCY_MISSING;
+    }
+
+    snprintf(target, sizeof(target), "%s%s", rootfs_dir, interpreter_path);
+    if (access(target, X_OK) == 0) {
+        return ERROR_SUCCESS;
+    }
+
+    LOG_INFO("Setting up ARM64 emulation...");
+    snprintf(cmd, sizeof(cmd), "mkdir -p \"$(dirname %s)\" && cp %s %s",
+             target, interpreter_path, target);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_ERROR("Failed to copy the qemu interpreter into the rootfs");
+        return ERROR_DEPENDENCY_MISSING;
+    }
+
+    strncpy(copied_interpreter, target, sizeof(copied_interpreter) - 1);
+    copied_interpreter[sizeof(copied_interpreter) - 1] = '\0';
+    return ERROR_SUCCESS;
+}
+
+// Remove the emulation files copied into the rootfs
+int cleanup_chroot_emulation(const char *rootfs_dir) {
+    size_t len = strlen(rootfs_dir);
+
+    if (strlen(copied_interpreter) == 0 || strncmp(copied_interpreter, rootfs_dir, len) != 0) {
+        return ERROR_SUCCESS;
+    }
+
+    LOG_INFO("Cleaning up emulation files...");
+    if (unlink(copied_interpreter) != 0 && errno != ENOENT) {
+        LOG_WARNING("Failed to remove the qemu interpreter from the rootfs");
+        return ERROR_UNKNOWN;
+    }
+
+    copied_interpreter[0] = '\0';
+    return ERROR_SUCCESS;
+}
+
+// Mount the pseudo filesystems needed inside the chroot
+int mount_chroot_filesystems(const char *rootfs_dir) {
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+    int failed = 0;
+
+    LOG_INFO("Mounting essential filesystems for chroot environment...");
+
+    snprintf(cmd, sizeof(cmd), "mountpoint -q %s/proc || mount -t proc /proc %s/proc",
+             rootfs_dir, rootfs_dir);
+    failed |= execute_command_safe(cmd, 0, &error_ctx);
+
+    snprintf(cmd, sizeof(cmd), "mountpoint -q %s/sys || mount -t sysfs /sys %s/sys",
+             rootfs_dir, rootfs_dir);
+    failed |= execute_command_safe(cmd, 0, &error_ctx);
+
+    snprintf(cmd, sizeof(cmd), "mountpoint -q %s/dev || mount -o bind /dev %s/dev",
+             rootfs_dir, rootfs_dir);
+    failed |= execute_command_safe(cmd, 0, &error_ctx);
+
+    snprintf(cmd, sizeof(cmd), "mountpoint -q %s/dev/pts || mount -o bind /dev/pts %s/dev/pts",
+             rootfs_dir, rootfs_dir);
+    failed |= execute_command_safe(cmd, 0, &error_ctx);
+
+    return failed ? ERROR_UNKNOWN : ERROR_SUCCESS;
+}
+
+// Unmount the chroot pseudo filesystems in reverse order
+void unmount_chroot_filesystems(const char *rootfs_dir) {
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+
+    LOG_INFO("Unmounting chroot filesystems...");
+
+    // Kill any processes still using the chroot
+    snprintf(cmd, sizeof(cmd), "fuser -km %s || true", rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    // Give processes time to exit
+    sleep(1);
+
+    snprintf(cmd, sizeof(cmd), "umount %s/dev/pts || true", rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    snprintf(cmd, sizeof(cmd), "umount %s/dev || true", rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    snprintf(cmd, sizeof(cmd), "umount %s/sys || true", rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    snprintf(cmd, sizeof(cmd), "umount %s/proc || true", rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+}
+
+// Execute a command that runs aarch64 code, accounting emulated time to the current stage
+int execute_emulated_command(const char *cmd, int show_output, error_context_t *error_ctx) {
+    double start = get_monotonic_time();
+    int result = execute_command_safe(cmd, show_output, error_ctx);
+
+    if (detect_chroot_exec_mode() != CHROOT_EXEC_NATIVE) {
+        build_stage_t *stage = get_current_build_stage();
+        if (stage) {
+            stage->emulated_commands++;
+            stage->emulated_seconds += get_monotonic_time() - start;
+        }
+    }
+
+    return result;
+}
+
+// Execute a command inside the rootfs chroot
+int execute_chroot_command(const char *rootfs_dir, const char *cmd, int show_output, error_context_t *error_ctx) {
+    char chroot_cmd[MAX_CMD_LEN];
+
+    snprintf(chroot_cmd, sizeof(chroot_cmd), "chroot %s %s", rootfs_dir, cmd);
+    return execute_emulated_command(chroot_cmd, show_output, error_ctx);
+}
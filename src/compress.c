@@ -0,0 +1,486 @@
+/*
+ * compress.c - Image compression for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file produces the compressed copy of the SD image in one read of the
+ * raw image. A reader thread fills a ring of blocks, taking holes of the
+ * sparse image from a shared zero block instead of reading them. Three
+ * consumers work through the ring concurrently: one streams it into a
+ * multithreaded zstd or xz through a FIFO, the others hash it with SHA-256
+ * and BLAKE3. The compressor's output comes back through the command sink,
+ * is hashed the same way and written next to the image, and a JSON manifest
+ * records sizes, hashes and the compression ratio.
+ */
+
+#include "builder.h"
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#define COMPRESS_BLOCK_SIZE (1 << 20)
+#define COMPRESS_SLOTS 8
+
+#define COMPRESS_FEED   0   // Writes the ring into the compressor
+#define COMPRESS_SHA256 1
+#define COMPRESS_BLAKE3 2
+#define COMPRESS_CONSUMERS 3
+
+typedef struct {
+    const unsigned char *data;  // The slot's buffer, or the shared zero block
+    size_t len;
+} compress_slot_t;
+
+typedef struct {
+    int image_fd;
+    off_t image_size;
+    const char *fifo_path;
+    unsigned char *buffers;
+    compress_slot_t slots[COMPRESS_SLOTS];
+    long long produced;                     // Slots filled so far
+    long long consumed[COMPRESS_CONSUMERS];  // Slots each consumer is done with
+    int eof;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // Raw image
+    long long data_bytes;
+    long long hole_bytes;
+    sha256_ctx_t raw_sha256;
+    blake3_ctx_t raw_blake3;
+
+    // Compressed stream
+    int out_fd;
+    long long packed_bytes;
+    sha256_ctx_t packed_sha256;
+    blake3_ctx_t packed_blake3;
+} compress_job_t;
+
+typedef struct {
+    compress_job_t *job;
+    int consumer;
+} compress_worker_t;
+
+static const unsigned char compress_zero_block[COMPRESS_BLOCK_SIZE];
+
+// Get a printable name for a compression format
+const char* compress_format_name(compress_format_t format) {
+    switch (format) {
+        case COMPRESS_NONE:
+            return "none";
+        case COMPRESS_ZSTD:
+            return "zstd";
+        case COMPRESS_XZ:
+            return "xz";
+        default:
+            return "unknown";
+    }
+}
+
+// File suffix of a compression format
+static const char* compress_suffix(compress_format_t format) {
+    return format == COMPRESS_XZ ? ".xz" : ".zst";
+}
+
+// Write a whole buffer; 0 on success
+static int compress_write_all(int fd, const void *data, size_t len) {
+    const char *bytes = data;
+
+    while (len > 0) {
+        ssize_t written = write(fd, bytes, len);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return -1;
+        bytes += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Stop every thread of the job
+static void compress_fail(compress_job_t *job) {
+    pthread_mutex_lock(&job->lock);
+    job->failed = 1;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Slowest consumer; the reader may not overtake it by more than the ring
+static long long compress_slowest(const compress_job_t *job) {
+    long long slowest = job->consumed[0];
+    for (int i = 1; i < COMPRESS_CONSUMERS; i++) {
+        if (job->consumed[i] < slowest) slowest = job->consumed[i];
+    }
+    return slowest;
+}
+
+// Hand one block to the consumers; 0 on success, -1 once the job failed
+static int compress_produce(compress_job_t *job, off_t offset, size_t len, int hole) {
+    pthread_mutex_lock(&job->lock);
+    while (!job->failed && job->produced - compress_slowest(job) >= COMPRESS_SLOTS) {
+        pthread_cond_wait(&job->cond, &job->lock);
+    }
+    int failed = job->failed;
+    int index = job->produced % COMPRESS_SLOTS;
+    pthread_mutex_unlock(&job->lock);
+    if (failed) return -1;
+
+    // No consumer looks at the slot until produced moves past it
+    compress_slot_t *slot = &job->slots[index];
+    if (hole) {
+        slot->data = compress_zero_block;
+        job->hole_bytes += len;
+    } else {
+        unsigned char *buffer = job->buffers + (size_t)index * COMPRESS_BLOCK_SIZE;
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = pread(job->image_fd, buffer + done, len - done, offset + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                LOG_ERROR("Failed to read the image");
+                compress_fail(job);
+                return -1;
+            }
+            done += n;
+        }
+        slot->data = buffer;
+        job->data_bytes += len;
+    }
+    slot->len = len;
+
+    pthread_mutex_lock(&job->lock);
+    job->produced++;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    return 0;
+}
+
+// Hand a range of the image to the consumers in ring-sized blocks
+static int compress_produce_range(compress_job_t *job, off_t start, off_t end, int hole) {
+    while (start < end) {
+        size_t len = end - start > COMPRESS_BLOCK_SIZE ? COMPRESS_BLOCK_SIZE : (size_t)(end - start);
+        if (compress_produce(job, start, len, hole) != 0) return -1;
+        start += len;
+    }
+    return 0;
+}
+
+// Reader thread: walk the data and hole extents of the image once
+static void* compress_reader(void *arg) {
+    compress_job_t *job = arg;
+    off_t offset = 0;
+
+    while (offset < job->image_size) {
+        off_t data = lseek(job->image_fd, offset, SEEK_DATA);
+        if (data < 0) {
+            // ENXIO: only a hole is left; anything else: no hole support
+            data = errno == ENXIO ? job->image_size : offset;
+        }
+        if (compress_produce_range(job, offset, data, 1) != 0) return NULL;
+        if (data >= job->image_size) break;
+
+        off_t hole = lseek(job->image_fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > job->image_size) hole = job->image_size;
+        if (compress_produce_range(job, data, hole, 0) != 0) return NULL;
+        offset = hole;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->eof = 1;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+// Open the FIFO once the compressor has opened its end
+static int compress_open_fifo(compress_job_t *job) {
+    for (;;) {
+        int fd = open(job->fifo_path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd >= 0) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            return fd;
+        }
+        if (errno != ENXIO) return -1;
+
+        // No reader yet; give up when the compressor never started
+        pthread_mutex_lock(&job->lock);
+        int failed = job->failed;
+        pthread_mutex_unlock(&job->lock);
+        if (failed) return -1;
+        usleep(10000);
+    }
+}
+
+// Consumer thread: feed or hash every block of the ring in order
+static void* compress_consumer(void *arg) {
+    compress_worker_t *worker = arg;
+    compress_job_t *job = worker->job;
+    long long position = 0;
+    int fifo_fd = -1;
+
+    if (worker->consumer == COMPRESS_FEED) {
+        // A compressor that dies shows up as EPIPE instead of killing the builder
+        sigset_t pipe_set;
+        sigemptyset(&pipe_set);
+        sigaddset(&pipe_set, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &pipe_set, NULL);
+
+        fifo_fd = compress_open_fifo(job);
+        if (fifo_fd < 0) {
+            compress_fail(job);
+            return NULL;
+        }
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        while (!job->failed && !job->eof && position == job->produced) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+        int done = job->failed || position == job->produced;
+        pthread_mutex_unlock(&job->lock);
+        if (done) break;
+
+        const compress_slot_t *slot = &job->slots[position % COMPRESS_SLOTS];
+        switch (worker->consumer) {
+            case COMPRESS_FEED:
+                if (compress_write_all(fifo_fd, slot->data, slot->len) != 0) {
+                    LOG_ERROR("The compressor stopped reading the image");
+                    close(fifo_fd);
+                    compress_fail(job);
+                    return NULL;
+                }
+                break;
+            case COMPRESS_SHA256:
+                sha256_update(&job->raw_sha256, slot->data, slot->len);
+                break;
+            case COMPRESS_BLAKE3:
+                blake3_update(&job->raw_blake3, slot->data, slot->len);
+                break;
+        }
+
+        pthread_mutex_lock(&job->lock);
+        job->consumed[worker->consumer] = ++position;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    // EOF for the compressor
+    if (fifo_fd >= 0) close(fifo_fd);
+    return NULL;
+}
+
+// Command sink: hash the compressed stream and write it out
+static int compress_sink(void *ctx, const char *data, size_t len) {
+    compress_job_t *job = ctx;
+
+    if (compress_write_all(job->out_fd, data, len) != 0) return -1;
+    sha256_update(&job->packed_sha256, data, len);
+    blake3_update(&job->packed_blake3, data, len);
+    job->packed_bytes += len;
+    return 0;
+}
+
+// Compressor command line reading the FIFO
+static void compress_command(const build_config_t *config, const char *fifo_path,
+                             char *cmd, size_t size, int *level, int *threads) {
+    *threads = config->compress_threads > 0 ? config->compress_threads : jobserver_current_jobs();
+    if (*threads < 1) *threads = 1;
+
+    if (config->compress_format == COMPRESS_XZ) {
+        *level = config->compress_level >= 0 ? config->compress_level : 6;
+        snprintf(cmd, size, "xz -q -c -T%d -%d < '%s'", *threads, *level, fifo_path);
+    } else {
+        *level = config->compress_level >= 0 ? config->compress_level : 10;
+        snprintf(cmd, size, "zstd -q -c -T%d %s-%d < '%s'",
+                 *threads, *level > 19 ? "--ultra " : "", *level, fifo_path);
+    }
+}
+
+// Write the manifest next to the image, atomically
+static int compress_write_manifest(const char *path, const char *image_path,
+                                   const char *packed_path, const build_config_t *config,
+                                   const compress_job_t *job, const char *hashes[4],
+                                   int level, int threads, double seconds) {
+    char tmp_path[MAX_PATH_LEN + 32];
+    const char *image_name = strrchr(image_path, '/') ? strrchr(image_path, '/') + 1 : image_path;
+    const char *packed_name = strrchr(packed_path, '/') ? strrchr(packed_path, '/') + 1 : packed_path;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) return -1;
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) return -1;
+
+    fprintf(fp, "{\n  \"image\": {\"file\": ");
+    write_json_string(fp, image_name);
+    fprintf(fp, ", \"size\": %lld, \"data\": %lld, \"holes\": %lld, "
+                "\"sha256\": \"%s\", \"blake3\": \"%s\"},\n",
+            (long long)job->image_size, job->data_bytes, job->hole_bytes, hashes[0], hashes[1]);
+    fprintf(fp, "  \"compressed\": {\"file\": ");
+    write_json_string(fp, packed_name);
+    fprintf(fp, ", \"size\": %lld, \"sha256\": \"%s\", \"blake3\": \"%s\"},\n",
+            job->packed_bytes, hashes[2], hashes[3]);
+    fprintf(fp, "  \"format\": \"%s\", \"level\": %d, \"threads\": %d,\n",
+            compress_format_name(config->compress_format), level, threads);
+    fprintf(fp, "  \"ratio\": %.3f, \"seconds\": %.3f\n}\n",
+            job->packed_bytes > 0 ? (double)job->image_size / job->packed_bytes : 0.0, seconds);
+
+    int ok = !ferror(fp);
+    if (fclose(fp) != 0 || !ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Compress the SD image, hashing the raw and compressed streams on the way
+int compress_system_image(build_config_t *config) {
+    char image_path[MAX_PATH_LEN];
+    char packed_path[MAX_PATH_LEN + 8];         // image_path and its suffix
+    char tmp_path[MAX_PATH_LEN + 16];
+    char fifo_path[MAX_PATH_LEN + 8];
+    char manifest_path[MAX_PATH_LEN + 16];
+    char cmd[MAX_CMD_LEN];
+    char msg[MAX_PATH_LEN + 256];
+    char hex[4][SHA256_HEX_LEN + 1];
+    const char *hashes[4] = { hex[0], hex[1], hex[2], hex[3] };
+    pthread_t reader;
+    pthread_t consumers[COMPRESS_CONSUMERS];
+    compress_worker_t workers[COMPRESS_CONSUMERS];
+    compress_job_t job;
+    error_context_t error_ctx = {0};
+    struct stat st;
+    int level;
+    int threads;
+    int started = 0;
+    int reader_started = 0;
+    int consumers_started = 0;
+    int result = ERROR_SUCCESS;
+
+    if (config->compress_format == COMPRESS_NONE) return ERROR_SUCCESS;
+
+    system_image_path(config, image_path, sizeof(image_path));
+    snprintf(packed_path, sizeof(packed_path), "%s%s", image_path, compress_suffix(config->compress_format));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", packed_path);
+    snprintf(fifo_path, sizeof(fifo_path), "%s.fifo", image_path);
+    snprintf(manifest_path, sizeof(manifest_path), "%s.manifest.json", image_path);
+
+    snprintf(cmd, sizeof(cmd), "command -v %s >/dev/null",
+             config->compress_format == COMPRESS_XZ ? "xz" : "zstd");
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        snprintf(msg, sizeof(msg), "%s is not installed",
+                 compress_format_name(config->compress_format));
+        LOG_ERROR(msg);
+        return ERROR_DEPENDENCY_MISSING;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.out_fd = -1;
+    job.image_fd = open(image_path, O_RDONLY | O_CLOEXEC);
+    if (job.image_fd < 0 || fstat(job.image_fd, &st) != 0) {
+        snprintf(msg, sizeof(msg), "Image not found: %s", image_path);
+        LOG_ERROR(msg);
+        if (job.image_fd >= 0) close(job.image_fd);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    job.image_size = st.st_size;
+    job.fifo_path = fifo_path;
+    job.buffers = malloc((size_t)COMPRESS_SLOTS * COMPRESS_BLOCK_SIZE);
+    job.out_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    unlink(fifo_path);
+    if (!job.buffers || job.out_fd < 0 || mkfifo(fifo_path, 0600) != 0) {
+        LOG_ERROR("Failed to set up image compression");
+        result = ERROR_UNKNOWN;
+        goto out;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    sha256_init(&job.raw_sha256);
+    blake3_init(&job.raw_blake3);
+    sha256_init(&job.packed_sha256);
+    blake3_init(&job.packed_blake3);
+
+    compress_command(config, fifo_path, cmd, sizeof(cmd), &level, &threads);
+    snprintf(msg, sizeof(msg), "Compressing %s with %s level %d on %d threads (%lld MiB, %lld MiB allocated)",
+             image_path, compress_format_name(config->compress_format), level, threads,
+             (long long)st.st_size >> 20, ((long long)st.st_blocks * 512) >> 20);
+    LOG_INFO(msg);
+
+    double start = get_monotonic_time();
+    started = 1;
+    reader_started = pthread_create(&reader, NULL, compress_reader, &job) == 0;
+    for (int i = 0; i < COMPRESS_CONSUMERS && reader_started; i++) {
+        workers[i].job = &job;
+        workers[i].consumer = i;
+        if (pthread_create(&consumers[i], NULL, compress_consumer, &workers[i]) != 0) break;
+        consumers_started++;
+    }
+
+    // Without every thread the ring never drains, so the compressor is not run
+    if (!reader_started || consumers_started < COMPRESS_CONSUMERS) {
+        LOG_ERROR("Failed to start the image compression threads");
+        result = ERROR_UNKNOWN;
+    } else if (execute_command_stream(cmd, compress_sink, &job, &error_ctx) != 0) {
+        LOG_ERROR("Image compression failed");
+        result = ERROR_UNKNOWN;
+    }
+
+    // After a failure the threads must not wait for a compressor that is gone
+    if (result != ERROR_SUCCESS) compress_fail(&job);
+    if (reader_started) pthread_join(reader, NULL);
+    for (int i = 0; i < consumers_started; i++) {
+        pthread_join(consumers[i], NULL);
+    }
+    double seconds = get_monotonic_time() - start;
+
+    if (result == ERROR_SUCCESS && (job.failed || !job.eof)) {
+        result = ERROR_UNKNOWN;
+    }
+    if (result == ERROR_SUCCESS && (fsync(job.out_fd) != 0 || close(job.out_fd) != 0)) {
+        LOG_ERROR("Failed to write the compressed image");
+        result = ERROR_INSUFFICIENT_SPACE;
+    }
+    job.out_fd = -1;
+    if (result != ERROR_SUCCESS) goto out;
+
+    sha256_final_hex(&job.raw_sha256, hex[0]);
+    blake3_final_hex(&job.raw_blake3, hex[1]);
+    sha256_final_hex(&job.packed_sha256, hex[2]);
+    blake3_final_hex(&job.packed_blake3, hex[3]);
+
+    if (rename(tmp_path, packed_path) != 0 ||
+        compress_write_manifest(manifest_path, image_path, packed_path, config, &job, hashes,
+                                level, threads, seconds) != 0) {
+        LOG_ERROR("Failed to write the compressed image manifest");
+        result = ERROR_UNKNOWN;
+        goto out;
+    }
+
+    // A copy in the other format would now be stale
+    snprintf(tmp_path, sizeof(tmp_path), "%s%s", image_path,
+             compress_suffix(config->compress_format == COMPRESS_XZ ? COMPRESS_ZSTD : COMPRESS_XZ));
+    unlink(tmp_path);
+
+    snprintf(msg, sizeof(msg),
+             "Compressed image: %s (%lld MiB -> %lld MiB, ratio %.2f, %lld MiB of holes skipped, %.1fs)",
+             packed_path, (long long)job.image_size >> 20, job.packed_bytes >> 20,
+             job.packed_bytes > 0 ? (double)job.image_size / job.packed_bytes : 0.0,
+             job.hole_bytes >> 20, seconds);
+    LOG_INFO(msg);
+    snprintf(msg, sizeof(msg), "Image manifest: %s", manifest_path);
+    LOG_INFO(msg);
+    metrics_record_image(image_path);
+
+out:
+    if (job.out_fd >= 0) close(job.out_fd);
+    if (result != ERROR_SUCCESS) {
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", packed_path);
+        unlink(tmp_path);
+    }
+    if (started) {
+        pthread_cond_destroy(&job.cond);
+        pthread_mutex_destroy(&job.lock);
+    }
+    unlink(fifo_path);
+    close(job.image_fd);
+    free(job.buffers);
+    return result;
+}
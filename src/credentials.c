@@ -0,0 +1,173 @@
+/*
+ * credentials.c - GitHub credentials for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file is the one place the GitHub token is read. It is loaded once,
+ * from the environment or .env, into a private directory that lives as long
+ * as the builder. git gets it from a credential helper passed to every child
+ * through GIT_CONFIG_* variables, so the operator's global git config is left
+ * alone; curl gets it as a header file. The token itself never appears in a
+ * URL or a command line, so it cannot end up in the log.
+ */
+
+#include "builder.h"
+#include <pthread.h>
+#include <sys/stat.h>
+
+static pthread_once_t credentials_once = PTHREAD_ONCE_INIT;
+static char credentials_token[GITHUB_TOKEN_MAX_LEN + 1];
+static char credentials_dir[64];
+static char credentials_header[128];    // "Authorization: Bearer ..." for curl -H @file
+static char credentials_curl[160];
+
+// Token from a .env file, without quotes and trailing whitespace
+static int credentials_read_env_file(char *token, size_t size) {
+    char line[GITHUB_TOKEN_MAX_LEN + 100];
+
+    FILE *env_file = fopen(ENV_FILE, "r");
+    if (!env_file) return 0;
+
+    while (fgets(line, sizeof(line), env_file) != NULL) {
+        // Skip comments and empty lines
+        char *start = line;
+        while (*start == ' ' || *start == '\t') start++;
+        if (start[0] == '#' || start[0] == '\n' || start[0] == '\r') continue;
+
+        if (strncmp(start, GITHUB_TOKEN_ENV, strlen(GITHUB_TOKEN_ENV)) != 0) continue;
+        char *value = start + strlen(GITHUB_TOKEN_ENV);
+        while (*value == ' ' || *value == '\t') value++;
+        if (*value != '=') continue;
+        value++;
+        while (*value == ' ' || *value == '\t') value++;
+
+        size_t len = strcspn(value, "\r\n");
+        while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) len--;
+        if (len >= 2 && (value[0] == '"' || value[0] == '\'') && value[len - 1] == value[0]) {
+            value++;
+            len -= 2;
+        }
+        if (len == 0 || len >= size) continue;
+
+        memcpy(token, value, len);
+        token[len] = '\0';
+        fclose(env_file);
+        return 1;
+    }
+    fclose(env_file);
+    return 0;
+}
+
+// Write a private file; 0 on success
+static int credentials_write_file(const char *path, const char *text) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    size_t len = strlen(text);
+    int ok = write(fd, text, len) == (ssize_t)len;
+    return close(fd) == 0 && ok ? 0 : -1;
+}
+
+// Remove the private directory at exit
+static void credentials_cleanup(void) {
+    char path[128];
+
+    if (!credentials_dir[0]) return;
+    snprintf(path, sizeof(path), "%s/token", credentials_dir);
+    unlink(path);
+    unlink(credentials_header);
+    rmdir(credentials_dir);
+    credentials_dir[0] = '\0';
+}
+
+// Pass git settings to every child through GIT_CONFIG_COUNT/KEY/VALUE,
+// after whatever the operator already passes that way
+static void credentials_export_git(void) {
+    char helper[256];
+    char name[32];
+    const char *count_env = getenv("GIT_CONFIG_COUNT");
+    int count = count_env ? atoi(count_env) : 0;
+
+    // The helper reads the token file when git asks for a password
+    snprintf(helper, sizeof(helper),
+             "!f() { test \"$1\" = get && echo username=x-access-token && "
+             "printf 'password=%%s\\n' \"$(cat '%s/token')\"; }; f", credentials_dir);
+
+    const char *settings[][2] = {
+        // An empty helper first, so that no configured helper answers for GitHub
+        {"credential.https://github.com.helper", ""},
+        {"credential.https://github.com.helper", helper},
+        {"url.https://github.com/.insteadOf", "git@github.com:"},
+    };
+
+    for (size_t i = 0; i < sizeof(settings) / sizeof(settings[0]); i++, count++) {
+        snprintf(name, sizeof(name), "GIT_CONFIG_KEY_%d", count);
+        setenv(name, settings[i][0], 1);
+        snprintf(name, sizeof(name), "GIT_CONFIG_VALUE_%d", count);
+        setenv(name, settings[i][1], 1);
+    }
+    snprintf(name, sizeof(name), "%d", count);
+    setenv("GIT_CONFIG_COUNT", name, 1);
+}
+
+// Load the token once and hand it to git
+static void credentials_load(void) {
+    char path[128];
+    char header[GITHUB_TOKEN_MAX_LEN + 32];
+
+    const char *env_token = getenv(GITHUB_TOKEN_ENV);
+    if (env_token && env_token[0] && strlen(env_token) <= GITHUB_TOKEN_MAX_LEN) {
+        strcpy(credentials_token, env_token);
+    } else if (!credentials_read_env_file(credentials_token, sizeof(credentials_token))) {
+        return;
+    }
+
+    strcpy(credentials_dir, "/tmp/opi5plus-credentials-XXXXXX");
+    if (!mkdtemp(credentials_dir)) {
+        credentials_dir[0] = '\0';
+        LOG_WARNING("Could not create a private directory for the GitHub token");
+        return;
+    }
+    atexit(credentials_cleanup);
+
+    snprintf(path, sizeof(path), "%s/token", credentials_dir);
+    snprintf(credentials_header, sizeof(credentials_header), "%s/github.header", credentials_dir);
+    snprintf(header, sizeof(header), "Authorization: Bearer %s\n", credentials_token);
+    if (credentials_write_file(path, credentials_token) != 0 ||
+        credentials_write_file(credentials_header, header) != 0) {
+        LOG_WARNING("Could not write the GitHub token file");
+        credentials_cleanup();
+        return;
+    }
+
+    snprintf(credentials_curl, sizeof(credentials_curl), "-H @%s ", credentials_header);
+    credentials_export_git();
+}
+
+// Load the credentials; 1 when a GitHub token is in use
+int credentials_init(void) {
+    pthread_once(&credentials_once, credentials_load);
+    return credentials_dir[0] != '\0';
+}
+
+// The GitHub token, NULL when there is none
+char* get_github_token(void) {
+    pthread_once(&credentials_once, credentials_load);
+    return credentials_token[0] ? credentials_token : NULL;
+}
+
+// Is a URL served by GitHub; only those get the token
+static int credentials_is_github(const char *url) {
+    char host[256];
+
+    if (metrics_url_host(url, host, sizeof(host)) != 0) return 0;
+    size_t len = strlen(host);
+    return strcmp(host, "github.com") == 0 ||
+           (len > 11 && strcmp(host + len - 11, ".github.com") == 0) ||
+           (len > 22 && strcmp(host + len - 22, ".githubusercontent.com") == 0);
+}
+
+// curl options carrying the token for a URL, "" for none; curl drops the
+// header when a redirect leaves the host
+const char* credentials_curl_options(const char *url) {
+    if (!credentials_init() || !credentials_is_github(url)) return "";
+    return credentials_curl;
+}
@@ -0,0 +1,1021 @@
+/*
+ * download.c - Verified downloads for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file fetches files into a persistent content-addressed store under
+ * config->cache_dir. Each transfer is hashed and size checked while it is
+ * written, error pages are recognised by their content, and only verified
+ * files are renamed into store/sha256/<digest> and hard linked to where the
+ * build wants them. Every file needs a known digest, except those that may
+ * change upstream, which are revalidated instead; nothing is trusted on
+ * first use.
+ *
+ * Transfers go to store/tmp/<url key>.part and resume from where they
+ * stopped with an HTTP range request, guarded by If-Range so a file that
+ * changed upstream starts over. Downloads of files that may change
+ * (revalidate) send the ETag and Last-Modified of the copy in the store and
+ * reuse it on 304 Not Modified. Large files can be split into segments that
+ * are fetched in parallel and joined, and hashed, once all have arrived;
+ * segments left by an earlier run are only reused while the validators of
+ * the file are unchanged.
+ */
+
+#include "builder.h"
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#define DOWNLOAD_ATTEMPTS 4
+#define DOWNLOAD_MAX_PARALLEL 4
+#define DOWNLOAD_MAX_SEGMENTS 8
+#define DOWNLOAD_SNIFF_LEN 512
+#define DOWNLOAD_SEGMENT_MIN (32LL << 20)    // Smaller files are fetched in one piece
+#define DOWNLOAD_OUTPUT_MAX 1024            // Diagnostics of one request kept for the retry policy
+
+static pthread_mutex_t download_lock = PTHREAD_MUTEX_INITIALIZER;
+static char download_store[MAX_PATH_LEN];
+
+// What the store knows about a URL: its pin, or the copy to revalidate
+typedef struct {
+    char digest[SHA256_HEX_LEN + 1];    // Empty when unknown
+    long long size;
+    char etag[128];
+    char last_modified[64];
+} download_meta_t;
+
+// Response headers, which curl -D - writes ahead of the body
+typedef struct {
+    int status;
+    long long content_length;           // -1 when not sent
+    long long range_start;              // First byte of a 206 response, -1 otherwise
+    long long range_total;              // Full size from Content-Range, -1 when unknown
+    int accept_ranges;
+    int redirect;                       // Has a Location header
+    char etag[128];
+    char last_modified[64];
+    char retry_after[64];
+} http_response_t;
+
+// State of one transfer, fed by the command sink
+typedef struct {
+    int fd;                             // -1 when only headers are wanted
+    sha256_ctx_t sha;
+    int hashing;                        // Segments are hashed when they are joined
+    long long bytes;                    // Bytes in the file, a resumed prefix included
+    long long offset;                   // First byte requested, 0 without a range
+    long long limit;                    // Refuse more than this, 0 for no limit
+    int segment;                        // A full response instead of the range is an error
+    const char *part_meta;              // Validators are saved here as soon as they arrive
+    unsigned char head[DOWNLOAD_SNIFF_LEN];
+    int head_len;
+    int write_failed;
+    int too_large;
+    int bad_range;
+
+    int in_headers;
+    char line[1024];
+    int line_len;
+    http_response_t response;
+
+    // Retry-After and curl's stderr of this transfer's last request
+    char output[DOWNLOAD_OUTPUT_MAX];
+} download_transfer_t;
+
+// Create a directory and its parents
+static int make_path(const char *path) {
+    char partial[MAX_PATH_LEN];
+
+    strncpy(partial, path, sizeof(partial) - 1);
+    partial[sizeof(partial) - 1] = '\0';
+    for (char *p = partial + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(partial, 0755) != 0 && errno != EEXIST) return -1;
+        *p = '/';
+    }
+    return mkdir(partial, 0755) != 0 && errno != EEXIST ? -1 : 0;
+}
+
+// Set up the store once; NULL when it cannot be created
+static const char* download_store_dir(void) {
+    const char *cache_dir = global_config && global_config->cache_dir[0] ? global_config->cache_dir
+                                                                         : CACHE_DIR;
+    char path[MAX_PATH_LEN + 16];
+
+    pthread_mutex_lock(&download_lock);
+    if (download_store[0] == '\0') {
+        snprintf(path, sizeof(path), "%s/store", cache_dir);
+        const char *subdirs[] = { "sha256", "urls", "tmp", NULL };
+        int ok = 1;
+        for (int i = 0; subdirs[i] != NULL && ok; i++) {
+            char dir[MAX_PATH_LEN + 32];
+            snprintf(dir, sizeof(dir), "%s/%s", path, subdirs[i]);
+            ok = make_path(dir) == 0;
+        }
+        if (ok && snprintf(download_store, sizeof(download_store), "%s", path) >= (int)sizeof(download_store)) {
+            download_store[0] = '\0';
+            ok = 0;
+        }
+        if (!ok) {
+            char msg[MAX_PATH_LEN + 64];
+            snprintf(msg, sizeof(msg), "Could not create the download store in %s", path);
+            LOG_ERROR(msg);
+        }
+    }
+    pthread_mutex_unlock(&download_lock);
+
+    return download_store[0] ? download_store : NULL;
+}
+
+// Path of a store object
+const char* download_store_path(const char *digest, char *path, size_t size) {
+    const char *store = download_store_dir();
+    if (!store) return NULL;
+    snprintf(path, size, "%s/sha256/%s", store, digest);
+    return path;
+}
+
+// Add a mirror to a download
+void download_add_url(download_t *item, const char *url) {
+    if (!url || !url[0] || item->url_count >= DOWNLOAD_MAX_URLS) return;
+    for (int i = 0; i < item->url_count; i++) {
+        if (strcmp(item->urls[i], url) == 0) return;
+    }
+    strncpy(item->urls[item->url_count], url, sizeof(item->urls[0]) - 1);
+    item->urls[item->url_count][sizeof(item->urls[0]) - 1] = '\0';
+    item->url_count++;
+}
+
+// URL without credentials, which must not end up in the store
+static void url_public(const char *url, char *out, size_t size) {
+    const char *scheme = strstr(url, "://");
+    const char *at = scheme ? strchr(scheme + 3, '@') : NULL;
+    const char *slash = scheme ? strchr(scheme + 3, '/') : NULL;
+
+    if (at && (!slash || at < slash)) {
+        snprintf(out, size, "%.*s%s", (int)(scheme + 3 - url), url, at + 1);
+    } else {
+        snprintf(out, size, "%s", url);
+    }
+}
+
+// Store key of a URL: the hash of its public form
+static void url_key(const char *url, char key[SHA256_HEX_LEN + 1]) {
+    char public_url[1024];
+
+    url_public(url, public_url, sizeof(public_url));
+    sha256_string_hex(public_url, key);
+}
+
+// Path of the metadata kept for a URL
+static void meta_path(const char *url, char *path, size_t size) {
+    char key[SHA256_HEX_LEN + 1];
+
+    url_key(url, key);
+    snprintf(path, size, "%s/urls/%s", download_store, key);
+}
+
+// Read URL metadata: "<digest|-> <size> <url>", then optional validator lines
+static int read_meta(const char *path, download_meta_t *meta) {
+    char line[1024];
+    int found = 0;
+
+    memset(meta, 0, sizeof(*meta));
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+    if (fgets(line, sizeof(line), fp) && sscanf(line, "%64s %lld", meta->digest, &meta->size) == 2) {
+        if (strlen(meta->digest) != SHA256_HEX_LEN) meta->digest[0] = '\0';
+        found = 1;
+    }
+    while (found && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        // A cut validator would never match, so one that does not fit is dropped
+        if (strncmp(line, "etag ", 5) == 0) {
+            if (snprintf(meta->etag, sizeof(meta->etag), "%s", line + 5) >= (int)sizeof(meta->etag)) {
+                meta->etag[0] = '\0';
+            }
+        } else if (strncmp(line, "last-modified ", 14) == 0) {
+            if (snprintf(meta->last_modified, sizeof(meta->last_modified), "%s",
+                         line + 14) >= (int)sizeof(meta->last_modified)) {
+                meta->last_modified[0] = '\0';
+            }
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+// Write URL metadata atomically
+static void write_meta(const char *path, const download_meta_t *meta, const char *url) {
+    char public_url[1024];
+    char tmp[MAX_PATH_LEN + 192];
+
+    url_public(url, public_url, sizeof(public_url));
+    snprintf(tmp, sizeof(tmp), "%s.%d.%lx.tmp", path, (int)getpid(), (unsigned long)pthread_self());
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) return;
+    fprintf(fp, "%s %lld %s\n", meta->digest[0] ? meta->digest : "-", meta->size, public_url);
+    if (meta->etag[0]) fprintf(fp, "etag %s\n", meta->etag);
+    if (meta->last_modified[0]) fprintf(fp, "last-modified %s\n", meta->last_modified);
+    if (fclose(fp) == 0) {
+        rename(tmp, path);
+    } else {
+        unlink(tmp);
+    }
+}
+
+// Hard link a store object into place, copying across file systems
+int download_link(const char *object, const char *dest) {
+    char tmp[MAX_PATH_LEN + 32];
+    char buffer[65536];
+    struct stat object_st, dest_st;
+    ssize_t len;
+
+    // Already in place from an earlier build
+    if (stat(object, &object_st) == 0 && stat(dest, &dest_st) == 0 &&
+        object_st.st_dev == dest_st.st_dev && object_st.st_ino == dest_st.st_ino) {
+        return ERROR_SUCCESS;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", dest, (int)getpid());
+    unlink(tmp);
+    if (link(object, tmp) != 0) {
+        if (errno != EXDEV && errno != EPERM && errno != EMLINK) return ERROR_INSTALLATION_FAILED;
+
+        int in = open(object, O_RDONLY | O_CLOEXEC);
+        int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        int failed = in < 0 || out < 0;
+        while (!failed && (len = read(in, buffer, sizeof(buffer))) > 0) {
+            failed = write(out, buffer, len) != len;
+        }
+        if (in >= 0) close(in);
+        if (out >= 0 && close(out) != 0) failed = 1;
+        if (failed) {
+            unlink(tmp);
+            return ERROR_INSTALLATION_FAILED;
+        }
+    }
+
+    // Replace atomically so a half-written file is never in place
+    if (rename(tmp, dest) != 0) {
+        unlink(tmp);
+        return ERROR_INSTALLATION_FAILED;
+    }
+    return ERROR_SUCCESS;
+}
+
+// Remember the first bytes of a file for sniff_content()
+static void keep_head(download_transfer_t *transfer, const char *data, size_t len) {
+    if (transfer->head_len < DOWNLOAD_SNIFF_LEN) {
+        int take = DOWNLOAD_SNIFF_LEN - transfer->head_len;
+        if ((size_t)take > len) take = len;
+        memcpy(transfer->head + transfer->head_len, data, take);
+        transfer->head_len += take;
+    }
+}
+
+// Header value of a line when its name matches, NULL otherwise
+static const char* header_value(const char *line, const char *name) {
+    size_t n = strlen(name);
+
+    if (strncasecmp(line, name, n) != 0 || line[n] != ':') return NULL;
+    line += n + 1;
+    while (*line == ' ' || *line == '\t') line++;
+    return line;
+}
+
+// The final response has started: decide what to do with its body
+static int start_body(download_transfer_t *transfer) {
+    http_response_t *response = &transfer->response;
+
+    if (response->status == 206) {
+        if (response->range_start != transfer->offset) {
+            transfer->bad_range = 1;
+            return -1;
+        }
+    } else if (transfer->offset > 0 && response->status == 200) {
+        // The file changed upstream, or the server ignores ranges: start over
+        if (transfer->segment || ftruncate(transfer->fd, 0) != 0 ||
+            lseek(transfer->fd, 0, SEEK_SET) != 0) {
+            transfer->bad_range = 1;
+            return -1;
+        }
+        sha256_init(&transfer->sha);
+        transfer->bytes = 0;
+        transfer->offset = 0;
+        transfer->head_len = 0;
+    }
+
+    if (transfer->limit > 0 && response->content_length >= 0 &&
+        transfer->bytes + response->content_length > transfer->limit) {
+        transfer->too_large = 1;
+        return -1;
+    }
+
+    // Validators go to disk now so that an interrupted transfer can resume
+    if (transfer->part_meta && (response->status == 200 || response->status == 206)) {
+        download_meta_t meta;
+        memset(&meta, 0, sizeof(meta));
+        meta.size = response->range_total >= 0 ? response->range_total : response->content_length;
+        strcpy(meta.etag, response->etag);
+        strcpy(meta.last_modified, response->last_modified);
+        write_meta(transfer->part_meta, &meta, "");
+    }
+    return 0;
+}
+
+// One header line; an empty line ends a response's headers
+static int parse_header_line(download_transfer_t *transfer) {
+    http_response_t *response = &transfer->response;
+    char *line = transfer->line;
+    const char *value;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0') {
+        // Redirects and 1xx responses are followed by more headers
+        if (response->status / 100 == 1 || (response->status / 100 == 3 && response->redirect)) {
+            return 0;
+        }
+        transfer->in_headers = 0;
+        return start_body(transfer);
+    }
+
+    if (strncmp(line, "HTTP/", 5) == 0) {
+        memset(response, 0, sizeof(*response));
+        response->content_length = -1;
+        response->range_start = -1;
+        response->range_total = -1;
+        sscanf(line, "HTTP/%*s %d", &response->status);
+    } else if ((value = header_value(line, "etag")) != NULL) {
+        // A weak ETag cannot guard a range request
+        if (strncmp(value, "W/", 2) != 0 && !strchr(value, '\'')) {
+            strncpy(response->etag, value, sizeof(response->etag) - 1);
+        }
+    } else if ((value = header_value(line, "last-modified")) != NULL) {
+        if (!strchr(value, '\'')) {
+            strncpy(response->last_modified, value, sizeof(response->last_modified) - 1);
+        }
+    } else if ((value = header_value(line, "content-length")) != NULL) {
+        response->content_length = atoll(value);
+    } else if ((value = header_value(line, "content-range")) != NULL) {
+        long long start, end, total;
+        if (sscanf(value, "bytes %lld-%lld/%lld", &start, &end, &total) == 3) {
+            response->range_start = start;
+            response->range_total = total;
+        } else if (sscanf(value, "bytes %lld-%lld/*", &start, &end) == 2) {
+            response->range_start = start;
+        }
+    } else if ((value = header_value(line, "retry-after")) != NULL) {
+        snprintf(response->retry_after, sizeof(response->retry_after), "%s", value);
+    } else if ((value = header_value(line, "accept-ranges")) != NULL) {
+        response->accept_ranges = strncasecmp(value, "bytes", 5) == 0;
+    } else if (header_value(line, "location") != NULL) {
+        response->redirect = 1;
+    }
+    return 0;
+}
+
+// Command sink: parse the headers, then write, hash and count the body
+static int download_sink(void *ctx, const char *data, size_t len) {
+    download_transfer_t *transfer = ctx;
+
+    while (transfer->in_headers && len > 0) {
+        char c = *data++;
+        len--;
+        if (transfer->line_len < (int)sizeof(transfer->line) - 1) {
+            transfer->line[transfer->line_len++] = c;
+        }
+        if (c == '\n') {
+            transfer->line[transfer->line_len] = '\0';
+            transfer->line_len = 0;
+            if (parse_header_line(transfer) != 0) return -1;
+        }
+    }
+    if (len == 0) return 0;
+    if (transfer->fd < 0) return -1;
+
+    if (transfer->limit > 0 && transfer->bytes + (long long)len > transfer->limit) {
+        transfer->too_large = 1;
+        return -1;
+    }
+    if (transfer->bytes < DOWNLOAD_SNIFF_LEN) {
+        keep_head(transfer, data, len);
+    }
+
+    while (len > 0) {
+        ssize_t written = write(transfer->fd, data, len);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) {
+            transfer->write_failed = 1;
+            return -1;
+        }
+        if (transfer->hashing) sha256_update(&transfer->sha, data, written);
+        transfer->bytes += written;
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Why the start of a download is not what was asked for, NULL when it looks right
+static const char* sniff_content(const unsigned char *head, int len, int content) {
+    static const char *markup[] = { "<!doctype", "<html", "<?xml", "<head", "<body", NULL };
+    int start = 0;
+
+    if (len == 0) return "empty response";
+
+    // Error pages of mirrors and captive portals come back with status 200
+    while (start < len && isspace(head[start])) start++;
+    for (int i = 0; markup[i] != NULL; i++) {
+        size_t n = strlen(markup[i]);
+        if ((size_t)(len - start) >= n && strncasecmp((const char *)head + start, markup[i], n) == 0) {
+            return "HTML/XML page";
+        }
+    }
+
+    if (content == DOWNLOAD_ELF && (len < 4 || memcmp(head, "\177ELF", 4) != 0)) {
+        return "not an ELF object";
+    }
+    if (content == DOWNLOAD_BINARY) {
+        int text = 1;
+        for (int i = 0; i < len && text; i++) {
+            text = isprint(head[i]) || isspace(head[i]);
+        }
+        if (text) return "text instead of binary data";
+    }
+    return NULL;
+}
+
+// Serve a download from the store when its digest is known and present
+static int fetch_from_store(download_t *item, const char *digest, long long size) {
+    char object[MAX_PATH_LEN + 128];
+    char actual[SHA256_HEX_LEN + 1];
+    long long actual_size;
+
+    download_store_path(digest, object, sizeof(object));
+    if (access(object, F_OK) != 0) return 0;
+
+    // The store outlives builds; do not trust it blindly
+    if (sha256_file_hex(object, actual, &actual_size) != ERROR_SUCCESS) return 0;
+    if (size > 0 && actual_size != size) return 0;
+    if (strcmp(actual, digest) != 0) {
+        char msg[sizeof(object) + 64];
+        snprintf(msg, sizeof(msg), "Removing corrupt store object: %s", object);
+        LOG_WARNING(msg);
+        unlink(object);
+        return 0;
+    }
+
+    strcpy(item->digest, digest);
+    item->bytes = actual_size;
+    item->cached = 1;
+    return 1;
+}
+
+// Read an existing part file into the digest so the transfer can append to it
+static int seed_transfer(download_transfer_t *transfer) {
+    char buffer[65536];
+    ssize_t len;
+
+    if (lseek(transfer->fd, 0, SEEK_SET) != 0) return -1;
+    while ((len = read(transfer->fd, buffer, sizeof(buffer))) > 0) {
+        if (transfer->hashing) sha256_update(&transfer->sha, buffer, len);
+        if (transfer->bytes < DOWNLOAD_SNIFF_LEN) keep_head(transfer, buffer, len);
+        transfer->bytes += len;
+    }
+    return len < 0 ? -1 : 0;
+}
+
+// Run one curl request through the transfer sink; 0 when it completed
+static int run_transfer(download_transfer_t *transfer, const char *url, const char *options,
+                        int head_only, failure_class_t *failure) {
+    char cmd[MAX_CMD_LEN];
+
+    // Redirects are followed; -f turns HTTP errors into a failed command
+    snprintf(cmd, sizeof(cmd), "curl -fsSL %s --connect-timeout 30 %s%s\"%s\"",
+             head_only ? "-I" : "-D -", credentials_curl_options(url), options, url);
+    transfer->in_headers = 1;
+    transfer->line_len = 0;
+    transfer->response.retry_after[0] = '\0';
+    int result = execute_command_stream(cmd, download_sink, transfer, NULL);
+
+    // The headers come through the sink and stderr through the watchdog; keep
+    // both with the transfer, later commands in this thread replace the tail
+    const char *tail = watchdog_output_tail();
+    size_t tail_len = strlen(tail);
+    if (tail_len > DOWNLOAD_OUTPUT_MAX / 2) tail += tail_len - DOWNLOAD_OUTPUT_MAX / 2;
+    snprintf(transfer->output, sizeof(transfer->output), "%s%.63s%s%s",
+             transfer->response.retry_after[0] ? "Retry-After: " : "", transfer->response.retry_after,
+             transfer->response.retry_after[0] ? "\n" : "", tail);
+
+    if (transfer->write_failed) {
+        *failure = FAILURE_NO_SPACE;
+    } else if (transfer->too_large || transfer->bad_range) {
+        *failure = FAILURE_HTTP_4XX;
+    } else if (result != 0) {
+        *failure = retry_classify(cmd, get_last_command_usage(), transfer->output);
+    }
+    return result != 0 || transfer->write_failed || transfer->too_large || transfer->bad_range ? -1 : 0;
+}
+
+// Append conditional request headers for what the store knows about a URL
+static void conditional_options(char *options, size_t size, const char *etag, const char *last_modified,
+                                int if_range) {
+    size_t used = strlen(options);
+
+    if (if_range) {
+        // If-Range takes one validator; the ETag is the stronger one
+        if (etag[0] || last_modified[0]) {
+            snprintf(options + used, size - used, "-H 'If-Range: %s' ", etag[0] ? etag : last_modified);
+        }
+        return;
+    }
+    if (etag[0]) {
+        snprintf(options + used, size - used, "-H 'If-None-Match: %s' ", etag);
+        used = strlen(options);
+    }
+    if (last_modified[0]) {
+        snprintf(options + used, size - used, "-H 'If-Modified-Since: %s' ", last_modified);
+    }
+}
+
+// Work of one segment of a parallel download
+typedef struct {
+    const char *url;
+    char path[MAX_PATH_LEN + 160];
+    long long start;
+    long long end;                      // Inclusive
+    char validator[128];
+    int ok;
+    char output[DOWNLOAD_OUTPUT_MAX];   // Of the last failed request
+} download_segment_t;
+
+// Remove the segment files of a part file, for every segment count
+static void remove_segments(const char *part) {
+    char path[MAX_PATH_LEN + 160];
+
+    for (int count = 2; count <= DOWNLOAD_MAX_SEGMENTS; count++) {
+        for (int i = 0; i < count; i++) {
+            snprintf(path, sizeof(path), "%s.%d-%d", part, count, i);
+            unlink(path);
+        }
+    }
+    snprintf(path, sizeof(path), "%s.segments", part);
+    unlink(path);
+}
+
+static void* segment_worker(void *arg) {
+    download_segment_t *segment = arg;
+    long long length = segment->end - segment->start + 1;
+
+    for (int attempt = 1; !interrupted; attempt++) {
+        download_transfer_t transfer;
+        failure_class_t failure = FAILURE_NONE;
+        char options[256] = "";
+
+        memset(&transfer, 0, sizeof(transfer));
+        transfer.fd = open(segment->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (transfer.fd < 0) return NULL;
+        transfer.segment = 1;
+        transfer.bytes = lseek(transfer.fd, 0, SEEK_END);
+        if (transfer.bytes > length && ftruncate(transfer.fd, 0) == 0) transfer.bytes = 0;
+        if (transfer.bytes == length) {
+            close(transfer.fd);
+            segment->ok = 1;
+            return NULL;
+        }
+        transfer.offset = segment->start + transfer.bytes;
+        transfer.limit = length;
+
+        snprintf(options, sizeof(options), "-r %lld-%lld ", transfer.offset, segment->end);
+        conditional_options(options, sizeof(options), segment->validator, "", 1);
+        int result = run_transfer(&transfer, segment->url, options, 0, &failure);
+        close(transfer.fd);
+
+        if (result == 0 && transfer.bytes == length) {
+            segment->ok = 1;
+            return NULL;
+        }
+        snprintf(segment->output, sizeof(segment->output), "%s", transfer.output);
+        if (result == 0) failure = FAILURE_CONNECTION;
+        if (transfer.bad_range) {
+            // If-Range failed: the file changed upstream, this segment is stale
+            unlink(segment->path);
+            return NULL;
+        }
+        if (!retry_should_retry(failure, attempt, DOWNLOAD_ATTEMPTS)) {
+            return NULL;
+        }
+        retry_sleep(retry_delay(failure, attempt, transfer.output));
+    }
+    return NULL;
+}
+
+// Fetch a large file as parallel range requests and join them into the part file
+static int fetch_segments(download_transfer_t *transfer, const char *url, const char *part,
+                          const http_response_t *head, int count) {
+    download_segment_t segments[DOWNLOAD_MAX_SEGMENTS];
+    pthread_t threads[DOWNLOAD_MAX_SEGMENTS];
+    int started[DOWNLOAD_MAX_SEGMENTS];
+    long long total = head->content_length;
+    long long chunk = (total + count - 1) / count;
+    char buffer[65536];
+    char segments_meta[MAX_PATH_LEN + 160];
+    download_meta_t previous;
+    int ok = 1;
+
+    // Segments of an earlier run are kept only for the same file: same size
+    // and validators. Without a validator they cannot be checked at all.
+    snprintf(segments_meta, sizeof(segments_meta), "%s.segments", part);
+    if (!(head->etag[0] || head->last_modified[0]) || !read_meta(segments_meta, &previous) ||
+        previous.size != total || strcmp(previous.etag, head->etag) != 0 ||
+        strcmp(previous.last_modified, head->last_modified) != 0) {
+        remove_segments(part);
+        memset(&previous, 0, sizeof(previous));
+        previous.size = total;
+        strcpy(previous.etag, head->etag);
+        strcpy(previous.last_modified, head->last_modified);
+        write_meta(segments_meta, &previous, "");
+    }
+
+    for (int i = 0; i < count; i++) {
+        download_segment_t *segment = &segments[i];
+        memset(segment, 0, sizeof(*segment));
+        segment->url = url;
+        snprintf(segment->path, sizeof(segment->path), "%s.%d-%d", part, count, i);
+        segment->start = i * chunk;
+        segment->end = (i + 1) * chunk < total ? (i + 1) * chunk - 1 : total - 1;
+        strcpy(segment->validator, head->etag[0] ? head->etag : head->last_modified);
+        started[i] = pthread_create(&threads[i], NULL, segment_worker, segment) == 0;
+        if (!started[i]) segment_worker(segment);
+    }
+    for (int i = 0; i < count; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        if (ok && !segments[i].ok) {
+            snprintf(transfer->output, sizeof(transfer->output), "%s", segments[i].output);
+        }
+        ok = ok && segments[i].ok;
+    }
+    if (!ok) return -1;
+
+    // Join in order; this is where a segmented download is hashed
+    for (int i = 0; i < count && ok; i++) {
+        int fd = open(segments[i].path, O_RDONLY | O_CLOEXEC);
+        ssize_t len;
+        if (fd < 0) {
+            ok = 0;
+            break;
+        }
+        while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+            if (write(transfer->fd, buffer, len) != len) {
+                transfer->write_failed = 1;
+                ok = 0;
+                break;
+            }
+            sha256_update(&transfer->sha, buffer, len);
+            if (transfer->bytes < DOWNLOAD_SNIFF_LEN) keep_head(transfer, buffer, len);
+            transfer->bytes += len;
+        }
+        close(fd);
+    }
+    remove_segments(part);
+    transfer->response = *head;
+    return ok ? 0 : -1;
+}
+
+// Number of segments a file of this size is split into, 1 for a single stream
+static int segment_count(long long size) {
+    int segments = global_config ? global_config->download_segments : 1;
+
+    if (segments > DOWNLOAD_MAX_SEGMENTS) segments = DOWNLOAD_MAX_SEGMENTS;
+    if (segments <= 1 || size < DOWNLOAD_SEGMENT_MIN) return 1;
+    if (size / segments < DOWNLOAD_SEGMENT_MIN / 4) segments = size / (DOWNLOAD_SEGMENT_MIN / 4);
+    return segments > 1 ? segments : 1;
+}
+
+// Fetch one URL into its part file and verify it; 1 when verified, and the
+// object is in the store. A failed transfer leaves the part file to resume,
+// and the diagnostics of its last request in output for the retry policy.
+static int fetch_url(download_t *item, const char *url, const char *expected, long long size,
+                     download_meta_t *known, failure_class_t *failure, char *output, size_t output_size) {
+    char key[SHA256_HEX_LEN + 1];
+    char part[MAX_PATH_LEN + 128];
+    char part_meta_path[MAX_PATH_LEN + 160];
+    char options[512] = "";
+    char msg[1024];
+    download_transfer_t transfer;
+    download_meta_t part_meta;
+    const char *problem = NULL;
+    int result = 0;
+    int resumed = 0;
+
+    output[0] = '\0';
+    url_key(url, key);
+    snprintf(part, sizeof(part), "%s/tmp/%s.part", download_store, key);
+    snprintf(part_meta_path, sizeof(part_meta_path), "%s.meta", part);
+
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.fd = open(part, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (transfer.fd < 0) {
+        *failure = FAILURE_NO_SPACE;
+        return 0;
+    }
+
+    // Another thread or build fetching the same URL finishes first
+    while (flock(transfer.fd, LOCK_EX) != 0 && errno == EINTR) {
+    }
+    sha256_init(&transfer.sha);
+    transfer.hashing = 1;
+    transfer.limit = size;
+    transfer.part_meta = part_meta_path;
+
+    // Resume only when the part can be checked: by If-Range, or by the digest
+    long long have = lseek(transfer.fd, 0, SEEK_END);
+    int has_meta = read_meta(part_meta_path, &part_meta);
+    if (have > 0 && (expected[0] || (has_meta && (part_meta.etag[0] || part_meta.last_modified[0]))) &&
+        (size == 0 || have <= size) && seed_transfer(&transfer) == 0) {
+        resumed = 1;
+    } else {
+        if (have != 0 && ftruncate(transfer.fd, 0) != 0) {
+            *failure = FAILURE_NO_SPACE;
+            close(transfer.fd);
+            return 0;
+        }
+        lseek(transfer.fd, 0, SEEK_SET);
+        has_meta = 0;
+        transfer.bytes = 0;
+        transfer.head_len = 0;
+        sha256_init(&transfer.sha);
+    }
+
+    if (resumed && size > 0 && transfer.bytes == size) {
+        // Complete already; the build stopped before the rename
+        snprintf(msg, sizeof(msg), "Download of %s already complete, verifying", item->name);
+        LOG_DEBUG(msg);
+    } else {
+        if (resumed) {
+            transfer.offset = transfer.bytes;
+            snprintf(options, sizeof(options), "-r %lld- ", transfer.offset);
+            if (has_meta) {
+                conditional_options(options, sizeof(options), part_meta.etag, part_meta.last_modified, 1);
+            }
+            snprintf(msg, sizeof(msg), "Resuming %s at %lld bytes", item->name, transfer.offset);
+            LOG_INFO(msg);
+        } else if (known) {
+            conditional_options(options, sizeof(options), known->etag, known->last_modified, 0);
+        }
+
+        // Large files can be split when the server takes ranges
+        int segments = 1;
+        http_response_t head;
+        memset(&head, 0, sizeof(head));
+        if (!resumed && segment_count(size > 0 ? size : DOWNLOAD_SEGMENT_MIN) > 1) {
+            download_transfer_t probe;
+            failure_class_t probe_failure = FAILURE_NONE;
+            memset(&probe, 0, sizeof(probe));
+            probe.fd = -1;
+            if (run_transfer(&probe, url, options, 1, &probe_failure) == 0) {
+                if (probe.response.status == 304) {
+                    transfer.response = probe.response;
+                    segments = 0;
+                } else if (probe.response.status == 200 && probe.response.accept_ranges &&
+                           (size == 0 || probe.response.content_length == size)) {
+                    head = probe.response;
+                    segments = segment_count(head.content_length);
+                }
+            }
+        }
+
+        if (segments > 1) {
+            snprintf(msg, sizeof(msg), "Fetching %s in %d segments", item->name, segments);
+            LOG_INFO(msg);
+            result = fetch_segments(&transfer, url, part, &head, segments);
+            if (result != 0 && *failure == FAILURE_NONE) *failure = FAILURE_CONNECTION;
+        } else if (segments == 1) {
+            result = run_transfer(&transfer, url, options, 0, failure);
+            if (result != 0 && resumed && *failure == FAILURE_HTTP_4XX) {
+                // The server refused the range (416): the part is useless
+                if (ftruncate(transfer.fd, 0) == 0) *failure = FAILURE_CONNECTION;
+            }
+        }
+        snprintf(output, output_size, "%s", transfer.output);
+    }
+
+    if (fsync(transfer.fd) != 0) {
+        transfer.write_failed = 1;
+    }
+
+    // Not modified: the copy in the store is current
+    if (result == 0 && transfer.response.status == 304) {
+        close(transfer.fd);
+        if (known && fetch_from_store(item, known->digest, 0)) {
+            snprintf(msg, sizeof(msg), "%s is unchanged upstream", item->name);
+            LOG_DEBUG(msg);
+            return 1;
+        }
+        *failure = FAILURE_CONNECTION;
+        return 0;
+    }
+
+    char digest[SHA256_HEX_LEN + 1];
+    sha256_final_hex(&transfer.sha, digest);
+
+    if (transfer.write_failed) {
+        *failure = FAILURE_NO_SPACE;
+        problem = "could not write to the download store";
+    } else if (transfer.too_large) {
+        problem = "larger than expected";
+    } else if (result != 0) {
+        close(transfer.fd);
+        snprintf(msg, sizeof(msg), "Download of %s stopped at %lld bytes (%s): %s",
+                 item->name, transfer.bytes, retry_failure_name(*failure), url);
+        LOG_WARNING(msg);
+        return 0;
+    } else if ((problem = sniff_content(transfer.head, transfer.head_len, item->content)) != NULL) {
+        *failure = FAILURE_HTTP_4XX;
+    } else if (size > 0 && transfer.bytes != size) {
+        *failure = FAILURE_CONNECTION;
+        problem = "truncated";
+    } else if (expected[0] && strcmp(digest, expected) != 0) {
+        *failure = FAILURE_HTTP_4XX;
+        problem = "SHA-256 mismatch";
+    }
+
+    if (problem) {
+        snprintf(msg, sizeof(msg), "Download of %s rejected (%s, %lld bytes): %s",
+                 item->name, problem, transfer.bytes, url);
+        LOG_WARNING(msg);
+        if (*failure == FAILURE_NONE) *failure = FAILURE_HTTP_4XX;
+        unlink(part);
+        unlink(part_meta_path);
+        close(transfer.fd);
+        return 0;
+    }
+
+    char object[MAX_PATH_LEN + 128];
+    download_store_path(digest, object, sizeof(object));
+    if (rename(part, object) != 0) {
+        close(transfer.fd);
+        *failure = FAILURE_NO_SPACE;
+        return 0;
+    }
+    fchmod(transfer.fd, 0644);
+    close(transfer.fd);
+
+    // Validators of the final response, or of the transfer this one resumed
+    if (!transfer.response.etag[0] && !transfer.response.last_modified[0] && has_meta) {
+        strcpy(transfer.response.etag, part_meta.etag);
+        strcpy(transfer.response.last_modified, part_meta.last_modified);
+    }
+    unlink(part_meta_path);
+
+    strcpy(item->digest, digest);
+    item->bytes = transfer.bytes;
+    if (known) {
+        strcpy(known->etag, transfer.response.etag);
+        strcpy(known->last_modified, transfer.response.last_modified);
+    }
+    return 1;
+}
+
+// Fetch one file into the store and link it into place
+int download_fetch(download_t *item) {
+    char msg[1024];
+    char path[MAX_PATH_LEN + 128];
+    char expected[SHA256_HEX_LEN + 1] = "";
+    long long size = item->size;
+    int fetched = 0;
+
+    item->result = ERROR_NETWORK_FAILURE;
+    item->cached = 0;
+    item->digest[0] = '\0';
+    item->bytes = 0;
+
+    if (!download_store_dir()) {
+        item->result = ERROR_PERMISSION_DENIED;
+        return item->result;
+    }
+
+    // Files that may change upstream are revalidated; everything else must
+    // come with its digest, a first download is not trusted to provide one
+    if (item->sha256[0]) {
+        strncpy(expected, item->sha256, SHA256_HEX_LEN);
+        expected[SHA256_HEX_LEN] = '\0';
+    } else if (!item->revalidate) {
+        snprintf(msg, sizeof(msg), "No sha256 pin for %s, refusing an unverified download", item->name);
+        LOG_ERROR(msg);
+        item->result = ERROR_DEPENDENCY_MISSING;
+        return item->result;
+    }
+
+    if (expected[0]) {
+        fetched = fetch_from_store(item, expected, size);
+    }
+
+    for (int i = 0; i < item->url_count && !fetched && !interrupted; i++) {
+        failure_class_t failure = FAILURE_NONE;
+        download_meta_t known;
+        int has_known = 0;
+
+        // The copy in the store is revalidated rather than fetched again
+        meta_path(item->urls[i], path, sizeof(path));
+        if (item->revalidate && read_meta(path, &known) && known.digest[0] &&
+            (known.etag[0] || known.last_modified[0])) {
+            char object[MAX_PATH_LEN + 128];
+            download_store_path(known.digest, object, sizeof(object));
+            has_known = access(object, F_OK) == 0;
+        }
+        if (!has_known) memset(&known, 0, sizeof(known));
+
+        for (int attempt = 1; !interrupted; attempt++) {
+            char output[DOWNLOAD_OUTPUT_MAX];
+            failure = FAILURE_NONE;
+            fetched = fetch_url(item, item->urls[i], expected, size, item->revalidate ? &known : NULL,
+                                &failure, output, sizeof(output));
+            if (fetched || !retry_should_retry(failure, attempt, DOWNLOAD_ATTEMPTS)) break;
+
+            double delay = retry_delay(failure, attempt, output);
+            snprintf(msg, sizeof(msg), "Download of %s failed (%s, attempt %d), retrying in %.1fs",
+                     item->name, retry_failure_name(failure), attempt, delay);
+            LOG_WARNING(msg);
+            metrics_record_retry();
+            retry_sleep(delay);
+        }
+
+        if (fetched && item->revalidate) {
+            strcpy(known.digest, item->digest);
+            known.size = item->bytes;
+            write_meta(path, &known, item->urls[i]);
+        }
+    }
+
+    metrics_record_cache("download_store", item->cached, !item->cached);
+    if (!fetched) {
+        snprintf(msg, sizeof(msg), "Could not download a verified copy of %s", item->name);
+        if (item->required) LOG_ERROR(msg);
+        else LOG_WARNING(msg);
+        return item->result;
+    }
+
+    if (item->dest[0]) {
+        char object[MAX_PATH_LEN + 128];
+        download_store_path(item->digest, object, sizeof(object));
+        if (download_link(object, item->dest) != ERROR_SUCCESS) {
+            snprintf(msg, sizeof(msg), "Could not place %s at %s", item->name, item->dest);
+            LOG_ERROR(msg);
+            item->result = ERROR_INSTALLATION_FAILED;
+            return item->result;
+        }
+    }
+
+    snprintf(msg, sizeof(msg), "%s %s (%lld bytes, sha256 %.16s)",
+             item->cached ? "Reused" : "Downloaded", item->name, item->bytes, item->digest);
+    LOG_INFO(msg);
+    item->result = ERROR_SUCCESS;
+    return item->result;
+}
+
+// Work shared by the download threads
+typedef struct {
+    download_t *items;
+    int count;
+    int next;
+} download_queue_t;
+
+static void* download_worker(void *arg) {
+    download_queue_t *queue = arg;
+    int index;
+
+    while ((index = __sync_fetch_and_add(&queue->next, 1)) < queue->count) {
+        download_fetch(&queue->items[index]);
+    }
+    return NULL;
+}
+
+// Fetch several files at once; fails when a required one could not be fetched
+int download_fetch_all(download_t *items, int count, int parallel) {
+    pthread_t threads[DOWNLOAD_MAX_PARALLEL];
+    download_queue_t queue = { items, count, 0 };
+    int started = 0;
+
+    if (parallel <= 0 || parallel > DOWNLOAD_MAX_PARALLEL) parallel = DOWNLOAD_MAX_PARALLEL;
+    if (parallel > count) parallel = count;
+
+    // The calling thread works the queue too, so one thread needs no helpers
+    for (int i = 1; i < parallel; i++) {
+        if (pthread_create(&threads[started], NULL, download_worker, &queue) == 0) {
+            started++;
+        }
+    }
+    download_worker(&queue);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (items[i].required && items[i].result != ERROR_SUCCESS) {
+            return items[i].result;
+        }
+    }
+    return ERROR_SUCCESS;
+}
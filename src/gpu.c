@@ -8,9 +8,95 @@
 
 #include "builder.h"
 
+// Fallback mirrors; each one serves the file with the same name only
+static const char* mali_fallback_urls[] = {
+    "https://github.com/JeffyCN/mali_libs/raw/master/lib/aarch64-linux-gnu/libmali-valhall-g610-g6p0-wayland-gbm.so",
+    "https://github.com/armbian/build/raw/master/packages/blobs/mali/rk3588/g610/libmali-valhall-g610-g6p0-wayland-gbm.so",
+    NULL
+};
+
+// Read the pin of a Mali file from the pins file, one "<sha256> <bytes> <filename>"
+// per line; MALI_PINS_FILE overrides the default path
+static int read_mali_pin(const char *filename, char *sha256, long long *size) {
+    const char *path = getenv("MALI_PINS_FILE");
+    char line[512];
+    char digest[SHA256_HEX_LEN + 1];
+    char name[128];
+    long long bytes;
+    int found = 0;
+
+    FILE *fp = fopen(path && path[0] ? path : MALI_PINS_FILE, "r");
+    if (!fp) return 0;
+
+    while (!found && fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%64s %lld %127s", digest, &bytes, name) == 3 &&
+            strlen(digest) == SHA256_HEX_LEN && bytes > 0 && strcmp(name, filename) == 0) {
+            strcpy(sha256, digest);
+            *size = bytes;
+            found = 1;
+        }
+    }
+    fclose(fp);
+
+    return found;
+}
+
+// Does every Mali blob have a pin, in the table or the pins file; the blobs
+// are only on by default then, so a default build does not stop at the download
+int mali_blobs_pinned(void) {
+    char sha256[SHA256_HEX_LEN + 1];
+    long long size;
+
+    for (int i = 0; mali_drivers[i].url[0]; i++) {
+        if (!mali_drivers[i].sha256[0] && !read_mali_pin(mali_drivers[i].filename, sha256, &size)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Describe a Mali file as a verified download into dest; returns 0 when the
+// file has no sha256 pin, which the caller must treat as an error
+static int mali_download_init(download_t *item, const mali_driver_t *driver, const char *dest) {
+    memset(item, 0, sizeof(*item));
+    snprintf(item->name, sizeof(item->name), "%s", driver->description);
+    download_add_url(item, driver->url);
+    
+    // A custom URL from the environment is the first mirror
+    const char *custom_url = getenv(strstr(driver->description, "Firmware") ? "MALI_FIRMWARE_URL"
+                                                                          : "MALI_DRIVER_URL");
+    download_add_url(item, custom_url);
+    
+    for (int i = 0; mali_fallback_urls[i] != NULL; i++) {
+        const char *name = strrchr(mali_fallback_urls[i], '/');
+        if (name && strcmp(name + 1, driver->filename) == 0) {
+            download_add_url(item, mali_fallback_urls[i]);
+        }
+    }
+    
+    snprintf(item->sha256, sizeof(item->sha256), "%s", driver->sha256);
+    item->size = driver->size;
+    if (!item->sha256[0] && !read_mali_pin(driver->filename, item->sha256, &item->size)) {
+        char msg[512];
+        snprintf(msg, sizeof(msg), "No sha256 pin for %s: add \"<sha256> <bytes> %s\" to %s",
+                 driver->description, driver->filename, MALI_PINS_FILE);
+        LOG_ERROR(msg);
+        return 0;
+    }
+    
+    // An error page saved as libmali breaks the GPU at boot, so check content
+    item->content = strstr(driver->filename, ".so") ? DOWNLOAD_ELF : DOWNLOAD_BINARY;
+    item->required = driver->required;
+    strncpy(item->dest, dest, sizeof(item->dest) - 1);
+    return 1;
+}
+
 // Download Mali blobs
 int download_mali_blobs(build_config_t *config) {
     error_context_t error_ctx = {0};
+    download_t items[8];
+    int count = 0;
     int i;
     
     LOG_INFO("Downloading Mali G610 GPU drivers and firmware...");
@@ -20,20 +106,7 @@ int download_mali_blobs(build_config_t *config) {
         return ERROR_FILE_NOT_FOUND;
     }
     
-    if (chdir("/tmp/mali_install") != 0) {
-        LOG_ERROR("Failed to change to Mali install directory");
-        return ERROR_FILE_NOT_FOUND;
-    }
-    
-    // Fallback URLs for Mali drivers
-    const char* mali_fallback_urls[] = {
-        "https://github.com/JeffyCN/mali_libs/raw/master/lib/aarch64-linux-gnu/libmali-valhall-g610-g6p0-wayland-gbm.so",
-        "https://github.com/armbian/build/raw/master/packages/blobs/mali/rk3588/g610/libmali-valhall-g610-g6p0-wayland-gbm.so",
-        NULL
-    };
-    
-    // Download all Mali drivers
-    for (i = 0; strlen(mali_drivers[i].url) > 0; i++) {
+    for (i = 0; strlen(mali_drivers[i].url) > 0 && count < (int)(sizeof(items) / sizeof(items[0])); i++) {
         mali_driver_t *driver = &mali_drivers[i];
         
         // Skip optional drivers based on config
@@ -42,81 +115,36 @@ int download_mali_blobs(build_config_t *config) {
             continue;
         }
         
-        char msg[256];
-        snprintf(msg, sizeof(msg), "Downloading %s...", driver->description);
-        LOG_INFO(msg);
-        
-        char cmd[MAX_CMD_LEN];
-        snprintf(cmd, sizeof(cmd), "wget -O %s \"%s\"", driver->filename, driver->url);
+        char dest[MAX_PATH_LEN];
+        snprintf(dest, sizeof(dest), "/tmp/mali_install/%s", driver->filename);
         
-        int download_failed = 1;
-        
-        // First try the original URL
-        if (execute_command_with_retry(cmd, 1, 2) == 0) {
-            // Check if file exists and has some size
-            struct stat st;
-            if (stat(driver->filename, &st) == 0 && st.st_size > 10000) {
-                LOG_INFO("Downloaded Mali driver successfully");
-                download_failed = 0;
-            } else {
-                LOG_WARNING("Downloaded file is too small or empty");
-            }
+        // Blobs are never trusted on first use; every file needs a known digest
+        if (!mali_download_init(&items[count++], driver, dest)) {
+            return ERROR_GPU_DRIVER_FAILED;
         }
+    }
+    
+    // All files at once; each is verified before it lands in /tmp/mali_install
+    int result = download_fetch_all(items, count, count);
+    
+    for (i = 0; i < count; i++) {
+        if (items[i].result == ERROR_SUCCESS) continue;
         
-        // If download failed, try fallback URLs
-        if (download_failed && driver->required) {
-            LOG_WARNING("Failed to download from primary URL, trying fallbacks...");
-            
-            // Check if custom URL is provided in environment
-            char* env_var_name = NULL;
-            if (strstr(driver->description, "Firmware")) {
-                env_var_name = "MALI_FIRMWARE_URL";
-            } else {
-                env_var_name = "MALI_DRIVER_URL";
-            }
-            
-            char* custom_url = getenv(env_var_name);
-            if (custom_url != NULL && strlen(custom_url) > 0) {
-                LOG_INFO("Trying custom URL from environment");
-                snprintf(cmd, sizeof(cmd), "wget -O %s \"%s\"", driver->filename, custom_url);
-                if (execute_command_with_retry(cmd, 1, 2) == 0) {
-                    struct stat st;
-                    if (stat(driver->filename, &st) == 0 && st.st_size > 10000) {
-                        LOG_INFO("Downloaded Mali driver from custom URL");
-                        download_failed = 0;
-                    }
-                }
-            }
-            
-            // Try fallback URLs if still failed
-            if (download_failed) {
-                for (int j = 0; mali_fallback_urls[j] != NULL; j++) {
-                    LOG_INFO("Trying fallback URL...");
-                    snprintf(cmd, sizeof(cmd), "wget -O %s \"%s\"", driver->filename, mali_fallback_urls[j]);
-                    if (execute_command_with_retry(cmd, 1, 2) == 0) {
-                        struct stat st;
-                        if (stat(driver->filename, &st) == 0 && st.st_size > 10000) {
-                            LOG_INFO("Downloaded Mali driver from fallback URL");
-                            download_failed = 0;
-                            break;
-                        }
-                    }
-                }
-            }
-            
-            // If still failed and required, report error
-            if (download_failed && driver->required) {
-                LOG_ERROR("Failed to download required Mali driver from all sources");
-                LOG_ERROR("Please download the driver manually and place it in /tmp/mali_install");
-                snprintf(msg, sizeof(msg), "Required file: %s", driver->filename);
-                LOG_ERROR(msg);
-                return ERROR_GPU_DRIVER_FAILED;
-            }
-        } else if (download_failed) {
+        if (items[i].required) {
+            char msg[256];
+            LOG_ERROR("Failed to download required Mali driver from all sources");
+            LOG_ERROR("Please download the driver manually and place it in /tmp/mali_install");
+            snprintf(msg, sizeof(msg), "Required file: %s", strrchr(items[i].dest, '/') + 1);
+            LOG_ERROR(msg);
+        } else {
             LOG_WARNING("Failed to download optional Mali driver");
         }
     }
     
+    if (result != ERROR_SUCCESS) {
+        return ERROR_GPU_DRIVER_FAILED;
+    }
+    
     LOG_INFO("Mali GPU drivers downloaded successfully");
     return ERROR_SUCCESS;
 }
@@ -163,12 +191,19 @@ int install_mali_drivers(build_config_t *config) {
     if (access("/tmp/mali_install/mali_csffw.bin", F_OK) != 0) {
         LOG_WARNING("Mali firmware not found, trying to download it directly...");
         
-        // Try to download firmware directly
-        snprintf(cmd, sizeof(cmd), 
-                 "wget -O /lib/firmware/mali/mali_csffw.bin "
-                 "https://github.com/JeffyCN/mirrors/raw/libmali/firmware/g610/mali_csffw.bin");
+        // Try to download firmware directly, verified like the other blobs
+        download_t firmware;
+        int index = 0;
+        while (mali_drivers[index].url[0] && strcmp(mali_drivers[index].filename, "mali_csffw.bin") != 0) {
+            index++;
+        }
+        if (!mali_drivers[index].url[0] ||
+            !mali_download_init(&firmware, &mali_drivers[index], "/lib/firmware/mali/mali_csffw.bin")) {
+            LOG_ERROR("Mali firmware has no sha256 pin, not downloading it");
+            return ERROR_GPU_DRIVER_FAILED;
+        }
         
-        if (execute_command_with_retry(cmd, 1, 3) != 0) {
+        if (download_fetch(&firmware) != ERROR_SUCCESS) {
             LOG_WARNING("Failed to download Mali firmware");
         } else {
             LOG_INFO("Mali firmware downloaded and installed directly");
@@ -672,47 +707,45 @@ int integrate_mali_into_kernel(build_config_t *config) {
     // Try different sources for Mali patches with authentication
     LOG_INFO("Downloading Mali integration patches...");
     
-    // Define potential sources for Mali patches
-    const char *mali_patch_sources[] = {
-        "https://raw.githubusercontent.com/armbian/build/master/patch/kernel/rockchip-rk3588-edge/panfrost",
-        "https://github.com/JeffyCN/mirrors/tree/libmali/patches",
-        "https://gitlab.freedesktop.org/panfrost/linux/-/archive/master/linux-master.tar.gz",
-        NULL
+    // Patch series resolved from manifests, in order of preference
+    static const patch_source_t mali_patch_series[] = {
+        {"armbian-panfrost", PATCH_MANIFEST_TREE,
+         "https://api.github.com/repos/armbian/build/git/trees/master:patch/kernel/rockchip-rk3588-edge/panfrost",
+         "https://raw.githubusercontent.com/armbian/build/master/patch/kernel/rockchip-rk3588-edge/panfrost"},
+        {"libmali-patches", PATCH_MANIFEST_TREE,
+         "https://api.github.com/repos/JeffyCN/mirrors/git/trees/libmali:patches",
+         "https://raw.githubusercontent.com/JeffyCN/mirrors/libmali/patches"},
+        {NULL, 0, NULL, NULL}
     };
     
     int patch_success = 0;
     
-    // Try to download from each source
-    for (int i = 0; mali_patch_sources[i] != NULL && !patch_success; i++) {
-        LOG_INFO("Trying to download Mali patches from:");
-        LOG_INFO(mali_patch_sources[i]);
+    // Try each series; a source that fails leaves nothing behind for the next one
+    for (int i = 0; mali_patch_series[i].name != NULL && !patch_success; i++) {
+        int patch_count = 0;
         
-        char* auth_url = add_github_token_to_url(mali_patch_sources[i]);
+        LOG_INFO("Trying to download Mali patches from:");
+        LOG_INFO(mali_patch_series[i].manifest_url);
         
-        if (strstr(mali_patch_sources[i], ".tar.gz") != NULL) {
-            // Handle archive downloads
-            snprintf(cmd, sizeof(cmd), "wget -O mali-patches.tar.gz \"%s\"", auth_url);
-            if (execute_command_safe(cmd, 1, &error_ctx) == 0) {
-                // Check if the file exists and has some content
-                struct stat st;
-                if (stat("mali-patches.tar.gz", &st) == 0 && st.st_size > 10000) {
-                    execute_command_safe("tar -xzf mali-patches.tar.gz", 1, &error_ctx);
-                    patch_success = 1;
-                }
-            }
+        if (fetch_patch_series(&mali_patch_series[i], ".", &patch_count) == ERROR_SUCCESS && patch_count > 0) {
+            patch_success = 1;
         } else {
-            // Handle GitHub/GitLab directories
-            snprintf(cmd, sizeof(cmd), 
-                     "git clone --depth 1 %s mali-patches || "
-                     "wget -r -np -nd -A '*.patch' %s/",
-                     auth_url, auth_url);
-            
-            if (execute_command_safe(cmd, 1, &error_ctx) == 0) {
-                // Check if the directory exists or if we have patch files
-                if (access("mali-patches", F_OK) == 0 || system("ls *.patch >/dev/null 2>&1") == 0) {
-                    patch_success = 1;
-                }
-            }
+            execute_command_safe("rm -f ./*.patch", 0, &error_ctx);
+        }
+    }
+    
+    // Fall back to the panfrost tree archive; the store revalidates instead of refetching
+    if (!patch_success) {
+        download_t archive;
+        memset(&archive, 0, sizeof(archive));
+        strcpy(archive.name, "Mali kernel patches");
+        download_add_url(&archive, "https://gitlab.freedesktop.org/panfrost/linux/-/archive/master/linux-master.tar.gz");
+        archive.content = DOWNLOAD_BINARY;
+        archive.revalidate = 1;
+        strcpy(archive.dest, "mali-patches.tar.gz");
+        if (download_fetch(&archive) == ERROR_SUCCESS) {
+            execute_command_safe("tar -xzf mali-patches.tar.gz", 1, &error_ctx);
+            patch_success = 1;
         }
     }
     
@@ -0,0 +1,270 @@
+/*
+ * jobserver.c - Adaptive GNU make jobserver for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file makes the builder the GNU make jobserver for every make it runs.
+ * All concurrent stages draw job tokens from one pipe, advertised to them via
+ * MAKEFLAGS, instead of each starting config->jobs jobs of its own. A
+ * controller thread resizes the token pool once a second from MemAvailable,
+ * memory and CPU pressure (PSI) and the load of the rest of the machine, with
+ * config->jobs as the ceiling, so LTO links stop running the box out of
+ * memory and I/O-bound phases leave idle cores to others.
+ */
+
+#include "builder.h"
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#define JOBSERVER_INTERVAL_MS 1000
+#define JOBSERVER_MEMORY_RESERVE (512LL << 20)   // Left to the rest of the system
+#define JOBSERVER_PSI_SOME_LIMIT 10.0            // memory some avg10, percent
+#define JOBSERVER_PSI_FULL_LIMIT 2.0             // memory full avg10, percent
+#define JOBSERVER_TOKEN '+'
+
+static char jobserver_fifo[MAX_PATH_LEN];
+static int jobserver_read_fd = -1;      // Blocking, inherited by make
+static int jobserver_write_fd = -1;     // Inherited by make, used to add tokens
+static int jobserver_drain_fd = -1;     // Non-blocking, used to withdraw tokens
+static int jobserver_tokens = 0;        // Tokens in circulation, pipe plus held
+static int jobserver_target = 0;
+static int jobserver_min_target = 0;
+static int jobserver_max_target = 0;
+static int jobserver_ceiling = 0;
+static long long jobserver_job_memory = 0;
+static char jobserver_make_jobs[16];
+
+static pthread_t jobserver_thread;
+static pthread_mutex_t jobserver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobserver_wakeup = PTHREAD_COND_INITIALIZER;
+static int jobserver_running = 0;
+
+// MemAvailable in bytes, -1 when unknown
+static long long read_mem_available(void) {
+    char line[128];
+    long long kb = -1;
+
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (!fp) return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "MemAvailable: %lld kB", &kb) == 1) break;
+    }
+    fclose(fp);
+
+    return kb < 0 ? -1 : kb * 1024;
+}
+
+// avg10 of the some and full lines of a PSI file, 0 when PSI is unavailable
+static void read_pressure(const char *path, double *some, double *full) {
+    char line[256];
+
+    *some = *full = 0.0;
+    FILE *fp = fopen(path, "r");
+    if (!fp) return;
+    while (fgets(line, sizeof(line), fp)) {
+        double value;
+        if (sscanf(line, "some avg10=%lf", &value) == 1) *some = value;
+        else if (sscanf(line, "full avg10=%lf", &value) == 1) *full = value;
+    }
+    fclose(fp);
+}
+
+// Tokens currently held by make processes
+static int jobserver_held(void) {
+    int queued = 0;
+
+    if (ioctl(jobserver_drain_fd, FIONREAD, &queued) != 0) queued = 0;
+    return jobserver_tokens - queued > 0 ? jobserver_tokens - queued : 0;
+}
+
+// Work out how many jobs the machine can take right now
+static int jobserver_compute_target(void) {
+    int held = jobserver_held();
+    int target = jobserver_ceiling;
+    double loadavg[1] = {0.0};
+    double some, full;
+
+    // Running jobs already show in MemAvailable; only new ones need room
+    long long available = read_mem_available();
+    if (available >= 0 && jobserver_job_memory > 0) {
+        long long spare = available - JOBSERVER_MEMORY_RESERVE;
+        int memory_jobs = held + 1 + (int)(spare > 0 ? spare / jobserver_job_memory : 0);
+        if (memory_jobs < target) target = memory_jobs;
+    }
+
+    // Stalls on memory mean the estimate above is too optimistic
+    read_pressure("/proc/pressure/memory", &some, &full);
+    if (full > JOBSERVER_PSI_FULL_LIMIT) {
+        target = (held + 1) / 2;
+    } else if (some > JOBSERVER_PSI_SOME_LIMIT && target > held) {
+        target = held;
+    }
+
+    // Leave the cores that other work on the machine is using
+    if (getloadavg(loadavg, 1) == 1) {
+        double others = loadavg[0] - held - 1;
+        int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (others > 0 && cpus > 0 && cpus - (int)others < target) {
+            target = cpus - (int)others;
+        }
+    }
+
+    read_pressure("/proc/pressure/cpu", &some, &full);
+    if (some > 80.0 && target > held) {
+        target = held;
+    }
+
+    if (target < 1) target = 1;
+    if (target > jobserver_ceiling) target = jobserver_ceiling;
+    return target;
+}
+
+// Grow or shrink the token pool; make holds one implicit token per process
+static void jobserver_apply_target(int target) {
+    char tokens[128];
+
+    while (jobserver_tokens < target - 1) {
+        int count = target - 1 - jobserver_tokens;
+        if (count > (int)sizeof(tokens)) count = sizeof(tokens);
+        memset(tokens, JOBSERVER_TOKEN, count);
+        ssize_t written = write(jobserver_write_fd, tokens, count);
+        if (written <= 0) break;
+        jobserver_tokens += written;
+    }
+
+    // Held tokens come back when their job ends and are withdrawn then
+    while (jobserver_tokens > target - 1) {
+        int count = jobserver_tokens - (target - 1);
+        if (count > (int)sizeof(tokens)) count = sizeof(tokens);
+        ssize_t drained = read(jobserver_drain_fd, tokens, count);
+        if (drained <= 0) break;
+        jobserver_tokens -= drained;
+    }
+}
+
+// Controller thread
+static void* jobserver_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&jobserver_lock);
+    while (jobserver_running) {
+        int target = jobserver_compute_target();
+
+        if (target != jobserver_target) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Jobserver: %d jobs (was %d, %d running)",
+                     target, jobserver_target, jobserver_held() + 1);
+            LOG_DEBUG(msg);
+            jobserver_target = target;
+            if (target < jobserver_min_target) jobserver_min_target = target;
+            if (target > jobserver_max_target) jobserver_max_target = target;
+        }
+        jobserver_apply_target(jobserver_target);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += JOBSERVER_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&jobserver_wakeup, &jobserver_lock, &deadline);
+    }
+    pthread_mutex_unlock(&jobserver_lock);
+
+    return NULL;
+}
+
+// Start the jobserver and export it to every make the builder runs
+int jobserver_start(build_config_t *config) {
+    char makeflags[128];
+    char msg[256];
+
+    snprintf(jobserver_make_jobs, sizeof(jobserver_make_jobs), "-j%d", config->jobs);
+    if (!config->adaptive_jobs || jobserver_running) return ERROR_SUCCESS;
+
+    // A FIFO lets the controller open a non-blocking end of its own
+    snprintf(jobserver_fifo, sizeof(jobserver_fifo), "/tmp/opi5plus_jobserver.%d", (int)getpid());
+    unlink(jobserver_fifo);
+    if (mkfifo(jobserver_fifo, 0600) != 0) {
+        LOG_WARNING("Could not create the jobserver FIFO, make uses a fixed job count");
+        return ERROR_PERMISSION_DENIED;
+    }
+
+    jobserver_write_fd = open(jobserver_fifo, O_RDWR);
+    jobserver_read_fd = open(jobserver_fifo, O_RDONLY);
+    jobserver_drain_fd = open(jobserver_fifo, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    unlink(jobserver_fifo);
+    if (jobserver_write_fd < 0 || jobserver_read_fd < 0 || jobserver_drain_fd < 0) {
+        LOG_WARNING("Could not open the jobserver FIFO, make uses a fixed job count");
+        jobserver_stop();
+        return ERROR_PERMISSION_DENIED;
+    }
+
+    jobserver_ceiling = config->jobs;
+    jobserver_job_memory = config->job_memory;
+    jobserver_tokens = 0;
+    jobserver_target = jobserver_compute_target();
+    jobserver_min_target = jobserver_max_target = jobserver_target;
+    jobserver_apply_target(jobserver_target);
+
+    // A bare -j with the auth fds makes every top-level make a jobserver client
+    snprintf(makeflags, sizeof(makeflags), " -j --jobserver-auth=%d,%d",
+             jobserver_read_fd, jobserver_write_fd);
+    setenv("MAKEFLAGS", makeflags, 1);
+    jobserver_make_jobs[0] = '\0';
+
+    jobserver_running = 1;
+    if (pthread_create(&jobserver_thread, NULL, jobserver_main, NULL) != 0) {
+        jobserver_running = 0;
+        LOG_WARNING("Could not start the jobserver controller, keeping the initial job count");
+    }
+
+    snprintf(msg, sizeof(msg), "Jobserver started: %d of at most %d jobs, %lld MiB per job",
+             jobserver_target, jobserver_ceiling, jobserver_job_memory >> 20);
+    LOG_INFO(msg);
+
+    return ERROR_SUCCESS;
+}
+
+// Stop the controller and withdraw the jobserver from the environment
+void jobserver_stop(void) {
+    char msg[128];
+
+    if (jobserver_running) {
+        pthread_mutex_lock(&jobserver_lock);
+        jobserver_running = 0;
+        pthread_cond_signal(&jobserver_wakeup);
+        pthread_mutex_unlock(&jobserver_lock);
+        pthread_join(jobserver_thread, NULL);
+
+        snprintf(msg, sizeof(msg), "Jobserver stopped: job count ranged from %d to %d",
+                 jobserver_min_target, jobserver_max_target);
+        LOG_INFO(msg);
+    }
+
+    if (jobserver_read_fd >= 0) close(jobserver_read_fd);
+    if (jobserver_write_fd >= 0) close(jobserver_write_fd);
+    if (jobserver_drain_fd >= 0) close(jobserver_drain_fd);
+    jobserver_read_fd = jobserver_write_fd = jobserver_drain_fd = -1;
+    jobserver_tokens = 0;
+
+    unsetenv("MAKEFLAGS");
+    if (global_config) {
+        snprintf(jobserver_make_jobs, sizeof(jobserver_make_jobs), "-j%d", global_config->jobs);
+    }
+}
+
+// Job option for make command lines: empty while the jobserver hands out jobs
+const char* jobserver_make_args(void) {
+    if (jobserver_make_jobs[0] == '\0' && jobserver_read_fd < 0 && global_config) {
+        snprintf(jobserver_make_jobs, sizeof(jobserver_make_jobs), "-j%d", global_config->jobs);
+    }
+    return jobserver_make_jobs;
+}
+
+// Current number of jobs the jobserver allows
+int jobserver_current_jobs(void) {
+    if (jobserver_read_fd < 0) {
+        return global_config ? global_config->jobs : 1;
+    }
+    return jobserver_target;
+}
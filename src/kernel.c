@@ -13,7 +13,7 @@ int download_kernel_source(build_config_t *config) {
     char cmd[MAX_CMD_LEN];
     char source_dir[MAX_PATH_LEN];
     error_context_t error_ctx = {0};
-    char* auth_url;
+    const char *repo_url;
     
     if (!config) {
         LOG_ERROR("Configuration is NULL");
@@ -43,7 +43,7 @@ int download_kernel_source(build_config_t *config) {
     // First approach: Try the Orange Pi specific repository
     LOG_INFO("Trying to download Orange Pi kernel source...");
     
-    // For Orange Pi repository, try different authentication methods
+    // For Orange Pi repository, try the known repository names
     const char* orangepi_urls[] = {
         "https://github.com/orangepi-xunlong/linux.git",
         "https://github.com/orangepi-xunlong/linux-orangepi.git",
@@ -52,25 +52,17 @@ int download_kernel_source(build_config_t *config) {
     
     int success = 0;
     for (int i = 0; orangepi_urls[i] != NULL && !success; i++) {
-        auth_url = add_github_token_to_url(orangepi_urls[i]);
-        
-        // Try with depth 1 first for faster clone
-        snprintf(cmd, sizeof(cmd), 
-                 "git clone --depth 1 \"%s\" -b orange-pi-5.10-rk3588 linux_temp 2>&1", auth_url);
+        repo_url = orangepi_urls[i];
         
         LOG_INFO("Attempting to clone from:");
         LOG_INFO(orangepi_urls[i]);
         
-        if (execute_command_with_retry(cmd, 1, 2) == 0) {
+        // Try with depth 1 first for faster clone
+        if (kernel_clone(config, repo_url, "orange-pi-5.10-rk3588", "linux_temp", 2) == 0) {
+            success = 1;
+        } else if (kernel_clone(config, repo_url, NULL, "linux_temp", 1) == 0) {
+            // Without branch specification
             success = 1;
-        } else {
-            // Try without branch specification
-            snprintf(cmd, sizeof(cmd), 
-                     "git clone --depth 1 \"%s\" linux_temp 2>&1", auth_url);
-            
-            if (execute_command_with_retry(cmd, 1, 1) == 0) {
-                success = 1;
-            }
         }
         
         if (!success) {
@@ -95,11 +87,9 @@ int download_kernel_source(build_config_t *config) {
     execute_command_safe("rm -rf linux_temp", 0, &error_ctx);
     
     // Second approach: Try standard Rockchip kernel
-    auth_url = add_github_token_to_url("https://github.com/rockchip-linux/kernel.git");
-    snprintf(cmd, sizeof(cmd), 
-             "git clone --depth 1 %s -b develop-5.10 linux_temp", auth_url);
+    repo_url = "https://github.com/rockchip-linux/kernel.git";
     
-    if (execute_command_with_retry(cmd, 1, 2) == 0) {
+    if (kernel_clone(config, repo_url, "develop-5.10", "linux_temp", 2) == 0) {
         LOG_INFO("Successfully downloaded Rockchip kernel source");
         
         // Move the contents to the final location
@@ -117,11 +107,17 @@ int download_kernel_source(build_config_t *config) {
             LOG_WARNING("Could not change to device tree directory, might need manual configuration");
         } else {
             // Download Orange Pi 5 Plus device tree file
-            auth_url = add_github_token_to_url("https://raw.githubusercontent.com/orangepi-xunlong/linux-orangepi/orange-pi-5.10-rk3588/arch/arm64/boot/dts/rockchip/rk3588-orangepi-5-plus.dts");
-            snprintf(cmd, sizeof(cmd), 
-                     "wget -O rk3588-orangepi-5-plus.dts \"%s\"", auth_url);
+            repo_url = "https://raw.githubusercontent.com/orangepi-xunlong/linux-orangepi/orange-pi-5.10-rk3588/arch/arm64/boot/dts/rockchip/rk3588-orangepi-5-plus.dts";
+            download_t dts;
+            memset(&dts, 0, sizeof(dts));
+            strcpy(dts.name, "Orange Pi 5 Plus device tree");
+            download_add_url(&dts, repo_url);
+            dts.content = DOWNLOAD_TEXT;
+            dts.revalidate = 1;
             
-            if (execute_command_with_retry(cmd, 1, 3) != 0) {
+            if (snprintf(dts.dest, sizeof(dts.dest), "%s/rk3588-orangepi-5-plus.dts",
+                         dtb_dir) >= (int)sizeof(dts.dest) ||
+                download_fetch(&dts) != ERROR_SUCCESS) {
                 LOG_WARNING("Could not download Orange Pi 5 Plus device tree, board might not be fully supported");
             }
             
@@ -144,13 +140,12 @@ int download_kernel_source(build_config_t *config) {
     // Third approach: Get mainline kernel and add Rockchip patches
     LOG_WARNING("Could not download Rockchip kernel, falling back to mainline with patches...");
     
-    auth_url = add_github_token_to_url("https://github.com/torvalds/linux.git");
-    snprintf(cmd, sizeof(cmd),
-             "git clone --depth 1 %s -b v%s linux_temp || "
-             "git clone --depth 1 %s linux_temp",
-             auth_url, config->kernel_version, auth_url);
+    repo_url = "https://github.com/torvalds/linux.git";
+    char version_tag[sizeof(config->kernel_version) + 1];
+    snprintf(version_tag, sizeof(version_tag), "v%s", config->kernel_version);
     
-    if (execute_command_with_retry(cmd, 1, 2) == 0) {
+    if (kernel_clone(config, repo_url, version_tag, "linux_temp", 2) == 0 ||
+        kernel_clone(config, repo_url, NULL, "linux_temp", 2) == 0) {
         LOG_INFO("Successfully downloaded mainline kernel source");
         
         // Move the contents to the final location
@@ -169,20 +164,30 @@ int download_kernel_source(build_config_t *config) {
         snprintf(cmd, sizeof(cmd), "mkdir -p rockchip_patches");
         execute_command_safe(cmd, 0, &error_ctx);
         
-        // Download Rockchip patches from various sources
-        const char *patch_sources[] = {
-            "https://raw.githubusercontent.com/armbian/build/master/patch/kernel/rockchip-rk3588-current",
-            "https://raw.githubusercontent.com/armbian/build/master/patch/kernel/rockchip-rk3588-edge",
-            NULL
+        // Rockchip patch series, resolved from their git tree listings
+        static const patch_source_t patch_sources[] = {
+            {"rockchip-rk3588-current", PATCH_MANIFEST_TREE,
+             "https://api.github.com/repos/armbian/build/git/trees/master:patch/kernel/rockchip-rk3588-current",
+             "https://raw.githubusercontent.com/armbian/build/master/patch/kernel/rockchip-rk3588-current"},
+            {"rockchip-rk3588-edge", PATCH_MANIFEST_TREE,
+             "https://api.github.com/repos/armbian/build/git/trees/master:patch/kernel/rockchip-rk3588-edge",
+             "https://raw.githubusercontent.com/armbian/build/master/patch/kernel/rockchip-rk3588-edge"},
+            {NULL, 0, NULL, NULL}
         };
         
-        for (int i = 0; patch_sources[i] != NULL; i++) {
-            auth_url = add_github_token_to_url(patch_sources[i]);
-            snprintf(cmd, sizeof(cmd), 
-                     "cd rockchip_patches && wget -r -np -nd -A '*.patch' \"%s/\"",
-                     auth_url);
+        for (int i = 0; patch_sources[i].name != NULL; i++) {
+            char series_dir[MAX_PATH_LEN];
+            int patch_count = 0;
+            
+            snprintf(series_dir, sizeof(series_dir), "rockchip_patches/%s", patch_sources[i].name);
+            snprintf(cmd, sizeof(cmd), "mkdir -p %s", series_dir);
+            execute_command_safe(cmd, 0, &error_ctx);
             
-            execute_command_with_retry(cmd, 1, 2);
+            if (fetch_patch_series(&patch_sources[i], series_dir, &patch_count) != ERROR_SUCCESS) {
+                LOG_WARNING("Could not fetch a Rockchip patch series, continuing without it");
+                snprintf(cmd, sizeof(cmd), "rm -rf %s", series_dir);
+                execute_command_safe(cmd, 0, &error_ctx);
+            }
         }
         
         // Apply the patches
@@ -219,14 +224,14 @@ int download_kernel_source(build_config_t *config) {
 // Download Ubuntu Rockchip patches
 int download_ubuntu_rockchip_patches(void) {
     char cmd[MAX_CMD_LEN];
-    char* auth_url;
+    const char *repo_url;
     
     LOG_INFO("Downloading Ubuntu Rockchip project components...");
     
     // Clone Ubuntu Rockchip repository
-    auth_url = add_github_token_to_url("https://github.com/Joshua-Riek/ubuntu-rockchip.git");
+    repo_url = "https://github.com/Joshua-Riek/ubuntu-rockchip.git";
     snprintf(cmd, sizeof(cmd),
-             "git clone --depth 1 %s ubuntu-rockchip", auth_url);
+             "git clone --depth 1 %s ubuntu-rockchip", repo_url);
     
     if (execute_command_with_retry(cmd, 1, 2) != 0) {
         LOG_WARNING("Failed to download Ubuntu Rockchip project components");
@@ -420,27 +425,33 @@ int build_kernel(build_config_t *config) {
     }
     
     // Build kernel image
-    snprintf(cmd, sizeof(cmd), "make -j%d Image", config->jobs);
+    snprintf(cmd, sizeof(cmd), "make %s Image", jobserver_make_args());
     if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
         LOG_ERROR("Failed to build kernel image");
         return ERROR_COMPILATION_FAILED;
     }
     
     // Build device tree blobs
-    snprintf(cmd, sizeof(cmd), "make -j%d dtbs", config->jobs);
+    snprintf(cmd, sizeof(cmd), "make %s dtbs", jobserver_make_args());
     if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
         LOG_ERROR("Failed to build device tree blobs");
         return ERROR_COMPILATION_FAILED;
     }
     
     // Build modules
-    snprintf(cmd, sizeof(cmd), "make -j%d modules", config->jobs);
+    snprintf(cmd, sizeof(cmd), "make %s modules", jobserver_make_args());
     if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
         LOG_ERROR("Failed to build kernel modules");
         return ERROR_COMPILATION_FAILED;
     }
     
     LOG_INFO("Kernel built successfully");
+    
+    // What this build read becomes the sparse checkout of the next clone
+    char source_dir[MAX_PATH_LEN];
+    snprintf(source_dir, sizeof(source_dir), "%s/linux", config->build_dir);
+    kernel_sparse_learn(config, source_dir);
+    
     return ERROR_SUCCESS;
 }
 
@@ -512,25 +523,25 @@ int download_uboot_source(build_config_t *config) {
     char cmd[MAX_CMD_LEN];
     char uboot_dir[MAX_PATH_LEN];
     error_context_t error_ctx = {0};
-    char* auth_url;
+    const char *repo_url;
     
     LOG_INFO("Downloading U-Boot source for RK3588...");
     
     snprintf(uboot_dir, sizeof(uboot_dir), "%s/u-boot", config->build_dir);
     
     // Clone U-Boot with Rockchip support
-    auth_url = add_github_token_to_url("https://github.com/u-boot/u-boot.git");
+    repo_url = "https://github.com/u-boot/u-boot.git";
     snprintf(cmd, sizeof(cmd),
              "git clone --depth 1 --branch v2024.01-rc4 %s %s",
-             auth_url, uboot_dir);
+             repo_url, uboot_dir);
     
     if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
         LOG_WARNING("Failed to clone mainline U-Boot, trying Rockchip fork...");
         
-        auth_url = add_github_token_to_url("https://github.com/rockchip-linux/u-boot.git");
+        repo_url = "https://github.com/rockchip-linux/u-boot.git";
         snprintf(cmd, sizeof(cmd),
                  "git clone --depth 1 %s %s",
-                 auth_url, uboot_dir);
+                 repo_url, uboot_dir);
         
         if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
             LOG_ERROR("Failed to download U-Boot source");
@@ -540,18 +551,18 @@ int download_uboot_source(build_config_t *config) {
     
     // Download ARM Trusted Firmware
     LOG_INFO("Downloading ARM Trusted Firmware...");
-    auth_url = add_github_token_to_url("https://github.com/ARM-software/arm-trusted-firmware.git");
+    repo_url = "https://github.com/ARM-software/arm-trusted-firmware.git";
     snprintf(cmd, sizeof(cmd),
              "git clone --depth 1 %s %s/arm-trusted-firmware",
-             auth_url, config->build_dir);
+             repo_url, config->build_dir);
     execute_command_safe(cmd, 1, &error_ctx);
     
     // Download Rockchip binary blobs
     LOG_INFO("Downloading Rockchip firmware blobs...");
-    auth_url = add_github_token_to_url("https://github.com/rockchip-linux/rkbin.git");
+    repo_url = "https://github.com/rockchip-linux/rkbin.git";
     snprintf(cmd, sizeof(cmd),
              "git clone --depth 1 %s %s/rkbin",
-             auth_url, config->build_dir);
+             repo_url, config->build_dir);
     execute_command_safe(cmd, 1, &error_ctx);
     
     LOG_INFO("U-Boot source downloaded successfully");
@@ -560,59 +571,14 @@ int download_uboot_source(build_config_t *config) {
 
 // Build U-Boot
 int build_uboot(build_config_t *config) {
-    char cmd[MAX_CMD_LEN];
-    char uboot_dir[MAX_PATH_LEN];
-    error_context_t error_ctx = {0};
-    
     LOG_INFO("Building U-Boot for Orange Pi 5 Plus...");
     
-    snprintf(uboot_dir, sizeof(uboot_dir), "%s/u-boot", config->build_dir);
-    
-    if (chdir(uboot_dir) != 0) {
-        LOG_ERROR("Failed to change to U-Boot directory");
-        return ERROR_FILE_NOT_FOUND;
-    }
-    
-    // Configure U-Boot for Orange Pi 5 Plus
-    snprintf(cmd, sizeof(cmd),
-             "make ARCH=arm CROSS_COMPILE=%s orangepi-5-plus-rk3588_defconfig",
-             config->cross_compile);
-    
-    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
-        LOG_WARNING("Orange Pi 5 Plus config not found, using generic RK3588");
-        snprintf(cmd, sizeof(cmd),
-                 "make ARCH=arm CROSS_COMPILE=%s evb-rk3588_defconfig",
-                 config->cross_compile);
-        execute_command_safe(cmd, 1, &error_ctx);
-    }
-    
-    // Build U-Boot
-    snprintf(cmd, sizeof(cmd),
-             "make ARCH=arm CROSS_COMPILE=%s -j%d",
-             config->cross_compile, config->jobs);
-    
-    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
-        LOG_ERROR("Failed to build U-Boot");
-        return ERROR_COMPILATION_FAILED;
+    // TF-A, U-Boot and rkbin go through the cached bootloader pipeline
+    int result = bootloader_build(config);
+    if (result != ERROR_SUCCESS) {
+        return result;
     }
     
-    // Build ARM Trusted Firmware
-    LOG_INFO("Building ARM Trusted Firmware...");
-    snprintf(cmd, sizeof(cmd),
-             "cd %s/arm-trusted-firmware && "
-             "make CROSS_COMPILE=%s PLAT=rk3588 bl31",
-             config->build_dir, config->cross_compile);
-    execute_command_safe(cmd, 1, &error_ctx);
-    
-    // Create final bootloader image
-    LOG_INFO("Creating bootloader image...");
-    snprintf(cmd, sizeof(cmd),
-             "%s/rkbin/tools/mkimage -n rk3588 -T rksd -d "
-             "%s/rkbin/bin/rk35/rk3588_ddr_lp4_2112MHz_lp5_2736MHz_v1.08.bin:%s/spl/u-boot-spl.bin "
-             "%s/idbloader.img",
-             config->build_dir, config->build_dir, uboot_dir, config->output_dir);
-    execute_command_safe(cmd, 1, &error_ctx);
-    
     LOG_INFO("U-Boot built successfully");
     return ERROR_SUCCESS;
 }
@@ -622,6 +588,7 @@ int build_ubuntu_rootfs(build_config_t *config) {
     char cmd[MAX_CMD_LEN];
     char rootfs_dir[MAX_PATH_LEN];
     error_context_t error_ctx = {0};
+    int result;
     
     LOG_INFO("Building Ubuntu root filesystem...");
     
@@ -637,169 +604,32 @@ int build_ubuntu_rootfs(build_config_t *config) {
         return ERROR_FILE_NOT_FOUND;
     }
     
-    // Check if debootstrap script exists for this release
-    char script_path[256];
-    snprintf(script_path, sizeof(script_path), "/usr/share/debootstrap/scripts/%s", 
-             config->ubuntu_codename);
-    
-    if (access(script_path, F_OK) != 0) {
-        char msg[512];
-        snprintf(msg, sizeof(msg), "Debootstrap script not found for Ubuntu %s (%s)", 
-                config->ubuntu_release, config->ubuntu_codename);
-        LOG_WARNING(msg);
-        LOG_INFO("Creating symlink to jammy script...");
-        
-        // Try to create the symlink
-        snprintf(cmd, sizeof(cmd), 
-                 "ln -sf /usr/share/debootstrap/scripts/jammy %s", 
-                 script_path);
-        if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
-            LOG_WARNING("Failed to create debootstrap script symlink");
-            LOG_INFO("Falling back to Ubuntu 22.04 (jammy) which is known to work");
-            
-            // Change to jammy
-            strcpy(config->ubuntu_release, "22.04");
-            strcpy(config->ubuntu_codename, "jammy");
-        }
-    }
-    
     // Suppress Python warnings for the entire process
     setenv("PYTHONWARNINGS", "ignore", 1);
     
-    // Run debootstrap first stage
-    LOG_INFO("Running debootstrap first stage...");
-    snprintf(cmd, sizeof(cmd),
-             "debootstrap --arch=arm64 --foreign --include=wget,ca-certificates,locales "
-             "%s %s http://ports.ubuntu.com/ubuntu-ports",
-             config->ubuntu_codename, rootfs_dir);
-    
-    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
-        LOG_ERROR("Failed to run debootstrap first stage");
-        LOG_ERROR("This usually means the Ubuntu release is not supported");
-        LOG_ERROR("Try using Ubuntu 22.04 (jammy) or 20.04 (focal) instead");
-        return ERROR_INSTALLATION_FAILED;
-    }
-    
-    // Check if debootstrap created the necessary files
-    char debootstrap_dir[MAX_PATH_LEN];
-    snprintf(debootstrap_dir, sizeof(debootstrap_dir), "%s/debootstrap", rootfs_dir);
-    if (access(debootstrap_dir, F_OK) != 0) {
-        LOG_ERROR("Debootstrap did not create the expected directory structure");
-        return ERROR_INSTALLATION_FAILED;
-    }
-    
-    // Copy qemu static for arm64 emulation
-    LOG_INFO("Setting up ARM64 emulation...");
-    snprintf(cmd, sizeof(cmd),
-             "cp /usr/bin/qemu-aarch64-static %s/usr/bin/",
-             rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    // Mount essential filesystems for chroot
-    LOG_INFO("Mounting essential filesystems for chroot environment...");
-    snprintf(cmd, sizeof(cmd), "mount -t proc /proc %s/proc", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    snprintf(cmd, sizeof(cmd), "mount -t sysfs /sys %s/sys", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    snprintf(cmd, sizeof(cmd), "mount -o bind /dev %s/dev", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    snprintf(cmd, sizeof(cmd), "mount -o bind /dev/pts %s/dev/pts", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    // Run debootstrap second stage
-    LOG_INFO("Running debootstrap second stage...");
-    snprintf(cmd, sizeof(cmd),
-             "chroot %s /debootstrap/debootstrap --second-stage",
-             rootfs_dir);
-    
-    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
-        LOG_ERROR("Failed to run debootstrap second stage");
+    // Bootstrap the base system plus the distribution packages
+    result = bootstrap_rootfs(config, rootfs_dir);
+    if (result != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to bootstrap the root filesystem");
         goto cleanup_mounts;
     }
     
-    // Configure locales IMMEDIATELY after debootstrap
-    LOG_INFO("Configuring locales...");
-    
-    // Create locale.gen file
-    snprintf(cmd, sizeof(cmd), "echo 'en_US.UTF-8 UTF-8' > %s/etc/locale.gen", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    // Generate locales
-    snprintf(cmd, sizeof(cmd), "chroot %s locale-gen", rootfs_dir);
-    execute_command_safe(cmd, 1, &error_ctx);
-    
-    // Set default locale
-    snprintf(cmd, sizeof(cmd), "echo 'LANG=en_US.UTF-8' > %s/etc/default/locale", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    // Also set locale environment for subsequent commands
-    snprintf(cmd, sizeof(cmd), 
-             "echo 'export LANG=en_US.UTF-8\n"
-             "export LANGUAGE=en_US:en\n"
-             "export LC_ALL=en_US.UTF-8' >> %s/etc/environment",
-             rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    // Configure apt sources
-    LOG_INFO("Configuring package sources...");
-    
-    // Create apt directory if it doesn't exist
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s/etc/apt", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    FILE *sources_file = fopen("/tmp/sources.list", "w");
-    if (sources_file) {
-        fprintf(sources_file,
-                "deb http://ports.ubuntu.com/ubuntu-ports %s main restricted universe multiverse\n"
-                "deb http://ports.ubuntu.com/ubuntu-ports %s-updates main restricted universe multiverse\n"
-                "deb http://ports.ubuntu.com/ubuntu-ports %s-security main restricted universe multiverse\n",
-                config->ubuntu_codename, config->ubuntu_codename, config->ubuntu_codename);
-        fclose(sources_file);
-        
-        snprintf(cmd, sizeof(cmd),
-                 "cp /tmp/sources.list %s/etc/apt/sources.list",
-                 rootfs_dir);
-        execute_command_safe(cmd, 0, &error_ctx);
-    }
-    
-    // Update package database in chroot with locale set
-    LOG_INFO("Updating package database...");
-    snprintf(cmd, sizeof(cmd),
-             "chroot %s /bin/bash -c 'export LANG=en_US.UTF-8; export LC_ALL=en_US.UTF-8; apt update'",
-             rootfs_dir);
-    execute_command_safe(cmd, 1, &error_ctx);
-    
-    // First, ensure locale package is properly installed and configured
-    LOG_INFO("Ensuring locale system is properly configured...");
-    snprintf(cmd, sizeof(cmd),
-             "chroot %s /bin/bash -c 'export DEBIAN_FRONTEND=noninteractive; "
-             "apt-get install -y locales language-pack-en'",
-             rootfs_dir);
-    execute_command_safe(cmd, 1, &error_ctx);
-    
-    // Reconfigure locales to be absolutely sure
-    snprintf(cmd, sizeof(cmd),
-             "chroot %s /bin/bash -c 'export DEBIAN_FRONTEND=noninteractive; "
-             "locale-gen en_US.UTF-8; update-locale LANG=en_US.UTF-8'",
-             rootfs_dir);
-    execute_command_safe(cmd, 1, &error_ctx);
+    // Configure and compile the locales once
+    configure_locales(config, rootfs_dir);
     
     // Create a wrapper script for locale-aware apt operations
+    char locales[MAX_LOCALES][64];
+    get_locale_set(config, locales, MAX_LOCALES);
     FILE *apt_wrapper = fopen("/tmp/apt-wrapper.sh", "w");
     if (apt_wrapper) {
         fprintf(apt_wrapper,
                 "#!/bin/bash\n"
-                "export LANG=en_US.UTF-8\n"
-                "export LANGUAGE=en_US:en\n"
-                "export LC_ALL=en_US.UTF-8\n"
-                "export LC_CTYPE=en_US.UTF-8\n"
-                "export LC_MESSAGES=en_US.UTF-8\n"
+                "export LANG=%s\n"
+                "export LC_ALL=%s\n"
                 "export DEBIAN_FRONTEND=noninteractive\n"
                 "export PYTHONWARNINGS=ignore\n"
-                "exec \"$@\"\n");
+                "exec \"$@\"\n",
+                locales[0], locales[0]);
         fclose(apt_wrapper);
         
         snprintf(cmd, sizeof(cmd), "cp /tmp/apt-wrapper.sh %s/usr/local/bin/apt-wrapper", rootfs_dir);
@@ -809,33 +639,6 @@ int build_ubuntu_rootfs(build_config_t *config) {
         execute_command_safe(cmd, 0, &error_ctx);
     }
     
-    // Install base packages based on distribution type
-    const char *base_packages = "ubuntu-minimal init systemd sudo";
-    const char *extra_packages = "";
-    
-    switch (config->distro_type) {
-        case DISTRO_DESKTOP:
-            extra_packages = "ubuntu-desktop network-manager";
-            break;
-        case DISTRO_SERVER:
-            extra_packages = "ubuntu-server openssh-server";
-            break;
-        case DISTRO_EMULATION:
-            extra_packages = "xserver-xorg-core openbox";
-            break;
-        case DISTRO_MINIMAL:
-            extra_packages = "";
-            break;
-        default:
-            break;
-    }
-    
-    LOG_INFO("Installing base system packages...");
-    snprintf(cmd, sizeof(cmd),
-             "chroot %s /usr/local/bin/apt-wrapper apt-get install -y %s %s",
-             rootfs_dir, base_packages, extra_packages);
-    execute_command_safe(cmd, 1, &error_ctx);
-    
     // Configure hostname
     LOG_INFO("Configuring hostname...");
     snprintf(cmd, sizeof(cmd), "echo '%s' > %s/etc/hostname",
@@ -861,15 +664,15 @@ int build_ubuntu_rootfs(build_config_t *config) {
     // Create user
     LOG_INFO("Creating user account...");
     snprintf(cmd, sizeof(cmd),
-             "chroot %s useradd -m -s /bin/bash -G sudo,audio,video %s",
-             rootfs_dir, config->username);
-    execute_command_safe(cmd, 0, &error_ctx);
+             "useradd -m -s /bin/bash -G sudo,audio,video %s",
+             config->username);
+    execute_chroot_command(rootfs_dir, cmd, 0, &error_ctx);
     
     // Set password
     snprintf(cmd, sizeof(cmd),
              "echo '%s:%s' | chroot %s chpasswd",
              config->username, config->password, rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
+    execute_emulated_command(cmd, 0, &error_ctx);
     
     // Enable sudo for user
     snprintf(cmd, sizeof(cmd),
@@ -881,44 +684,25 @@ int build_ubuntu_rootfs(build_config_t *config) {
              rootfs_dir, config->username);
     execute_command_safe(cmd, 0, &error_ctx);
     
-    // Clean up qemu binary
-    LOG_INFO("Cleaning up emulation files...");
-    snprintf(cmd, sizeof(cmd), "rm -f %s/usr/bin/qemu-aarch64-static", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
+    // No more packages are installed in this stage
+    restore_locale_gen(rootfs_dir);
     
-    // Success - now unmount filesystems
     LOG_INFO("Ubuntu root filesystem created successfully");
     
 cleanup_mounts:
     // Cleanup - unmount filesystems in reverse order
-    LOG_INFO("Unmounting chroot filesystems...");
+    unmount_chroot_filesystems(rootfs_dir);
     
-    // Kill any processes still using the chroot
-    snprintf(cmd, sizeof(cmd), "fuser -km %s || true", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    // Give processes time to exit
-    sleep(1);
-    
-    // Unmount in reverse order
-    snprintf(cmd, sizeof(cmd), "umount %s/dev/pts || true", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    snprintf(cmd, sizeof(cmd), "umount %s/dev || true", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    snprintf(cmd, sizeof(cmd), "umount %s/sys || true", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    snprintf(cmd, sizeof(cmd), "umount %s/proc || true", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    // If there was an error during rootfs creation, return it
-    if (execute_command_safe("true", 0, &error_ctx) != 0) {
-        return ERROR_INSTALLATION_FAILED;
-    }
+    // Clean up qemu binary
+    cleanup_chroot_emulation(rootfs_dir);
     
-    return ERROR_SUCCESS;
+    return result == ERROR_SUCCESS ? ERROR_SUCCESS : ERROR_INSTALLATION_FAILED;
+}
+
+// Path of the SD image
+void system_image_path(const build_config_t *config, char *path, size_t size) {
+    snprintf(path, size, "%s/orangepi5plus-%s-%s.img",
+             config->output_dir, config->ubuntu_codename, config->kernel_version);
 }
 
 // Create system image
@@ -929,15 +713,14 @@ int create_system_image(build_config_t *config) {
     
     LOG_INFO("Creating system image...");
     
-    snprintf(image_path, sizeof(image_path), 
-             "%s/orangepi5plus-%s-%s.img",
-             config->output_dir, config->ubuntu_codename, config->kernel_version);
+    system_image_path(config, image_path, sizeof(image_path));
     
-    // Create empty image file
+    // Create a sparse image file; space never written stays a hole, which
+    // the compression stage does not have to read
     LOG_INFO("Creating image file...");
     snprintf(cmd, sizeof(cmd),
-             "dd if=/dev/zero of=%s bs=1M count=%s status=progress",
-             image_path, config->image_size);
+             "rm -f %s && truncate -s %sM %s",
+             image_path, config->image_size, image_path);
     
     if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
         LOG_ERROR("Failed to create image file");
@@ -952,11 +735,12 @@ int create_system_image(build_config_t *config) {
     
     // Create partitions
     snprintf(cmd, sizeof(cmd),
-             "parted -s %s mkpart loader 64s 8MiB", image_path);
+             "parted -s %s mkpart loader 64s 16MiB", image_path);
     execute_command_safe(cmd, 1, &error_ctx);
     
+    // u-boot.itb is at 8MiB, inside the loader partition
     snprintf(cmd, sizeof(cmd),
-             "parted -s %s mkpart boot fat32 8MiB 256MiB", image_path);
+             "parted -s %s mkpart boot fat32 16MiB 256MiB", image_path);
     execute_command_safe(cmd, 1, &error_ctx);
     
     snprintf(cmd, sizeof(cmd),
@@ -1025,6 +809,11 @@ int create_system_image(build_config_t *config) {
              config->output_dir, loop_dev);
     execute_command_safe(cmd, 1, &error_ctx);
     
+    snprintf(cmd, sizeof(cmd),
+             "dd if=%s/u-boot.itb of=%s seek=16384 conv=notrunc",
+             config->output_dir, loop_dev);
+    execute_command_safe(cmd, 1, &error_ctx);
+    
     // Create boot configuration
     execute_command_safe("mkdir -p /mnt/boot/extlinux", 0, &error_ctx);
     FILE *boot_cfg = fopen("/mnt/boot/extlinux/extlinux.conf", "w");
@@ -1049,6 +838,7 @@ int create_system_image(build_config_t *config) {
     char msg[512];
     snprintf(msg, sizeof(msg), "System image created successfully: %s", image_path);
     LOG_INFO(msg);
+    metrics_record_image(image_path);
     
     return ERROR_SUCCESS;
 }
@@ -1071,67 +861,66 @@ int install_system_packages(build_config_t *config) {
     
     // Mount filesystems if not already mounted
     LOG_INFO("Ensuring filesystems are mounted...");
-    snprintf(cmd, sizeof(cmd), "mountpoint -q %s/proc || mount -t proc /proc %s/proc", 
-             rootfs_dir, rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    snprintf(cmd, sizeof(cmd), "mountpoint -q %s/sys || mount -t sysfs /sys %s/sys", 
-             rootfs_dir, rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    snprintf(cmd, sizeof(cmd), "mountpoint -q %s/dev || mount -o bind /dev %s/dev", 
-             rootfs_dir, rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
-    
-    snprintf(cmd, sizeof(cmd), "mountpoint -q %s/dev/pts || mount -o bind /dev/pts %s/dev/pts", 
-             rootfs_dir, rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
+    mount_chroot_filesystems(rootfs_dir);
     
     // Set environment variables to suppress warnings
     setenv("PYTHONWARNINGS", "ignore", 1);
     
+    // The interpreter copied by build_ubuntu_rootfs() is gone by now
+    if (prepare_chroot_emulation(rootfs_dir) != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to set up ARM64 emulation");
+        return ERROR_DEPENDENCY_MISSING;
+    }
+    
+    // Locales are compiled once below, not by every package that ships some
+    if (divert_locale_gen(rootfs_dir) != ERROR_SUCCESS) {
+        unmount_chroot_filesystems(rootfs_dir);
+        cleanup_chroot_emulation(rootfs_dir);
+        return ERROR_INSTALLATION_FAILED;
+    }
+    
     // Use the apt-wrapper if it exists, otherwise create locale environment
     char apt_command[256];
-    if (access("/usr/local/bin/apt-wrapper", F_OK) == 0) {
+    char apt_wrapper[MAX_PATH_LEN + 32];
+    snprintf(apt_wrapper, sizeof(apt_wrapper), "%s/usr/local/bin/apt-wrapper", rootfs_dir);
+    if (access(apt_wrapper, F_OK) == 0) {
         strcpy(apt_command, "/usr/local/bin/apt-wrapper apt-get");
     } else {
-        strcpy(apt_command, "/bin/bash -c 'export LANG=en_US.UTF-8; export LC_ALL=en_US.UTF-8; "
-                           "export LC_CTYPE=en_US.UTF-8; export LC_MESSAGES=en_US.UTF-8; "
-                           "export DEBIAN_FRONTEND=noninteractive; apt-get'");
+        strcpy(apt_command, "/usr/bin/env LANG=C.UTF-8 DEBIAN_FRONTEND=noninteractive apt-get");
     }
     
     // Common packages for all distributions
     const char *common_packages = 
         "linux-firmware wireless-tools wpasupplicant "
         "network-manager usbutils pciutils i2c-tools "
-        "htop nano vim curl wget git sudo locales "
-        "software-properties-common dbus-x11 language-pack-en";
+        "htop nano vim curl wget git sudo "
+        "software-properties-common dbus-x11";
     
     snprintf(cmd, sizeof(cmd),
-             "chroot %s %s install -y %s",
-             rootfs_dir, apt_command, common_packages);
-    execute_command_safe(cmd, 1, &error_ctx);
+             "%s install -y %s",
+             apt_command, common_packages);
+    execute_chroot_command(rootfs_dir, cmd, 1, &error_ctx);
     
     // Distribution-specific packages
     switch (config->distro_type) {
         case DISTRO_DESKTOP:
             LOG_INFO("Installing desktop packages...");
             snprintf(cmd, sizeof(cmd),
-                     "chroot %s %s install -y "
+                     "%s install -y "
                      "gnome-shell gdm3 gnome-terminal firefox "
                      "gnome-tweaks gnome-system-monitor",
-                     rootfs_dir, apt_command);
-            execute_command_safe(cmd, 1, &error_ctx);
+                     apt_command);
+            execute_chroot_command(rootfs_dir, cmd, 1, &error_ctx);
             break;
             
         case DISTRO_SERVER:
             LOG_INFO("Installing server packages...");
             snprintf(cmd, sizeof(cmd),
-                     "chroot %s %s install -y "
+                     "%s install -y "
                      "openssh-server fail2ban ufw "
                      "docker.io docker-compose",
-                     rootfs_dir, apt_command);
-            execute_command_safe(cmd, 1, &error_ctx);
+                     apt_command);
+            execute_chroot_command(rootfs_dir, cmd, 1, &error_ctx);
             break;
             
         case DISTRO_EMULATION:
@@ -1147,32 +936,21 @@ int install_system_packages(build_config_t *config) {
     if (config->install_gpu_blobs) {
         LOG_INFO("Installing GPU support packages...");
         snprintf(cmd, sizeof(cmd),
-                 "chroot %s %s install -y "
+                 "%s install -y "
                  "mesa-utils glmark2-es2 vulkan-tools",
-                 rootfs_dir, apt_command);
-        execute_command_safe(cmd, 1, &error_ctx);
+                 apt_command);
+        execute_chroot_command(rootfs_dir, cmd, 1, &error_ctx);
     }
     
-    // Final locale configuration to ensure everything is set
-    LOG_INFO("Finalizing locale configuration...");
-    snprintf(cmd, sizeof(cmd),
-             "chroot %s /bin/bash -c 'locale-gen en_US.UTF-8 && update-locale LANG=en_US.UTF-8'",
-             rootfs_dir);
-    execute_command_safe(cmd, 1, &error_ctx);
-    
-    // Unmount filesystems
-    LOG_INFO("Unmounting filesystems...");
-    snprintf(cmd, sizeof(cmd), "umount %s/dev/pts || true", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
+    restore_locale_gen(rootfs_dir);
     
-    snprintf(cmd, sizeof(cmd), "umount %s/dev || true", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
+    // Packages above may have reset locale.gen; recompiles only if the archive changed
+    configure_locales(config, rootfs_dir);
     
-    snprintf(cmd, sizeof(cmd), "umount %s/sys || true", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
+    // Unmount filesystems
+    unmount_chroot_filesystems(rootfs_dir);
     
-    snprintf(cmd, sizeof(cmd), "umount %s/proc || true", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
+    cleanup_chroot_emulation(rootfs_dir);
     
     LOG_INFO("System packages installed successfully");
     return ERROR_SUCCESS;
@@ -1194,50 +972,11 @@ int configure_system_services(build_config_t *config) {
         return ERROR_FILE_NOT_FOUND;
     }
     
-    // Enable essential services
-    const char *enable_services[] = {
-        "systemd-networkd",
-        "systemd-resolved",
-        "ssh",
-        NULL
-    };
-    
-    for (int i = 0; enable_services[i] != NULL; i++) {
-        snprintf(cmd, sizeof(cmd),
-                 "chroot %s systemctl enable %s",
-                 rootfs_dir, enable_services[i]);
-        execute_command_safe(cmd, 0, &error_ctx);
-    }
-    
-    // Distribution-specific service configuration
-    switch (config->distro_type) {
-        case DISTRO_DESKTOP:
-            snprintf(cmd, sizeof(cmd),
-                     "chroot %s systemctl enable gdm3",
-                     rootfs_dir);
-            execute_command_safe(cmd, 0, &error_ctx);
-            break;
-            
-        case DISTRO_SERVER:
-            // Configure firewall
-            snprintf(cmd, sizeof(cmd),
-                     "chroot %s ufw default deny incoming",
-                     rootfs_dir);
-            execute_command_safe(cmd, 0, &error_ctx);
-            
-            snprintf(cmd, sizeof(cmd),
-                     "chroot %s ufw default allow outgoing",
-                     rootfs_dir);
-            execute_command_safe(cmd, 0, &error_ctx);
-            
-            snprintf(cmd, sizeof(cmd),
-                     "chroot %s ufw allow ssh",
-                     rootfs_dir);
-            execute_command_safe(cmd, 0, &error_ctx);
-            break;
-            
-        default:
-            break;
+    // Services and firewall are configured from the host, no chroot needed
+    int services_result = configure_services_offline(config, rootfs_dir);
+    if (services_result != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to configure services offline");
+        return services_result;
     }
     
     // Create netplan directory
@@ -1330,13 +1069,13 @@ int setup_libreelec(build_config_t *config) {
     LOG_WARNING("LibreELEC is a complete OS - this will prepare the build environment");
     
     char cmd[MAX_CMD_LEN];
-    char* auth_url;
+    const char *repo_url;
     
     // Clone LibreELEC source
-    auth_url = add_github_token_to_url("https://github.com/LibreELEC/LibreELEC.tv.git");
+    repo_url = "https://github.com/LibreELEC/LibreELEC.tv.git";
     snprintf(cmd, sizeof(cmd), 
              "cd %s && git clone --depth 1 %s libreelec",
-             config->build_dir, auth_url);
+             config->build_dir, repo_url);
     
     if (execute_command_safe(cmd, 1, NULL) != 0) {
         LOG_ERROR("Failed to clone LibreELEC source");
@@ -1365,15 +1104,15 @@ int setup_emulationstation(build_config_t *config) {
     
     char cmd[MAX_CMD_LEN];
     char es_dir[MAX_PATH_LEN];
-    char* auth_url;
+    const char *repo_url;
     
     snprintf(es_dir, sizeof(es_dir), "%s/emulationstation", config->build_dir);
     
     // Clone EmulationStation
-    auth_url = add_github_token_to_url("https://github.com/RetroPie/EmulationStation.git");
+    repo_url = "https://github.com/RetroPie/EmulationStation.git";
     snprintf(cmd, sizeof(cmd), 
              "git clone --recursive %s %s",
-             auth_url, es_dir);
+             repo_url, es_dir);
     
     if (execute_command_safe(cmd, 1, NULL) != 0) {
         LOG_ERROR("Failed to clone EmulationStation");
@@ -1384,8 +1123,8 @@ int setup_emulationstation(build_config_t *config) {
     snprintf(cmd, sizeof(cmd), 
              "cd %s && mkdir build && cd build && "
              "cmake .. -DFREETYPE_INCLUDE_DIRS=/usr/include/freetype2/ && "
-             "make -j%d",
-             es_dir, config->jobs);
+             "make %s",
+             es_dir, jobserver_make_args());
     
     if (execute_command_safe(cmd, 1, NULL) != 0) {
         LOG_WARNING("Failed to build EmulationStation");
@@ -1413,15 +1152,15 @@ int setup_retropie(build_config_t *config) {
     
     char cmd[MAX_CMD_LEN];
     char retropie_dir[MAX_PATH_LEN];
-    char* auth_url;
+    const char *repo_url;
     
     snprintf(retropie_dir, sizeof(retropie_dir), "%s/RetroPie-Setup", config->build_dir);
     
     // Clone RetroPie-Setup
-    auth_url = add_github_token_to_url("https://github.com/RetroPie/RetroPie-Setup.git");
+    repo_url = "https://github.com/RetroPie/RetroPie-Setup.git";
     snprintf(cmd, sizeof(cmd), 
              "git clone --depth 1 %s %s",
-             auth_url, retropie_dir);
+             repo_url, retropie_dir);
     
     if (execute_command_safe(cmd, 1, NULL) != 0) {
         LOG_ERROR("Failed to clone RetroPie-Setup");
@@ -0,0 +1,320 @@
+/*
+ * locale.c - Locale configuration for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file computes the requested locale set once, writes the locale
+ * configuration of the rootfs from the host and compiles the locale archive
+ * a single time, with the host localedef when its glibc matches the target
+ * and inside the chroot otherwise. Nothing is compiled when the archive
+ * already contains every requested locale. While packages are installed,
+ * locale-gen is diverted to a no-op so maintainer scripts do not compile
+ * the archive behind the builder's back.
+ */
+
+#include "builder.h"
+#include <gnu/libc-version.h>
+
+#define LOCALE_GEN_PATH "/usr/sbin/locale-gen"
+#define LOCALE_LIST_PATH "/tmp/opi5plus-locale-archive.list"
+
+// Split a locale name such as en_US.UTF-8 into its parts
+static void split_locale_name(const char *name, char *language, size_t language_size,
+                              char *charmap, size_t charmap_size) {
+    const char *dot = strchr(name, '.');
+    size_t len = dot ? (size_t)(dot - name) : strlen(name);
+
+    if (len >= language_size) len = language_size - 1;
+    memcpy(language, name, len);
+    language[len] = '\0';
+
+    snprintf(charmap, charmap_size, "%s", dot ? dot + 1 : "UTF-8");
+}
+
+// Normalize a locale name the way localedef stores it (en_US.UTF-8 -> en_US.utf8)
+static void normalize_locale_name(const char *name, char *out, size_t size) {
+    char language[64];
+    char charmap[32];
+    size_t pos;
+
+    split_locale_name(name, language, sizeof(language), charmap, sizeof(charmap));
+    pos = snprintf(out, size, "%s.", language);
+
+    for (const char *c = charmap; *c && pos + 1 < size; c++) {
+        if (*c == '-' || *c == '_') continue;
+        out[pos++] = tolower((unsigned char)*c);
+    }
+    out[pos < size ? pos : size - 1] = '\0';
+}
+
+// Compute the requested locale set; the first entry is the default locale
+int get_locale_set(build_config_t *config, char locales[][64], int max) {
+    char buffer[sizeof(config->locales)];
+    char *saveptr = NULL;
+    int count = 0;
+
+    snprintf(buffer, sizeof(buffer), "%s", config->locales);
+
+    for (char *item = strtok_r(buffer, ", ", &saveptr); item != NULL && count < max;
+         item = strtok_r(NULL, ", ", &saveptr)) {
+        int duplicate = 0;
+
+        // Bare names get the UTF-8 charmap
+        char name[64];
+        snprintf(name, sizeof(name), strchr(item, '.') ? "%s" : "%s.UTF-8", item);
+
+        for (int i = 0; i < count; i++) {
+            if (strcmp(locales[i], name) == 0) duplicate = 1;
+        }
+        if (duplicate) continue;
+
+        strcpy(locales[count++], name);
+    }
+
+    if (count == 0 && max > 0) {
+        strcpy(locales[count++], "en_US.UTF-8");
+    }
+
+    return count;
+}
+
+// Read the glibc release (e.g. 2.39) installed in the rootfs
+static int get_rootfs_glibc_version(const char *rootfs_dir, char *version, size_t size) {
+    char path[MAX_PATH_LEN];
+    char line[512];
+    int in_libc = 0;
+
+    snprintf(path, sizeof(path), "%s/var/lib/dpkg/status", rootfs_dir);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "Package: ", 9) == 0) {
+            in_libc = strcmp(line + 9, "libc6\n") == 0;
+        } else if (in_libc && strncmp(line, "Version: ", 9) == 0) {
+            // Debian revision and any epoch are not part of the glibc release
+            const char *start = strchr(line + 9, ':');
+            start = start ? start + 1 : line + 9;
+            size_t len = strcspn(start, "-+~\n");
+            if (len >= size) len = size - 1;
+            memcpy(version, start, len);
+            version[len] = '\0';
+            fclose(fp);
+            return 0;
+        }
+    }
+
+    fclose(fp);
+    return -1;
+}
+
+// Check whether the locale archive already holds every requested locale
+static int locale_archive_matches(const char *rootfs_dir, char locales[][64], int count, int host_localedef) {
+    char cmd[MAX_CMD_LEN];
+    char path[MAX_PATH_LEN];
+    char line[128];
+    char archived[64][64];
+    int archived_count = 0;
+    error_context_t error_ctx = {0};
+
+    if (snprintf(path, sizeof(path), "%s/usr/lib/locale/locale-archive", rootfs_dir) >= (int)sizeof(path) ||
+        access(path, F_OK) != 0) {
+        return 0;
+    }
+    if (snprintf(path, sizeof(path), "%s" LOCALE_LIST_PATH, rootfs_dir) >= (int)sizeof(path)) return 0;
+
+    // Listing only reads the archive header, which any localedef understands
+    int result;
+    if (host_localedef) {
+        snprintf(cmd, sizeof(cmd), "localedef --prefix=%s --list-archive > %s 2>/dev/null", rootfs_dir, path);
+        result = execute_command_safe(cmd, 0, &error_ctx);
+    } else {
+        result = execute_chroot_command(rootfs_dir,
+                                        "/bin/sh -c 'localedef --list-archive > " LOCALE_LIST_PATH " 2>/dev/null'",
+                                        0, &error_ctx);
+    }
+
+    FILE *fp = result == 0 ? fopen(path, "r") : NULL;
+    if (!fp) {
+        unlink(path);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp) && archived_count < 64) {
+        line[strcspn(line, "\n")] = '\0';
+        // Longer names cannot be one of the requested locales
+        if (snprintf(archived[archived_count], sizeof(archived[0]), "%s", line) < (int)sizeof(archived[0])) {
+            archived_count++;
+        }
+    }
+    fclose(fp);
+    unlink(path);
+
+    for (int i = 0; i < count; i++) {
+        char normalized[64];
+        int found = 0;
+
+        normalize_locale_name(locales[i], normalized, sizeof(normalized));
+        for (int j = 0; j < archived_count && !found; j++) {
+            found = strcmp(archived[j], normalized) == 0;
+        }
+        if (!found) return 0;
+    }
+
+    return 1;
+}
+
+// Write locale.gen and the default locale of the rootfs
+static int write_locale_files(const char *rootfs_dir, char locales[][64], int count) {
+    char path[MAX_PATH_LEN];
+    char language[64];
+    char charmap[32];
+
+    snprintf(path, sizeof(path), "%s/etc/locale.gen", rootfs_dir);
+    FILE *fp = fopen(path, "w");
+    if (!fp) return ERROR_PERMISSION_DENIED;
+    for (int i = 0; i < count; i++) {
+        split_locale_name(locales[i], language, sizeof(language), charmap, sizeof(charmap));
+        fprintf(fp, "%s %s\n", locales[i], charmap);
+    }
+    fclose(fp);
+
+    snprintf(path, sizeof(path), "%s/etc/default", rootfs_dir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/etc/default/locale", rootfs_dir);
+    fp = fopen(path, "w");
+    if (!fp) return ERROR_PERMISSION_DENIED;
+
+    // LANGUAGE lists the default locale first, then its bare language
+    split_locale_name(locales[0], language, sizeof(language), charmap, sizeof(charmap));
+    char *underscore = strchr(language, '_');
+    fprintf(fp, "LANG=%s\n", locales[0]);
+    if (underscore) {
+        fprintf(fp, "LANGUAGE=%s:%.*s\n", language, (int)(underscore - language), language);
+    } else {
+        fprintf(fp, "LANGUAGE=%s\n", language);
+    }
+    fclose(fp);
+
+    return ERROR_SUCCESS;
+}
+
+// Configure and compile the requested locales in the rootfs
+int configure_locales(build_config_t *config, const char *rootfs_dir) {
+    char locales[MAX_LOCALES][64];
+    char target_glibc[32] = {0};
+    char cmd[MAX_CMD_LEN];
+    char msg[256];
+    error_context_t error_ctx = {0};
+    int count = get_locale_set(config, locales, MAX_LOCALES);
+
+    LOG_INFO("Configuring locales...");
+
+    if (write_locale_files(rootfs_dir, locales, count) != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to write the locale configuration");
+        return ERROR_PERMISSION_DENIED;
+    }
+
+    // The archive format follows glibc, so the host localedef is only used
+    // when it comes from the same glibc release as the rootfs
+    int host_localedef = system("command -v localedef >/dev/null 2>&1") == 0;
+    int use_host = 0;
+    if (host_localedef && get_rootfs_glibc_version(rootfs_dir, target_glibc, sizeof(target_glibc)) == 0) {
+        use_host = strcmp(gnu_get_libc_version(), target_glibc) == 0;
+    }
+
+    if (locale_archive_matches(rootfs_dir, locales, count, host_localedef)) {
+        snprintf(msg, sizeof(msg), "Locale archive already contains all %d requested locales, "
+                 "skipping compilation", count);
+        LOG_INFO(msg);
+        return ERROR_SUCCESS;
+    }
+
+    snprintf(msg, sizeof(msg), "Compiling %d locales with the %s localedef (target glibc %s)",
+             count, use_host ? "host" : "rootfs", strlen(target_glibc) ? target_glibc : "unknown");
+    LOG_INFO(msg);
+
+    // One command compiles the whole set
+    int len = 0;
+    if (use_host) {
+        len = snprintf(cmd, sizeof(cmd), "export I18NPATH=%s/usr/share/i18n; mkdir -p %s/usr/lib/locale",
+                       rootfs_dir, rootfs_dir);
+    } else {
+        len = snprintf(cmd, sizeof(cmd), "/bin/sh -c 'mkdir -p /usr/lib/locale");
+    }
+
+    for (int i = 0; i < count && len < (int)sizeof(cmd); i++) {
+        char language[64];
+        char charmap[32];
+
+        split_locale_name(locales[i], language, sizeof(language), charmap, sizeof(charmap));
+        if (use_host) {
+            len += snprintf(cmd + len, sizeof(cmd) - len,
+                            "; localedef --prefix=%s -c -i %s -f %s %s",
+                            rootfs_dir, language, charmap, locales[i]);
+        } else {
+            len += snprintf(cmd + len, sizeof(cmd) - len,
+                            "; localedef -c -i %s -f %s %s", language, charmap, locales[i]);
+        }
+    }
+    if (!use_host && len < (int)sizeof(cmd)) {
+        len += snprintf(cmd + len, sizeof(cmd) - len, "'");
+    }
+
+    if (len >= (int)sizeof(cmd)) {
+        LOG_ERROR("Too many locales requested");
+        return ERROR_UNKNOWN;
+    }
+
+    // localedef -c exits with 1 for warnings only, so the archive decides
+    int result = use_host ? execute_command_safe(cmd, 1, &error_ctx)
+                          : execute_chroot_command(rootfs_dir, cmd, 1, &error_ctx);
+    if (result != 0 && !locale_archive_matches(rootfs_dir, locales, count, host_localedef)) {
+        LOG_ERROR("Failed to compile the locale archive");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Divert locale-gen to a no-op so package maintainer scripts skip compiling
+// the archive; dpkg must already be installed in the rootfs
+int divert_locale_gen(const char *rootfs_dir) {
+    char path[MAX_PATH_LEN];
+    error_context_t error_ctx = {0};
+
+    if (execute_chroot_command(rootfs_dir,
+                               "dpkg-divert --quiet --local --rename "
+                               "--divert " LOCALE_GEN_PATH ".distrib --add " LOCALE_GEN_PATH,
+                               0, &error_ctx) != 0) {
+        LOG_ERROR("Failed to divert locale-gen in the rootfs");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    if (snprintf(path, sizeof(path), "%s" LOCALE_GEN_PATH, rootfs_dir) >= (int)sizeof(path)) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        LOG_ERROR("Failed to write the locale-gen placeholder");
+        return ERROR_PERMISSION_DENIED;
+    }
+    fprintf(fp, "#!/bin/sh\n# Locales are compiled by the Orange Pi 5 Plus builder\nexit 0\n");
+    fclose(fp);
+    chmod(path, 0755);
+
+    return ERROR_SUCCESS;
+}
+
+// Put the real locale-gen back once no more packages are installed
+void restore_locale_gen(const char *rootfs_dir) {
+    char path[MAX_PATH_LEN];
+    error_context_t error_ctx = {0};
+
+    if (snprintf(path, sizeof(path), "%s" LOCALE_GEN_PATH, rootfs_dir) >= (int)sizeof(path)) return;
+    unlink(path);
+
+    if (execute_chroot_command(rootfs_dir,
+                               "dpkg-divert --quiet --local --rename --remove " LOCALE_GEN_PATH,
+                               0, &error_ctx) != 0) {
+        LOG_WARNING("Failed to remove the locale-gen diversion from the rootfs");
+    }
+}
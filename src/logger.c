@@ -0,0 +1,385 @@
+/*
+ * logger.c - Asynchronous logging for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file implements the log backend behind log_message_detailed(). Any
+ * thread queues messages into a bounded lock-free ring buffer; a single
+ * writer thread formats them and writes them to the log files in batches,
+ * and to the console through a non-blocking descriptor so that a slow
+ * terminal can never stall the build. logger_flush() is called at stage
+ * boundaries, before user input and from the signal handler.
+ */
+
+#include "builder.h"
+#include <pthread.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define LOG_RING_SLOTS 512             // Power of two
+#define LOG_MESSAGE_MAX (MAX_CMD_LEN + 128)
+#define LOG_CONSOLE_BUFFER (64 * 1024)
+#define LOG_FLUSH_TIMEOUT_MS 2000
+#define LOG_CONSOLE_WAIT_MS 100
+
+// One queued message
+typedef struct {
+    atomic_size_t sequence;
+    log_level_t level;
+    struct timespec timestamp;
+    int line;
+    char file[32];
+    char message[LOG_MESSAGE_MAX];
+} log_slot_t;
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARNING", "ERROR", "CRITICAL"};
+static const char *level_colors[] = {COLOR_RESET, COLOR_CYAN, COLOR_YELLOW, COLOR_RED, COLOR_MAGENTA};
+
+static log_slot_t log_ring[LOG_RING_SLOTS];
+static atomic_size_t enqueue_pos;
+static atomic_size_t written_pos;
+static size_t dequeue_pos = 0;          // Owned by the writer thread
+
+static pthread_t writer_thread;
+static sem_t writer_wakeup;
+static atomic_int logger_running;
+static atomic_int logger_stopping;
+static int exit_handler_registered = 0;
+
+// Console output that the terminal has not accepted yet
+static int console_fd = -1;
+static char console_buffer[LOG_CONSOLE_BUFFER];
+static size_t console_length = 0;
+static unsigned long console_dropped = 0;
+static atomic_int console_idle;
+
+// Cached timestamp text; ctime() per message is what this file replaces.
+// Per thread, since synchronous writes format in the calling thread.
+static __thread time_t cached_second = 0;
+static __thread char cached_timestamp[32] = "Unknown";
+
+// Format a realtime timestamp like ctime() without the trailing newline
+static const char* format_timestamp(const struct timespec *ts) {
+    if (ts->tv_sec != cached_second) {
+        struct tm tm_info;
+        localtime_r(&ts->tv_sec, &tm_info);
+        strftime(cached_timestamp, sizeof(cached_timestamp), "%a %b %e %H:%M:%S %Y", &tm_info);
+        cached_second = ts->tv_sec;
+    }
+    return cached_timestamp;
+}
+
+// Open a console descriptor that does not share blocking mode with stdout
+static int open_console_fd(void) {
+    struct stat st;
+
+    // Regular files never block, and reopening them would lose the offset
+    if (fstat(STDOUT_FILENO, &st) == 0 && !S_ISREG(st.st_mode)) {
+        int fd = open("/proc/self/fd/1", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd >= 0) return fd;
+    }
+
+    return fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+}
+
+// Write as much pending console output as the terminal accepts right now
+static void drain_console(int timeout_ms) {
+    if (console_fd < 0) {
+        console_length = 0;
+        return;
+    }
+
+    while (console_length > 0) {
+        struct pollfd pfd = { .fd = console_fd, .events = POLLOUT };
+        if (poll(&pfd, 1, timeout_ms) <= 0) return;
+
+        ssize_t written = write(console_fd, console_buffer, console_length);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            console_length = 0;
+            return;
+        }
+        memmove(console_buffer, console_buffer + written, console_length - written);
+        console_length -= written;
+    }
+}
+
+// Queue one console line, dropping it when the terminal is too far behind
+static void queue_console_line(const char *text, size_t len) {
+    if (console_dropped > 0 && console_length == 0) {
+        char notice[128];
+        int n = snprintf(notice, sizeof(notice),
+                         "%s[%lu log lines not shown on the console, see " LOG_FILE "]%s\n",
+                         COLOR_YELLOW, console_dropped, COLOR_RESET);
+        memcpy(console_buffer, notice, n);
+        console_length = n;
+        console_dropped = 0;
+    }
+
+    if (console_length + len > sizeof(console_buffer)) {
+        drain_console(0);
+    }
+    if (console_length + len > sizeof(console_buffer)) {
+        console_dropped++;
+        return;
+    }
+    memcpy(console_buffer + console_length, text, len);
+    console_length += len;
+}
+
+// Format one message into the log files and the console queue
+static void write_log_slot(const log_slot_t *slot, int async) {
+    const char *timestamp = format_timestamp(&slot->timestamp);
+
+    if (async) {
+        char console_line[LOG_MESSAGE_MAX + 160];
+        int len = snprintf(console_line, sizeof(console_line), "[%s%s%s] %s%s:%d%s %s%s%s\n",
+                           COLOR_CYAN, timestamp, COLOR_RESET,
+                           COLOR_BLUE, slot->file, slot->line, COLOR_RESET,
+                           level_colors[slot->level], slot->message, COLOR_RESET);
+        if (len > 0) {
+            queue_console_line(console_line, (size_t)len < sizeof(console_line) ? (size_t)len
+                                                                                 : sizeof(console_line) - 1);
+        }
+    } else {
+        printf("[%s%s%s] %s%s:%d%s %s%s%s\n",
+               COLOR_CYAN, timestamp, COLOR_RESET,
+               COLOR_BLUE, slot->file, slot->line, COLOR_RESET,
+               level_colors[slot->level], slot->message, COLOR_RESET);
+    }
+
+    if (log_fp) {
+        fprintf(log_fp, "[%s] [%s] %s:%d %s\n",
+                timestamp, level_names[slot->level], slot->file, slot->line, slot->message);
+    }
+
+    if (slot->level >= LOG_LEVEL_ERROR && error_log_fp) {
+        fprintf(error_log_fp, "[%s] [%s] %s:%d %s\n",
+                timestamp, level_names[slot->level], slot->file, slot->line, slot->message);
+    }
+}
+
+// Drain the ring buffer; returns the number of messages written
+static int drain_ring(void) {
+    int count = 0;
+
+    while (1) {
+        log_slot_t *slot = &log_ring[dequeue_pos & (LOG_RING_SLOTS - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+
+        if (sequence != dequeue_pos + 1) break;
+
+        write_log_slot(slot, 1);
+        atomic_store_explicit(&slot->sequence, dequeue_pos + LOG_RING_SLOTS, memory_order_release);
+        dequeue_pos++;
+        count++;
+    }
+
+    return count;
+}
+
+// Write the published messages still queued, skipping slots that were claimed
+// but never filled (a producer interrupted by the signal that stops the build)
+static void drain_ring_final(void) {
+    size_t end = atomic_load(&enqueue_pos);
+
+    for (; dequeue_pos != end; dequeue_pos++) {
+        log_slot_t *slot = &log_ring[dequeue_pos & (LOG_RING_SLOTS - 1)];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) == dequeue_pos + 1) {
+            write_log_slot(slot, 1);
+        }
+    }
+}
+
+// Background writer: batches file writes and feeds the console when it is ready
+static void* logger_writer_main(void *arg) {
+    sigset_t blocked;
+
+    struct timespec stop_deadline = {0, 0};
+
+    (void)arg;
+
+    // Signals are handled by the build threads, which may flush the logger
+    sigfillset(&blocked);
+    pthread_sigmask(SIG_BLOCK, &blocked, NULL);
+
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 50 * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        sem_timedwait(&writer_wakeup, &deadline);
+
+        int stopping = atomic_load(&logger_stopping);
+        int expired = 0;
+
+        // Shutting down waits a bounded time for messages still being written
+        if (stopping) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (stop_deadline.tv_sec == 0) {
+                stop_deadline = now;
+                stop_deadline.tv_sec += LOG_FLUSH_TIMEOUT_MS / 1000;
+            }
+            expired = now.tv_sec > stop_deadline.tv_sec ||
+                      (now.tv_sec == stop_deadline.tv_sec && now.tv_nsec >= stop_deadline.tv_nsec);
+        }
+
+        int drained = drain_ring();
+        if (expired) drain_ring_final();
+        if (drained > 0 || expired) {
+            if (log_fp) fflush(log_fp);
+            if (error_log_fp) fflush(error_log_fp);
+        }
+        atomic_store_explicit(&written_pos, dequeue_pos, memory_order_release);
+
+        drain_console(stopping ? 1000 : 0);
+        atomic_store(&console_idle, console_length == 0);
+
+        if (stopping && (expired || dequeue_pos == atomic_load(&enqueue_pos))) break;
+    }
+
+    return NULL;
+}
+
+// Start the background writer
+int logger_start(void) {
+    if (atomic_load(&logger_running)) return ERROR_SUCCESS;
+
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++) {
+        atomic_init(&log_ring[i].sequence, i);
+    }
+    atomic_store(&enqueue_pos, 0);
+    atomic_store(&written_pos, 0);
+    atomic_store(&logger_stopping, 0);
+    dequeue_pos = 0;
+
+    fflush(stdout);
+    console_fd = open_console_fd();
+
+    if (sem_init(&writer_wakeup, 0, 0) != 0 ||
+        pthread_create(&writer_thread, NULL, logger_writer_main, NULL) != 0) {
+        if (console_fd >= 0) close(console_fd);
+        console_fd = -1;
+        return ERROR_UNKNOWN;
+    }
+
+    atomic_store(&logger_running, 1);
+    if (!exit_handler_registered) {
+        atexit(logger_shutdown);
+        exit_handler_registered = 1;
+    }
+    return ERROR_SUCCESS;
+}
+
+// Wait until everything queued so far has been written
+void logger_flush(void) {
+    if (!atomic_load(&logger_running)) {
+        fflush(stdout);
+        if (log_fp) fflush(log_fp);
+        return;
+    }
+
+    // Bounded, so a producer interrupted mid-message cannot hang a signal handler
+    size_t target = atomic_load(&enqueue_pos);
+    struct timespec pause = { 0, 200 * 1000 };
+    int waited_us = 0;
+    for (; waited_us < LOG_FLUSH_TIMEOUT_MS * 1000; waited_us += 200) {
+        if (atomic_load_explicit(&written_pos, memory_order_acquire) >= target) break;
+        sem_post(&writer_wakeup);
+        nanosleep(&pause, NULL);
+    }
+
+    // Give the terminal a moment to catch up, but never wait on it for long
+    for (waited_us = 0; waited_us < LOG_CONSOLE_WAIT_MS * 1000; waited_us += 200) {
+        if (atomic_load(&console_idle)) break;
+        sem_post(&writer_wakeup);
+        nanosleep(&pause, NULL);
+    }
+}
+
+// Flush and stop the background writer; logging falls back to synchronous writes.
+// The writer gives up on unpublished slots after LOG_FLUSH_TIMEOUT_MS, so this
+// also returns when called from a signal that interrupted a producer.
+void logger_shutdown(void) {
+    if (!atomic_exchange(&logger_running, 0)) return;
+
+    atomic_store(&logger_stopping, 1);
+    sem_post(&writer_wakeup);
+    pthread_join(writer_thread, NULL);
+    sem_destroy(&writer_wakeup);
+
+    if (console_fd >= 0) {
+        close(console_fd);
+        console_fd = -1;
+    }
+}
+
+// Start a writer of its own in a forked child; the parent's writer thread
+// does not exist there. The parent flushes before it forks.
+void logger_restart_after_fork(void) {
+    if (!atomic_exchange(&logger_running, 0)) return;
+
+    if (console_fd >= 0) {
+        close(console_fd);
+        console_fd = -1;
+    }
+    console_length = 0;
+    logger_start();
+}
+
+// Queue a message, or write it directly while the writer is not running
+void logger_write(log_level_t level, const char *message, const char *file, int line) {
+    log_slot_t local;
+    log_slot_t *slot = &local;
+    size_t pos = 0;
+
+    if (atomic_load(&logger_running)) {
+        // Bounded MPMC queue (Vyukov): claim a slot whose sequence equals the position
+        pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        while (1) {
+            slot = &log_ring[pos & (LOG_RING_SLOTS - 1)];
+            size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+            if (diff == 0) {
+                if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                          memory_order_relaxed, memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Full: wake the writer and wait for it to free a slot
+                struct timespec pause = { 0, 100 * 1000 };
+                sem_post(&writer_wakeup);
+                nanosleep(&pause, NULL);
+                pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+            } else {
+                pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+            }
+        }
+    }
+
+    slot->level = level;
+    slot->line = line;
+    clock_gettime(CLOCK_REALTIME, &slot->timestamp);
+
+    const char *basename = strrchr(file, '/');
+    strncpy(slot->file, basename ? basename + 1 : file, sizeof(slot->file) - 1);
+    slot->file[sizeof(slot->file) - 1] = '\0';
+    strncpy(slot->message, message, sizeof(slot->message) - 1);
+    slot->message[sizeof(slot->message) - 1] = '\0';
+
+    if (slot == &local) {
+        write_log_slot(slot, 0);
+        if (log_fp) fflush(log_fp);
+        if (error_log_fp) fflush(error_log_fp);
+        return;
+    }
+
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    sem_post(&writer_wakeup);
+}
@@ -0,0 +1,628 @@
+/*
+ * manifest.c - Build manifests for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file reads and writes build manifests: INI files that declare every
+ * build_config_t setting plus per-stage limits, so a build can run without
+ * menus or a long command line. A manifest is checked as a whole - every
+ * bad line is reported with its line number - and applied only when it has
+ * no errors. Batch builds write the configuration they ran with back out as
+ * build-manifest.ini next to the image.
+ *
+ *   [build]            kernel_version, jobs, command_timeout, ...
+ *   [target]           distro_type, ubuntu_release, emu_platform
+ *   [components]       kernel, rootfs, uboot, image, spi_image
+ *   [gpu]              blobs, opencl, vulkan
+ *   [rootfs]           bootstrap_engine, slim, locales, ...
+ *   [image]            size, hostname, compress, ...
+ *   [matrix]           target (repeatable), parallel
+ *   [stage NAME]       cpu.weight, memory.max, io.weight, timeout, idle-timeout
+ *
+ * Lines starting with # or ; are comments. Values may be double-quoted,
+ * which is the only way to give an empty string; there are no trailing
+ * comments, so a password may contain any character.
+ */
+
+#include "builder.h"
+#include <limits.h>
+#include <stddef.h>
+
+#define MANIFEST_LINE_LEN 1024
+
+typedef enum {
+    MANIFEST_STRING,            // char array
+    MANIFEST_INT,               // int within min..max
+    MANIFEST_BOOL,              // true/false, yes/no, on/off, 1/0
+    MANIFEST_SIZE,              // long long bytes, K/M/G/T suffixes
+    MANIFEST_DURATION,          // int seconds, s/m/h suffixes
+    MANIFEST_ENUM,              // int from a name table
+    MANIFEST_MEGABYTES,         // Number of MB within min..max, kept as text
+    MANIFEST_SLIM,              // Slimming policy flags
+    MANIFEST_RELEASE,           // Ubuntu version or codename, sets both
+    MANIFEST_DISTRO,            // Distribution type
+    MANIFEST_PLATFORM,          // Emulation platform
+    MANIFEST_TARGET             // One matrix target, repeatable
+} manifest_type_t;
+
+typedef struct {
+    const char *name;
+    int value;
+} manifest_name_t;
+
+typedef struct {
+    const char *section;
+    const char *key;
+    manifest_type_t type;
+    size_t offset;
+    size_t size;
+    int min;
+    int max;
+    const manifest_name_t *names;
+} manifest_field_t;
+
+static const manifest_name_t manifest_log_levels[] = {
+    {"debug", LOG_LEVEL_DEBUG},
+    {"info", LOG_LEVEL_INFO},
+    {"warning", LOG_LEVEL_WARNING},
+    {"error", LOG_LEVEL_ERROR},
+    {"critical", LOG_LEVEL_CRITICAL},
+    {NULL, 0}
+};
+
+static const manifest_name_t manifest_bootstrap_engines[] = {
+    {"debootstrap", BOOTSTRAP_DEBOOTSTRAP},
+    {"single-pass", BOOTSTRAP_SINGLE_PASS},
+    {NULL, 0}
+};
+
+static const manifest_name_t manifest_compress_formats[] = {
+    {"none", COMPRESS_NONE},
+    {"zstd", COMPRESS_ZSTD},
+    {"xz", COMPRESS_XZ},
+    {NULL, 0}
+};
+
+// Names the slimming policy is written back with; parse_slim_policy reads them
+static const manifest_name_t manifest_slim_flags[] = {
+    {"apt", SLIM_APT_CACHE},
+    {"docs", SLIM_DOCS},
+    {"locales", SLIM_LOCALES},
+    {"strip-dev", SLIM_STRIP_DEV},
+    {NULL, 0}
+};
+
+#define FIELD(section, key, type, member) \
+    {section, key, type, offsetof(build_config_t, member), sizeof(((build_config_t *)0)->member), 0, 0, NULL}
+#define FIELD_RANGE(section, key, type, member, min, max) \
+    {section, key, type, offsetof(build_config_t, member), sizeof(((build_config_t *)0)->member), min, max, NULL}
+#define FIELD_ENUM(section, key, member, names) \
+    {section, key, MANIFEST_ENUM, offsetof(build_config_t, member), sizeof(((build_config_t *)0)->member), 0, 0, names}
+
+// Every manifest key, in the order manifest_write() writes them
+static const manifest_field_t manifest_fields[] = {
+    FIELD("build", "kernel_version", MANIFEST_STRING, kernel_version),
+    FIELD("build", "build_dir", MANIFEST_STRING, build_dir),
+    FIELD("build", "output_dir", MANIFEST_STRING, output_dir),
+    FIELD("build", "cross_compile", MANIFEST_STRING, cross_compile),
+    FIELD("build", "arch", MANIFEST_STRING, arch),
+    FIELD("build", "defconfig", MANIFEST_STRING, defconfig),
+    FIELD_RANGE("build", "jobs", MANIFEST_INT, jobs, 1, 128),
+    FIELD("build", "adaptive_jobs", MANIFEST_BOOL, adaptive_jobs),
+    FIELD("build", "job_memory", MANIFEST_SIZE, job_memory),
+    FIELD("build", "command_timeout", MANIFEST_DURATION, command_timeout),
+    FIELD("build", "idle_timeout", MANIFEST_DURATION, idle_timeout),
+    FIELD("build", "verbose", MANIFEST_BOOL, verbose),
+    FIELD("build", "clean_build", MANIFEST_BOOL, clean_build),
+    FIELD("build", "continue_on_error", MANIFEST_BOOL, continue_on_error),
+    FIELD_ENUM("build", "log_level", log_level, manifest_log_levels),
+    FIELD("build", "batch", MANIFEST_BOOL, batch),
+    FIELD("build", "cache_dir", MANIFEST_STRING, cache_dir),
+    FIELD_RANGE("build", "download_segments", MANIFEST_INT, download_segments, 1, 16),
+    FIELD("build", "kernel_sparse", MANIFEST_BOOL, kernel_sparse),
+    FIELD("build", "metrics_file", MANIFEST_STRING, metrics_file),
+
+    FIELD("target", "distro_type", MANIFEST_DISTRO, distro_type),
+    FIELD("target", "ubuntu_release", MANIFEST_RELEASE, ubuntu_release),
+    FIELD("target", "emu_platform", MANIFEST_PLATFORM, emu_platform),
+
+    FIELD("components", "kernel", MANIFEST_BOOL, build_kernel),
+    FIELD("components", "rootfs", MANIFEST_BOOL, build_rootfs),
+    FIELD("components", "uboot", MANIFEST_BOOL, build_uboot),
+    FIELD("components", "image", MANIFEST_BOOL, create_image),
+    FIELD("components", "spi_image", MANIFEST_BOOL, create_spi_image),
+
+    FIELD("gpu", "blobs", MANIFEST_BOOL, install_gpu_blobs),
+    FIELD("gpu", "opencl", MANIFEST_BOOL, enable_opencl),
+    FIELD("gpu", "vulkan", MANIFEST_BOOL, enable_vulkan),
+
+    FIELD_ENUM("rootfs", "bootstrap_engine", bootstrap_engine, manifest_bootstrap_engines),
+    FIELD("rootfs", "benchmark_bootstrap", MANIFEST_BOOL, benchmark_bootstrap),
+    FIELD("rootfs", "slim", MANIFEST_SLIM, slim_policy),
+    FIELD_RANGE("rootfs", "slim_report_top", MANIFEST_INT, slim_report_top, 1, 1000),
+    FIELD("rootfs", "locales", MANIFEST_STRING, locales),
+
+    FIELD_RANGE("image", "size", MANIFEST_MEGABYTES, image_size, 4096, 1 << 20),
+    FIELD("image", "hostname", MANIFEST_STRING, hostname),
+    FIELD("image", "username", MANIFEST_STRING, username),
+    FIELD("image", "password", MANIFEST_STRING, password),
+    FIELD_ENUM("image", "compress", compress_format, manifest_compress_formats),
+    FIELD_RANGE("image", "compress_level", MANIFEST_INT, compress_level, -1, 22),
+    FIELD_RANGE("image", "compress_threads", MANIFEST_INT, compress_threads, 0, 256),
+
+    FIELD("matrix", "target", MANIFEST_TARGET, matrix_targets),
+    FIELD_RANGE("matrix", "parallel", MANIFEST_INT, matrix_parallel, 0, MAX_MATRIX_TARGETS),
+};
+
+#define MANIFEST_FIELD_COUNT (sizeof(manifest_fields) / sizeof(manifest_fields[0]))
+
+// Look up a value in a name table, -1 when unknown
+static int manifest_value(const manifest_name_t *table, const char *name) {
+    for (int i = 0; table[i].name; i++) {
+        if (strcasecmp(table[i].name, name) == 0) return table[i].value;
+    }
+    return -1;
+}
+
+// Look up a name in a name table
+static const char* manifest_name(const manifest_name_t *table, int value) {
+    for (int i = 0; table[i].name; i++) {
+        if (table[i].value == value) return table[i].name;
+    }
+    return "unknown";
+}
+
+// Parse a boolean, -1 when it is not one
+static int manifest_bool(const char *text) {
+    if (strcasecmp(text, "true") == 0 || strcasecmp(text, "yes") == 0 ||
+        strcasecmp(text, "on") == 0 || strcmp(text, "1") == 0) return 1;
+    if (strcasecmp(text, "false") == 0 || strcasecmp(text, "no") == 0 ||
+        strcasecmp(text, "off") == 0 || strcmp(text, "0") == 0) return 0;
+    return -1;
+}
+
+// Parse a whole decimal integer
+static int manifest_int(const char *text, int *value) {
+    char *end = NULL;
+    long parsed = strtol(text, &end, 10);
+
+    if (end == text || *end != '\0' || parsed < INT_MIN || parsed > INT_MAX) return -1;
+    *value = (int)parsed;
+    return 0;
+}
+
+// Strip leading and trailing white space in place
+static char* manifest_trim(char *text) {
+    char *end;
+
+    while (isspace((unsigned char)*text)) text++;
+    end = text + strlen(text);
+    while (end > text && isspace((unsigned char)end[-1])) *--end = '\0';
+    return text;
+}
+
+// Find the field of a section and key
+static const manifest_field_t* manifest_find_field(const char *section, const char *key) {
+    for (size_t i = 0; i < MANIFEST_FIELD_COUNT; i++) {
+        if (strcmp(manifest_fields[i].section, section) == 0 &&
+            strcmp(manifest_fields[i].key, key) == 0) return &manifest_fields[i];
+    }
+    return NULL;
+}
+
+// Whether a section name is one the manifest knows
+static int manifest_known_section(const char *section) {
+    for (size_t i = 0; i < MANIFEST_FIELD_COUNT; i++) {
+        if (strcmp(manifest_fields[i].section, section) == 0) return 1;
+    }
+    return 0;
+}
+
+// Set one field from its text; returns NULL or what is wrong with the value
+static const char* manifest_apply(build_config_t *config, const manifest_field_t *field,
+                                  const char *value, int *targets_seen) {
+    char *member = (char *)config + field->offset;
+    int number;
+
+    switch (field->type) {
+        case MANIFEST_STRING:
+            if (strlen(value) >= field->size) return "value is too long";
+            strcpy(member, value);
+            return NULL;
+
+        case MANIFEST_INT:
+            if (manifest_int(value, &number) != 0) return "expected a number";
+            if (number < field->min || number > field->max) return "number out of range";
+            *(int *)member = number;
+            return NULL;
+
+        case MANIFEST_BOOL:
+            number = manifest_bool(value);
+            if (number < 0) return "expected true or false";
+            *(int *)member = number;
+            return NULL;
+
+        case MANIFEST_SIZE: {
+            long long size = parse_size(value);
+            if (size <= 0) return "expected a size such as 512M or 2G";
+            *(long long *)member = size;
+            return NULL;
+        }
+
+        case MANIFEST_DURATION:
+            number = parse_duration(value);
+            if (number < 0) return "expected a duration such as 90s, 30m or 2h";
+            *(int *)member = number;
+            return NULL;
+
+        case MANIFEST_ENUM:
+            number = manifest_value(field->names, value);
+            if (number < 0) return "unknown name";
+            *(int *)member = number;
+            return NULL;
+
+        case MANIFEST_MEGABYTES:
+            if (manifest_int(value, &number) != 0) return "expected a number of MB";
+            if (number < field->min || number > field->max) return "size out of range";
+            snprintf(member, field->size, "%d", number);
+            return NULL;
+
+        case MANIFEST_SLIM:
+            number = parse_slim_policy(value);
+            if (number < 0) return "expected apt, docs, locales, strip-dev, default, all or none";
+            *(int *)member = number;
+            return NULL;
+
+        case MANIFEST_RELEASE: {
+            const ubuntu_release_t *release = find_ubuntu_release(value);
+            if (!release) return "unknown Ubuntu release";
+            strncpy(config->ubuntu_release, release->version, sizeof(config->ubuntu_release) - 1);
+            config->ubuntu_release[sizeof(config->ubuntu_release) - 1] = '\0';
+            strncpy(config->ubuntu_codename, release->codename, sizeof(config->ubuntu_codename) - 1);
+            config->ubuntu_codename[sizeof(config->ubuntu_codename) - 1] = '\0';
+            return NULL;
+        }
+
+        case MANIFEST_DISTRO:
+            number = parse_distro_type(value);
+            if (number < 0) return "unknown distribution type";
+            config->distro_type = number;
+            return NULL;
+
+        case MANIFEST_PLATFORM:
+            number = parse_emu_platform(value);
+            if (number < 0) return "unknown emulation platform";
+            config->emu_platform = number;
+            return NULL;
+
+        case MANIFEST_TARGET:
+            // The manifest's targets replace any given before it
+            if (!*targets_seen) config->matrix_count = 0;
+            *targets_seen = 1;
+            if (parse_matrix_targets(config, value) != ERROR_SUCCESS) return "invalid matrix target";
+            return NULL;
+    }
+
+    return "unsupported field";
+}
+
+// Report one manifest error
+static void manifest_error(const char *path, int line, const char *what, int *errors) {
+    char msg[MANIFEST_LINE_LEN + MAX_PATH_LEN];
+
+    snprintf(msg, sizeof(msg), "%s:%d: %s", path, line, what);
+    LOG_ERROR(msg);
+    (*errors)++;
+}
+
+// Settings no single key can check
+static void manifest_check(const build_config_t *config, const char *path, int *errors) {
+    char msg[256];
+
+    if (config->emu_platform != EMU_NONE && config->distro_type != DISTRO_EMULATION) {
+        snprintf(msg, sizeof(msg), "%s: emu_platform %s needs distro_type emulation", path,
+                 emu_platform_name(config->emu_platform));
+        LOG_ERROR(msg);
+        (*errors)++;
+    }
+    if ((config->enable_opencl || config->enable_vulkan) && !config->install_gpu_blobs) {
+        snprintf(msg, sizeof(msg), "%s: gpu opencl and vulkan need gpu blobs", path);
+        LOG_ERROR(msg);
+        (*errors)++;
+    }
+    if (config->compress_format == COMPRESS_XZ && config->compress_level > 9) {
+        snprintf(msg, sizeof(msg), "%s: compress_level %d is beyond xz's 0-9", path,
+                 config->compress_level);
+        LOG_ERROR(msg);
+        (*errors)++;
+    }
+    if (config->compress_format == COMPRESS_ZSTD && config->compress_level == 0) {
+        snprintf(msg, sizeof(msg), "%s: compress_level 0 is below zstd's 1-22", path);
+        LOG_ERROR(msg);
+        (*errors)++;
+    }
+}
+
+// Load a manifest over the configuration; nothing is applied unless the
+// whole file is valid
+int manifest_load(build_config_t *config, const char *path) {
+    char line[MANIFEST_LINE_LEN];
+    char section[96] = "";
+    char stage[64] = "";
+    int section_bad = 0;
+    char what[MANIFEST_LINE_LEN + 64];
+    char msg[MAX_PATH_LEN + 64];
+    unsigned char seen[MANIFEST_FIELD_COUNT] = {0};
+    int targets_seen = 0;
+    int line_number = 0;
+    int errors = 0;
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        snprintf(msg, sizeof(msg), "Cannot open manifest %s: %s", path, strerror(errno));
+        LOG_ERROR(msg);
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    // Keys land in a copy; the configuration only changes once all of them passed
+    build_config_t *scratch = malloc(sizeof(*scratch));
+    if (!scratch) {
+        fclose(fp);
+        return ERROR_UNKNOWN;
+    }
+    *scratch = *config;
+
+    while (fgets(line, sizeof(line), fp)) {
+        line_number++;
+
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] != '\n' && !feof(fp)) {
+            int c;
+            while ((c = fgetc(fp)) != EOF && c != '\n') {}
+            manifest_error(path, line_number, "line is too long", &errors);
+            continue;
+        }
+
+        char *text = manifest_trim(line);
+        if (*text == '\0' || *text == '#' || *text == ';') continue;
+
+        // [section] or [stage NAME]
+        if (*text == '[') {
+            char *close = strchr(text, ']');
+            if (!close || *manifest_trim(close + 1) != '\0') {
+                manifest_error(path, line_number, "expected [section]", &errors);
+                section[0] = '\0';
+                section_bad = 1;
+                continue;
+            }
+            *close = '\0';
+            char *name = manifest_trim(text + 1);
+            stage[0] = '\0';
+            section_bad = 0;
+            if (strncmp(name, "stage", 5) == 0 && isspace((unsigned char)name[5])) {
+                char *stage_name = manifest_trim(name + 5);
+                if (strlen(stage_name) >= sizeof(stage) || strchr(stage_name, ':')) {
+                    manifest_error(path, line_number, "invalid stage name", &errors);
+                    section[0] = '\0';
+                    section_bad = 1;
+                    continue;
+                }
+                strcpy(stage, stage_name);
+                strcpy(section, "stage");
+            } else if (manifest_known_section(name)) {
+                strcpy(section, name);
+            } else {
+                snprintf(what, sizeof(what), "unknown section [%s]", name);
+                manifest_error(path, line_number, what, &errors);
+                section[0] = '\0';
+                section_bad = 1;
+            }
+            continue;
+        }
+
+        char *equals = strchr(text, '=');
+        if (!equals) {
+            manifest_error(path, line_number, "expected key = value", &errors);
+            continue;
+        }
+        *equals = '\0';
+        char *key = manifest_trim(text);
+        char *value = manifest_trim(equals + 1);
+        len = strlen(value);
+        if (len >= 2 && value[0] == '"' && value[len - 1] == '"') {
+            value[len - 1] = '\0';
+            value++;
+        }
+
+        // Keys of a section already reported as bad are not reported again
+        if (section[0] == '\0') {
+            if (!section_bad) manifest_error(path, line_number, "key outside of a section", &errors);
+            continue;
+        }
+
+        if (strcmp(section, "stage") == 0) {
+            char spec[MANIFEST_LINE_LEN + 128];
+            snprintf(spec, sizeof(spec), "%s:%s=%s", stage, key, value);
+            if (parse_stage_limit(scratch, spec) != ERROR_SUCCESS) {
+                snprintf(what, sizeof(what), "invalid limit %s = %s for stage %s", key, value, stage);
+                manifest_error(path, line_number, what, &errors);
+            }
+            continue;
+        }
+
+        const manifest_field_t *field = manifest_find_field(section, key);
+        if (!field) {
+            snprintf(what, sizeof(what), "unknown key %s in [%s]", key, section);
+            manifest_error(path, line_number, what, &errors);
+            continue;
+        }
+        if (field->type != MANIFEST_TARGET && seen[field - manifest_fields]++) {
+            snprintf(what, sizeof(what), "%s.%s is set twice", section, key);
+            manifest_error(path, line_number, what, &errors);
+            continue;
+        }
+
+        const char *problem = manifest_apply(scratch, field, value, &targets_seen);
+        if (problem) {
+            snprintf(what, sizeof(what), "%s.%s = %s: %s", section, key, value, problem);
+            manifest_error(path, line_number, what, &errors);
+        }
+    }
+    fclose(fp);
+
+    manifest_check(scratch, path, &errors);
+
+    if (errors > 0) {
+        snprintf(msg, sizeof(msg), "Manifest %s has %d error%s, nothing applied", path, errors,
+                 errors == 1 ? "" : "s");
+        LOG_ERROR(msg);
+        free(scratch);
+        return ERROR_UNKNOWN;
+    }
+
+    *config = *scratch;
+    free(scratch);
+
+    snprintf(msg, sizeof(msg), "Loaded manifest %s", path);
+    LOG_INFO(msg);
+    return ERROR_SUCCESS;
+}
+
+// Write a size with the largest suffix that keeps it whole
+static void manifest_write_size(FILE *fp, long long bytes) {
+    static const char suffixes[] = "TGMK";
+
+    if (bytes < 0) {
+        fprintf(fp, "max");
+        return;
+    }
+    for (int i = 0; suffixes[i]; i++) {
+        long long unit = 1LL << (10 * (4 - i));
+        if (bytes >= unit && bytes % unit == 0) {
+            fprintf(fp, "%lld%c", bytes / unit, suffixes[i]);
+            return;
+        }
+    }
+    fprintf(fp, "%lld", bytes);
+}
+
+// Write the value of one field
+static void manifest_write_value(FILE *fp, const build_config_t *config, const manifest_field_t *field) {
+    const char *member = (const char *)config + field->offset;
+    int value = 0;
+
+    switch (field->type) {
+        case MANIFEST_STRING:
+            fprintf(fp, "\"%s\"", member);
+            break;
+        case MANIFEST_MEGABYTES:
+            fprintf(fp, "%s", member);
+            break;
+        case MANIFEST_INT:
+        case MANIFEST_DURATION:
+            fprintf(fp, "%d", *(const int *)member);
+            break;
+        case MANIFEST_BOOL:
+            fprintf(fp, "%s", *(const int *)member ? "true" : "false");
+            break;
+        case MANIFEST_SIZE:
+            manifest_write_size(fp, *(const long long *)member);
+            break;
+        case MANIFEST_ENUM:
+            fprintf(fp, "%s", manifest_name(field->names, *(const int *)member));
+            break;
+        case MANIFEST_SLIM:
+            for (int i = 0; manifest_slim_flags[i].name; i++) {
+                if (config->slim_policy & manifest_slim_flags[i].value) {
+                    fprintf(fp, "%s%s", value++ ? "," : "", manifest_slim_flags[i].name);
+                }
+            }
+            if (value == 0) fprintf(fp, "none");
+            break;
+        case MANIFEST_RELEASE:
+            fprintf(fp, "%s", config->ubuntu_release);
+            break;
+        case MANIFEST_DISTRO:
+            fprintf(fp, "%s", distro_type_name(config->distro_type));
+            break;
+        case MANIFEST_PLATFORM:
+            fprintf(fp, "%s", emu_platform_name(config->emu_platform));
+            break;
+        case MANIFEST_TARGET:
+            break;
+    }
+}
+
+// Write the configuration as a manifest that manifest_load() reads back
+// unchanged; written next to the final path, then renamed over it
+int manifest_write(const build_config_t *config, const char *path) {
+    char tmp_path[MAX_PATH_LEN + 8];
+    char msg[MAX_PATH_LEN + 64];
+    const char *section = "";
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    // The manifest holds the image password
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    FILE *fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!fp) {
+        if (fd >= 0) close(fd);
+        snprintf(msg, sizeof(msg), "Cannot write manifest %s: %s", tmp_path, strerror(errno));
+        LOG_ERROR(msg);
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    fprintf(fp, "# Orange Pi 5 Plus build manifest, builder %s\n", VERSION);
+    fprintf(fp, "# Rebuild with: --batch --manifest %s\n", path);
+
+    for (size_t i = 0; i < MANIFEST_FIELD_COUNT; i++) {
+        const manifest_field_t *field = &manifest_fields[i];
+
+        if (strcmp(section, field->section) != 0) {
+            section = field->section;
+            fprintf(fp, "\n[%s]\n", section);
+        }
+        if (field->type == MANIFEST_TARGET) {
+            for (int t = 0; t < config->matrix_count; t++) {
+                const build_target_t *target = &config->matrix_targets[t];
+                fprintf(fp, "%s = %s:%s", field->key, distro_type_name(target->distro_type),
+                        target->ubuntu_release);
+                if (target->emu_platform != EMU_NONE) {
+                    fprintf(fp, ":%s", emu_platform_name(target->emu_platform));
+                }
+                fprintf(fp, "\n");
+            }
+            continue;
+        }
+        fprintf(fp, "%s = ", field->key);
+        manifest_write_value(fp, config, field);
+        fprintf(fp, "\n");
+    }
+
+    for (int i = 0; i < config->stage_limit_count; i++) {
+        const stage_limits_t *limits = &config->stage_limits[i];
+
+        fprintf(fp, "\n[stage %s]\n", limits->stage);
+        if (limits->cpu_weight) fprintf(fp, "cpu.weight = %d\n", limits->cpu_weight);
+        if (limits->memory_max) {
+            fprintf(fp, "memory.max = ");
+            manifest_write_size(fp, limits->memory_max);
+            fprintf(fp, "\n");
+        }
+        if (limits->io_weight) fprintf(fp, "io.weight = %d\n", limits->io_weight);
+        if (limits->command_timeout) fprintf(fp, "timeout = %d\n", limits->command_timeout);
+        if (limits->idle_timeout) fprintf(fp, "idle-timeout = %d\n", limits->idle_timeout);
+    }
+
+    int failed = ferror(fp);
+    if (fclose(fp) != 0) failed = 1;
+    if (failed || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        snprintf(msg, sizeof(msg), "Cannot write manifest %s", path);
+        LOG_ERROR(msg);
+        return ERROR_UNKNOWN;
+    }
+
+    snprintf(msg, sizeof(msg), "Build manifest written to %s", path);
+    LOG_INFO(msg);
+    return ERROR_SUCCESS;
+}
@@ -0,0 +1,506 @@
+/*
+ * matrix.c - Build matrix for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file builds a list of targets (distribution type, Ubuntu release,
+ * emulation platform) in one run. The stages every target shares - kernel,
+ * GPU stack and bootloader - run once. Each target then runs its rootfs and
+ * image stages in a forked child with an output and build directory of its
+ * own, several at a time within the job budget; their make jobs draw from
+ * the same jobserver. A combined report of all targets ends the run.
+ */
+
+#include "builder.h"
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+typedef struct {
+    const char *name;
+    int value;
+} matrix_name_t;
+
+static const matrix_name_t matrix_distro_names[] = {
+    {"desktop", DISTRO_DESKTOP},
+    {"server", DISTRO_SERVER},
+    {"emulation", DISTRO_EMULATION},
+    {"minimal", DISTRO_MINIMAL},
+    {"custom", DISTRO_CUSTOM},
+    {NULL, 0}
+};
+
+static const matrix_name_t matrix_emu_names[] = {
+    {"none", EMU_NONE},
+    {"libreelec", EMU_LIBREELEC},
+    {"emulationstation", EMU_EMULATIONSTATION},
+    {"retropie", EMU_RETROPIE},
+    {"lakka", EMU_LAKKA},
+    {"batocera", EMU_BATOCERA},
+    {"all", EMU_ALL},
+    {NULL, 0}
+};
+
+// Bootloader images the SD image is assembled from
+static const char *matrix_bootloader_files[] = {"idbloader.img", "u-boot.itb", NULL};
+
+// Signals a target's child takes the default action for; the handler it
+// inherits would clean up the parent's build and run the parent's atexit handlers
+static const int matrix_child_signals[] = {SIGINT, SIGTERM, SIGQUIT, 0};
+
+// Look up a value in a name table
+static const char* matrix_name(const matrix_name_t *table, int value) {
+    for (int i = 0; table[i].name; i++) {
+        if (table[i].value == value) return table[i].name;
+    }
+    return "unknown";
+}
+
+// Look up a name in a name table, -1 when unknown
+static int matrix_value(const matrix_name_t *table, const char *name) {
+    for (int i = 0; table[i].name; i++) {
+        if (strcasecmp(table[i].name, name) == 0) return table[i].value;
+    }
+    return -1;
+}
+
+// Get a printable name for a distribution type
+const char* distro_type_name(distro_type_t type) {
+    return matrix_name(matrix_distro_names, type);
+}
+
+// Parse a distribution type name, -1 when unknown
+int parse_distro_type(const char *text) {
+    return matrix_value(matrix_distro_names, text);
+}
+
+// Get a printable name for an emulation platform
+const char* emu_platform_name(emulation_platform_t platform) {
+    return matrix_name(matrix_emu_names, platform);
+}
+
+// Parse an emulation platform name, -1 when unknown
+int parse_emu_platform(const char *text) {
+    return matrix_value(matrix_emu_names, text);
+}
+
+// Name of a target, e.g. "desktop-noble" or "emulation-noble-retropie"; it
+// names the target's directories and prefixes its stages
+void build_target_name(const build_target_t *target, char *name, size_t size) {
+    const ubuntu_release_t *release = find_ubuntu_release(target->ubuntu_release);
+    const char *codename = release ? release->codename : target->ubuntu_release;
+
+    if (target->emu_platform != EMU_NONE) {
+        snprintf(name, size, "%s-%s-%s", distro_type_name(target->distro_type), codename,
+                 emu_platform_name(target->emu_platform));
+    } else {
+        snprintf(name, size, "%s-%s", distro_type_name(target->distro_type), codename);
+    }
+}
+
+// Add targets from "distro:release[:platform]" entries separated by commas
+int parse_matrix_targets(build_config_t *config, const char *spec) {
+    char list[1024];
+    char msg[256];
+    char *saveptr = NULL;
+
+    strncpy(list, spec, sizeof(list) - 1);
+    list[sizeof(list) - 1] = '\0';
+
+    for (char *entry = strtok_r(list, ", ", &saveptr); entry; entry = strtok_r(NULL, ", ", &saveptr)) {
+        build_target_t target = {0};
+        char *release = strchr(entry, ':');
+        char *platform = release ? strchr(release + 1, ':') : NULL;
+
+        if (!release) {
+            snprintf(msg, sizeof(msg), "Matrix target %s: expected distro:release[:platform]", entry);
+            LOG_ERROR(msg);
+            return ERROR_UNKNOWN;
+        }
+        *release++ = '\0';
+        if (platform) *platform++ = '\0';
+
+        int distro = parse_distro_type(entry);
+        const ubuntu_release_t *info = find_ubuntu_release(release);
+        int emu = platform ? parse_emu_platform(platform) : EMU_NONE;
+        if (distro < 0 || distro == DISTRO_CUSTOM || !info || emu < 0) {
+            snprintf(msg, sizeof(msg), "Matrix target %s:%s%s%s: unknown %s", entry, release,
+                     platform ? ":" : "", platform ? platform : "",
+                     distro < 0 || distro == DISTRO_CUSTOM ? "distribution type" :
+                     !info ? "Ubuntu release" : "emulation platform");
+            LOG_ERROR(msg);
+            return ERROR_UNKNOWN;
+        }
+        if (emu != EMU_NONE && distro != DISTRO_EMULATION) {
+            snprintf(msg, sizeof(msg), "Matrix target %s:%s:%s: platforms need the emulation type",
+                     entry, release, platform);
+            LOG_ERROR(msg);
+            return ERROR_UNKNOWN;
+        }
+
+        target.distro_type = distro;
+        target.emu_platform = emu;
+        snprintf(target.ubuntu_release, sizeof(target.ubuntu_release), "%s", info->version);
+
+        // Targets are told apart by their name, which must be unique
+        char name[96], other[96];
+        build_target_name(&target, name, sizeof(name));
+        for (int i = 0; i < config->matrix_count; i++) {
+            build_target_name(&config->matrix_targets[i], other, sizeof(other));
+            if (strcmp(name, other) == 0) {
+                snprintf(msg, sizeof(msg), "Matrix target %s is listed twice", name);
+                LOG_ERROR(msg);
+                return ERROR_UNKNOWN;
+            }
+        }
+        if (config->matrix_count >= MAX_MATRIX_TARGETS) {
+            snprintf(msg, sizeof(msg), "At most %d matrix targets are supported", MAX_MATRIX_TARGETS);
+            LOG_ERROR(msg);
+            return ERROR_UNKNOWN;
+        }
+        config->matrix_targets[config->matrix_count++] = target;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Configuration of one target: the shared one with the target's choices and
+// directories of its own; -1 when those directories do not fit
+static int matrix_target_config(const build_config_t *shared, const build_target_t *target,
+                                const char *name, build_config_t *config) {
+    const ubuntu_release_t *release = find_ubuntu_release(target->ubuntu_release);
+
+    *config = *shared;
+    config->distro_type = target->distro_type;
+    config->emu_platform = target->emu_platform;
+    snprintf(config->ubuntu_release, sizeof(config->ubuntu_release), "%s", target->ubuntu_release);
+    if (release) {
+        snprintf(config->ubuntu_codename, sizeof(config->ubuntu_codename), "%s", release->codename);
+    }
+
+    // Built once by the parent, or not comparable across targets
+    config->create_spi_image = 0;
+    config->benchmark_bootstrap = 0;
+    config->matrix_count = 0;
+
+    if (snprintf(config->output_dir, sizeof(config->output_dir), "%s/%s",
+                 shared->output_dir, name) >= (int)sizeof(config->output_dir) ||
+        snprintf(config->build_dir, sizeof(config->build_dir), "%s/variants/%s",
+                 shared->build_dir, name) >= (int)sizeof(config->build_dir)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Point the target's directories at the shared kernel tree and bootloader
+static int matrix_prepare_target(const build_config_t *shared, build_config_t *config) {
+    char shared_path[MAX_PATH_LEN + 32];
+    char path[MAX_PATH_LEN + 32];
+
+    if (ensure_directories_exist(config) != ERROR_SUCCESS) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    // kernel_install runs make modules_install in <build_dir>/linux
+    snprintf(shared_path, sizeof(shared_path), "%s/linux", shared->build_dir);
+    snprintf(path, sizeof(path), "%s/linux", config->build_dir);
+    unlink(path);
+    if (symlink(shared_path, path) != 0) {
+        LOG_ERROR("Failed to link the shared kernel tree");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    for (int i = 0; matrix_bootloader_files[i]; i++) {
+        snprintf(shared_path, sizeof(shared_path), "%s/%s", shared->output_dir, matrix_bootloader_files[i]);
+        snprintf(path, sizeof(path), "%s/%s", config->output_dir, matrix_bootloader_files[i]);
+        if (access(shared_path, F_OK) == 0 && download_link(shared_path, path) != ERROR_SUCCESS) {
+            LOG_ERROR("Failed to link the bootloader images");
+            return ERROR_FILE_NOT_FOUND;
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Write the target's stages for the combined report, one per line:
+// name, seconds, result, commands, emulated seconds, CPU seconds, peak bytes
+static void matrix_write_stages(const build_config_t *config, int first) {
+    char path[MAX_PATH_LEN + 32];
+    const build_stage_t *stage;
+
+    snprintf(path, sizeof(path), "%s/stages.tsv", config->output_dir);
+    FILE *fp = fopen(path, "w");
+    if (!fp) return;
+
+    for (int i = first; (stage = get_build_stage(i)) != NULL; i++) {
+        const char *name = strchr(stage->name, '/');
+        fprintf(fp, "%s\t%.3f\t%d\t%d\t%.3f\t%.3f\t%lld\n",
+                name ? name + 1 : stage->name, stage->duration, stage->result, stage->commands_run,
+                stage->emulated_seconds, stage->cpu_user + stage->cpu_system, stage->memory_peak);
+    }
+    fclose(fp);
+}
+
+// Child: build one target and exit with 0 when it built, 1 when it did not
+static void matrix_run_target(const build_config_t *shared, const build_target_t *target,
+                              const char *name, int parallel) {
+    static build_config_t config;
+    int first = 0;
+
+    logger_restart_after_fork();
+    if (matrix_target_config(shared, target, name, &config) != 0) {
+        LOG_ERROR("Output or build directory path too long for the matrix target");
+        logger_shutdown();
+        fflush(NULL);
+        _exit(1);
+    }
+    global_config = &config;
+    build_stage_set_prefix(name);
+
+    // Each target's metrics would overwrite the parent's textfile
+    config.metrics_file[0] = '\0';
+
+    // Compressors of targets that finish together split the job budget
+    if (config.compress_threads <= 0) {
+        config.compress_threads = jobserver_current_jobs() / parallel;
+        if (config.compress_threads < 1) config.compress_threads = 1;
+    }
+
+    while (get_build_stage(first) != NULL) first++;
+
+    int result = matrix_prepare_target(shared, &config);
+    if (result == ERROR_SUCCESS) {
+        result = build_target_stages(&config);
+    }
+    matrix_write_stages(&config, first);
+
+    // exit() would run the parent's atexit handlers, which remove its files;
+    // an error code as exit status could be cut to 8 bits, so only 0 or 1
+    logger_shutdown();
+    fflush(NULL);
+    _exit(result == ERROR_SUCCESS ? 0 : 1);
+}
+
+// Write a line of the combined report to the log and the report file
+static void matrix_report_line(FILE *fp, const char *line) {
+    LOG_INFO(line);
+    if (fp) fprintf(fp, "%s\n", line);
+}
+
+// Combined report: every target with its stages, image sizes and time
+static void matrix_report(const build_config_t *config, const int *results,
+                          const double *durations, double wall) {
+    static build_config_t target_config;
+    char path[MAX_PATH_LEN + 32];
+    char image[MAX_PATH_LEN];
+    char line[MAX_PATH_LEN + 64];
+    char name[96];
+    double busy = 0.0;
+    int ok = 0;
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/matrix-report.txt", config->output_dir);
+    FILE *fp = fopen(path, "w");
+
+    matrix_report_line(fp, "=== Build matrix report ===");
+    snprintf(line, sizeof(line), "%-34s %-8s %9s %10s %10s", "target", "result", "time", "image MiB",
+             "packed MiB");
+    matrix_report_line(fp, line);
+
+    for (int i = 0; i < config->matrix_count; i++) {
+        build_target_name(&config->matrix_targets[i], name, sizeof(name));
+        int have_config = matrix_target_config(config, &config->matrix_targets[i], name, &target_config) == 0;
+
+        long long image_size = 0;
+        long long packed_size = 0;
+        if (have_config) {
+            system_image_path(&target_config, image, sizeof(image));
+            image_size = stat(image, &st) == 0 ? st.st_size >> 20 : 0;
+            snprintf(path, sizeof(path), "%s%s", image,
+                     target_config.compress_format == COMPRESS_XZ ? ".xz" : ".zst");
+            if (target_config.compress_format != COMPRESS_NONE && stat(path, &st) == 0) {
+                packed_size = st.st_size >> 20;
+            }
+        }
+
+        snprintf(line, sizeof(line), "%-34s %-8s %8.1fs %10lld %10lld", name,
+                 results[i] < 0 ? "skipped" : results[i] == ERROR_SUCCESS ? "ok" : "failed",
+                 durations[i], image_size, packed_size);
+        matrix_report_line(fp, line);
+        if (results[i] == ERROR_SUCCESS) ok++;
+        busy += durations[i];
+
+        // The target's own stages
+        snprintf(path, sizeof(path), "%s/stages.tsv", target_config.output_dir);
+        FILE *stages = results[i] < 0 || !have_config ? NULL : fopen(path, "r");
+        char row[256];
+        while (stages && fgets(row, sizeof(row), stages)) {
+            char stage[64];
+            double seconds, emulated, cpu;
+            int result, commands;
+            long long peak;
+            if (sscanf(row, "%63[^\t]\t%lf\t%d\t%d\t%lf\t%lf\t%lld", stage, &seconds, &result,
+                       &commands, &emulated, &cpu, &peak) != 7) {
+                continue;
+            }
+            snprintf(line, sizeof(line), "  %-22s %8.1fs %4d cmds  emulated %7.1fs  cpu %7.1fs  "
+                     "peak %6lld MiB  %s", stage, seconds, commands, emulated, cpu, peak >> 20,
+                     result == ERROR_SUCCESS ? "ok" : "failed");
+            matrix_report_line(fp, line);
+        }
+        if (stages) fclose(stages);
+    }
+
+    snprintf(line, sizeof(line), "%d of %d targets built in %.1fs; %.1fs of target time, %.1fx in parallel",
+             ok, config->matrix_count, wall, busy, wall > 0 ? busy / wall : 0.0);
+    matrix_report_line(fp, line);
+
+    if (fp) {
+        fclose(fp);
+        snprintf(line, sizeof(line), "Matrix report written to %s/matrix-report.txt", config->output_dir);
+        LOG_INFO(line);
+    }
+}
+
+// Build every target of the matrix, sharing the common stages
+int perform_matrix_build(build_config_t *config) {
+    pid_t pids[MAX_MATRIX_TARGETS];
+    int results[MAX_MATRIX_TARGETS];
+    double starts[MAX_MATRIX_TARGETS];
+    double durations[MAX_MATRIX_TARGETS];
+    char names[MAX_MATRIX_TARGETS][96];
+    char msg[256];
+    int result;
+    int first_failure = ERROR_SUCCESS;
+
+    for (int i = 0; i < config->matrix_count; i++) {
+        build_target_name(&config->matrix_targets[i], names[i], sizeof(names[i]));
+        pids[i] = 0;
+        results[i] = -1;
+        durations[i] = 0.0;
+        snprintf(msg, sizeof(msg), "Matrix target %d: %.*s", i + 1, (int)sizeof(names[i]) - 1, names[i]);
+        LOG_INFO(msg);
+    }
+
+    snprintf(msg, sizeof(msg), "Start matrix build of %d targets?", config->matrix_count);
+    if (!confirm_action(msg)) {
+        return ERROR_USER_CANCELLED;
+    }
+
+    result = prepare_build_host(config);
+    if (result != ERROR_SUCCESS && !config->continue_on_error) {
+        return result;
+    }
+
+    result = build_shared_stages(config);
+    if (result != ERROR_SUCCESS && !config->continue_on_error) {
+        return result;
+    }
+
+    // The SPI image does not depend on the target
+    if (config->create_spi_image) {
+        build_stage_t *stage = build_stage_begin("spi_image");
+        result = create_spi_image(config);
+        build_stage_end(stage, result);
+        if (result != ERROR_SUCCESS && !config->continue_on_error) {
+            return result;
+        }
+    }
+
+    // Every target counts as one job of the budget
+    int parallel = config->matrix_parallel > 0 ? config->matrix_parallel : jobserver_current_jobs();
+    if (parallel > config->matrix_count) parallel = config->matrix_count;
+    if (parallel < 1) parallel = 1;
+
+    snprintf(msg, sizeof(msg), "Building %d targets, %d at a time", config->matrix_count, parallel);
+    LOG_INFO(msg);
+
+    build_stage_t *stage = build_stage_begin("targets");
+    double start = get_monotonic_time();
+    int next = 0;
+    int running = 0;
+
+    while (next < config->matrix_count || running > 0) {
+        // After a failure only the targets already running are finished
+        while (running < parallel && next < config->matrix_count &&
+               (first_failure == ERROR_SUCCESS || config->continue_on_error)) {
+            // The child must not inherit unwritten buffers
+            logger_flush();
+            fflush(NULL);
+
+            // Held back until the child has dropped the parent's handlers
+            sigset_t block, saved;
+            sigemptyset(&block);
+            for (int i = 0; matrix_child_signals[i]; i++) sigaddset(&block, matrix_child_signals[i]);
+            pthread_sigmask(SIG_BLOCK, &block, &saved);
+
+            pid_t pid = fork();
+            if (pid == 0) {
+                // Only async-signal-safe calls until the handlers are reset
+                for (int i = 0; matrix_child_signals[i]; i++) signal(matrix_child_signals[i], SIG_DFL);
+                pthread_sigmask(SIG_SETMASK, &saved, NULL);
+                matrix_run_target(config, &config->matrix_targets[next], names[next], parallel);
+            }
+            pthread_sigmask(SIG_SETMASK, &saved, NULL);
+            if (pid < 0) {
+                LOG_ERROR("Failed to start a matrix target");
+                results[next] = ERROR_UNKNOWN;
+                if (first_failure == ERROR_SUCCESS) first_failure = ERROR_UNKNOWN;
+                next++;
+                continue;
+            }
+
+            pids[next] = pid;
+            starts[next] = get_monotonic_time();
+            snprintf(msg, sizeof(msg), "Target %s started (pid %d)", names[next], (int)pid);
+            LOG_INFO(msg);
+            running++;
+            next++;
+        }
+        if (running == 0) break;
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i = 0; i < next; i++) {
+            if (pids[i] != pid) continue;
+            pids[i] = 0;
+            running--;
+            durations[i] = get_monotonic_time() - starts[i];
+
+            // The child exits 0 or 1; what failed is in its log
+            results[i] = WIFEXITED(status) && WEXITSTATUS(status) == 0 ? ERROR_SUCCESS : ERROR_UNKNOWN;
+            if (results[i] != ERROR_SUCCESS && first_failure == ERROR_SUCCESS) {
+                first_failure = results[i];
+            }
+
+            if (WIFSIGNALED(status)) {
+                snprintf(msg, sizeof(msg), "Target %s killed by signal %d after %.1fs", names[i],
+                         WTERMSIG(status), durations[i]);
+            } else {
+                snprintf(msg, sizeof(msg), "Target %s %s in %.1fs", names[i],
+                         results[i] == ERROR_SUCCESS ? "finished" : "failed", durations[i]);
+            }
+            if (results[i] == ERROR_SUCCESS) {
+                LOG_INFO(msg);
+            } else {
+                LOG_ERROR(msg);
+            }
+            break;
+        }
+    }
+
+    double wall = get_monotonic_time() - start;
+    build_stage_end(stage, first_failure);
+
+    build_stage_report();
+    matrix_report(config, results, durations, wall);
+
+    if (first_failure != ERROR_SUCCESS) {
+        return first_failure;
+    }
+    LOG_INFO("Matrix build completed successfully");
+    return ERROR_SUCCESS;
+}
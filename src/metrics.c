@@ -0,0 +1,331 @@
+/*
+ * metrics.c - Prometheus textfile exporter for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file collects build metrics (stage durations and results, cache hit
+ * ratios, downloaded bytes per source, package counts, image size and
+ * compression, retries and failure codes) and writes them in the text
+ * exposition format read by the node_exporter textfile collector. The file
+ * is replaced atomically at the end of every stage.
+ *
+ * Metric names, label names and label values are part of the interface of
+ * this tool; dashboards depend on them, so never rename them.
+ */
+
+#include "builder.h"
+#include <pthread.h>
+
+#define METRICS_BOARD "orangepi5plus"
+#define METRICS_MAX_CACHES 16
+#define METRICS_MAX_SOURCES 32
+
+// Hits and misses of one cache
+typedef struct {
+    char name[32];
+    long hits;
+    long misses;
+} metrics_cache_t;
+
+// Bytes fetched from one source
+typedef struct {
+    char name[64];
+    long long bytes;
+} metrics_source_t;
+
+// Failure counters, indexed like the names below
+static const int failure_codes[] = {
+    ERROR_PERMISSION_DENIED, ERROR_FILE_NOT_FOUND, ERROR_NETWORK_FAILURE,
+    ERROR_COMPILATION_FAILED, ERROR_INSUFFICIENT_SPACE, ERROR_DEPENDENCY_MISSING,
+    ERROR_GPU_DRIVER_FAILED, ERROR_KERNEL_CONFIG_FAILED, ERROR_INSTALLATION_FAILED,
+    ERROR_USER_CANCELLED, ERROR_UNKNOWN
+};
+static const char *failure_names[] = {
+    "permission_denied", "file_not_found", "network_failure",
+    "compilation_failed", "insufficient_space", "dependency_missing",
+    "gpu_driver_failed", "kernel_config_failed", "installation_failed",
+    "user_cancelled", "unknown"
+};
+#define METRICS_FAILURE_KINDS (int)(sizeof(failure_codes) / sizeof(failure_codes[0]))
+
+static metrics_cache_t metrics_caches[METRICS_MAX_CACHES];
+static int metrics_cache_count = 0;
+static metrics_source_t metrics_sources[METRICS_MAX_SOURCES];
+static int metrics_source_count = 0;
+static long metrics_failures[METRICS_FAILURE_KINDS];
+static long metrics_retries = 0;
+static long long image_size_bytes = -1;
+static long long image_allocated_bytes = -1;
+static long long image_compressed_bytes = -1;
+static double metrics_start_time = 0.0;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Write a label value, escaped as the exposition format requires
+static void write_label_value(FILE *fp, const char *value) {
+    for (const char *c = value; *c; c++) {
+        if (*c == '\\' || *c == '"') {
+            fputc('\\', fp);
+            fputc(*c, fp);
+        } else if (*c == '\n') {
+            fputs("\\n", fp);
+        } else {
+            fputc(*c, fp);
+        }
+    }
+}
+
+// Write the HELP and TYPE header of a metric family
+static void write_family(FILE *fp, const char *name, const char *type, const char *help) {
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Start a sample: name{board="..",codename="..",distro_type=".."
+static void write_sample_start(FILE *fp, const char *name) {
+    fprintf(fp, "%s{board=\"%s\",codename=\"", name, METRICS_BOARD);
+    write_label_value(fp, global_config ? global_config->ubuntu_codename : "");
+    fprintf(fp, "\",distro_type=\"%s\"",
+            distro_type_name(global_config ? global_config->distro_type : DISTRO_CUSTOM));
+}
+
+// Write a sample with one extra label, or none when label is NULL
+static void write_sample(FILE *fp, const char *name, const char *label, const char *value, double sample) {
+    write_sample_start(fp, name);
+    if (label) {
+        fprintf(fp, ",%s=\"", label);
+        write_label_value(fp, value);
+        fputc('"', fp);
+    }
+    fprintf(fp, "} %.17g\n", sample);
+}
+
+// Remember when the build started
+void metrics_start(void) {
+    if (metrics_start_time == 0.0) {
+        metrics_start_time = get_monotonic_time();
+    }
+}
+
+// Add cache lookups of the named cache
+void metrics_record_cache(const char *cache, long hits, long misses) {
+    pthread_mutex_lock(&metrics_lock);
+    for (int i = 0; i < metrics_cache_count; i++) {
+        if (strcmp(metrics_caches[i].name, cache) == 0) {
+            metrics_caches[i].hits += hits;
+            metrics_caches[i].misses += misses;
+            pthread_mutex_unlock(&metrics_lock);
+            return;
+        }
+    }
+    if (metrics_cache_count < METRICS_MAX_CACHES) {
+        metrics_cache_t *entry = &metrics_caches[metrics_cache_count++];
+        strncpy(entry->name, cache, sizeof(entry->name) - 1);
+        entry->hits = hits;
+        entry->misses = misses;
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+// Add bytes downloaded from a source (usually the host name)
+void metrics_add_download(const char *source, long long bytes) {
+    if (bytes <= 0) return;
+
+    pthread_mutex_lock(&metrics_lock);
+    for (int i = 0; i < metrics_source_count; i++) {
+        if (strcmp(metrics_sources[i].name, source) == 0) {
+            metrics_sources[i].bytes += bytes;
+            pthread_mutex_unlock(&metrics_lock);
+            return;
+        }
+    }
+    if (metrics_source_count < METRICS_MAX_SOURCES) {
+        metrics_source_t *entry = &metrics_sources[metrics_source_count++];
+        strncpy(entry->name, source, sizeof(entry->name) - 1);
+        entry->bytes = bytes;
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+// Extract the host of the first URL in text
+int metrics_url_host(const char *text, char *host, size_t size) {
+    const char *start = strstr(text, "://");
+    if (!start || size == 0) return -1;
+
+    start += 3;
+    // Skip credentials
+    const char *at = strpbrk(start, "@/ \"'");
+    if (at && *at == '@') start = at + 1;
+
+    size_t len = strcspn(start, "/:?#\"' ");
+    if (len == 0) return -1;
+    if (len >= size) len = size - 1;
+    memcpy(host, start, len);
+    host[len] = '\0';
+    return 0;
+}
+
+// Attribute what a download command received to the host it fetched from
+void metrics_record_command(const char *cmd, const command_usage_t *usage) {
+    char host[64];
+
+    while (*cmd == ' ') cmd++;
+    if (strncmp(cmd, "wget ", 5) != 0 && strncmp(cmd, "curl ", 5) != 0) return;
+    if (usage->exit_status != 0 || usage->rchar <= 0) return;
+
+    // wget and curl read little besides the socket, so rchar is the transfer
+    if (metrics_url_host(cmd, host, sizeof(host)) == 0) {
+        metrics_add_download(host, usage->rchar);
+    }
+}
+
+// Count a retried command
+void metrics_record_retry(void) {
+    pthread_mutex_lock(&metrics_lock);
+    metrics_retries++;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+// Count a failure by error code
+void metrics_record_failure(int code) {
+    pthread_mutex_lock(&metrics_lock);
+    for (int i = 0; i < METRICS_FAILURE_KINDS; i++) {
+        if (failure_codes[i] == code || (i == METRICS_FAILURE_KINDS - 1)) {
+            metrics_failures[i]++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+// Record the size of the image and of a compressed copy next to it
+void metrics_record_image(const char *image_path) {
+    static const char *suffixes[] = {".zst", ".xz", ".gz", NULL};
+    char path[MAX_PATH_LEN];
+    struct stat st;
+
+    pthread_mutex_lock(&metrics_lock);
+    if (stat(image_path, &st) == 0) {
+        image_size_bytes = st.st_size;
+        image_allocated_bytes = (long long)st.st_blocks * 512;
+    }
+    for (int i = 0; suffixes[i]; i++) {
+        snprintf(path, sizeof(path), "%s%s", image_path, suffixes[i]);
+        if (stat(path, &st) == 0) {
+            image_compressed_bytes = st.st_size;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+// Write all metrics to the textfile; the rename keeps scrapes consistent
+int metrics_write(void) {
+    char path[sizeof(global_config->metrics_file)];
+    char tmp_path[sizeof(path) + 16];  // ".<pid>.tmp"
+    const build_stage_t *stage;
+
+    if (!global_config || strlen(global_config->metrics_file) == 0) return ERROR_SUCCESS;
+
+    snprintf(path, sizeof(path), "%s", global_config->metrics_file);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) return ERROR_PERMISSION_DENIED;
+
+    pthread_mutex_lock(&metrics_lock);
+
+    write_family(fp, "opi5plus_build_info", "gauge", "Builder version and target of the build");
+    write_sample_start(fp, "opi5plus_build_info");
+    fputs(",version=\"" VERSION "\",kernel_version=\"", fp);
+    write_label_value(fp, global_config->kernel_version);
+    fputs("\"} 1\n", fp);
+
+    write_family(fp, "opi5plus_build_duration_seconds", "gauge", "Wall time of the build so far");
+    write_sample(fp, "opi5plus_build_duration_seconds", NULL, NULL,
+                 metrics_start_time > 0 ? get_monotonic_time() - metrics_start_time : 0.0);
+
+    write_family(fp, "opi5plus_build_last_update_timestamp_seconds", "gauge", "Time this file was written");
+    write_sample(fp, "opi5plus_build_last_update_timestamp_seconds", NULL, NULL, (double)time(NULL));
+
+    // Stages
+    write_family(fp, "opi5plus_build_stage_duration_seconds", "gauge", "Wall time of each build stage");
+    for (int i = 0; (stage = get_build_stage(i)) != NULL; i++) {
+        double duration = stage->active ? get_monotonic_time() - stage->start_time : stage->duration;
+        write_sample(fp, "opi5plus_build_stage_duration_seconds", "stage", stage->name, duration);
+    }
+    write_family(fp, "opi5plus_build_stage_success", "gauge", "1 if the stage succeeded, 0 if it failed");
+    for (int i = 0; (stage = get_build_stage(i)) != NULL; i++) {
+        if (stage->active) continue;
+        write_sample(fp, "opi5plus_build_stage_success", "stage", stage->name,
+                     stage->result == ERROR_SUCCESS ? 1 : 0);
+    }
+    write_family(fp, "opi5plus_build_stage_commands", "gauge", "Commands run by each build stage");
+    for (int i = 0; (stage = get_build_stage(i)) != NULL; i++) {
+        write_sample(fp, "opi5plus_build_stage_commands", "stage", stage->name, stage->commands_run);
+    }
+
+    // Caches
+    write_family(fp, "opi5plus_build_cache_hits_total", "counter", "Cache lookups that were hits");
+    for (int i = 0; i < metrics_cache_count; i++) {
+        write_sample(fp, "opi5plus_build_cache_hits_total", "cache", metrics_caches[i].name,
+                     metrics_caches[i].hits);
+    }
+    write_family(fp, "opi5plus_build_cache_misses_total", "counter", "Cache lookups that were misses");
+    for (int i = 0; i < metrics_cache_count; i++) {
+        write_sample(fp, "opi5plus_build_cache_misses_total", "cache", metrics_caches[i].name,
+                     metrics_caches[i].misses);
+    }
+    write_family(fp, "opi5plus_build_cache_hit_ratio", "gauge", "Hits divided by lookups of each cache");
+    for (int i = 0; i < metrics_cache_count; i++) {
+        long lookups = metrics_caches[i].hits + metrics_caches[i].misses;
+        write_sample(fp, "opi5plus_build_cache_hit_ratio", "cache", metrics_caches[i].name,
+                     lookups > 0 ? (double)metrics_caches[i].hits / lookups : 0.0);
+    }
+
+    // Downloads
+    write_family(fp, "opi5plus_build_download_bytes_total", "counter", "Bytes downloaded from each source");
+    for (int i = 0; i < metrics_source_count; i++) {
+        write_sample(fp, "opi5plus_build_download_bytes_total", "source", metrics_sources[i].name,
+                     (double)metrics_sources[i].bytes);
+    }
+
+    // Packages installed in the rootfs
+    char rootfs_dir[sizeof(global_config->output_dir) + 8];
+    snprintf(rootfs_dir, sizeof(rootfs_dir), "%s/rootfs", global_config->output_dir);
+    int packages = count_installed_packages(rootfs_dir);
+    if (packages > 0) {
+        write_family(fp, "opi5plus_build_apt_packages", "gauge", "Packages installed in the rootfs");
+        write_sample(fp, "opi5plus_build_apt_packages", NULL, NULL, packages);
+    }
+
+    // Image
+    if (image_size_bytes >= 0) {
+        write_family(fp, "opi5plus_build_image_size_bytes", "gauge", "Apparent size of the disk image");
+        write_sample(fp, "opi5plus_build_image_size_bytes", NULL, NULL, (double)image_size_bytes);
+        write_family(fp, "opi5plus_build_image_allocated_bytes", "gauge", "Disk blocks allocated to the sparse image");
+        write_sample(fp, "opi5plus_build_image_allocated_bytes", NULL, NULL, (double)image_allocated_bytes);
+    }
+    if (image_size_bytes > 0 && image_compressed_bytes >= 0) {
+        write_family(fp, "opi5plus_build_image_compressed_bytes", "gauge", "Size of the compressed image");
+        write_sample(fp, "opi5plus_build_image_compressed_bytes", NULL, NULL, (double)image_compressed_bytes);
+        write_family(fp, "opi5plus_build_image_compression_ratio", "gauge", "Image size divided by compressed size");
+        write_sample(fp, "opi5plus_build_image_compression_ratio", NULL, NULL,
+                     image_compressed_bytes > 0 ? (double)image_size_bytes / image_compressed_bytes : 0.0);
+    }
+
+    // Retries and failures
+    write_family(fp, "opi5plus_build_command_retries_total", "counter", "Command attempts repeated after a failure");
+    write_sample(fp, "opi5plus_build_command_retries_total", NULL, NULL, metrics_retries);
+
+    write_family(fp, "opi5plus_build_failures_total", "counter", "Failed build stages by error code");
+    for (int i = 0; i < METRICS_FAILURE_KINDS; i++) {
+        write_sample(fp, "opi5plus_build_failures_total", "code", failure_names[i], metrics_failures[i]);
+    }
+
+    pthread_mutex_unlock(&metrics_lock);
+
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return ERROR_PERMISSION_DENIED;
+    }
+
+    return ERROR_SUCCESS;
+}
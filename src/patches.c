@@ -0,0 +1,447 @@
+/*
+ * patches.c - Kernel patch series for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file resolves a patch series from a manifest instead of scraping
+ * directories that raw.githubusercontent.com cannot list. A manifest is a
+ * GitHub git tree listing, whose entries carry the git blob id and size of
+ * every patch, or a quilt series file. The manifest is revalidated with a
+ * conditional request; when it is unchanged the series resolved from it
+ * last time is reused as is. Otherwise the missing patches are fetched
+ * concurrently through the download store, checked against their blob ids
+ * (or, from a series file, for looking like a patch), and recorded so that
+ * unchanged patches are not fetched again when the series changes.
+ */
+
+#include "builder.h"
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define PATCH_MAX_SERIES 512
+
+// One patch of a series
+typedef struct {
+    char name[256];
+    char blob[41];          // git blob id from a tree listing, empty from a series file
+    long long size;         // -1 when unknown
+    char sha256[SHA256_HEX_LEN + 1];
+} patch_entry_t;
+
+// SHA-1, only to check git blob ids
+typedef struct {
+    uint32_t state[5];
+    uint64_t length;
+    unsigned char buffer[64];
+    size_t used;
+} sha1_ctx_t;
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(sha1_ctx_t *ctx, const unsigned char *block) {
+    uint32_t w[80];
+    uint32_t a, b, c, d, e;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+               (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+    }
+    for (i = 16; i < 80; i++) {
+        w[i] = ROTL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3]; e = ctx->state[4];
+    for (i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) { f = (b & c) | (~b & d); k = 0x5a827999; }
+        else if (i < 40) { f = b ^ c ^ d; k = 0x6ed9eba1; }
+        else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8f1bbcdc; }
+        else { f = b ^ c ^ d; k = 0xca62c1d6; }
+        uint32_t t = ROTL(a, 5) + f + e + k + w[i];
+        e = d; d = c; c = ROTL(b, 30); b = a; a = t;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d; ctx->state[4] += e;
+}
+
+static void sha1_init(sha1_ctx_t *ctx) {
+    ctx->state[0] = 0x67452301; ctx->state[1] = 0xefcdab89; ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476; ctx->state[4] = 0xc3d2e1f0;
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static void sha1_update(sha1_ctx_t *ctx, const void *data, size_t len) {
+    const unsigned char *p = data;
+
+    ctx->length += len;
+    while (len > 0) {
+        size_t take = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->buffer + ctx->used, p, take);
+        ctx->used += take;
+        p += take;
+        len -= take;
+        if (ctx->used == 64) {
+            sha1_block(ctx, ctx->buffer);
+            ctx->used = 0;
+        }
+    }
+}
+
+static void sha1_final_hex(sha1_ctx_t *ctx, char hex[41]) {
+    static const char digits[] = "0123456789abcdef";
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad = 0x80;
+    unsigned char length[8];
+    int i;
+
+    sha1_update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->used != 56) sha1_update(ctx, &pad, 1);
+    for (i = 0; i < 8; i++) length[i] = (unsigned char)(bits >> (56 - i * 8));
+    sha1_update(ctx, length, 8);
+
+    for (i = 0; i < 20; i++) {
+        unsigned char byte = (unsigned char)(ctx->state[i / 4] >> (24 - (i % 4) * 8));
+        hex[i * 2] = digits[byte >> 4];
+        hex[i * 2 + 1] = digits[byte & 0x0f];
+    }
+    hex[40] = '\0';
+}
+
+// git blob id of a file: SHA-1 of "blob <size>\0" and the content
+static int git_blob_id(const char *path, char hex[41]) {
+    char buffer[65536];
+    char header[32];
+    struct stat st;
+    sha1_ctx_t ctx;
+    ssize_t len;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    sha1_init(&ctx);
+    int header_len = snprintf(header, sizeof(header), "blob %lld", (long long)st.st_size);
+    sha1_update(&ctx, header, header_len + 1);
+    while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+        sha1_update(&ctx, buffer, len);
+    }
+    close(fd);
+    sha1_final_hex(&ctx, hex);
+    return len < 0 ? -1 : 0;
+}
+
+// Directory for resolved series and blob id records
+static const char* patch_cache_dir(char *path, size_t size) {
+    const char *cache_dir = global_config && global_config->cache_dir[0] ? global_config->cache_dir
+                                                                         : CACHE_DIR;
+    char sub[MAX_PATH_LEN + 32];
+
+    snprintf(path, size, "%s/patches", cache_dir);
+    snprintf(sub, sizeof(sub), "%s/blobs", path);
+    mkdir(path, 0755);
+    mkdir(sub, 0755);
+    return path;
+}
+
+// Value of a field in a flat JSON object, as text; strings lose their quotes
+static int json_field(const char *object, const char *end, const char *key, char *out, size_t size) {
+    char pattern[64];
+    size_t used = 0;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+    const char *p = object;
+    while ((p = strstr(p, pattern)) != NULL && p < end) {
+        p += strlen(pattern);
+        while (p < end && isspace((unsigned char)*p)) p++;
+        if (p < end && *p == ':') break;
+    }
+    if (!p || p >= end) return 0;
+    p++;
+    while (p < end && isspace((unsigned char)*p)) p++;
+
+    if (*p == '"') {
+        for (p++; p < end && *p != '"' && used + 1 < size; p++) {
+            if (*p == '\\' && p + 1 < end) p++;
+            out[used++] = *p;
+        }
+    } else {
+        while (p < end && (isalnum((unsigned char)*p) || *p == '-' || *p == '.') && used + 1 < size) {
+            out[used++] = *p++;
+        }
+    }
+    out[used] = '\0';
+    return 1;
+}
+
+// Patches of a GitHub git tree listing, in listing (name) order
+static int parse_tree_listing(const char *text, patch_entry_t *entries, int max) {
+    int count = 0;
+    const char *p = strstr(text, "\"tree\"");
+    char value[256];
+
+    if (!p) return -1;
+    if (strstr(text, "\"truncated\": true") || strstr(text, "\"truncated\":true")) {
+        LOG_WARNING("Patch tree listing is truncated, the series may be incomplete");
+    }
+
+    while ((p = strchr(p, '{')) != NULL && count < max) {
+        const char *end = strchr(p, '}');
+        if (!end) break;
+
+        patch_entry_t *entry = &entries[count];
+        memset(entry, 0, sizeof(*entry));
+        if (json_field(p, end, "type", value, sizeof(value)) && strcmp(value, "blob") == 0 &&
+            json_field(p, end, "path", entry->name, sizeof(entry->name)) &&
+            json_field(p, end, "sha", entry->blob, sizeof(entry->blob)) && strlen(entry->blob) == 40) {
+            size_t n = strlen(entry->name);
+            entry->size = json_field(p, end, "size", value, sizeof(value)) ? atoll(value) : -1;
+            if (n > 6 && strcmp(entry->name + n - 6, ".patch") == 0) count++;
+        }
+        p = end + 1;
+    }
+    return count;
+}
+
+// Patches of a quilt series file, in series order
+static int parse_series(char *text, patch_entry_t *entries, int max) {
+    int count = 0;
+
+    for (char *line = strtok(text, "\n"); line && count < max; line = strtok(NULL, "\n")) {
+        line[strcspn(line, "#\r")] = '\0';
+        while (isspace((unsigned char)*line)) line++;
+        // Options such as -p1 follow the name
+        line[strcspn(line, " \t")] = '\0';
+        if (line[0] == '\0') continue;
+
+        memset(&entries[count], 0, sizeof(entries[count]));
+        strncpy(entries[count].name, line, sizeof(entries[count].name) - 1);
+        entries[count].size = -1;
+        count++;
+    }
+    return count;
+}
+
+// Read a whole store object into memory
+static char* read_object(const char *digest) {
+    char path[MAX_PATH_LEN + 128];
+    struct stat st;
+
+    if (!download_store_path(digest, path, sizeof(path)) || stat(path, &st) != 0) return NULL;
+    char *text = malloc(st.st_size + 1);
+    FILE *fp = fopen(path, "r");
+    if (!text || !fp || fread(text, 1, st.st_size, fp) != (size_t)st.st_size) {
+        free(text);
+        if (fp) fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    text[st.st_size] = '\0';
+    return text;
+}
+
+// Series resolved from a manifest last time; 1 when every patch is still stored
+static int load_resolved(const char *file, patch_entry_t *entries, int *count) {
+    char line[512];
+    char object[MAX_PATH_LEN + 128];
+    int ok = 1;
+
+    FILE *fp = fopen(file, "r");
+    if (!fp) return 0;
+    *count = 0;
+    while (ok && *count < PATCH_MAX_SERIES && fgets(line, sizeof(line), fp)) {
+        patch_entry_t *entry = &entries[*count];
+        memset(entry, 0, sizeof(*entry));
+        line[strcspn(line, "\r\n")] = '\0';
+        if (sscanf(line, "%64s %255[^\n]", entry->sha256, entry->name) != 2) continue;
+        ok = download_store_path(entry->sha256, object, sizeof(object)) && access(object, F_OK) == 0;
+        (*count)++;
+    }
+    fclose(fp);
+    return ok && *count > 0;
+}
+
+// Does a file look like a patch rather than an error page
+static int looks_like_patch(const char *digest) {
+    char *text = read_object(digest);
+    int ok = text && (strncmp(text, "diff ", 5) == 0 || strncmp(text, "From ", 5) == 0 ||
+                      strstr(text, "\n--- ") != NULL || strstr(text, "\ndiff ") != NULL);
+    free(text);
+    return ok;
+}
+
+// Place the series in dest_dir as NNNN-name.patch, so that sorting keeps its order
+static int link_series(const patch_entry_t *entries, int count, const char *dest_dir) {
+    char object[MAX_PATH_LEN + 128];
+    char dest[MAX_PATH_LEN * 2];
+
+    for (int i = 0; i < count; i++) {
+        const char *base = strrchr(entries[i].name, '/');
+        if (snprintf(dest, sizeof(dest), "%s/%04d-%s", dest_dir, i + 1,
+                     base ? base + 1 : entries[i].name) >= (int)sizeof(dest)) {
+            LOG_ERROR("Patch destination path too long");
+            return ERROR_INSTALLATION_FAILED;
+        }
+        if (!download_store_path(entries[i].sha256, object, sizeof(object)) ||
+            download_link(object, dest) != ERROR_SUCCESS) {
+            return ERROR_INSTALLATION_FAILED;
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
+// Resolve a patch series from its manifest and place it in dest_dir
+int fetch_patch_series(const patch_source_t *source, const char *dest_dir, int *count) {
+    static patch_entry_t entries[PATCH_MAX_SERIES];
+    static pthread_mutex_t series_lock = PTHREAD_MUTEX_INITIALIZER;
+    char cache[MAX_PATH_LEN + 16];
+    char resolved[MAX_PATH_LEN + 128];
+    char msg[1024];
+    download_t manifest;
+    int total = 0;
+    int result = ERROR_SUCCESS;
+
+    *count = 0;
+    pthread_mutex_lock(&series_lock);
+
+    // One conditional request when the manifest is already in the store
+    memset(&manifest, 0, sizeof(manifest));
+    snprintf(manifest.name, sizeof(manifest.name), "%s patch manifest", source->name);
+    download_add_url(&manifest, source->manifest_url);
+    manifest.content = DOWNLOAD_TEXT;
+    manifest.revalidate = 1;
+    if (download_fetch(&manifest) != ERROR_SUCCESS) {
+        pthread_mutex_unlock(&series_lock);
+        return ERROR_NETWORK_FAILURE;
+    }
+
+    patch_cache_dir(cache, sizeof(cache));
+    snprintf(resolved, sizeof(resolved), "%s/%s", cache, manifest.digest);
+    if (load_resolved(resolved, entries, &total)) {
+        snprintf(msg, sizeof(msg), "Patch series %s unchanged: %d patches from the store", source->name, total);
+        LOG_INFO(msg);
+        result = link_series(entries, total, dest_dir);
+        if (result == ERROR_SUCCESS) *count = total;
+        pthread_mutex_unlock(&series_lock);
+        return result;
+    }
+
+    char *text = read_object(manifest.digest);
+    if (text) {
+        total = source->manifest_type == PATCH_MANIFEST_TREE ? parse_tree_listing(text, entries, PATCH_MAX_SERIES)
+                                                             : parse_series(text, entries, PATCH_MAX_SERIES);
+        free(text);
+    }
+    if (total <= 0) {
+        snprintf(msg, sizeof(msg), "No patches in the %s manifest", source->name);
+        LOG_WARNING(msg);
+        pthread_mutex_unlock(&series_lock);
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    // Patches already fetched under the same blob id are not fetched again
+    download_t *items = calloc(total, sizeof(download_t));
+    int *item_entry = calloc(total, sizeof(int));
+    int missing = 0;
+    if (!items || !item_entry) {
+        free(items);
+        free(item_entry);
+        pthread_mutex_unlock(&series_lock);
+        return ERROR_INSUFFICIENT_SPACE;
+    }
+
+    for (int i = 0; i < total; i++) {
+        patch_entry_t *entry = &entries[i];
+        if (entry->blob[0]) {
+            char record[MAX_PATH_LEN + 64];
+            char object[MAX_PATH_LEN + 128];
+            snprintf(record, sizeof(record), "%s/blobs/%s", cache, entry->blob);
+            FILE *fp = fopen(record, "r");
+            if (fp) {
+                if (fscanf(fp, "%64s", entry->sha256) != 1) entry->sha256[0] = '\0';
+                fclose(fp);
+            }
+            if (entry->sha256[0] && download_store_path(entry->sha256, object, sizeof(object)) &&
+                access(object, F_OK) == 0) {
+                continue;
+            }
+            entry->sha256[0] = '\0';
+        }
+
+        char url[1024];
+        download_t *item = &items[missing];
+        snprintf(item->name, sizeof(item->name), "%s", entry->name);
+        snprintf(url, sizeof(url), "%s/%s", source->raw_base, entry->name);
+        download_add_url(item, url);
+        item->size = entry->size > 0 ? entry->size : 0;
+        item->content = DOWNLOAD_TEXT;
+        item->required = 1;
+        // The branch moves, so the URL must not be pinned; blob ids check it
+        item->revalidate = 1;
+        item_entry[missing++] = i;
+    }
+
+    snprintf(msg, sizeof(msg), "Patch series %s: %d patches, fetching %d", source->name, total, missing);
+    LOG_INFO(msg);
+    if (missing > 0) {
+        download_fetch_all(items, missing, 0);
+    }
+
+    for (int m = 0; m < missing && result == ERROR_SUCCESS; m++) {
+        patch_entry_t *entry = &entries[item_entry[m]];
+        char object[MAX_PATH_LEN + 128];
+        char blob[41];
+
+        if (items[m].result != ERROR_SUCCESS) {
+            result = items[m].result;
+            break;
+        }
+        strcpy(entry->sha256, items[m].digest);
+        download_store_path(entry->sha256, object, sizeof(object));
+
+        // Verify against the manifest: the blob id, or the shape of a patch
+        if (entry->blob[0]) {
+            if (git_blob_id(object, blob) != 0 || strcmp(blob, entry->blob) != 0) {
+                snprintf(msg, sizeof(msg), "Patch %s does not match its blob id %s (upstream moved?)",
+                         entry->name, entry->blob);
+                LOG_ERROR(msg);
+                result = ERROR_NETWORK_FAILURE;
+                break;
+            }
+            char record[MAX_PATH_LEN + 64];
+            snprintf(record, sizeof(record), "%s/blobs/%s", cache, entry->blob);
+            FILE *fp = fopen(record, "w");
+            if (fp) {
+                fprintf(fp, "%s\n", entry->sha256);
+                fclose(fp);
+            }
+        } else if (!looks_like_patch(entry->sha256)) {
+            snprintf(msg, sizeof(msg), "Downloaded %s is not a patch", entry->name);
+            LOG_ERROR(msg);
+            result = ERROR_NETWORK_FAILURE;
+            break;
+        }
+    }
+    free(items);
+    free(item_entry);
+
+    // Record the resolved series only once all of it is verified
+    if (result == ERROR_SUCCESS) {
+        char tmp[MAX_PATH_LEN + 160];
+        snprintf(tmp, sizeof(tmp), "%s.%d.tmp", resolved, (int)getpid());
+        FILE *fp = fopen(tmp, "w");
+        if (fp) {
+            for (int i = 0; i < total; i++) {
+                fprintf(fp, "%s %s\n", entries[i].sha256, entries[i].name);
+            }
+            if (fclose(fp) == 0) rename(tmp, resolved);
+            else unlink(tmp);
+        }
+        result = link_series(entries, total, dest_dir);
+        if (result == ERROR_SUCCESS) *count = total;
+    }
+
+    pthread_mutex_unlock(&series_lock);
+    return result;
+}
@@ -0,0 +1,300 @@
+/*
+ * profile.c - Span profiler for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file implements the in-process profiler behind PROFILE_BEGIN() and
+ * PROFILE_END(). Spans nest per thread; every distinct parent/name pair is a
+ * node in a hashed call tree holding count, total, min, max and a log-scale
+ * histogram for p50/p95. It is compiled into every build and costs a single
+ * branch per span while profiling is disabled.
+ */
+
+#include "builder.h"
+#include <pthread.h>
+#include <stdint.h>
+
+#define PROFILE_MAX_NODES 512          // Power of two
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_SUB_BUCKETS 4           // Histogram buckets per power of two
+#define PROFILE_MIN_SHIFT 10            // Smallest bucket starts at ~1 µs
+#define PROFILE_BUCKETS (32 * PROFILE_SUB_BUCKETS)
+
+// One node of the call tree
+typedef struct {
+    uint32_t hash;
+    int parent;                         // Node index, -1 for top-level spans
+    int depth;
+    char name[64];
+    unsigned long count;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint32_t histogram[PROFILE_BUCKETS];
+} profile_node_t;
+
+// One open span on a thread's stack
+typedef struct {
+    int node;
+    uint64_t start_ns;
+} profile_frame_t;
+
+int profile_enabled = 0;
+
+static profile_node_t profile_nodes[PROFILE_MAX_NODES];
+static int profile_slots[PROFILE_MAX_NODES];    // Hash slot -> node index + 1
+static int profile_node_count = 0;
+static unsigned long profile_dropped = 0;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread profile_frame_t profile_stack[PROFILE_MAX_DEPTH];
+static __thread int profile_depth = 0;
+
+// Monotonic clock in nanoseconds
+static uint64_t profile_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// FNV-1a over the name, seeded with the parent so each call path is distinct
+static uint32_t profile_hash(const char *name, int parent) {
+    uint32_t hash = 2166136261u ^ (uint32_t)(parent + 1) * 16777619u;
+    for (const char *c = name; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
+
+// Find or create the node for name under parent; caller holds profile_lock
+static int profile_find_node(const char *name, int parent) {
+    uint32_t hash = profile_hash(name, parent);
+
+    // Linear probing; nodes are never removed
+    for (int probe = 0; probe < PROFILE_MAX_NODES; probe++) {
+        int slot = (hash + probe) & (PROFILE_MAX_NODES - 1);
+        int index = profile_slots[slot] - 1;
+
+        if (index < 0) {
+            // Keep a quarter of the table free so probe chains stay short
+            if (profile_node_count >= PROFILE_MAX_NODES * 3 / 4) {
+                profile_dropped++;
+                return -1;
+            }
+
+            profile_node_t *node = &profile_nodes[profile_node_count];
+            memset(node, 0, sizeof(*node));
+            node->hash = hash;
+            node->parent = parent;
+            node->depth = parent >= 0 ? profile_nodes[parent].depth + 1 : 0;
+            node->min_ns = UINT64_MAX;
+            strncpy(node->name, name, sizeof(node->name) - 1);
+            profile_slots[slot] = ++profile_node_count;
+            return profile_node_count - 1;
+        }
+
+        profile_node_t *node = &profile_nodes[index];
+        if (node->hash == hash && node->parent == parent &&
+            strncmp(node->name, name, sizeof(node->name) - 1) == 0) {
+            return index;
+        }
+    }
+
+    profile_dropped++;
+    return -1;
+}
+
+// Histogram bucket of a duration
+static int profile_bucket(uint64_t ns) {
+    if (ns < (1ULL << PROFILE_MIN_SHIFT)) return 0;
+
+    int octave = 63 - __builtin_clzll(ns);
+    int sub = (int)((ns >> (octave - 2)) & (PROFILE_SUB_BUCKETS - 1));
+    int bucket = (octave - PROFILE_MIN_SHIFT) * PROFILE_SUB_BUCKETS + sub;
+
+    return bucket < PROFILE_BUCKETS ? bucket : PROFILE_BUCKETS - 1;
+}
+
+// Lower bound of a histogram bucket in nanoseconds
+static double profile_bucket_floor(int bucket) {
+    int octave = bucket / PROFILE_SUB_BUCKETS + PROFILE_MIN_SHIFT;
+    int sub = bucket % PROFILE_SUB_BUCKETS;
+    return (double)(1ULL << octave) * (1.0 + sub / (double)PROFILE_SUB_BUCKETS);
+}
+
+// Estimate a percentile from a histogram, clamped to the observed range
+static double profile_percentile(const uint32_t *histogram, unsigned long count,
+                                 uint64_t min_ns, uint64_t max_ns, double fraction) {
+    unsigned long target = (unsigned long)(fraction * count + 0.5);
+    unsigned long seen = 0;
+    double value = (double)max_ns;
+
+    if (target < 1) target = 1;
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        seen += histogram[i];
+        if (seen >= target) {
+            // Midpoint of the bucket
+            value = (profile_bucket_floor(i) + profile_bucket_floor(i + 1)) / 2.0;
+            break;
+        }
+    }
+
+    if (value < (double)min_ns) value = (double)min_ns;
+    if (value > (double)max_ns) value = (double)max_ns;
+    return value;
+}
+
+// Turn profiling on or off
+void profile_enable(int enabled) {
+    profile_enabled = enabled;
+}
+
+// Open a span on the calling thread
+void profile_begin(const char *name) {
+    int parent = profile_depth > 0 && profile_depth <= PROFILE_MAX_DEPTH
+                     ? profile_stack[profile_depth - 1].node : -1;
+
+    if (profile_depth >= PROFILE_MAX_DEPTH) {
+        profile_depth++;
+        return;
+    }
+
+    pthread_mutex_lock(&profile_lock);
+    int node = profile_find_node(name, parent);
+    pthread_mutex_unlock(&profile_lock);
+
+    profile_stack[profile_depth].node = node;
+    profile_stack[profile_depth].start_ns = profile_now_ns();
+    profile_depth++;
+}
+
+// Record the innermost span of the calling thread as finished
+static void profile_pop(uint64_t now_ns) {
+    profile_depth--;
+    if (profile_depth >= PROFILE_MAX_DEPTH) return;
+
+    profile_frame_t *frame = &profile_stack[profile_depth];
+    if (frame->node < 0) return;
+
+    uint64_t elapsed = now_ns - frame->start_ns;
+
+    pthread_mutex_lock(&profile_lock);
+    profile_node_t *node = &profile_nodes[frame->node];
+    node->count++;
+    node->total_ns += elapsed;
+    if (elapsed < node->min_ns) node->min_ns = elapsed;
+    if (elapsed > node->max_ns) node->max_ns = elapsed;
+    node->histogram[profile_bucket(elapsed)]++;
+    pthread_mutex_unlock(&profile_lock);
+}
+
+// Close the span called name, and anything left open inside it
+void profile_end(const char *name) {
+    uint64_t now_ns = profile_now_ns();
+    int target = -1;
+
+    for (int i = (profile_depth < PROFILE_MAX_DEPTH ? profile_depth : PROFILE_MAX_DEPTH) - 1; i >= 0; i--) {
+        int node = profile_stack[i].node;
+        if (!name || (node >= 0 && strncmp(profile_nodes[node].name, name, sizeof(profile_nodes[0].name) - 1) == 0)) {
+            target = i;
+            break;
+        }
+    }
+
+    // Ending a span that was never started must not unbalance the stack
+    if (target < 0) return;
+
+    while (profile_depth > target) {
+        profile_pop(now_ns);
+    }
+}
+
+// Format a duration with a unit that keeps it readable
+static void profile_format_ns(double ns, char *buffer, size_t size) {
+    if (ns >= 1e9) {
+        snprintf(buffer, size, "%.2fs", ns / 1e9);
+    } else if (ns >= 1e6) {
+        snprintf(buffer, size, "%.2fms", ns / 1e6);
+    } else {
+        snprintf(buffer, size, "%.1fus", ns / 1e3);
+    }
+}
+
+// Log one line of aggregates
+static void profile_log_line(const char *label, int indent, unsigned long count, uint64_t total_ns,
+                             uint64_t min_ns, uint64_t max_ns, const uint32_t *histogram) {
+    char total[16], minimum[16], maximum[16], p50[16], p95[16];
+    char msg[256];
+
+    profile_format_ns((double)total_ns, total, sizeof(total));
+    profile_format_ns((double)min_ns, minimum, sizeof(minimum));
+    profile_format_ns((double)max_ns, maximum, sizeof(maximum));
+    profile_format_ns(profile_percentile(histogram, count, min_ns, max_ns, 0.50), p50, sizeof(p50));
+    profile_format_ns(profile_percentile(histogram, count, min_ns, max_ns, 0.95), p95, sizeof(p95));
+
+    snprintf(msg, sizeof(msg), "%*s%-*s %7lu %10s %10s %10s %10s %10s",
+             indent * 2, "", 32 - indent * 2 > 8 ? 32 - indent * 2 : 8, label,
+             count, total, minimum, p50, p95, maximum);
+    LOG_INFO(msg);
+}
+
+// Log the call tree below parent, depth first
+static void profile_report_tree(int parent) {
+    for (int i = 0; i < profile_node_count; i++) {
+        profile_node_t *node = &profile_nodes[i];
+        if (node->parent != parent || node->count == 0) continue;
+
+        profile_log_line(node->name, node->depth, node->count, node->total_ns,
+                         node->min_ns, node->max_ns, node->histogram);
+        profile_report_tree(i);
+    }
+}
+
+// Report the aggregates of every call path of one span name
+void profile_report(const char *name) {
+    static uint32_t histogram[PROFILE_BUCKETS];
+    unsigned long count = 0;
+    uint64_t total_ns = 0, min_ns = UINT64_MAX, max_ns = 0;
+
+    pthread_mutex_lock(&profile_lock);
+    memset(histogram, 0, sizeof(histogram));
+    for (int i = 0; i < profile_node_count; i++) {
+        profile_node_t *node = &profile_nodes[i];
+        if (node->count == 0 || strcmp(node->name, name) != 0) continue;
+
+        count += node->count;
+        total_ns += node->total_ns;
+        if (node->min_ns < min_ns) min_ns = node->min_ns;
+        if (node->max_ns > max_ns) max_ns = node->max_ns;
+        for (int b = 0; b < PROFILE_BUCKETS; b++) {
+            histogram[b] += node->histogram[b];
+        }
+    }
+
+    if (count > 0) {
+        profile_log_line(name, 0, count, total_ns, min_ns, max_ns, histogram);
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+// Report the whole call tree
+void profile_report_all(void) {
+    char msg[256];
+
+    pthread_mutex_lock(&profile_lock);
+    if (profile_node_count == 0) {
+        pthread_mutex_unlock(&profile_lock);
+        return;
+    }
+
+    LOG_INFO("=== Profile report ===");
+    snprintf(msg, sizeof(msg), "%-32s %7s %10s %10s %10s %10s %10s",
+             "span", "count", "total", "min", "p50", "p95", "max");
+    LOG_INFO(msg);
+    profile_report_tree(-1);
+
+    if (profile_dropped > 0) {
+        snprintf(msg, sizeof(msg), "%lu spans were not recorded, the profile table is full", profile_dropped);
+        LOG_WARNING(msg);
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
@@ -0,0 +1,287 @@
+/*
+ * retry.c - Failure classification and retry policy for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file decides what a failed command deserves from its exit status and
+ * the tail of its output: transient network, mirror and lock failures are
+ * retried with exponential backoff and jitter (honouring Retry-After), while
+ * compiler errors, a full disk, missing URLs and commands that ran out of
+ * time fail at once. Downloads are retried with resume flags so that a
+ * retry continues the partial file instead of starting over.
+ */
+
+#include "builder.h"
+
+// How a failure class is retried
+typedef struct {
+    const char *name;
+    int retry;              // 0: fail fast
+    int max_attempts;       // Unknown failures use the caller's limit instead
+    double base_delay;      // Seconds before the first retry, doubled per attempt
+    double max_delay;
+} retry_policy_t;
+
+static const retry_policy_t retry_policies[] = {
+    [FAILURE_NONE]        = {"none",        0,  1,  0.0,   0.0},
+    [FAILURE_UNKNOWN]     = {"unknown",     1,  3,  2.0,  30.0},
+    [FAILURE_DNS]         = {"dns",         1,  5,  2.0,  60.0},
+    [FAILURE_CONNECTION]  = {"connection",  1,  5,  2.0,  60.0},
+    [FAILURE_TLS]         = {"tls",         1,  3,  2.0,  30.0},
+    [FAILURE_HTTP_5XX]    = {"http_5xx",    1,  5,  5.0, 120.0},
+    [FAILURE_HTTP_429]    = {"http_429",    1,  5, 10.0, 300.0},
+    [FAILURE_HTTP_4XX]    = {"http_4xx",    0,  1,  0.0,   0.0},
+    [FAILURE_APT_LOCK]    = {"apt_lock",    1, 10,  5.0,  60.0},
+    [FAILURE_GIT_EOF]     = {"git_eof",     1,  4,  5.0,  60.0},
+    [FAILURE_NO_SPACE]    = {"no_space",    0,  1,  0.0,   0.0},
+    [FAILURE_COMPILER]    = {"compiler",    0,  1,  0.0,   0.0},
+    [FAILURE_HUNG]        = {"hung",        1,  2,  5.0,  30.0},
+    [FAILURE_TIMEOUT]     = {"timeout",     0,  1,  0.0,   0.0},
+    [FAILURE_INTERRUPTED] = {"interrupted", 0,  1,  0.0,   0.0},
+};
+
+// Output patterns, checked in order; the first match wins
+static const struct {
+    const char *pattern;
+    failure_class_t failure;
+} retry_patterns[] = {
+    // A full disk breaks everything else, so it is recognised first
+    {"No space left on device", FAILURE_NO_SPACE},
+    {"Disk quota exceeded", FAILURE_NO_SPACE},
+
+    {"Could not get lock", FAILURE_APT_LOCK},
+    {"Unable to acquire the dpkg frontend lock", FAILURE_APT_LOCK},
+    {"Unable to lock directory", FAILURE_APT_LOCK},
+    {"is another process using it?", FAILURE_APT_LOCK},
+
+    {"Could not resolve host", FAILURE_DNS},
+    {"Temporary failure in name resolution", FAILURE_DNS},
+    {"Temporary failure resolving", FAILURE_DNS},
+    {"unable to resolve host address", FAILURE_DNS},
+    {"Name or service not known", FAILURE_DNS},
+
+    {"429 Too Many Requests", FAILURE_HTTP_429},
+    {"returned error: 429", FAILURE_HTTP_429},
+    {"ERROR 429", FAILURE_HTTP_429},
+    {"rate limit", FAILURE_HTTP_429},
+
+    {"returned error: 50", FAILURE_HTTP_5XX},
+    {"ERROR 50", FAILURE_HTTP_5XX},
+    {" 500 Internal Server Error", FAILURE_HTTP_5XX},
+    {" 502 Bad Gateway", FAILURE_HTTP_5XX},
+    {" 503 Service Unavailable", FAILURE_HTTP_5XX},
+    {" 504 Gateway Time", FAILURE_HTTP_5XX},
+
+    {"returned error: 40", FAILURE_HTTP_4XX},
+    {"ERROR 404", FAILURE_HTTP_4XX},
+    {"ERROR 403", FAILURE_HTTP_4XX},
+    {" 404 Not Found", FAILURE_HTTP_4XX},
+    {"Repository not found", FAILURE_HTTP_4XX},
+    {"Remote branch", FAILURE_HTTP_4XX},           // ... not found in upstream origin
+
+    {"early EOF", FAILURE_GIT_EOF},
+    {"the remote end hung up unexpectedly", FAILURE_GIT_EOF},
+    {"RPC failed", FAILURE_GIT_EOF},
+    {"unexpected disconnect while reading sideband packet", FAILURE_GIT_EOF},
+    {"fetch-pack: invalid index-pack output", FAILURE_GIT_EOF},
+
+    {"SSL_ERROR", FAILURE_TLS},
+    {"SSL connect error", FAILURE_TLS},
+    {"TLS handshake", FAILURE_TLS},
+    {"gnutls_handshake() failed", FAILURE_TLS},
+    {"GnuTLS recv error", FAILURE_TLS},
+
+    {"Connection timed out", FAILURE_CONNECTION},
+    {"Connection refused", FAILURE_CONNECTION},
+    {"Connection reset by peer", FAILURE_CONNECTION},
+    {"Network is unreachable", FAILURE_CONNECTION},
+    {"Operation timed out", FAILURE_CONNECTION},
+    {"Failed to fetch", FAILURE_CONNECTION},
+    {"Hash Sum mismatch", FAILURE_CONNECTION},      // A mirror caught mid-sync
+
+    {": fatal error: ", FAILURE_COMPILER},
+    {": error: ", FAILURE_COMPILER},
+    {"undefined reference to", FAILURE_COMPILER},
+    {"collect2: error:", FAILURE_COMPILER},
+    {"Error 1\n", FAILURE_COMPILER},
+    {"Error 2\n", FAILURE_COMPILER},
+};
+
+// Classify a failed command from its usage and output tail
+failure_class_t retry_classify(const char *cmd, const command_usage_t *usage, const char *output) {
+    if (usage) {
+        if (usage->timed_out == WATCHDOG_WALL) return FAILURE_TIMEOUT;
+        if (usage->timed_out == WATCHDOG_IDLE) return FAILURE_HUNG;
+        if (usage->exit_status == 0) return FAILURE_NONE;
+        if (usage->exit_status == 128 + SIGINT || usage->exit_status == 128 + SIGQUIT) {
+            return FAILURE_INTERRUPTED;
+        }
+    }
+
+    if (output) {
+        for (size_t i = 0; i < sizeof(retry_patterns) / sizeof(retry_patterns[0]); i++) {
+            if (strcasestr(output, retry_patterns[i].pattern)) {
+                return retry_patterns[i].failure;
+            }
+        }
+    }
+
+    // Exit codes of curl and wget when their messages were not captured
+    if (usage && cmd) {
+        if (strstr(cmd, "curl ")) {
+            switch (usage->exit_status) {
+                case 6: return FAILURE_DNS;
+                case 7: case 28: case 52: case 56: return FAILURE_CONNECTION;
+                case 18: return FAILURE_CONNECTION;
+                case 35: return FAILURE_TLS;
+                default: break;
+            }
+        }
+        if (strstr(cmd, "wget ")) {
+            switch (usage->exit_status) {
+                case 4: return FAILURE_CONNECTION;
+                case 5: return FAILURE_TLS;
+                case 8: return FAILURE_HTTP_5XX;
+                default: break;
+            }
+        }
+    }
+
+    return FAILURE_UNKNOWN;
+}
+
+// Name of a failure class, as used in the log and the event log
+const char* retry_failure_name(failure_class_t failure) {
+    if (failure < 0 || failure > FAILURE_INTERRUPTED) return "unknown";
+    return retry_policies[failure].name;
+}
+
+// Error code that describes a failure class
+error_code_t retry_error_code(failure_class_t failure) {
+    switch (failure) {
+        case FAILURE_NONE: return ERROR_SUCCESS;
+        case FAILURE_DNS:
+        case FAILURE_CONNECTION:
+        case FAILURE_TLS:
+        case FAILURE_HTTP_5XX:
+        case FAILURE_HTTP_429:
+        case FAILURE_HTTP_4XX:
+        case FAILURE_GIT_EOF: return ERROR_NETWORK_FAILURE;
+        case FAILURE_APT_LOCK: return ERROR_INSTALLATION_FAILED;
+        case FAILURE_NO_SPACE: return ERROR_INSUFFICIENT_SPACE;
+        case FAILURE_COMPILER: return ERROR_COMPILATION_FAILED;
+        case FAILURE_INTERRUPTED: return ERROR_USER_CANCELLED;
+        default: return ERROR_UNKNOWN;
+    }
+}
+
+// Whether a failure is worth another attempt; the caller's limit only
+// applies to failures that could not be classified
+int retry_should_retry(failure_class_t failure, int attempt, int max_attempts) {
+    if (failure < 0 || failure > FAILURE_INTERRUPTED) failure = FAILURE_UNKNOWN;
+    if (!retry_policies[failure].retry) return 0;
+    if (failure == FAILURE_UNKNOWN) return attempt < max_attempts;
+    return attempt < retry_policies[failure].max_attempts;
+}
+
+// Seconds asked for by a Retry-After header in the output, 0 when absent
+static double parse_retry_after(const char *output) {
+    const char *header = output ? strcasestr(output, "Retry-After:") : NULL;
+    struct tm tm_info;
+
+    if (!header) return 0.0;
+    header += strlen("Retry-After:");
+    while (*header == ' ') header++;
+
+    if (isdigit((unsigned char)*header)) {
+        return atof(header);
+    }
+
+    // HTTP date form: Wed, 21 Oct 2015 07:28:00 GMT
+    memset(&tm_info, 0, sizeof(tm_info));
+    if (strptime(header, "%a, %d %b %Y %H:%M:%S GMT", &tm_info)) {
+        double wait = difftime(timegm(&tm_info), time(NULL));
+        return wait > 0 ? wait : 0.0;
+    }
+
+    return 0.0;
+}
+
+// Delay before the next attempt: exponential backoff with jitter, at least Retry-After
+double retry_delay(failure_class_t failure, int attempt, const char *output) {
+    static __thread unsigned int seed = 0;
+    const retry_policy_t *policy;
+
+    if (failure < 0 || failure > FAILURE_INTERRUPTED) failure = FAILURE_UNKNOWN;
+    policy = &retry_policies[failure];
+
+    if (seed == 0) {
+        seed = (unsigned int)(get_monotonic_time() * 1000000.0) ^ (unsigned int)getpid();
+    }
+
+    double delay = policy->base_delay;
+    for (int i = 1; i < attempt && delay < policy->max_delay; i++) {
+        delay *= 2.0;
+    }
+    if (delay > policy->max_delay) delay = policy->max_delay;
+
+    // Equal jitter: half fixed, half random, so parallel builds spread out
+    delay = delay / 2.0 + (delay / 2.0) * (rand_r(&seed) / (double)RAND_MAX);
+
+    double retry_after = parse_retry_after(output);
+    if (retry_after > delay) {
+        delay = retry_after > 600.0 ? 600.0 : retry_after;
+    }
+
+    return delay;
+}
+
+// Check that a program name found in a command is the word that runs: at the
+// start or after a separator, not an argument such as a package name
+static int is_command_position(const char *cmd, const char *at) {
+    while (at > cmd && at[-1] == ' ') at--;
+    return at == cmd || strchr(";&|(", at[-1]) != NULL;
+}
+
+// Insert text after the first occurrence of a program name in a command
+static int insert_after_program(const char *cmd, const char *program, const char *text,
+                                char *out, size_t size) {
+    const char *at = strstr(cmd, program);
+    size_t plen = strlen(program);
+
+    // "apt-get install git wget curl" must not become "wget -c curl"
+    while (at && !is_command_position(cmd, at)) {
+        at = strstr(at + plen, program);
+    }
+    if (!at) return 0;
+
+    int written = snprintf(out, size, "%.*s%s%s", (int)(at - cmd + plen), cmd, text, at + plen);
+    return written > 0 && (size_t)written < size;
+}
+
+// Rewrite a download command so that a retry continues its partial file
+int retry_resume_command(const char *cmd, char *out, size_t size) {
+    if (strstr(cmd, "wget ") && !strstr(cmd, " -c ") && !strstr(cmd, "--continue")) {
+        return insert_after_program(cmd, "wget ", "-c ", out, size);
+    }
+
+    // curl resumes only into a named output file
+    if (strstr(cmd, "curl ") && !strstr(cmd, " -C ") && !strstr(cmd, "--continue-at") &&
+        (strstr(cmd, " -o ") || strstr(cmd, " -O") || strstr(cmd, "--output"))) {
+        return insert_after_program(cmd, "curl ", "-C - ", out, size);
+    }
+
+    return 0;
+}
+
+// Sleep for seconds, waking early when the build is interrupted
+void retry_sleep(double seconds) {
+    double end = get_monotonic_time() + seconds;
+
+    while (!interrupted) {
+        double left = end - get_monotonic_time();
+        if (left <= 0) break;
+        struct timespec ts = { (time_t)(left > 1.0 ? 1.0 : left),
+                               (long)((left > 1.0 ? 0.0 : left - (long)left) * 1e9) };
+        nanosleep(&ts, NULL);
+    }
+}
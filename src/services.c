@@ -0,0 +1,413 @@
+/*
+ * services.c - Offline service configuration for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file enables systemd units in the rootfs directly from the host by
+ * reading their [Install] sections and writing the .wants/ symlinks, writes a
+ * preset file describing the result, and generates the ufw rules without
+ * running anything inside the chroot. Host-side "systemctl --root
+ * is-enabled" calls, which only read the unit state, verify the result
+ * when systemctl is available.
+ */
+
+#include "builder.h"
+
+#define SERVICES_PRESET_FILE "/etc/systemd/system-preset/80-opi5plus.preset"
+#define UNIT_INSTALL_MAX_DEPTH 4
+
+// Services enabled on every distribution
+static const char *common_services[] = {
+    "systemd-networkd.service",
+    "systemd-resolved.service",
+    "ssh.service",
+    NULL
+};
+
+// Services and firewall ports per distribution
+typedef struct {
+    distro_type_t distro_type;
+    const char *services[8];
+    const char *allow_tcp_ports[8];  // Opened in ufw, NULL for no firewall rules
+} distro_services_t;
+
+static const distro_services_t distro_services[] = {
+    { DISTRO_DESKTOP,   { "gdm3.service", NULL }, { NULL } },
+    { DISTRO_SERVER,    { NULL },                 { "22", NULL } },
+    { DISTRO_EMULATION, { NULL },                 { NULL } },
+    { DISTRO_MINIMAL,   { NULL },                 { NULL } },
+    { DISTRO_CUSTOM,    { NULL },                 { NULL } }
+};
+
+// Directories searched for unit files, in systemd's order of precedence
+static const char *unit_search_dirs[] = {
+    "/etc/systemd/system",
+    "/usr/lib/systemd/system",
+    "/lib/systemd/system",
+    NULL
+};
+
+// Find the service table entry of a distribution
+static const distro_services_t* find_distro_services(distro_type_t distro_type) {
+    for (size_t i = 0; i < sizeof(distro_services) / sizeof(distro_services[0]); i++) {
+        if (distro_services[i].distro_type == distro_type) {
+            return &distro_services[i];
+        }
+    }
+    return NULL;
+}
+
+// Locate a unit file in the rootfs, following alias symlinks to the real unit
+static int find_unit_file(const char *rootfs_dir, const char *unit,
+                          char *unit_name, size_t name_size,
+                          char *unit_path, size_t path_size) {
+    char name[256];
+    char path[MAX_PATH_LEN];
+
+    if (snprintf(name, sizeof(name), "%s", unit) >= (int)sizeof(name)) return -1;
+
+    // Alias chains are short; anything longer is treated as broken
+    for (int hops = 0; hops < 8; hops++) {
+        int found = 0;
+
+        for (int i = 0; unit_search_dirs[i] != NULL; i++) {
+            struct stat st;
+            char link[MAX_PATH_LEN];
+
+            if (snprintf(path, sizeof(path), "%s%s/%s", rootfs_dir, unit_search_dirs[i], name) >= (int)sizeof(path)) {
+                return -1;
+            }
+            if (lstat(path, &st) != 0) continue;
+
+            if (S_ISLNK(st.st_mode)) {
+                ssize_t len = readlink(path, link, sizeof(link) - 1);
+                if (len <= 0) return -1;
+                link[len] = '\0';
+
+                // Masked units cannot be enabled
+                if (strcmp(link, "/dev/null") == 0) return -1;
+
+                const char *base = strrchr(link, '/');
+                base = base ? base + 1 : link;
+                if (strcmp(base, name) == 0) return -1;
+                if (snprintf(name, sizeof(name), "%s", base) >= (int)sizeof(name)) return -1;
+                found = 1;
+                break;
+            }
+
+            if (snprintf(unit_name, name_size, "%s", name) >= (int)name_size ||
+                snprintf(unit_path, path_size, "%s/%s", unit_search_dirs[i], name) >= (int)path_size) {
+                return -1;
+            }
+            return 0;
+        }
+
+        if (!found) return -1;
+    }
+
+    return -1;
+}
+
+// Create one enablement symlink, replacing a stale one
+static int create_unit_symlink(const char *target, const char *link_path) {
+    if (symlink(target, link_path) == 0) return 0;
+    if (errno != EEXIST) return -1;
+
+    unlink(link_path);
+    return symlink(target, link_path);
+}
+
+// Enable one unit by applying its [Install] section inside the rootfs
+static int enable_unit_offline(const char *rootfs_dir, const char *unit, int depth) {
+    char unit_name[256];
+    char unit_path[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN];
+    char line[1024];
+    char msg[2 * MAX_PATH_LEN + 128];
+    int in_install = 0;
+    int links = 0;
+    int failed = 0;
+    error_context_t error_ctx = {0};
+
+    if (depth > UNIT_INSTALL_MAX_DEPTH) return ERROR_SUCCESS;
+
+    if (find_unit_file(rootfs_dir, unit, unit_name, sizeof(unit_name),
+                       unit_path, sizeof(unit_path)) != 0) {
+        snprintf(msg, sizeof(msg), "Unit %s not found in the rootfs, not enabling it", unit);
+        LOG_WARNING(msg);
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    snprintf(path, sizeof(path), "%s%s", rootfs_dir, unit_path);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return ERROR_FILE_NOT_FOUND;
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *key = line;
+        char *value;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        while (isspace((unsigned char)*key)) key++;
+
+        if (*key == '[') {
+            in_install = (strcmp(key, "[Install]") == 0);
+            continue;
+        }
+        if (!in_install || *key == '#' || *key == ';') continue;
+
+        value = strchr(key, '=');
+        if (!value) continue;
+        *value++ = '\0';
+        key[strcspn(key, " \t")] = '\0';
+
+        int wanted = strcmp(key, "WantedBy") == 0;
+        int required = strcmp(key, "RequiredBy") == 0;
+        int alias = strcmp(key, "Alias") == 0;
+        int also = strcmp(key, "Also") == 0;
+        if (!wanted && !required && !alias && !also) continue;
+
+        // Every key takes a whitespace separated list of unit names
+        char *saveptr = NULL;
+        for (char *name = strtok_r(value, " \t", &saveptr); name != NULL;
+             name = strtok_r(NULL, " \t", &saveptr)) {
+            char link_path[2 * MAX_PATH_LEN];
+            int too_long;
+
+            if (also) {
+                enable_unit_offline(rootfs_dir, name, depth + 1);
+                continue;
+            }
+
+            if (alias) {
+                too_long = snprintf(link_path, sizeof(link_path), "%s/etc/systemd/system/%s",
+                                    rootfs_dir, name) >= (int)sizeof(link_path);
+            } else {
+                too_long = snprintf(path, sizeof(path), "%s/etc/systemd/system/%s.%s", rootfs_dir, name,
+                                    wanted ? "wants" : "requires") >= (int)sizeof(path);
+                if (!too_long) {
+                    create_directory_safe(path, &error_ctx);
+                    too_long = snprintf(link_path, sizeof(link_path), "%s/%s",
+                                        path, unit_name) >= (int)sizeof(link_path);
+                }
+            }
+
+            if (too_long) {
+                snprintf(msg, sizeof(msg), "Path for %s in %s is too long", unit_name, name);
+                LOG_WARNING(msg);
+                failed = 1;
+            } else if (create_unit_symlink(unit_path, link_path) != 0) {
+                snprintf(msg, sizeof(msg), "Failed to create %s: %s", link_path, strerror(errno));
+                LOG_WARNING(msg);
+                failed = 1;
+            } else {
+                links++;
+            }
+        }
+    }
+    fclose(fp);
+
+    snprintf(msg, sizeof(msg), "Enabled %s (%d symlinks)", unit_name, links);
+    LOG_DEBUG(msg);
+
+    return failed ? ERROR_INSTALLATION_FAILED : ERROR_SUCCESS;
+}
+
+// Open the given TCP ports in the ufw user rules, as "ufw allow" would
+static int write_ufw_rules(const char *rootfs_dir, const char *const *ports) {
+    const char *rule_files[] = { "user.rules", "user6.rules" };
+    char path[MAX_PATH_LEN];
+    char tmp_path[MAX_PATH_LEN + 8];
+    char line[1024];
+    char msg[512];
+
+    // "ufw default deny incoming" / "allow outgoing"
+    if (snprintf(path, sizeof(path), "%s/etc/default/ufw", rootfs_dir) >= (int)sizeof(path)) {
+        LOG_ERROR("Rootfs path too long for the ufw configuration");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        LOG_WARNING("ufw is not installed in the rootfs, skipping firewall rules");
+        return ERROR_FILE_NOT_FOUND;
+    }
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        fclose(in);
+        return ERROR_PERMISSION_DENIED;
+    }
+    while (fgets(line, sizeof(line), in)) {
+        if (strncmp(line, "DEFAULT_INPUT_POLICY=", 21) == 0) {
+            fputs("DEFAULT_INPUT_POLICY=\"DROP\"\n", out);
+        } else if (strncmp(line, "DEFAULT_OUTPUT_POLICY=", 22) == 0) {
+            fputs("DEFAULT_OUTPUT_POLICY=\"ACCEPT\"\n", out);
+        } else {
+            fputs(line, out);
+        }
+    }
+    fclose(in);
+    if (fclose(out) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        LOG_ERROR("Failed to update the ufw default policies");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    for (int f = 0; f < 2; f++) {
+        int ipv6 = (f == 1);
+        int in_rules = 0;
+
+        if (snprintf(path, sizeof(path), "%s/etc/ufw/%s", rootfs_dir, rule_files[f]) >= (int)sizeof(path)) {
+            LOG_ERROR("Rootfs path too long for the ufw rules");
+            return ERROR_INSTALLATION_FAILED;
+        }
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+        in = fopen(path, "r");
+        if (!in) {
+            snprintf(msg, sizeof(msg), "ufw rules file %s not found, skipping", rule_files[f]);
+            LOG_WARNING(msg);
+            continue;
+        }
+        out = fopen(tmp_path, "w");
+        if (!out) {
+            fclose(in);
+            return ERROR_PERMISSION_DENIED;
+        }
+
+        while (fgets(line, sizeof(line), in)) {
+            if (in_rules) {
+                // Blank separators are rewritten below
+                if (strcmp(line, "\n") == 0) continue;
+
+                // Drop earlier copies of our rules so the result is idempotent
+                int ours = 0;
+                for (int p = 0; ports[p] != NULL; p++) {
+                    char tuple[128];
+                    snprintf(tuple, sizeof(tuple), "### tuple ### allow tcp %s %s any %s in\n",
+                             ports[p], ipv6 ? "::/0" : "0.0.0.0/0", ipv6 ? "::/0" : "0.0.0.0/0");
+                    if (strcmp(line, tuple) == 0) ours = 1;
+                }
+                if (ours) {
+                    if (!fgets(line, sizeof(line), in)) break;
+                    continue;
+                }
+
+                if (strncmp(line, "### tuple ### ", 14) == 0 || strcmp(line, "### END RULES ###\n") == 0) {
+                    fputs("\n", out);
+                }
+                if (strcmp(line, "### END RULES ###\n") == 0) {
+                    in_rules = 0;
+                }
+                fputs(line, out);
+                continue;
+            }
+
+            fputs(line, out);
+
+            if (strcmp(line, "### RULES ###\n") == 0) {
+                in_rules = 1;
+                for (int p = 0; ports[p] != NULL; p++) {
+                    fprintf(out,
+                            "\n"
+                            "### tuple ### allow tcp %s %s any %s in\n"
+                            "-A %s-user-input -p tcp --dport %s -j ACCEPT\n",
+                            ports[p], ipv6 ? "::/0" : "0.0.0.0/0", ipv6 ? "::/0" : "0.0.0.0/0",
+                            ipv6 ? "ufw6" : "ufw", ports[p]);
+                }
+            }
+        }
+
+        fclose(in);
+        if (fclose(out) != 0 || rename(tmp_path, path) != 0) {
+            unlink(tmp_path);
+            snprintf(msg, sizeof(msg), "Failed to update the ufw rules file %s", rule_files[f]);
+            LOG_ERROR(msg);
+            return ERROR_INSTALLATION_FAILED;
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Enable the distribution services and write the firewall rules from the host
+int configure_services_offline(build_config_t *config, const char *rootfs_dir) {
+    const distro_services_t *entry = find_distro_services(config->distro_type);
+    const char *units[32];
+    int unit_count = 0;
+    int enabled = 0;
+    int failed = 0;
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    char msg[512];
+    error_context_t error_ctx = {0};
+
+    LOG_INFO("Enabling services offline...");
+
+    for (int i = 0; common_services[i] != NULL; i++) {
+        units[unit_count++] = common_services[i];
+    }
+    for (int i = 0; entry && entry->services[i] != NULL && unit_count < 32; i++) {
+        units[unit_count++] = entry->services[i];
+    }
+
+    // A unit missing from the rootfs only warns; a failed symlink is an error
+    for (int i = 0; i < unit_count; i++) {
+        int result = enable_unit_offline(rootfs_dir, units[i], 0);
+        if (result == ERROR_SUCCESS) {
+            enabled++;
+        } else if (result != ERROR_FILE_NOT_FOUND) {
+            failed++;
+        }
+    }
+
+    // Record the selection as a preset so later preset runs agree with it
+    snprintf(path, sizeof(path), "%s/etc/systemd/system-preset", rootfs_dir);
+    create_directory_safe(path, &error_ctx);
+    snprintf(path, sizeof(path), "%s" SERVICES_PRESET_FILE, rootfs_dir);
+    FILE *fp = fopen(path, "w");
+    if (fp) {
+        fprintf(fp, "# Services enabled by the Orange Pi 5 Plus builder\n");
+        for (int i = 0; i < unit_count; i++) {
+            fprintf(fp, "enable %s\n", units[i]);
+        }
+        fclose(fp);
+    } else {
+        LOG_WARNING("Failed to write the systemd preset file");
+    }
+
+    // Firewall rules
+    if (entry && entry->allow_tcp_ports[0] != NULL) {
+        LOG_INFO("Writing firewall rules...");
+        int result = write_ufw_rules(rootfs_dir, entry->allow_tcp_ports);
+        if (result != ERROR_SUCCESS && result != ERROR_FILE_NOT_FOUND) {
+            return result;
+        }
+    }
+
+    // is-enabled only reads the unit state, so verifying changes nothing in the rootfs
+    if (system("command -v systemctl >/dev/null 2>&1") == 0) {
+        for (int i = 0; i < unit_count; i++) {
+            char unit_name[256];
+            char unit_path[MAX_PATH_LEN];
+
+            // Units missing from the rootfs were already reported above
+            if (find_unit_file(rootfs_dir, units[i], unit_name, sizeof(unit_name),
+                               unit_path, sizeof(unit_path)) != 0) {
+                continue;
+            }
+            snprintf(cmd, sizeof(cmd), "systemctl --root=%s is-enabled --quiet %s",
+                     rootfs_dir, units[i]);
+            if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+                snprintf(msg, sizeof(msg), "systemctl does not report %s as enabled", units[i]);
+                LOG_ERROR(msg);
+                failed++;
+            }
+        }
+    } else {
+        LOG_DEBUG("systemctl not available on the host, skipping the enablement check");
+    }
+
+    snprintf(msg, sizeof(msg), "Enabled %d of %d services", enabled, unit_count);
+    LOG_INFO(msg);
+
+    return failed ? ERROR_INSTALLATION_FAILED : ERROR_SUCCESS;
+}
@@ -0,0 +1,491 @@
+/*
+ * slim.c - Rootfs slimming for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file removes content that is not needed on the board (apt lists and
+ * caches, documentation, unused translations, debug info in development
+ * files) according to the configured policy, and reports where the space
+ * of the rootfs goes, by package and by directory.
+ */
+
+#include "builder.h"
+#include <dirent.h>
+#include <ftw.h>
+
+#define SLIM_DIR_DEPTH 3
+#define SLIM_DIR_TABLE_SIZE 8192
+#define SLIM_DPKG_EXCLUDE_FILE "/etc/dpkg/dpkg.cfg.d/01-opi5plus-slim"
+
+#define SLIM_MAX_KEEP (MAX_LOCALES * 2 + 2)
+
+// Translations kept when unused locales are removed, filled from the locale set
+static char slim_keep_locales[SLIM_MAX_KEEP][64];
+
+// Size of one package as recorded by dpkg
+typedef struct {
+    char name[128];
+    long installed_kb;
+} package_size_t;
+
+// Size attributed to one directory
+typedef struct {
+    char path[MAX_PATH_LEN];
+    long long bytes;
+    int used;
+} dir_size_t;
+
+// nftw() takes no user pointer, so the directory walk keeps its state here
+static dir_size_t *dir_table = NULL;
+static int dir_entries = 0;
+static size_t walk_root_len = 0;
+static long long walk_total_bytes = 0;
+
+// Parse a comma separated slimming policy (apt,docs,locales,strip-dev,all)
+int parse_slim_policy(const char *text) {
+    char buffer[128];
+    char *saveptr = NULL;
+    int policy = 0;
+
+    if (snprintf(buffer, sizeof(buffer), "%s", text) >= (int)sizeof(buffer)) return -1;
+
+    for (char *item = strtok_r(buffer, ",", &saveptr); item != NULL;
+         item = strtok_r(NULL, ",", &saveptr)) {
+        if (strcmp(item, "apt") == 0) {
+            policy |= SLIM_APT_CACHE;
+        } else if (strcmp(item, "docs") == 0) {
+            policy |= SLIM_DOCS;
+        } else if (strcmp(item, "locales") == 0) {
+            policy |= SLIM_LOCALES;
+        } else if (strcmp(item, "strip-dev") == 0) {
+            policy |= SLIM_STRIP_DEV;
+        } else if (strcmp(item, "default") == 0) {
+            policy |= SLIM_DEFAULT;
+        } else if (strcmp(item, "all") == 0) {
+            policy |= SLIM_DEFAULT | SLIM_STRIP_DEV;
+        } else if (strcmp(item, "none") != 0) {
+            return -1;
+        }
+    }
+
+    return policy;
+}
+
+// Hash a directory path into the attribution table
+static unsigned int dir_hash(const char *path) {
+    unsigned int hash = 2166136261u;
+
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Account one file to its directory, cut at SLIM_DIR_DEPTH levels
+static int slim_walk_entry(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    char dir[MAX_PATH_LEN];
+    const char *rel = fpath + walk_root_len;
+    int depth = 0;
+    size_t len = 0;
+
+    (void)ftwbuf;
+
+    if (typeflag != FTW_F && typeflag != FTW_SL) return 0;
+
+    // Parent directory of the file, limited to the first levels below /
+    const char *last_slash = strrchr(rel, '/');
+    size_t parent_len = last_slash ? (size_t)(last_slash - rel) : 0;
+    for (len = 0; len < parent_len; len++) {
+        if (rel[len] == '/' && len > 0 && ++depth >= SLIM_DIR_DEPTH) break;
+    }
+    if (len == 0) {
+        strcpy(dir, "/");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int)len, rel);
+    }
+
+    long long bytes = (long long)sb->st_blocks * 512;
+    walk_total_bytes += bytes;
+
+    unsigned int slot = dir_hash(dir) & (SLIM_DIR_TABLE_SIZE - 1);
+    for (int probe = 0; probe < SLIM_DIR_TABLE_SIZE; probe++) {
+        dir_size_t *entry = &dir_table[slot];
+        if (!entry->used) {
+            if (dir_entries >= SLIM_DIR_TABLE_SIZE - 1) return 0;
+            snprintf(entry->path, sizeof(entry->path), "%s", dir);
+            entry->used = 1;
+            dir_entries++;
+        }
+        if (strcmp(entry->path, dir) == 0) {
+            entry->bytes += bytes;
+            return 0;
+        }
+        slot = (slot + 1) & (SLIM_DIR_TABLE_SIZE - 1);
+    }
+
+    return 0;
+}
+
+// Sort directories by size, largest first
+static int compare_dir_size(const void *a, const void *b) {
+    const dir_size_t *da = a;
+    const dir_size_t *db = b;
+
+    if (da->used != db->used) return db->used - da->used;
+    return (db->bytes > da->bytes) - (db->bytes < da->bytes);
+}
+
+// Sort packages by installed size, largest first
+static int compare_package_size(const void *a, const void *b) {
+    const package_size_t *pa = a;
+    const package_size_t *pb = b;
+
+    return (pb->installed_kb > pa->installed_kb) - (pb->installed_kb < pa->installed_kb);
+}
+
+// Read the installed size of every package from the dpkg database
+static int read_package_sizes(const char *rootfs_dir, package_size_t **packages) {
+    char path[MAX_PATH_LEN];
+    char line[1024];
+    package_size_t current = {0};
+    int installed = 0;
+    int count = 0;
+    int capacity = 0;
+
+    *packages = NULL;
+
+    snprintf(path, sizeof(path), "%s/var/lib/dpkg/status", rootfs_dir);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+
+    // A trailing blank line terminates the last stanza
+    for (int done = 0; !done; ) {
+        if (!fgets(line, sizeof(line), fp)) {
+            done = 1;
+            strcpy(line, "\n");
+        }
+
+        if (strncmp(line, "Package: ", 9) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            // A cut name would not match the dpkg info files, so the package is left out
+            if (snprintf(current.name, sizeof(current.name), "%s", line + 9) >= (int)sizeof(current.name)) {
+                current.name[0] = '\0';
+            }
+        } else if (strcmp(line, "Status: install ok installed\n") == 0) {
+            installed = 1;
+        } else if (strncmp(line, "Installed-Size: ", 16) == 0) {
+            current.installed_kb = atol(line + 16);
+        } else if (strcmp(line, "\n") == 0) {
+            if (installed && current.name[0] != '\0') {
+                if (count == capacity) {
+                    capacity = capacity ? capacity * 2 : 1024;
+                    package_size_t *grown = realloc(*packages, capacity * sizeof(package_size_t));
+                    if (!grown) break;
+                    *packages = grown;
+                }
+                (*packages)[count++] = current;
+            }
+            memset(&current, 0, sizeof(current));
+            installed = 0;
+        }
+    }
+    fclose(fp);
+
+    return count;
+}
+
+// Write a top-N size report of the rootfs by package and by directory
+long long write_rootfs_size_report(build_config_t *config, const char *rootfs_dir, const char *label) {
+    char path[MAX_PATH_LEN];
+    char msg[MAX_PATH_LEN + 128];
+    package_size_t *packages = NULL;
+    int top = config->slim_report_top > 0 ? config->slim_report_top : 20;
+
+    if (snprintf(path, sizeof(path), "%s/rootfs-size-%s.txt", config->output_dir, label) >= (int)sizeof(path)) {
+        LOG_ERROR("Output directory path too long for the rootfs size report");
+        return -1;
+    }
+
+    dir_table = calloc(SLIM_DIR_TABLE_SIZE, sizeof(dir_size_t));
+    if (!dir_table) return -1;
+    dir_entries = 0;
+    walk_total_bytes = 0;
+    walk_root_len = strlen(rootfs_dir);
+
+    // Stay on the rootfs filesystem so mounted /proc, /sys and /dev are skipped
+    nftw(rootfs_dir, slim_walk_entry, 64, FTW_PHYS | FTW_MOUNT);
+    qsort(dir_table, SLIM_DIR_TABLE_SIZE, sizeof(dir_size_t), compare_dir_size);
+
+    int package_count = read_package_sizes(rootfs_dir, &packages);
+    if (package_count > 0) {
+        qsort(packages, package_count, sizeof(package_size_t), compare_package_size);
+    }
+
+    FILE *fp = fopen(path, "w");
+    if (fp) {
+        fprintf(fp, "Rootfs size report (%s): %.1f MiB in %d packages\n\n",
+                label, walk_total_bytes / 1048576.0, package_count);
+
+        fprintf(fp, "Top %d packages by installed size\n", top);
+        for (int i = 0; i < package_count && i < top; i++) {
+            fprintf(fp, "%10.1f MiB  %s\n", packages[i].installed_kb / 1024.0, packages[i].name);
+        }
+
+        fprintf(fp, "\nTop %d directories by disk usage\n", top);
+        for (int i = 0; i < dir_entries && i < top; i++) {
+            fprintf(fp, "%10.1f MiB  %s\n", dir_table[i].bytes / 1048576.0, dir_table[i].path);
+        }
+        fclose(fp);
+    }
+
+    snprintf(msg, sizeof(msg), "Rootfs %s: %.1f MiB, report written to %s",
+             label, walk_total_bytes / 1048576.0, path);
+    LOG_INFO(msg);
+    for (int i = 0; i < package_count && i < 5; i++) {
+        snprintf(msg, sizeof(msg), "  %8.1f MiB  %s", packages[i].installed_kb / 1024.0, packages[i].name);
+        LOG_INFO(msg);
+    }
+
+    free(packages);
+    free(dir_table);
+    dir_table = NULL;
+
+    return walk_total_bytes;
+}
+
+// Strip debug info from the ELF objects and archives shipped by -dev packages
+static int strip_dev_packages(build_config_t *config, const char *rootfs_dir) {
+    char path[MAX_PATH_LEN];
+    char list_path[MAX_PATH_LEN];
+    char line[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    char msg[256];
+    package_size_t *packages = NULL;
+    int files = 0;
+    error_context_t error_ctx = {0};
+
+    if (snprintf(list_path, sizeof(list_path), "%s/slim-strip.list", config->build_dir) >= (int)sizeof(list_path)) {
+        LOG_ERROR("Build directory path too long for the strip list");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    FILE *out = fopen(list_path, "w");
+    if (!out) return ERROR_PERMISSION_DENIED;
+
+    int package_count = read_package_sizes(rootfs_dir, &packages);
+    for (int i = 0; i < package_count; i++) {
+        size_t len = strlen(packages[i].name);
+        if (len < 4 || strcmp(packages[i].name + len - 4, "-dev") != 0) continue;
+
+        // Multi-arch packages keep their file list under name:arch
+        FILE *fp = NULL;
+        if (snprintf(path, sizeof(path), "%s/var/lib/dpkg/info/%s.list",
+                     rootfs_dir, packages[i].name) < (int)sizeof(path)) {
+            fp = fopen(path, "r");
+        }
+        if (!fp && snprintf(path, sizeof(path), "%s/var/lib/dpkg/info/%s:arm64.list",
+                            rootfs_dir, packages[i].name) < (int)sizeof(path)) {
+            fp = fopen(path, "r");
+        }
+        if (!fp) continue;
+
+        while (fgets(line, sizeof(line), fp)) {
+            unsigned char magic[8] = {0};
+            struct stat st;
+
+            line[strcspn(line, "\n")] = '\0';
+            if (snprintf(path, sizeof(path), "%s%s", rootfs_dir, line) >= (int)sizeof(path)) continue;
+            if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+            // Only ELF files and ar archives; libfoo.so is often a linker script
+            int fd = open(path, O_RDONLY);
+            if (fd < 0) continue;
+            ssize_t got = read(fd, magic, sizeof(magic));
+            close(fd);
+
+            if ((got >= 4 && memcmp(magic, "\177ELF", 4) == 0) ||
+                (got == 8 && memcmp(magic, "!<arch>\n", 8) == 0)) {
+                fprintf(out, "%s\n", path);
+                files++;
+            }
+        }
+        fclose(fp);
+    }
+    fclose(out);
+    free(packages);
+
+    snprintf(msg, sizeof(msg), "Stripping debug info from %d files in -dev packages...", files);
+    LOG_INFO(msg);
+    if (files == 0) return ERROR_SUCCESS;
+
+    snprintf(cmd, sizeof(cmd),
+             "xargs -a %s -d '\\n' -r -P %d -n 32 %sstrip --strip-debug --preserve-dates 2>/dev/null || true",
+             list_path, jobserver_current_jobs(), config->cross_compile);
+    return execute_command_safe(cmd, 0, &error_ctx) == 0 ? ERROR_SUCCESS : ERROR_UNKNOWN;
+}
+
+// Keep the translations of every configured locale (de_DE.UTF-8 keeps de_DE and de)
+static int build_keep_locales(build_config_t *config) {
+    char locales[MAX_LOCALES][64];
+    int count = get_locale_set(config, locales, MAX_LOCALES);
+    int keep = 0;
+
+    strcpy(slim_keep_locales[keep++], "locale.alias");
+
+    for (int i = 0; i < count; i++) {
+        char name[64];
+        char *cut;
+
+        strcpy(name, locales[i]);
+        for (int pass = 0; pass < 2; pass++) {
+            cut = strpbrk(name, pass == 0 ? ".@" : "_");
+            if (cut) *cut = '\0';
+
+            int known = 0;
+            for (int j = 0; j < keep; j++) {
+                if (strcmp(slim_keep_locales[j], name) == 0) known = 1;
+            }
+            if (!known && keep < SLIM_MAX_KEEP - 1) {
+                strcpy(slim_keep_locales[keep++], name);
+            }
+        }
+    }
+
+    slim_keep_locales[keep][0] = '\0';
+    return keep;
+}
+
+// Remove translations of languages that are not kept
+static void remove_unused_locales(const char *rootfs_dir) {
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+    int removed = 0;
+
+    if (snprintf(path, sizeof(path), "%s/usr/share/locale", rootfs_dir) >= (int)sizeof(path)) return;
+    DIR *dir = opendir(path);
+    if (!dir) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int keep = entry->d_name[0] == '.';
+
+        for (int i = 0; !keep && slim_keep_locales[i][0] != '\0'; i++) {
+            keep = strcmp(entry->d_name, slim_keep_locales[i]) == 0;
+        }
+        if (keep) continue;
+
+        snprintf(cmd, sizeof(cmd), "rm -rf '%s/%s'", path, entry->d_name);
+        if (execute_command_safe(cmd, 0, &error_ctx) == 0) {
+            removed++;
+        }
+    }
+    closedir(dir);
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Removed translations for %d locales", removed);
+    LOG_INFO(msg);
+}
+
+// Keep dpkg from reinstalling what the policy removed
+static void write_dpkg_excludes(const char *rootfs_dir, int policy) {
+    char path[MAX_PATH_LEN];
+
+    if (snprintf(path, sizeof(path), "%s/etc/dpkg/dpkg.cfg.d", rootfs_dir) >= (int)sizeof(path)) return;
+    mkdir(path, 0755);
+
+    if (snprintf(path, sizeof(path), "%s" SLIM_DPKG_EXCLUDE_FILE, rootfs_dir) >= (int)sizeof(path)) return;
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) return;
+
+    fprintf(fp, "# Written by the Orange Pi 5 Plus builder rootfs slimming stage\n");
+    if (policy & SLIM_DOCS) {
+        fprintf(fp,
+                "path-exclude=/usr/share/doc/*\n"
+                "path-include=/usr/share/doc/*/copyright\n"
+                "path-exclude=/usr/share/man/*\n"
+                "path-exclude=/usr/share/info/*\n");
+    }
+    if (policy & SLIM_LOCALES) {
+        fprintf(fp, "path-exclude=/usr/share/locale/*\n");
+        for (int i = 0; slim_keep_locales[i][0] != '\0'; i++) {
+            fprintf(fp, "path-include=/usr/share/locale/%s%s\n", slim_keep_locales[i],
+                    strchr(slim_keep_locales[i], '.') ? "" : "/*");
+        }
+    }
+    fclose(fp);
+}
+
+// Slim down the rootfs according to the configured policy
+int slim_rootfs(build_config_t *config) {
+    char rootfs_dir[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    char msg[256];
+    error_context_t error_ctx = {0};
+    int policy = config->slim_policy;
+
+    build_keep_locales(config);
+
+    if (snprintf(rootfs_dir, sizeof(rootfs_dir), "%s/rootfs", config->output_dir) >= (int)sizeof(rootfs_dir)) {
+        LOG_ERROR("Output directory path too long");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    if (access(rootfs_dir, F_OK) != 0) {
+        LOG_ERROR("Root filesystem not found");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    LOG_INFO("Slimming root filesystem...");
+    long long before = write_rootfs_size_report(config, rootfs_dir, "before-slim");
+
+    if (policy & SLIM_APT_CACHE) {
+        LOG_INFO("Removing apt lists and package caches...");
+        if (snprintf(cmd, sizeof(cmd),
+                     "find %s/var/lib/apt/lists -maxdepth 1 -type f ! -name lock -delete; "
+                     "rm -f %s/var/cache/apt/*.bin %s/var/cache/apt/archives/*.deb "
+                     "%s/var/cache/apt/archives/partial/*",
+                     rootfs_dir, rootfs_dir, rootfs_dir, rootfs_dir) >= (int)sizeof(cmd)) {
+            LOG_ERROR("Rootfs path too long for the apt cache cleanup");
+            return ERROR_INSTALLATION_FAILED;
+        }
+        execute_command_safe(cmd, 0, &error_ctx);
+    }
+
+    if (policy & SLIM_DOCS) {
+        LOG_INFO("Removing documentation, man and info pages...");
+        // Copyright files stay for license compliance
+        if (snprintf(cmd, sizeof(cmd),
+                     "find %s/usr/share/doc -mindepth 1 ! -type d ! -name copyright -delete; "
+                     "find %s/usr/share/doc -mindepth 1 -type d -empty -delete; "
+                     "rm -rf %s/usr/share/man/* %s/usr/share/info/*",
+                     rootfs_dir, rootfs_dir, rootfs_dir, rootfs_dir) >= (int)sizeof(cmd)) {
+            LOG_ERROR("Rootfs path too long for the documentation cleanup");
+            return ERROR_INSTALLATION_FAILED;
+        }
+        execute_command_safe(cmd, 0, &error_ctx);
+    }
+
+    if (policy & SLIM_LOCALES) {
+        LOG_INFO("Removing unused translations...");
+        remove_unused_locales(rootfs_dir);
+    }
+
+    if (policy & SLIM_STRIP_DEV) {
+        strip_dev_packages(config, rootfs_dir);
+    }
+
+    if (policy & (SLIM_DOCS | SLIM_LOCALES)) {
+        write_dpkg_excludes(rootfs_dir, policy);
+    }
+
+    long long after = write_rootfs_size_report(config, rootfs_dir, "after-slim");
+
+    if (before > 0 && after >= 0) {
+        snprintf(msg, sizeof(msg), "Rootfs slimmed from %.1f MiB to %.1f MiB (saved %.1f MiB)",
+                 before / 1048576.0, after / 1048576.0, (before - after) / 1048576.0);
+        LOG_INFO(msg);
+    }
+
+    return ERROR_SUCCESS;
+}
@@ -0,0 +1,403 @@
+/*
+ * sparse.c - Kernel source clone for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file clones the kernel source. By default that is a shallow clone of
+ * the whole tree. With --sparse-kernel it is a partial clone (blob:none) with
+ * a cone-mode sparse checkout, so only the blobs of the directories an arm64
+ * rk3588 build reads are fetched. That directory set is a profile learned
+ * from the dependency files Kbuild leaves behind after a successful build;
+ * until one exists the sparse clone checks out the whole tree. Transfer size
+ * and checkout time are reported against the last full clone. Profiles and
+ * figures are kept per repository URL and branch, since a profile learned
+ * from one tree says nothing about another.
+ */
+
+#include "builder.h"
+#include <ftw.h>
+#include <sys/stat.h>
+
+#define SPARSE_KEY_LEN 16       // Hex digits of the clone source hash in file names
+
+// Directories every build needs, whatever the profile says
+static const char *sparse_base_dirs[] = {
+    "arch/arm64",
+    "include",
+    "scripts",
+    NULL
+};
+
+// Directories seen while learning, as a hash set; nftw() takes no user pointer
+typedef struct {
+    char *path;
+    int is_dir;             // 0: not a directory of the tree, so not part of the profile
+} sparse_entry_t;
+
+static sparse_entry_t *sparse_table = NULL;
+static size_t sparse_table_size = 0;
+static size_t sparse_table_used = 0;
+static const char *sparse_root = NULL;
+static size_t sparse_root_len = 0;
+
+// Key of a clone source: a hash of its URL and branch
+static void sparse_source_key(const char *url, const char *branch, char key[SPARSE_KEY_LEN + 1]) {
+    sha256_ctx_t ctx;
+    char hex[SHA256_HEX_LEN + 1];
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, url, strlen(url));
+    sha256_update(&ctx, "\n", 1);
+    if (branch) sha256_update(&ctx, branch, strlen(branch));
+    sha256_final_hex(&ctx, hex);
+    memcpy(key, hex, SPARSE_KEY_LEN);
+    key[SPARSE_KEY_LEN] = '\0';
+}
+
+// Where the key of the last clone is kept, for learning once the tree built
+static int sparse_source_path(const build_config_t *config, char *path, size_t size) {
+    const char *cache_dir = config->cache_dir[0] ? config->cache_dir : CACHE_DIR;
+
+    return snprintf(path, size, "%s/kernel-sparse.source", cache_dir) < (int)size ? 0 : -1;
+}
+
+// Profile and full clone figures of a clone source, kept with the download store
+static int sparse_paths(const build_config_t *config, const char *key, char *profile, char *stats, size_t size) {
+    const char *cache_dir = config->cache_dir[0] ? config->cache_dir : CACHE_DIR;
+
+    if (snprintf(profile, size, "%s/kernel-sparse-%s.profile", cache_dir, key) >= (int)size ||
+        snprintf(stats, size, "%s/kernel-full-clone-%s.stats", cache_dir, key) >= (int)size) {
+        LOG_WARNING("Cache directory path too long for the sparse kernel profile");
+        return -1;
+    }
+    return 0;
+}
+
+// Bytes of objects in a clone, i.e. what was transferred
+static long long clone_object_bytes(const char *dest) {
+    char cmd[MAX_CMD_LEN];
+    char line[256];
+    long long kib = 0, value;
+
+    snprintf(cmd, sizeof(cmd), "git -C \"%s\" count-objects -v 2>/dev/null", dest);
+    FILE *fp = popen(cmd, "r");
+    if (!fp) return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "size-pack: %lld", &value) == 1 || sscanf(line, "size: %lld", &value) == 1) {
+            kib += value;
+        }
+    }
+    pclose(fp);
+    return kib * 1024;
+}
+
+// Files checked out, and files in the tree
+static void clone_file_counts(const char *dest, long *checked_out, long *total) {
+    char cmd[MAX_CMD_LEN];
+
+    *checked_out = *total = 0;
+    snprintf(cmd, sizeof(cmd), "git -C \"%s\" ls-files -t 2>/dev/null", dest);
+    FILE *fp = popen(cmd, "r");
+    if (!fp) return;
+
+    char line[MAX_PATH_LEN];
+    while (fgets(line, sizeof(line), fp)) {
+        (*total)++;
+        // S marks a skip-worktree entry, one outside the sparse checkout
+        if (line[0] != 'S') (*checked_out)++;
+    }
+    pclose(fp);
+}
+
+// Does the profile exist and list anything
+static int sparse_profile_usable(const char *profile) {
+    struct stat st;
+    return stat(profile, &st) == 0 && st.st_size > 0;
+}
+
+// Clone a kernel tree into dest; returns 0 on success like execute_command_with_retry
+int kernel_clone(const build_config_t *config, const char *url, const char *branch,
+                 const char *dest, int retries) {
+    char cmd[MAX_CMD_LEN];
+    char key[SPARSE_KEY_LEN + 1];
+    char source[MAX_PATH_LEN + 32];
+    char profile[MAX_PATH_LEN + 64];
+    char stats[MAX_PATH_LEN + 64];
+    char msg[512];
+    char branch_arg[128] = "";
+    long checked_out, total;
+
+    sparse_source_key(url, branch, key);
+    int have_paths = sparse_paths(config, key, profile, stats, sizeof(profile)) == 0;
+    int partial = config->kernel_sparse;
+    int sparse = partial && have_paths && sparse_profile_usable(profile);
+
+    if (branch && branch[0]) {
+        snprintf(branch_arg, sizeof(branch_arg), " -b %s", branch);
+    }
+
+    // Fetch commits and trees only; the checkout fetches the blobs it needs
+    snprintf(cmd, sizeof(cmd), "rm -rf \"%s\" && git clone --depth 1%s --no-checkout%s \"%s\" \"%s\" 2>&1",
+             dest, partial ? " --filter=blob:none" : "", branch_arg, url, dest);
+    double start = get_monotonic_time();
+    if (execute_command_with_retry(cmd, 1, retries) != 0) {
+        return -1;
+    }
+    double cloned = get_monotonic_time();
+
+    if (sparse) {
+        LOG_INFO("Checking out the kernel directories in the learned sparse profile");
+        snprintf(cmd, sizeof(cmd),
+                 "git -C \"%s\" sparse-checkout init --cone && "
+                 "git -C \"%s\" sparse-checkout set --stdin < \"%s\" && git -C \"%s\" checkout 2>&1",
+                 dest, dest, profile, dest);
+    } else {
+        if (partial) {
+            LOG_INFO("No sparse kernel profile yet, checking out the whole tree to learn one");
+        }
+        snprintf(cmd, sizeof(cmd), "git -C \"%s\" checkout 2>&1", dest);
+    }
+    if (execute_command_with_retry(cmd, 1, retries) != 0) {
+        return -1;
+    }
+    double done = get_monotonic_time();
+
+    // The profile learned after the build belongs to this source
+    FILE *source_fp = sparse_source_path(config, source, sizeof(source)) == 0 ? fopen(source, "w") : NULL;
+    if (source_fp) {
+        fprintf(source_fp, "%s\n", key);
+        fclose(source_fp);
+    }
+    if (!have_paths) return 0;
+
+    long long bytes = clone_object_bytes(dest);
+    clone_file_counts(dest, &checked_out, &total);
+
+    if (!sparse) {
+        // A full checkout is the baseline for later sparse clones
+        FILE *fp = fopen(stats, "w");
+        if (fp) {
+            fprintf(fp, "%lld %.1f %.1f %ld\n", bytes, cloned - start, done - cloned, checked_out);
+            fclose(fp);
+        }
+        snprintf(msg, sizeof(msg), "Kernel clone: %.1f MiB transferred, clone %.1fs, checkout %.1fs, %ld files",
+                 bytes / 1048576.0, cloned - start, done - cloned, checked_out);
+        LOG_INFO(msg);
+        return 0;
+    }
+
+    snprintf(msg, sizeof(msg), "Sparse kernel clone: %.1f MiB transferred, clone %.1fs, checkout %.1fs, "
+             "%ld of %ld files", bytes / 1048576.0, cloned - start, done - cloned, checked_out, total);
+    LOG_INFO(msg);
+
+    long long full_bytes;
+    double full_clone, full_checkout;
+    long full_files;
+    FILE *fp = fopen(stats, "r");
+    if (fp) {
+        if (fscanf(fp, "%lld %lf %lf %ld", &full_bytes, &full_clone, &full_checkout, &full_files) == 4 &&
+            full_bytes > 0) {
+            snprintf(msg, sizeof(msg), "Full clone was %.1f MiB, clone %.1fs, checkout %.1fs, %ld files: "
+                     "%.0f%% of the transfer, %.0f%% of the checkout time",
+                     full_bytes / 1048576.0, full_clone, full_checkout, full_files,
+                     100.0 * bytes / full_bytes,
+                     full_checkout > 0 ? 100.0 * (done - cloned) / full_checkout : 100.0);
+            LOG_INFO(msg);
+        }
+        fclose(fp);
+    }
+    return 0;
+}
+
+// djb2 over a directory name
+static size_t sparse_hash(const char *text, size_t len) {
+    size_t hash = 5381;
+    for (size_t i = 0; i < len; i++) hash = hash * 33 + (unsigned char)text[i];
+    return hash;
+}
+
+// Slot of a directory in the set, free or holding it
+static sparse_entry_t* sparse_slot(const char *dir, size_t len) {
+    size_t i = sparse_hash(dir, len) & (sparse_table_size - 1);
+    while (sparse_table[i].path &&
+           (strncmp(sparse_table[i].path, dir, len) != 0 || sparse_table[i].path[len] != '\0')) {
+        i = (i + 1) & (sparse_table_size - 1);
+    }
+    return &sparse_table[i];
+}
+
+// Add a directory (relative to the tree) to the set; NULL when out of memory
+static sparse_entry_t* sparse_add_dir(const char *dir, size_t len, int is_dir) {
+    while (len > 0 && dir[len - 1] == '/') len--;
+    if (len == 0 || len >= MAX_PATH_LEN) return NULL;
+
+    // Keep the table at most half full
+    if ((sparse_table_used + 1) * 2 > sparse_table_size) {
+        size_t old_size = sparse_table_size;
+        sparse_entry_t *old = sparse_table;
+        size_t size = old_size ? old_size * 2 : 4096;
+        sparse_entry_t *table = calloc(size, sizeof(sparse_entry_t));
+        if (!table) return NULL;
+        sparse_table = table;
+        sparse_table_size = size;
+        for (size_t i = 0; i < old_size; i++) {
+            if (old[i].path) *sparse_slot(old[i].path, strlen(old[i].path)) = old[i];
+        }
+        free(old);
+    }
+
+    sparse_entry_t *entry = sparse_slot(dir, len);
+    if (!entry->path) {
+        entry->path = strndup(dir, len);
+        if (!entry->path) return NULL;
+        entry->is_dir = is_dir;
+        sparse_table_used++;
+    }
+    return entry;
+}
+
+// Record the directory of a path a build step read
+static void sparse_add_path(const char *token) {
+    char path[MAX_PATH_LEN * 2];
+    struct stat st;
+
+    // Only relative paths inside the tree; flags, make functions and
+    // absolute (toolchain) paths are not part of it
+    if (token[0] == '-' || token[0] == '$' || token[0] == '/' || strchr(token, '=') ||
+        strncmp(token, "include/config/", 15) == 0 || strncmp(token, "include/generated/", 18) == 0) {
+        return;
+    }
+    const char *slash = strrchr(token, '/');
+    if (!slash || slash == token) return;
+
+    // Most dependencies are in directories already seen, so stat each once
+    size_t len = slash - token;
+    if (sparse_table_size && sparse_slot(token, len)->path) return;
+    snprintf(path, sizeof(path), "%s/%.*s", sparse_root, (int)len, token);
+    sparse_add_dir(token, len, stat(path, &st) == 0 && S_ISDIR(st.st_mode));
+}
+
+// Collect the paths a Kbuild .cmd file lists
+static void sparse_read_cmd_file(const char *file) {
+    char line[8192];
+
+    FILE *fp = fopen(file, "r");
+    if (!fp) return;
+    while (fgets(line, sizeof(line), fp)) {
+        // savedcmd_ lines are the compiler invocations, not dependencies
+        if (strncmp(line, "savedcmd_", 9) == 0 || strncmp(line, "cmd_", 4) == 0) continue;
+        for (char *token = strtok(line, " \t\r\n\\:"); token; token = strtok(NULL, " \t\r\n\\:")) {
+            sparse_add_path(token);
+        }
+    }
+    fclose(fp);
+}
+
+// Every .cmd file in the tree: its own directory was built, and it names what was read
+static int sparse_walk_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+
+    if (type == FTW_D && strcmp(path + ftw->base, ".git") == 0) return FTW_SKIP_SUBTREE;
+    if (type != FTW_F) return FTW_CONTINUE;
+
+    const char *name = path + ftw->base;
+    size_t len = strlen(name);
+    if (name[0] != '.' || len < 5 || strcmp(name + len - 4, ".cmd") != 0) return FTW_CONTINUE;
+
+    if ((size_t)ftw->base > sparse_root_len + 1) {
+        sparse_entry_t *entry = sparse_add_dir(path + sparse_root_len + 1, ftw->base - sparse_root_len - 1, 1);
+        if (entry) entry->is_dir = 1;
+    }
+    sparse_read_cmd_file(path);
+    return FTW_CONTINUE;
+}
+
+// Sort so that a directory comes right before its subdirectories
+static int sparse_dir_compare(const void *a, const void *b) {
+    const unsigned char *x = *(const unsigned char * const *)a;
+    const unsigned char *y = *(const unsigned char * const *)b;
+
+    while (*x && *x == *y) { x++; y++; }
+    // '/' sorts before anything else a name may contain
+    int cx = *x == '/' ? 1 : *x, cy = *y == '/' ? 1 : *y;
+    return cx - cy;
+}
+
+// Learn the sparse profile from a tree that just built; kept for later clones
+int kernel_sparse_learn(const build_config_t *config, const char *source_dir) {
+    char key[SPARSE_KEY_LEN + 2] = "";
+    char source[MAX_PATH_LEN + 32];
+    char profile[MAX_PATH_LEN + 64];
+    char stats[MAX_PATH_LEN + 64];
+    char tmp[MAX_PATH_LEN + 96];
+    char file[MAX_PATH_LEN + 64];
+    char msg[MAX_PATH_LEN + 128];
+    int written = 0;
+
+    if (!config->kernel_sparse) return ERROR_SUCCESS;
+
+    // Learn only for a tree whose clone source is known
+    FILE *source_fp = sparse_source_path(config, source, sizeof(source)) == 0 ? fopen(source, "r") : NULL;
+    if (source_fp) {
+        if (!fgets(key, sizeof(key), source_fp)) key[0] = '\0';
+        key[strcspn(key, "\r\n")] = '\0';
+        fclose(source_fp);
+    }
+    if (strlen(key) != SPARSE_KEY_LEN) {
+        LOG_WARNING("Kernel clone source unknown, not learning a sparse profile");
+        return ERROR_SUCCESS;
+    }
+    if (sparse_paths(config, key, profile, stats, sizeof(profile)) != 0) {
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    sparse_root = source_dir;
+    sparse_root_len = strlen(source_dir);
+    for (int i = 0; sparse_base_dirs[i]; i++) {
+        sparse_add_dir(sparse_base_dirs[i], strlen(sparse_base_dirs[i]), 1);
+    }
+
+    // Every Kconfig file read is in auto.conf.cmd, even those of disabled options
+    snprintf(file, sizeof(file), "%s/include/config/auto.conf.cmd", source_dir);
+    sparse_read_cmd_file(file);
+    nftw(source_dir, sparse_walk_entry, 64, FTW_PHYS | FTW_ACTIONRETVAL);
+
+    // Cone mode takes whole subtrees, so subdirectories of listed ones go
+    size_t count = 0;
+    char **dirs = calloc(sparse_table_used + 1, sizeof(char *));
+    for (size_t i = 0; dirs && i < sparse_table_size; i++) {
+        if (sparse_table[i].path && sparse_table[i].is_dir) dirs[count++] = sparse_table[i].path;
+    }
+    if (dirs) qsort(dirs, count, sizeof(char *), sparse_dir_compare);
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", profile, (int)getpid());
+    FILE *fp = dirs ? fopen(tmp, "w") : NULL;
+    if (fp) {
+        const char *last = NULL;
+        for (size_t i = 0; i < count; i++) {
+            size_t n = last ? strlen(last) : 0;
+            if (last && strncmp(dirs[i], last, n) == 0 && dirs[i][n] == '/') continue;
+            fprintf(fp, "%s\n", dirs[i]);
+            last = dirs[i];
+            written++;
+        }
+        if (fclose(fp) == 0 && rename(tmp, profile) == 0) {
+            snprintf(msg, sizeof(msg), "Learned a sparse kernel profile of %d directories: %s", written, profile);
+            LOG_INFO(msg);
+        } else {
+            unlink(tmp);
+            written = 0;
+        }
+    }
+
+    free(dirs);
+    for (size_t i = 0; i < sparse_table_size; i++) free(sparse_table[i].path);
+    free(sparse_table);
+    sparse_table = NULL;
+    sparse_table_size = sparse_table_used = 0;
+
+    if (written == 0) {
+        LOG_WARNING("Could not write the sparse kernel profile");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    return ERROR_SUCCESS;
+}
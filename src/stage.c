@@ -0,0 +1,169 @@
+/*
+ * stage.c - Build stage tracking for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file keeps a record of every build stage (kernel, rootfs, image, ...)
+ * together with its wall time, the number of commands it ran and how much of
+ * that time was spent running aarch64 code under emulation.
+ */
+
+#include "builder.h"
+
+static build_stage_t build_stages[MAX_BUILD_STAGES];
+static int build_stage_count = 0;
+static build_stage_t *current_stage = NULL;
+static char build_stage_prefix[48];
+
+// Get monotonic time in seconds
+double get_monotonic_time(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// Start a new build stage
+build_stage_t* build_stage_begin(const char *name) {
+    build_stage_t *stage;
+
+    if (!name) return NULL;
+
+    if (build_stage_count >= MAX_BUILD_STAGES) {
+        LOG_WARNING("Too many build stages, stage accounting disabled for the rest of the build");
+        return NULL;
+    }
+
+    stage = &build_stages[build_stage_count++];
+    memset(stage, 0, sizeof(*stage));
+    if (build_stage_prefix[0]) {
+        snprintf(stage->name, sizeof(stage->name), "%s/%s", build_stage_prefix, name);
+    } else {
+        strncpy(stage->name, name, sizeof(stage->name) - 1);
+        stage->name[sizeof(stage->name) - 1] = '\0';
+    }
+    stage->start_time = get_monotonic_time();
+    stage->active = 1;
+    current_stage = stage;
+    stage->trace_depth = trace_current_depth();
+    cgroup_stage_begin(stage);
+    trace_begin(stage->name, "stage");
+    PROFILE_BEGIN(stage->name);
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "=== Stage started: %s ===", stage->name);
+    LOG_INFO(msg);
+    event_stage_begin(stage);
+    logger_flush();
+
+    return stage;
+}
+
+// Finish a build stage and report its accounting
+void build_stage_end(build_stage_t *stage, int result) {
+    char msg[256];
+
+    if (!stage || !stage->active) return;
+
+    stage->duration = get_monotonic_time() - stage->start_time;
+    PROFILE_END(stage->name);
+    trace_unwind(stage->trace_depth);
+    cgroup_stage_end(stage);
+    stage->result = result;
+    stage->active = 0;
+
+    if (current_stage == stage) {
+        current_stage = NULL;
+    }
+
+    snprintf(msg, sizeof(msg), "=== Stage finished: %s (%s) in %.1fs, %d commands ===",
+             stage->name, result == ERROR_SUCCESS ? "ok" : "failed",
+             stage->duration, stage->commands_run);
+    LOG_INFO(msg);
+
+    if (stage->emulated_commands > 0) {
+        snprintf(msg, sizeof(msg), "Stage %s: %.1fs (%.0f%%) under emulation in %d chroot commands [%s]",
+                 stage->name, stage->emulated_seconds,
+                 stage->duration > 0 ? 100.0 * stage->emulated_seconds / stage->duration : 0.0,
+                 stage->emulated_commands, chroot_exec_mode_name(detect_chroot_exec_mode()));
+        LOG_INFO(msg);
+    }
+
+    if (stage->cpu_user + stage->cpu_system > 0 || stage->memory_peak > 0) {
+        snprintf(msg, sizeof(msg), "Stage %s: cpu %.1fs user %.1fs system%s, peak memory %lld MiB, "
+                 "read %lld MiB, written %lld MiB [%s]",
+                 stage->name, stage->cpu_user, stage->cpu_system,
+                 stage->cpu_throttled > 0 ? " (throttled)" : "",
+                 stage->memory_peak >> 20, stage->io_read_bytes >> 20, stage->io_write_bytes >> 20,
+                 stage->cgroup ? "cgroup" : "rusage");
+        LOG_INFO(msg);
+    }
+
+    event_stage_end(stage);
+    if (result != ERROR_SUCCESS) {
+        metrics_record_failure(result);
+    }
+    metrics_write();
+    logger_flush();
+}
+
+// Prefix the names of all later stages, "" for none; matrix variants use
+// their name so that their stages, cgroups and events stay apart
+void build_stage_set_prefix(const char *prefix) {
+    strncpy(build_stage_prefix, prefix, sizeof(build_stage_prefix) - 1);
+    build_stage_prefix[sizeof(build_stage_prefix) - 1] = '\0';
+}
+
+// Get the stage that is currently running
+build_stage_t* get_current_build_stage(void) {
+    return current_stage;
+}
+
+// Get a stage by its index in start order, NULL past the last one
+const build_stage_t* get_build_stage(int index) {
+    return index >= 0 && index < build_stage_count ? &build_stages[index] : NULL;
+}
+
+// Report all stages
+void build_stage_report(void) {
+    char msg[256];
+    double total = 0.0;
+    double total_emulated = 0.0;
+
+    if (build_stage_count == 0) return;
+
+    LOG_INFO("=== Build stage report ===");
+    for (int i = 0; i < build_stage_count; i++) {
+        build_stage_t *stage = &build_stages[i];
+        double duration = stage->active ? get_monotonic_time() - stage->start_time : stage->duration;
+
+        snprintf(msg, sizeof(msg), "%-24.63s %8.1fs  %4d cmds  emulated %7.1fs  %s",
+                 stage->name, duration, stage->commands_run, stage->emulated_seconds,
+                 stage->active ? "running" : (stage->result == ERROR_SUCCESS ? "ok" : "failed"));
+        LOG_INFO(msg);
+
+        if (stage->cpu_user + stage->cpu_system > 0 || stage->memory_peak > 0) {
+            snprintf(msg, sizeof(msg), "%-24s   cpu %7.1fs  peak %6lld MiB  io r/w %lld/%lld MiB%s",
+                     "", stage->cpu_user + stage->cpu_system, stage->memory_peak >> 20,
+                     stage->io_read_bytes >> 20, stage->io_write_bytes >> 20,
+                     stage->oom_kills > 0 ? "  oom-killed" : "");
+            LOG_INFO(msg);
+        }
+
+        total += duration;
+        total_emulated += stage->emulated_seconds;
+    }
+
+    snprintf(msg, sizeof(msg), "Total %.1fs, of which %.1fs under emulation (%s)",
+             total, total_emulated, chroot_exec_mode_name(detect_chroot_exec_mode()));
+    LOG_INFO(msg);
+
+    if (profile_enabled) {
+        profile_report_all();
+    }
+
+    metrics_write();
+
+    if (trace_write(TRACE_FILE) == ERROR_SUCCESS) {
+        LOG_INFO("Build trace written to " TRACE_FILE " (open in ui.perfetto.dev or chrome://tracing)");
+    }
+}
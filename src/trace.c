@@ -0,0 +1,274 @@
+/*
+ * trace.c - Chrome trace export for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file records build stages, the sub-steps inside them and every
+ * external command as nested spans and writes them in the Chrome trace event
+ * format to TRACE_FILE, which chrome://tracing and ui.perfetto.dev open
+ * directly. Each thread that records spans gets its own lane, so work that
+ * runs concurrently shows up side by side.
+ */
+
+#include "builder.h"
+#include <pthread.h>
+
+#define TRACE_MAX_SPANS 65536
+#define TRACE_MAX_DEPTH 16
+#define TRACE_MAX_LANES 64
+
+// One recorded span
+typedef struct {
+    char name[64];
+    const char *category;
+    char *args;             // JSON object body, or NULL
+    double start_time;      // Monotonic seconds
+    double duration;        // Negative while the span is open
+    int lane;
+} trace_span_t;
+
+static trace_span_t *trace_spans = NULL;
+static int trace_span_count = 0;
+static int trace_span_capacity = 0;
+static unsigned long trace_dropped = 0;
+static char trace_lane_names[TRACE_MAX_LANES][32];
+static int trace_lane_count = 0;
+static double trace_origin = 0.0;
+static int trace_enabled = 0;
+static int trace_exit_registered = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Per-thread lane and stack of open spans
+static __thread int trace_lane = -1;
+static __thread int trace_stack[TRACE_MAX_DEPTH];
+static __thread int trace_depth = 0;
+static __thread int trace_is_step[TRACE_MAX_DEPTH];
+
+// Assign a lane to the calling thread; caller holds trace_lock
+static int get_trace_lane(void) {
+    if (trace_lane < 0) {
+        trace_lane = trace_lane_count < TRACE_MAX_LANES ? trace_lane_count++ : TRACE_MAX_LANES - 1;
+        if (trace_lane_names[trace_lane][0] == '\0') {
+            snprintf(trace_lane_names[trace_lane], sizeof(trace_lane_names[0]),
+                     trace_lane == 0 ? "main" : "worker %d", trace_lane);
+        }
+    }
+    return trace_lane;
+}
+
+// Append a span; caller holds trace_lock. Returns its index or -1
+static int add_trace_span(const char *name, const char *category, double start_time) {
+    if (!trace_enabled) return -1;
+
+    if (trace_span_count >= trace_span_capacity) {
+        int capacity = trace_span_capacity ? trace_span_capacity * 2 : 1024;
+        trace_span_t *spans;
+
+        if (capacity > TRACE_MAX_SPANS) capacity = TRACE_MAX_SPANS;
+        if (trace_span_count >= capacity ||
+            !(spans = realloc(trace_spans, capacity * sizeof(*spans)))) {
+            trace_dropped++;
+            return -1;
+        }
+        trace_spans = spans;
+        trace_span_capacity = capacity;
+    }
+
+    trace_span_t *span = &trace_spans[trace_span_count];
+    strncpy(span->name, name, sizeof(span->name) - 1);
+    span->name[sizeof(span->name) - 1] = '\0';
+    span->category = category;
+    span->args = NULL;
+    span->start_time = start_time;
+    span->duration = -1.0;
+    span->lane = get_trace_lane();
+
+    return trace_span_count++;
+}
+
+// Name the lane of the calling thread
+void trace_set_lane_name(const char *name) {
+    pthread_mutex_lock(&trace_lock);
+    int lane = get_trace_lane();
+    strncpy(trace_lane_names[lane], name, sizeof(trace_lane_names[0]) - 1);
+    trace_lane_names[lane][sizeof(trace_lane_names[0]) - 1] = '\0';
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Open a nested span on the calling thread
+void trace_begin(const char *name, const char *category) {
+    double now = get_monotonic_time();
+
+    pthread_mutex_lock(&trace_lock);
+    int index = add_trace_span(name, category, now);
+    pthread_mutex_unlock(&trace_lock);
+
+    // Overflowing spans are still pushed so that trace_end() stays balanced
+    if (trace_depth < TRACE_MAX_DEPTH) {
+        trace_stack[trace_depth] = index;
+        trace_is_step[trace_depth] = 0;
+    }
+    trace_depth++;
+}
+
+// Close the innermost open span of the calling thread
+void trace_end(void) {
+    double now = get_monotonic_time();
+
+    if (trace_depth == 0) return;
+    trace_depth--;
+    if (trace_depth >= TRACE_MAX_DEPTH) return;
+
+    int index = trace_stack[trace_depth];
+    if (index < 0) return;
+
+    pthread_mutex_lock(&trace_lock);
+    trace_spans[index].duration = now - trace_spans[index].start_time;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Start a sub-step of the current span, ending the previous sub-step
+void trace_step(const char *name) {
+    if (trace_depth > 0 && trace_depth <= TRACE_MAX_DEPTH && trace_is_step[trace_depth - 1]) {
+        trace_end();
+    }
+    trace_begin(name, "step");
+    if (trace_depth <= TRACE_MAX_DEPTH) {
+        trace_is_step[trace_depth - 1] = 1;
+    }
+}
+
+// Close every span opened on this thread since depth was reached
+void trace_unwind(int depth) {
+    while (trace_depth > depth) {
+        trace_end();
+    }
+}
+
+// Current nesting depth of the calling thread
+int trace_current_depth(void) {
+    return trace_depth;
+}
+
+// Record a finished command as a span inside the current one
+void trace_command(const char *cmd, const command_usage_t *usage) {
+    char name[64];
+    size_t len;
+
+    // The span is named after the program, the full command goes into args
+    while (*cmd == ' ') cmd++;
+    len = strcspn(cmd, " ;|&");
+    if (len >= sizeof(name)) len = sizeof(name) - 1;
+    memcpy(name, cmd, len);
+    name[len] = '\0';
+
+    char *args = NULL;
+    size_t args_size = 0;
+    FILE *fp = open_memstream(&args, &args_size);
+    if (fp) {
+        fputs("\"cmd\":", fp);
+        write_json_string(fp, cmd);
+        fprintf(fp, ",\"exit\":%d,\"user_cpu\":%.3f,\"sys_cpu\":%.3f,\"max_rss_kb\":%ld,"
+                "\"read_bytes\":%lld,\"write_bytes\":%lld",
+                usage->exit_status, usage->user_cpu, usage->sys_cpu, usage->max_rss_kb,
+                usage->read_bytes, usage->write_bytes);
+        fclose(fp);
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    int index = add_trace_span(name, "command", usage->start_time);
+    if (index >= 0) {
+        trace_spans[index].duration = usage->duration;
+        trace_spans[index].args = args;
+        args = NULL;
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    free(args);
+}
+
+// Write the trace file; caller holds trace_lock
+static int write_trace_file(const char *path) {
+    double now = get_monotonic_time();
+    char tmp_path[MAX_PATH_LEN];
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) return ERROR_PERMISSION_DENIED;
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", fp);
+    fprintf(fp, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"tid\":0,"
+            "\"args\":{\"name\":\"opi5plus-builder\"}}", (int)getpid());
+
+    for (int i = 0; i < trace_lane_count; i++) {
+        fprintf(fp, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                (int)getpid(), i);
+        write_json_string(fp, trace_lane_names[i]);
+        fprintf(fp, "}},\n{\"ph\":\"M\",\"name\":\"thread_sort_index\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"sort_index\":%d}}", (int)getpid(), i, i);
+    }
+
+    // Complete events in microseconds; viewers nest them by time per lane
+    for (int i = 0; i < trace_span_count; i++) {
+        trace_span_t *span = &trace_spans[i];
+        double duration = span->duration >= 0 ? span->duration : now - span->start_time;
+
+        fputs(",\n{\"ph\":\"X\",\"name\":", fp);
+        write_json_string(fp, span->name);
+        fprintf(fp, ",\"cat\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                span->category, (int)getpid(), span->lane,
+                (span->start_time - trace_origin) * 1000000.0, duration * 1000000.0);
+        if (span->args) {
+            fprintf(fp, ",\"args\":{%s}", span->args);
+        } else if (span->duration < 0) {
+            fputs(",\"args\":{\"unfinished\":true}", fp);
+        }
+        fputc('}', fp);
+    }
+
+    fputs("\n]", fp);
+    if (trace_dropped > 0) {
+        fprintf(fp, ",\"metadata\":{\"dropped_spans\":%lu}", trace_dropped);
+    }
+    fputs("}\n", fp);
+
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Write all spans recorded so far; open spans end at the time of writing
+int trace_write(const char *path) {
+    pthread_mutex_lock(&trace_lock);
+    int result = write_trace_file(path);
+    pthread_mutex_unlock(&trace_lock);
+
+    return result;
+}
+
+// Exit handler: keep a trace of builds that stop early
+static void trace_write_at_exit(void) {
+    // A signal may have interrupted a thread holding the lock
+    if (pthread_mutex_trylock(&trace_lock) != 0) return;
+    if (trace_span_count > 0) {
+        write_trace_file(TRACE_FILE);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Start recording; timestamps in the trace are relative to this call
+void trace_start(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (!trace_enabled) {
+        trace_origin = get_monotonic_time();
+        trace_enabled = 1;
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    if (!trace_exit_registered) {
+        atexit(trace_write_at_exit);
+        trace_exit_registered = 1;
+    }
+}
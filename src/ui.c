@@ -7,6 +7,11 @@
 
 #include "builder.h"
 
+// Whether prompts are answered from the configuration instead of stdin (--batch)
+static int ui_batch_mode(void) {
+    return global_config && global_config->batch;
+}
+
 // Print header
 void print_header(void) {
     clear_screen();
@@ -39,23 +44,38 @@ void print_legal_notice(void) {
     printf("\n");
     printf("════════════════════════════════════════════════════════════════════════\n");
     printf("\n");
+    if (ui_batch_mode()) {
+        printf("Accepted by running in batch mode.\n");
+        return;
+    }
     printf("Press ENTER to accept and continue, or Ctrl+C to exit...");
+    fflush(stdout);
     getchar();
 }
 
 // Clear screen
 void clear_screen(void) {
+    logger_flush();
+    if (ui_batch_mode()) return;
     printf(CLEAR_SCREEN);
 }
 
 // Pause screen
 void pause_screen(void) {
+    logger_flush();
+    if (ui_batch_mode()) return;
     printf("\nPress ENTER to continue...");
     getchar();
 }
 
 // Get user input
 char* get_user_input(const char *prompt, char *buffer, size_t size) {
+    logger_flush();
+    buffer[0] = '\0';
+    if (ui_batch_mode()) {
+        LOG_WARNING("Batch mode: no input for prompt, keeping the configured value");
+        return NULL;
+    }
     printf("%s", prompt);
     fflush(stdout);
     
@@ -77,6 +97,16 @@ int get_user_choice(const char *prompt, int min, int max) {
     char buffer[32];
     int choice;
     
+    logger_flush();
+    
+    // The lowest choice backs out of every menu
+    if (ui_batch_mode()) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Batch mode: answering %d to \"%s\"", min, prompt);
+        LOG_WARNING(msg);
+        return min;
+    }
+    
     while (1) {
         printf("%s (%d-%d): ", prompt, min, max);
         fflush(stdout);
@@ -99,7 +129,12 @@ int get_user_choice(const char *prompt, int min, int max) {
 int confirm_action(const char *message) {
     char buffer[32];
     
+    logger_flush();
     printf("\n%s%s%s\n", COLOR_YELLOW, message, COLOR_RESET);
+    if (ui_batch_mode()) {
+        printf("Are you sure? (y/N): y (batch mode)\n");
+        return 1;
+    }
     printf("Are you sure? (y/N): ");
     fflush(stdout);
     
@@ -326,6 +361,29 @@ void show_gpu_options_menu(build_config_t *config) {
     printf("\n");
 }
 
+// Show build components menu
+void show_build_components_menu(build_config_t *config) {
+    const char *state[] = {COLOR_RED "No" COLOR_RESET, COLOR_GREEN "Yes" COLOR_RESET};
+    
+    clear_screen();
+    print_header();
+    
+    printf("\n%s%sBUILD COMPONENTS%s\n", COLOR_BOLD, COLOR_GREEN, COLOR_RESET);
+    printf("════════════════════════════════════════════════════════════════════════\n");
+    printf("\n");
+    printf("  %s1.%s Kernel               - %s\n", COLOR_CYAN, COLOR_RESET, state[config->build_kernel != 0]);
+    printf("  %s2.%s Root filesystem      - %s\n", COLOR_CYAN, COLOR_RESET, state[config->build_rootfs != 0]);
+    printf("  %s3.%s U-Boot               - %s\n", COLOR_CYAN, COLOR_RESET, state[config->build_uboot != 0]);
+    printf("  %s4.%s SD card image        - %s\n", COLOR_CYAN, COLOR_RESET, state[config->create_image != 0]);
+    printf("  %s5.%s SPI flash image      - %s\n", COLOR_CYAN, COLOR_RESET, state[config->create_spi_image != 0]);
+    printf("  %s6.%s Image compression    - %s\n", COLOR_CYAN, COLOR_RESET,
+           compress_format_name(config->compress_format));
+    printf("  %s0.%s Back\n", COLOR_CYAN, COLOR_RESET);
+    printf("\n");
+    printf("════════════════════════════════════════════════════════════════════════\n");
+    printf("\n");
+}
+
 // Show build options menu
 void show_build_options_menu(void) {
     clear_screen();
@@ -0,0 +1,404 @@
+/*
+ * watchdog.c - Command watchdog for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file supervises every external command while it runs. It copies the
+ * command's output into LOG_FILE (and to the console when asked), and
+ * enforces the wall-clock and inactivity timeouts of the current stage. A
+ * command is inactive when it has printed nothing and its process group has
+ * used no CPU and done no I/O. On expiry the process tree is logged with the
+ * wchan and kernel stack of every process, then the process group gets
+ * SIGTERM and, after a grace period, SIGKILL.
+ */
+
+#include "builder.h"
+#include <dirent.h>
+#include <poll.h>
+
+#define WATCHDOG_POLL_MS 250
+#define WATCHDOG_SCAN_INTERVAL 5.0      // Seconds between process group scans
+#define WATCHDOG_KILL_GRACE 10.0        // Seconds between SIGTERM and SIGKILL
+#define WATCHDOG_MAX_PROCESSES 256
+#define WATCHDOG_TAIL_SIZE 8192
+
+// One process of a supervised group
+typedef struct {
+    pid_t pid;
+    pid_t ppid;
+    char state;
+    char comm[32];
+    unsigned long long cpu_ticks;
+} watchdog_process_t;
+
+static volatile sig_atomic_t watchdog_signal_count = 0;
+static volatile sig_atomic_t watchdog_signal = 0;
+
+// Last output of the command this thread ran, for failure classification
+static __thread char output_tail[WATCHDOG_TAIL_SIZE];
+static __thread size_t output_tail_length = 0;
+
+// Handler for SIGINT/SIGQUIT while commands run; the supervisor forwards them
+// and the build stops once the commands are gone
+void watchdog_forward_signal(int sig) {
+    interrupted = 1;
+    watchdog_signal = sig;
+    watchdog_signal_count++;
+}
+
+// Signal forwarded since the last call, 0 if none; the caller re-raises it
+// once the previous handler is back in place
+int watchdog_take_forwarded_signal(void) {
+    int sig = watchdog_signal;
+    watchdog_signal = 0;
+    return sig;
+}
+
+// Parse /proc/<pid>/stat
+static int read_process_stat(pid_t pid, watchdog_process_t *process, pid_t *pgrp) {
+    char path[64];
+    char buffer[1024];
+    unsigned long long utime = 0, stime = 0;
+    int ppid = 0, group = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (len <= 0) return -1;
+    buffer[len] = '\0';
+
+    // comm may contain spaces and parentheses; it ends at the last ')'
+    char *open_paren = strchr(buffer, '(');
+    char *close_paren = strrchr(buffer, ')');
+    if (!open_paren || !close_paren || close_paren < open_paren) return -1;
+
+    size_t comm_len = close_paren - open_paren - 1;
+    if (comm_len >= sizeof(process->comm)) comm_len = sizeof(process->comm) - 1;
+    memcpy(process->comm, open_paren + 1, comm_len);
+    process->comm[comm_len] = '\0';
+
+    if (sscanf(close_paren + 2, "%c %d %d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+               &process->state, &ppid, &group, &utime, &stime) != 5) {
+        return -1;
+    }
+
+    process->pid = pid;
+    process->ppid = ppid;
+    process->cpu_ticks = utime + stime;
+    *pgrp = group;
+    return 0;
+}
+
+// Collect the processes of a process group
+static int list_process_group(pid_t pgid, watchdog_process_t *processes, int max) {
+    int count = 0;
+    struct dirent *entry;
+
+    DIR *dir = opendir("/proc");
+    if (!dir) return 0;
+
+    while ((entry = readdir(dir)) != NULL && count < max) {
+        pid_t pgrp;
+        if (!isdigit((unsigned char)entry->d_name[0])) continue;
+        if (read_process_stat(atoi(entry->d_name), &processes[count], &pgrp) == 0 && pgrp == pgid) {
+            count++;
+        }
+    }
+    closedir(dir);
+
+    return count;
+}
+
+// CPU ticks plus I/O characters of a process group; changes while it makes progress
+static unsigned long long process_group_progress(pid_t pgid) {
+    watchdog_process_t processes[WATCHDOG_MAX_PROCESSES];
+    unsigned long long progress = 0;
+    int count = list_process_group(pgid, processes, WATCHDOG_MAX_PROCESSES);
+
+    for (int i = 0; i < count; i++) {
+        command_usage_t io;
+        read_process_io(processes[i].pid, &io);
+        progress += processes[i].cpu_ticks;
+        if (io.rchar > 0) progress += io.rchar;
+        if (io.wchar > 0) progress += io.wchar;
+    }
+
+    return progress;
+}
+
+// Read a small /proc file of a process into one line
+static void read_process_text(pid_t pid, const char *name, char *buffer, size_t size, char separator) {
+    char path[64];
+
+    buffer[0] = '\0';
+    snprintf(path, sizeof(path), "/proc/%d/%s", (int)pid, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    ssize_t len = read(fd, buffer, size - 1);
+    close(fd);
+    if (len <= 0) return;
+
+    while (len > 0 && (buffer[len - 1] == '\n' || buffer[len - 1] == '\0')) len--;
+    buffer[len] = '\0';
+    for (ssize_t i = 0; i < len; i++) {
+        if (buffer[i] == '\0' || buffer[i] == '\n') buffer[i] = separator;
+    }
+}
+
+// Log one process and its children, depth first
+static void log_process_subtree(watchdog_process_t *processes, int count, int index, int depth) {
+    char msg[MAX_CMD_LEN + 256];
+    char cmdline[256], wchan[64], stack[1024];
+    watchdog_process_t *process = &processes[index];
+
+    read_process_text(process->pid, "cmdline", cmdline, sizeof(cmdline), ' ');
+    read_process_text(process->pid, "wchan", wchan, sizeof(wchan), ' ');
+    snprintf(msg, sizeof(msg), "  %*s%d %s [%c] wchan=%s: %s", depth * 2, "",
+             (int)process->pid, process->comm, process->state,
+             strlen(wchan) > 0 && strcmp(wchan, "0") != 0 ? wchan : "-", cmdline);
+    LOG_WARNING(msg);
+
+    // Needs root and a kernel that exposes it
+    read_process_text(process->pid, "stack", stack, sizeof(stack), '|');
+    if (strlen(stack) > 0) {
+        snprintf(msg, sizeof(msg), "  %*s  stack: %s", depth * 2, "", stack);
+        LOG_WARNING(msg);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (processes[i].ppid == process->pid && i != index && depth < 16) {
+            log_process_subtree(processes, count, i, depth + 1);
+        }
+    }
+}
+
+// Log the process tree of a hung command
+static void log_process_group(pid_t pgid) {
+    watchdog_process_t processes[WATCHDOG_MAX_PROCESSES];
+    int count = list_process_group(pgid, processes, WATCHDOG_MAX_PROCESSES);
+
+    // Roots are members whose parent is outside the group
+    for (int i = 0; i < count; i++) {
+        int has_parent = 0;
+        for (int j = 0; j < count; j++) {
+            if (processes[j].pid == processes[i].ppid) has_parent = 1;
+        }
+        if (!has_parent) {
+            log_process_subtree(processes, count, i, 0);
+        }
+    }
+}
+
+// Keep the last WATCHDOG_TAIL_SIZE - 1 bytes of output
+static void append_output_tail(const char *buffer, size_t len) {
+    size_t capacity = sizeof(output_tail) - 1;
+
+    if (len >= capacity) {
+        memcpy(output_tail, buffer + len - capacity, capacity);
+        output_tail_length = capacity;
+    } else {
+        if (output_tail_length + len > capacity) {
+            size_t drop = output_tail_length + len - capacity;
+            memmove(output_tail, output_tail + drop, output_tail_length - drop);
+            output_tail_length -= drop;
+        }
+        memcpy(output_tail + output_tail_length, buffer, len);
+        output_tail_length += len;
+    }
+    output_tail[output_tail_length] = '\0';
+}
+
+// Output tail of the last command run by the calling thread
+const char* watchdog_output_tail(void) {
+    return output_tail;
+}
+
+// Write all of a buffer, retrying short writes
+static void write_all(int fd, const char *buffer, ssize_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buffer, len);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return;
+        buffer += written;
+        len -= written;
+    }
+}
+
+// Copy what is waiting on *fd to the log, or to the sink for command data.
+// Closes *fd at EOF, or when the sink refuses the data. Returns 1 on input.
+static int pump_fd(int *fd, int exited, int log_fd, int show_output,
+                   command_sink_t sink, void *sink_ctx) {
+    char buffer[8192];
+    ssize_t len;
+    int chunks = 0;
+    int active = 0;
+
+    while ((len = read(*fd, buffer, sizeof(buffer))) > 0) {
+        active = 1;
+        if (sink) {
+            // The writer gets EPIPE and fails, which is what a refused download should do
+            if (sink(sink_ctx, buffer, len) != 0) {
+                len = 0;
+                break;
+            }
+        } else {
+            if (log_fd >= 0) write_all(log_fd, buffer, len);
+            if (show_output) write_all(STDOUT_FILENO, buffer, len);
+            append_output_tail(buffer, len);
+        }
+        // A daemon left behind may keep writing forever
+        if (!exited || ++chunks >= 64) break;
+    }
+
+    // EOF: every writer is gone, the exit follows shortly
+    if (len == 0) {
+        close(*fd);
+        *fd = -1;
+    }
+
+    return active;
+}
+
+// Pump the output of a command and enforce its timeouts until it exits.
+// With a sink, the command's stdout is data handed to the sink and only
+// stderr is log output. The child is left unreaped so that its I/O
+// counters can still be read.
+void watchdog_supervise(pid_t pid, int output_fd, int data_fd, command_sink_t sink, void *sink_ctx,
+                        int show_output, const build_stage_t *stage, command_usage_t *usage) {
+    char msg[256];
+    int wall_timeout = stage ? stage->command_timeout : (global_config ? global_config->command_timeout : 0);
+    int idle_timeout = stage ? stage->idle_timeout : (global_config ? global_config->idle_timeout : 0);
+    double start = usage->start_time;
+    double last_activity = start;
+    double next_scan = 0.0;
+    double term_time = 0.0;
+    unsigned long long last_progress = 0;
+    sig_atomic_t signals_seen = watchdog_signal_count;
+    siginfo_t info;
+
+    output_tail_length = 0;
+    output_tail[0] = '\0';
+
+    int log_fd = open(LOG_FILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (output_fd >= 0) {
+        fcntl(output_fd, F_SETFL, fcntl(output_fd, F_GETFL) | O_NONBLOCK);
+    }
+    if (data_fd >= 0) {
+        fcntl(data_fd, F_SETFL, fcntl(data_fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    for (;;) {
+        int exited;
+
+        memset(&info, 0, sizeof(info));
+        exited = waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pid;
+
+        // Copy whatever output is waiting; after exit, only what is buffered
+        struct pollfd pfds[2];
+        int nfds = 0;
+        if (output_fd >= 0) {
+            pfds[nfds].fd = output_fd;
+            pfds[nfds++].events = POLLIN;
+        }
+        if (data_fd >= 0) {
+            pfds[nfds].fd = data_fd;
+            pfds[nfds++].events = POLLIN;
+        }
+        if (nfds > 0) {
+            if (poll(pfds, nfds, exited ? 0 : WATCHDOG_POLL_MS) > 0) {
+                int active = 0;
+                if (output_fd >= 0) {
+                    active |= pump_fd(&output_fd, exited, log_fd, show_output, NULL, NULL);
+                }
+                if (data_fd >= 0) {
+                    active |= pump_fd(&data_fd, exited, log_fd, 0, sink, sink_ctx);
+                }
+                if (active) {
+                    last_activity = get_monotonic_time();
+                }
+            }
+        } else if (!exited) {
+            poll(NULL, 0, WATCHDOG_POLL_MS);
+        }
+
+        if (exited) break;
+
+        // Ctrl-C reaches only the builder; the command has a process group of its own
+        if (watchdog_signal_count != signals_seen) {
+            signals_seen = watchdog_signal_count;
+            kill(-pid, watchdog_signal);
+        }
+
+        double now = get_monotonic_time();
+
+        if (term_time > 0.0) {
+            if (now - term_time >= WATCHDOG_KILL_GRACE) {
+                kill(-pid, SIGKILL);
+                term_time = now + 3600.0;
+            }
+            continue;
+        }
+
+        if (idle_timeout > 0 && now - last_activity >= idle_timeout / 2.0 && now >= next_scan) {
+            unsigned long long progress = process_group_progress(pid);
+            next_scan = now + WATCHDOG_SCAN_INTERVAL;
+            if (progress != last_progress) {
+                last_progress = progress;
+                last_activity = now;
+            } else if (now - last_activity >= idle_timeout) {
+                usage->timed_out = WATCHDOG_IDLE;
+            }
+        }
+        if (wall_timeout > 0 && now - start >= wall_timeout) {
+            usage->timed_out = WATCHDOG_WALL;
+        }
+
+        if (usage->timed_out > 0) {
+            if (usage->timed_out == WATCHDOG_WALL) {
+                snprintf(msg, sizeof(msg), "Watchdog: command %d still running after %ds, stopping it",
+                         (int)pid, wall_timeout);
+            } else {
+                snprintf(msg, sizeof(msg), "Watchdog: command %d made no progress for %.0fs, stopping it",
+                         (int)pid, now - last_activity);
+            }
+            LOG_ERROR(msg);
+            log_process_group(pid);
+            kill(-pid, SIGTERM);
+            term_time = now;
+        }
+    }
+
+    // Do not leave daemons of a killed command holding the rootfs open
+    if (usage->timed_out > 0) {
+        kill(-pid, SIGKILL);
+    }
+
+    if (output_fd >= 0) close(output_fd);
+    if (data_fd >= 0) close(data_fd);
+    if (log_fd >= 0) close(log_fd);
+}
+
+// Name of a watchdog timeout
+const char* watchdog_timeout_name(int timed_out) {
+    switch (timed_out) {
+        case WATCHDOG_WALL: return "wall";
+        case WATCHDOG_IDLE: return "idle";
+        default: return "none";
+    }
+}
+
+// Parse a duration such as 90, 30s, 20m or 2h into seconds; -1 when invalid
+int parse_duration(const char *text) {
+    char *end = NULL;
+    long value = strtol(text, &end, 10);
+
+    if (end == text || value < 0) return -1;
+    switch (*end) {
+        case '\0':
+        case 's': return (int)value;
+        case 'm': return (int)(value * 60);
+        case 'h': return (int)(value * 3600);
+        default: return -1;
+    }
+}
@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+"""
+http_standin.py - Local HTTP server for the download tests of the
+Orange Pi 5 Plus Ultimate Interactive Builder
+
+Serves the files of a directory with the parts of HTTP the downloader relies
+on: strong ETags and Last-Modified, HEAD, single byte ranges, If-Range and
+If-None-Match. Files whose name starts with "cut-" are
+cut off halfway the first time they are fetched, like a dropped connection.
+Every request is appended to requests.log in the directory, one line each:
+
+    <method> <path> range=<Range> if-range=<If-Range> if-none-match=<...> status=<code>
+
+Usage: http_standin.py <directory> <port file>
+"""
+
+import email.utils
+import hashlib
+import http.server
+import os
+import sys
+import threading
+
+
+class StandinHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    cut_done = set()
+    lock = threading.Lock()
+
+    def log_message(self, format, *args):
+        pass
+
+    def record(self, status):
+        line = "%s %s range=%s if-range=%s if-none-match=%s status=%d\n" % (
+            self.command, self.path,
+            self.headers.get("Range", "-"),
+            self.headers.get("If-Range", "-"),
+            self.headers.get("If-None-Match", "-"),
+            status)
+        with self.lock:
+            with open(os.path.join(self.server.directory, "requests.log"), "a") as log:
+                log.write(line)
+
+    def send_plain(self, status, body=b""):
+        self.record(status)
+        self.send_response(status)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if self.command != "HEAD":
+            self.wfile.write(body)
+
+    def serve(self):
+        name = os.path.basename(self.path.split("?", 1)[0])
+        path = os.path.join(self.server.directory, name)
+        if not name or name == "requests.log" or not os.path.isfile(path):
+            self.send_plain(404, b"not found\n")
+            return
+
+        with open(path, "rb") as f:
+            data = f.read()
+        mtime = os.stat(path).st_mtime
+        etag = '"%s"' % hashlib.sha256(data).hexdigest()[:16]
+        last_modified = email.utils.formatdate(mtime, usegmt=True)
+
+        # Conditional GET: the client's copy is current
+        if_none_match = self.headers.get("If-None-Match")
+        if if_none_match is not None and if_none_match.strip() == etag:
+            self.record(304)
+            self.send_response(304)
+            self.send_header("ETag", etag)
+            self.send_header("Last-Modified", last_modified)
+            self.end_headers()
+            return
+
+        # A range is only honoured while If-Range still matches the file
+        start, end = 0, len(data) - 1
+        status = 200
+        range_header = self.headers.get("Range")
+        if_range = self.headers.get("If-Range")
+        if range_header and (if_range is None or if_range.strip() in (etag, last_modified)):
+            spec = range_header.replace("bytes=", "", 1).split(",")[0].strip()
+            first, _, last = spec.partition("-")
+            start = int(first) if first else 0
+            end = int(last) if last else len(data) - 1
+            end = min(end, len(data) - 1)
+            if start >= len(data) or start > end:
+                self.record(416)
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % len(data))
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            status = 206
+
+        body = data[start:end + 1]
+        cut = False
+        if self.command == "GET" and name.startswith("cut-"):
+            with self.lock:
+                cut = name not in self.cut_done
+                self.cut_done.add(name)
+
+        self.record(status)
+        self.send_response(status)
+        self.send_header("Content-Length", str(len(body)))
+        self.send_header("Accept-Ranges", "bytes")
+        self.send_header("ETag", etag)
+        self.send_header("Last-Modified", last_modified)
+        if status == 206:
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, len(data)))
+        if cut:
+            self.send_header("Connection", "close")
+        self.end_headers()
+        if self.command == "HEAD":
+            return
+
+        if cut:
+            self.wfile.write(body[:len(body) // 2])
+            self.wfile.flush()
+            self.close_connection = True
+            return
+        self.wfile.write(body)
+
+    def do_GET(self):
+        self.serve()
+
+    def do_HEAD(self):
+        self.serve()
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write("usage: http_standin.py <directory> <port file>\n")
+        return 2
+
+    server = http.server.ThreadingHTTPServer(("127.0.0.1", 0), StandinHandler)
+    server.directory = os.path.abspath(sys.argv[1])
+    server.daemon_threads = True
+
+    # The port goes out last, so a reader never sees a server that is not listening
+    tmp = sys.argv[2] + ".tmp"
+    with open(tmp, "w") as f:
+        f.write("%d\n" % server.server_address[1])
+    os.rename(tmp, sys.argv[2])
+
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,341 @@
+/*
+ * test_download.c - Download store tests for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * Runs download_fetch against tests/http_standin.py, a local HTTP server, and
+ * checks the transfers it makes in the server's request log: a resumed range
+ * request after a dropped connection, If-Range restarting a part file whose
+ * file changed upstream, 304 revalidation served from the store, and a
+ * segmented fetch that must not reuse the segments of a different file.
+ */
+
+#include "builder.h"
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TEST_SERVER "tests/http_standin.py"
+#define TEST_SMALL_SIZE (1LL << 20)
+#define TEST_LARGE_SIZE (40LL << 20)     // Above DOWNLOAD_SEGMENT_MIN, four 10 MiB segments
+
+static char test_dir[64];                       // A mkdtemp() name under /tmp
+static char test_www[sizeof(test_dir) + 8];
+static pid_t test_server_pid = -1;
+static int test_server_port;
+static int test_failures;
+static build_config_t test_config;
+
+// Report one check
+static void check(int ok, const char *what) {
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if (!ok) test_failures++;
+}
+
+// Write pseudo-random bytes, so no two test files share a digest
+static int write_blob(const char *name, long long size, unsigned int seed, char digest[SHA256_HEX_LEN + 1]) {
+    char path[MAX_PATH_LEN + 160];
+    unsigned char buffer[65536];
+    unsigned int state = seed;
+
+    snprintf(path, sizeof(path), "%s/%s", test_www, name);
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return -1;
+    for (long long done = 0; done < size; ) {
+        size_t len = size - done < (long long)sizeof(buffer) ? (size_t)(size - done) : sizeof(buffer);
+        for (size_t i = 0; i < len; i++) {
+            state = state * 1103515245u + 12345u;
+            buffer[i] = (unsigned char)(state >> 16);
+        }
+        if (fwrite(buffer, 1, len, fp) != len) {
+            fclose(fp);
+            return -1;
+        }
+        done += len;
+    }
+    if (fclose(fp) != 0) return -1;
+    return sha256_file_hex(path, digest, NULL);
+}
+
+// Write a small file
+static int write_text(const char *path, const char *text) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) return -1;
+    fputs(text, fp);
+    return fclose(fp);
+}
+
+// Start the stand-in server and wait for its port
+static int start_server(void) {
+    char port_file[MAX_PATH_LEN + 16];
+
+    snprintf(port_file, sizeof(port_file), "%s/port", test_dir);
+    test_server_pid = fork();
+    if (test_server_pid < 0) return -1;
+    if (test_server_pid == 0) {
+        execlp("python3", "python3", TEST_SERVER, test_www, port_file, (char *)NULL);
+        _exit(127);
+    }
+
+    for (int i = 0; i < 100; i++) {
+        FILE *fp = fopen(port_file, "r");
+        if (fp) {
+            int ok = fscanf(fp, "%d", &test_server_port) == 1;
+            fclose(fp);
+            if (ok) return 0;
+        }
+        if (waitpid(test_server_pid, NULL, WNOHANG) == test_server_pid) {
+            test_server_pid = -1;
+            return -1;
+        }
+        usleep(100000);
+    }
+    return -1;
+}
+
+// Stop the stand-in server
+static void stop_server(void) {
+    if (test_server_pid <= 0) return;
+    kill(test_server_pid, SIGTERM);
+    waitpid(test_server_pid, NULL, 0);
+    test_server_pid = -1;
+}
+
+// Forget the requests seen so far
+static void clear_requests(void) {
+    char path[MAX_PATH_LEN + 32];
+
+    snprintf(path, sizeof(path), "%s/requests.log", test_www);
+    unlink(path);
+}
+
+// Count logged requests for a file whose line contains all the given parts
+static int count_requests(const char *name, const char *part1, const char *part2) {
+    char path[MAX_PATH_LEN + 32];
+    char target[256];
+    char line[1024];
+    int count = 0;
+
+    snprintf(path, sizeof(path), "%s/requests.log", test_www);
+    snprintf(target, sizeof(target), " /%s ", name);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strstr(line, target) && (!part1 || strstr(line, part1)) && (!part2 || strstr(line, part2))) {
+            count++;
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+// Set up a download of a file on the stand-in server
+static void init_item(download_t *item, const char *name, const char *digest, long long size, int content) {
+    char url[512];
+
+    memset(item, 0, sizeof(*item));
+    snprintf(item->name, sizeof(item->name), "%s", name);
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/%s", test_server_port, name);
+    download_add_url(item, url);
+    if (digest) snprintf(item->sha256, sizeof(item->sha256), "%s", digest);
+    item->size = size;
+    item->content = content;
+    item->required = 1;
+}
+
+// Part file the downloader uses for a URL
+static void part_path(const char *url, char *path, size_t size) {
+    char key[SHA256_HEX_LEN + 1];
+
+    sha256_string_hex(url, key);
+    snprintf(path, size, "%s/store/tmp/%s.part", test_config.cache_dir, key);
+}
+
+// ETag the stand-in server sends for a file
+static void server_etag(const char *digest, char *etag, size_t size) {
+    snprintf(etag, size, "\"%.16s\"", digest);
+}
+
+// A dropped connection resumes with a range request guarded by If-Range
+static void test_range_resume(void) {
+    char digest[SHA256_HEX_LEN + 1];
+    char etag[64];
+    char if_range[96];
+    download_t item;
+
+    if (write_blob("cut-resume.bin", TEST_SMALL_SIZE, 1, digest) != 0) {
+        check(0, "range resume: test file written");
+        return;
+    }
+    server_etag(digest, etag, sizeof(etag));
+    snprintf(if_range, sizeof(if_range), "if-range=%s", etag);
+    clear_requests();
+
+    init_item(&item, "cut-resume.bin", digest, TEST_SMALL_SIZE, DOWNLOAD_BINARY);
+    download_fetch(&item);
+    check(item.result == ERROR_SUCCESS && strcmp(item.digest, digest) == 0,
+          "range resume: verified after a dropped connection");
+    check(count_requests("cut-resume.bin", "range=bytes=", "status=206") == 1 &&
+          count_requests("cut-resume.bin", if_range, "status=206") == 1,
+          "range resume: second request is a range guarded by If-Range");
+    check(count_requests("cut-resume.bin", "range=bytes=0-", NULL) == 0,
+          "range resume: the received prefix is not fetched again");
+}
+
+// A part file of an older version of the file is restarted, not extended
+static void test_if_range_changed(void) {
+    char digest[SHA256_HEX_LEN + 1];
+    char part[MAX_PATH_LEN + 128];
+    char meta[MAX_PATH_LEN + 160];
+    char meta_text[1024];
+    char junk[300 * 1024];
+    download_t item;
+
+    if (write_blob("changed.bin", TEST_SMALL_SIZE, 2, digest) != 0) {
+        check(0, "If-Range: test file written");
+        return;
+    }
+    clear_requests();
+    init_item(&item, "changed.bin", digest, TEST_SMALL_SIZE, DOWNLOAD_BINARY);
+
+    // What an interrupted download of the previous version left behind
+    part_path(item.urls[0], part, sizeof(part));
+    snprintf(meta, sizeof(meta), "%s.meta", part);
+    memset(junk, 0x5a, sizeof(junk));
+    FILE *fp = fopen(part, "wb");
+    if (!fp || fwrite(junk, 1, sizeof(junk), fp) != sizeof(junk) || fclose(fp) != 0) {
+        check(0, "If-Range: stale part file written");
+        return;
+    }
+    snprintf(meta_text, sizeof(meta_text), "- %lld %s\netag \"0000stale0000\"\n", TEST_SMALL_SIZE, item.urls[0]);
+    write_text(meta, meta_text);
+
+    download_fetch(&item);
+    check(item.result == ERROR_SUCCESS && strcmp(item.digest, digest) == 0,
+          "If-Range: verified after the part file was restarted");
+    check(count_requests("changed.bin", "if-range=\"0000stale0000\"", "status=200") == 1,
+          "If-Range: the stale validator got the full file");
+}
+
+// A file that may change is revalidated and served from the store on 304
+static void test_revalidate(void) {
+    char path[MAX_PATH_LEN + 32];
+    char digest[SHA256_HEX_LEN + 1];
+    char etag[64];
+    char if_none_match[96];
+    download_t item;
+
+    snprintf(path, sizeof(path), "%s/index.txt", test_www);
+    if (write_text(path, "linux-6.1.75 patches\n0001-rk3588-hdmi.patch\n") != 0 ||
+        sha256_file_hex(path, digest, NULL) != 0) {
+        check(0, "revalidate: test file written");
+        return;
+    }
+    server_etag(digest, etag, sizeof(etag));
+    snprintf(if_none_match, sizeof(if_none_match), "if-none-match=%s", etag);
+    clear_requests();
+
+    init_item(&item, "index.txt", NULL, 0, DOWNLOAD_TEXT);
+    item.revalidate = 1;
+    download_fetch(&item);
+    check(item.result == ERROR_SUCCESS && !item.cached && strcmp(item.digest, digest) == 0,
+          "revalidate: first download stored");
+
+    download_fetch(&item);
+    check(item.result == ERROR_SUCCESS && item.cached && strcmp(item.digest, digest) == 0,
+          "revalidate: unchanged file reused from the store");
+    check(count_requests("index.txt", if_none_match, "status=304") == 1,
+          "revalidate: conditional request answered with 304");
+
+    // With segments enabled the 304 arrives on the probe
+    test_config.download_segments = 4;
+    download_fetch(&item);
+    test_config.download_segments = 1;
+    check(item.result == ERROR_SUCCESS && item.cached && strcmp(item.digest, digest) == 0,
+          "revalidate: 304 on the segment probe reused from the store");
+    check(count_requests("index.txt", if_none_match, "status=304") == 2,
+          "revalidate: probe sent the validator");
+}
+
+// A large file is fetched in parallel ranges; segments of another file are discarded
+static void test_segmented(void) {
+    char digest[SHA256_HEX_LEN + 1];
+    char part[MAX_PATH_LEN + 128];
+    char path[MAX_PATH_LEN + 192];
+    char meta_text[1024];
+    download_t item;
+    int leftover = 0;
+
+    if (write_blob("large.bin", TEST_LARGE_SIZE, 3, digest) != 0) {
+        check(0, "segments: test file written");
+        return;
+    }
+    clear_requests();
+    init_item(&item, "large.bin", digest, TEST_LARGE_SIZE, DOWNLOAD_BINARY);
+
+    // Complete segments of a different version of the file, which a length
+    // check alone would join into the download
+    part_path(item.urls[0], part, sizeof(part));
+    for (int i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "%s.4-%d", part, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, TEST_LARGE_SIZE / 4) != 0) {
+            if (fd >= 0) close(fd);
+            check(0, "segments: stale segments written");
+            return;
+        }
+        close(fd);
+    }
+    snprintf(path, sizeof(path), "%s.segments", part);
+    snprintf(meta_text, sizeof(meta_text), "- %lld %s\netag \"0000stale0000\"\n", TEST_LARGE_SIZE, item.urls[0]);
+    write_text(path, meta_text);
+
+    test_config.download_segments = 4;
+    download_fetch(&item);
+    test_config.download_segments = 1;
+
+    check(item.result == ERROR_SUCCESS && strcmp(item.digest, digest) == 0 && item.bytes == TEST_LARGE_SIZE,
+          "segments: verified after the join");
+    check(count_requests("large.bin", "HEAD ", "status=200") == 1 &&
+          count_requests("large.bin", "GET ", "status=206") == 4,
+          "segments: one probe and four range requests");
+    for (int i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "%s.4-%d", part, i);
+        if (access(path, F_OK) == 0) leftover++;
+    }
+    snprintf(path, sizeof(path), "%s.segments", part);
+    if (access(path, F_OK) == 0) leftover++;
+    check(leftover == 0, "segments: segment files removed after the join");
+}
+
+int main(void) {
+    char cmd[MAX_CMD_LEN];
+
+    snprintf(test_dir, sizeof(test_dir), "/tmp/opi5plus-download-test.XXXXXX");
+    if (!mkdtemp(test_dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(test_www, sizeof(test_www), "%s/www", test_dir);
+    snprintf(test_config.cache_dir, sizeof(test_config.cache_dir), "%s/cache", test_dir);
+    test_config.download_segments = 1;
+    global_config = &test_config;
+
+    if (mkdir(test_www, 0755) != 0 || start_server() != 0) {
+        fprintf(stderr, "Could not start %s\n", TEST_SERVER);
+        stop_server();
+        return 1;
+    }
+
+    test_range_resume();
+    test_if_range_changed();
+    test_revalidate();
+    test_segmented();
+
+    stop_server();
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", test_dir);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "Could not remove %s\n", test_dir);
+    }
+
+    printf("%d failure(s)\n", test_failures);
+    return test_failures ? 1 : 0;
+}